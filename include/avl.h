@@ -1,7 +1,9 @@
 #ifndef avl_H
 #define avl_H  
 
+#include    <stddef.h>
 #include    "type.h"
+#include    "pool.h"
 
 
 
@@ -38,6 +40,11 @@ struct avl_tree
     
     /* the comparator function */
     avl_tree_compare_func* comparator;
+
+    /* Nodes for avl_insert come from here.  Unused by intrusive trees,
+     * whose nodes belong to the elements. */
+    struct node_pool pool;
+    bool intrusive;
 };
 
 
@@ -50,15 +57,28 @@ struct avl_tree
  * */
 void avl_init (struct avl_tree* tree, avl_tree_compare_func* func);
 
+/* Initializes TREE for intrusive use: elements embed their own struct
+ * AVL_NODE and are added with avl_insert_node, so the tree never allocates.
+ * Such a tree must not be used with avl_insert or avl_delete.
+ * */
+void avl_init_intrusive (struct avl_tree* tree, avl_tree_compare_func* func);
+
+/* Frees every node TREE allocated.  The elements themselves are left
+ * alone.
+ * */
+void avl_destroy (struct avl_tree* tree);
+
 /* Inserts the data pointed to by DATA into TREE
  * TREE must be a valid initialized tree
  * DATA must be a valid pointer
+ * Returns false if an equal element is already in TREE or memory ran out.
  * */
 bool avl_insert (struct avl_tree* tree, void* data);
 
 /* Deletes the data pointed to by DATA from TREE
  * TREE must be a valid initialized tree
  * DATA must be a valid pointer
+ * Returns the element that was removed, or NULL if there was none.
  * */
 void* avl_delete (struct avl_tree* tree, void* data);
 
@@ -67,6 +87,16 @@ void* avl_delete (struct avl_tree* tree, void* data);
  * */
 void* avl_find (struct avl_tree* tree, const void* elem);
 
+/* Intrusive forms of the above.  NODE is embedded in the element DATA, and
+ * links DATA into TREE without allocating; it must not be in any tree
+ * already.  avl_remove_node unlinks NODE, which must be in TREE.
+ * avl_find_node works on any tree.
+ * */
+bool avl_insert_node (struct avl_tree* tree, struct avl_node* node, 
+        void* data);
+void avl_remove_node (struct avl_tree* tree, struct avl_node* node);
+struct avl_node* avl_find_node (struct avl_tree* tree, const void* elem);
+
 /* Prints out the contents of TREE using FUNC to print the data 
  * (if supplied)
  * TREE must be a valid initialized tree
@@ -74,6 +104,13 @@ void* avl_find (struct avl_tree* tree, const void* elem);
  * */
 void avl_dump (struct avl_tree* tree, avl_tree_dump_func* func);
 
+/* Checks every invariant of TREE: ordering, balance factors, heights and
+ * parent pointers.  Returns false if any is broken.  Stores the number of
+ * elements in COUNT if it is not NULL.  This walks the whole tree, so it is
+ * meant for tests.
+ * */
+bool avl_check (struct avl_tree* tree, size_t* count);
+
 
 /* avl iterator functions.  */
 struct avl_iterator
@@ -82,13 +119,45 @@ struct avl_iterator
     struct avl_tree* tree;
 };
 
+/* Point IT, which usually lives on the caller's stack, at the first or
+ * last element of TREE, or with AVL_ITER_SEEK at the first element
+ * not less than ELEM.  Return false if there is no such element.  None of
+ * them allocate.
+ * */
+bool avl_iter_first (struct avl_tree* tree, struct avl_iterator* it);
+bool avl_iter_last (struct avl_tree* tree, struct avl_iterator* it);
+bool avl_iter_seek (struct avl_tree* tree, struct avl_iterator* it, 
+        const void* elem);
+
+/* Same as AVL_ITER_FIRST and AVL_ITER_LAST, but the iterator is
+ * malloc'd and the caller must free it.  Return NULL for an empty tree.
+ * */
 struct avl_iterator* avl_get_iterator (struct avl_tree*);
 struct avl_iterator* avl_get_reverse_iterator (struct avl_tree*);
+/* Moving off either end returns NULL and leaves the iterator spent, so
+ * AVL_GET returns NULL from then on */
 void* avl_get (struct avl_iterator*);
 void avl_itr_remove (struct avl_iterator*);
 void* avl_next (struct avl_iterator*);
 void* avl_prev (struct avl_iterator*);
 
+/* Called for each element by AVL_WALK.  Returning false stops the
+ * walk. */
+typedef bool avl_visit_func (void* data, void* aux);
+
+/* Calls FUNC on every element of TREE in order, without allocating.
+ * Returns the number of elements visited.
+ * */
+size_t avl_walk (struct avl_tree* tree, avl_visit_func* func, void* aux);
+
+/* Copies pointers to the elements from LO to HI, both included, into OUT in
+ * order, in a single pass.  Either bound may be NULL for no bound.  At most
+ * MAX are stored, but all are counted: returns how many elements are in the
+ * range.  Run it under whatever lock protects TREE to get a snapshot.
+ * */
+size_t avl_range (struct avl_tree* tree, const void* lo, const void* hi, 
+        void** out, size_t max);
+
 
 
 #endif
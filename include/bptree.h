@@ -0,0 +1,130 @@
+#ifndef BPTREE_H
+#define BPTREE_H
+
+#include    <stddef.h>
+#include    "type.h"
+#include    "pool.h"
+
+/*
+ * A B+tree of pointers to elements, with the same comparator interface as
+ * bst_tree and avl_tree.
+ *
+ * Every node is BPT_NODE_BYTES, four cache lines, so a lookup touches a
+ * handful of nodes instead of one node per level of a binary tree, and
+ * nodes come from a pool rather than one malloc each.  Elements are only
+ * kept in the leaves, which are linked both ways, so in-order scans read
+ * whole leaves in a row.  Inner nodes hold, as the key before each child
+ * but the first, a pointer to the smallest element under that child; that
+ * key always points at an element still in the tree.
+ *
+ * The comparator still has to follow the element pointers, so a search
+ * costs one cache miss per comparison on the elements themselves; what the
+ * B+tree saves is the misses on nodes.  Not synchronized.
+ * */
+
+#define BPT_NODE_BYTES  256
+
+/* Children of an inner node, and elements in a leaf, at most.  Both fill a
+ * node exactly with 8 byte pointers. */
+#define BPT_FANOUT      16
+#define BPT_LEAF_SLOTS  29
+
+/* Deep enough for any tree that fits in memory */
+#define BPT_MAX_HEIGHT  24
+
+typedef int bpt_tree_compare_func (const void*, const void*,
+        const void* AUX);
+
+struct bpt_node
+{
+    uint16 count;       // elements in a leaf, keys in an inner node
+    bool leaf;
+};
+
+struct bpt_inner
+{
+    struct bpt_node hdr;
+    void* keys[BPT_FANOUT - 1];
+    struct bpt_node* child[BPT_FANOUT];
+};
+
+struct bpt_leaf
+{
+    struct bpt_node hdr;
+    struct bpt_leaf* prev;
+    struct bpt_leaf* next;
+    void* data[BPT_LEAF_SLOTS];
+};
+
+struct bpt_tree
+{
+    struct bpt_node* root;
+    struct bpt_leaf* first;     // the leaves in order, for scans
+    struct bpt_leaf* last;
+    unsigned height;            // 0 when empty, 1 when the root is a leaf
+    size_t count;
+
+    bpt_tree_compare_func* comparator;
+    struct node_pool pool;
+};
+
+/* Initializes TREE, which must point to a valid block of memory.  FUNC
+ * compares elements.
+ * */
+void bpt_init (struct bpt_tree* tree, bpt_tree_compare_func* func);
+
+/* Frees every node.  The elements themselves are left alone. */
+void bpt_destroy (struct bpt_tree* tree);
+
+/* Inserts DATA.  Returns false if an equal element is already in TREE or
+ * memory ran out, and then TREE is unchanged.
+ * */
+bool bpt_insert (struct bpt_tree* tree, void* data);
+
+/* Removes the element equal to DATA and returns it, or NULL if there is
+ * none.
+ * */
+void* bpt_delete (struct bpt_tree* tree, const void* data);
+
+/* Returns the element equal to ELEM, or NULL */
+void* bpt_find (struct bpt_tree* tree, const void* elem);
+
+/* Fills the empty TREE with the N elements in SORTED, which must be in
+ * strictly increasing order, packing the leaves full.  Much faster than N
+ * inserts.  Returns false, leaving TREE empty, if TREE was not empty, the
+ * input is not sorted or memory ran out.
+ * */
+bool bpt_load (struct bpt_tree* tree, void** sorted, size_t n);
+
+/* Checks every invariant of TREE: ordering, node occupancy, separator keys,
+ * leaf depth and the leaf list.  Returns false if any is broken.  Stores
+ * the number of elements in COUNT if it is not NULL.  Meant for tests.
+ * */
+bool bpt_check (struct bpt_tree* tree, size_t* count);
+
+
+/* Iterators.  They live on the caller's stack and work as the avl ones do,
+ * except that any insert or delete invalidates them. */
+struct bpt_iterator
+{
+    struct bpt_leaf* leaf;      // NULL once spent
+    int pos;
+    struct bpt_tree* tree;
+};
+
+bool bpt_iter_first (struct bpt_tree* tree, struct bpt_iterator* it);
+bool bpt_iter_last (struct bpt_tree* tree, struct bpt_iterator* it);
+bool bpt_iter_seek (struct bpt_tree* tree, struct bpt_iterator* it,
+        const void* elem);
+void* bpt_get (struct bpt_iterator*);
+void* bpt_next (struct bpt_iterator*);
+void* bpt_prev (struct bpt_iterator*);
+
+typedef bool bpt_visit_func (void* data, void* aux);
+
+/* Same as avl_walk and avl_range, reading the leaves in order */
+size_t bpt_walk (struct bpt_tree* tree, bpt_visit_func* func, void* aux);
+size_t bpt_range (struct bpt_tree* tree, const void* lo, const void* hi,
+        void** out, size_t max);
+
+#endif //BPTREE_H
@@ -0,0 +1,677 @@
+/*
+ * A B+tree map specialized at compile time for one key and value type.
+ *
+ * bptree.h keeps void* elements and calls its comparator through a
+ * pointer, so every comparison is an indirect call that also has to follow
+ * the element pointer to reach the key.  This header generates the same
+ * tree with the keys stored in the nodes themselves and the comparison
+ * written out inline, so a search is a few tight loops over arrays.  It has
+ * no include guard; include it once per instantiation, after defining:
+ *
+ *   BPT_GEN_NAME           prefix of everything generated, e.g. idmap
+ *   BPT_GEN_KEY            key type, copied by assignment
+ *   BPT_GEN_VALUE          value type, copied by assignment
+ *   BPT_GEN_LESS(a, b)     (optional) true if key A sorts before key B;
+ *                          defaults to (a) < (b)
+ *
+ * For example, a map from child ids to records:
+ *
+ *   #define BPT_GEN_NAME    idmap
+ *   #define BPT_GEN_KEY     int
+ *   #define BPT_GEN_VALUE   struct server_child*
+ *   #include "bptree_gen.h"
+ *
+ * gives struct idmap_tree with idmap_init, idmap_destroy, idmap_insert,
+ * idmap_delete, idmap_find and idmap_check, and struct idmap_iterator with
+ * idmap_iter_first, idmap_iter_seek, idmap_iter_next, idmap_iter_key and
+ * idmap_iter_value.  The macros are undefined again at the end.  All
+ * functions are static inline, so each instantiation costs nothing where
+ * it is not used.  Nodes are BPT_NODE_BYTES and come from a node_pool, as
+ * in bptree.h.  Not synchronized.
+ * */
+
+#include    <stddef.h>
+#include    <string.h>
+#include    "type.h"
+#include    "pool.h"
+#include    "bptree.h"
+#include    "debug.h"
+
+#if !defined (BPT_GEN_NAME) || !defined (BPT_GEN_KEY) \
+    || !defined (BPT_GEN_VALUE)
+#error "Define BPT_GEN_NAME, BPT_GEN_KEY and BPT_GEN_VALUE first"
+#endif
+
+#ifndef BPT_GEN_LESS
+#define BPT_GEN_LESS(a, b)  ((a) < (b))
+#endif
+
+#define BPT_GEN_CAT2(a, b)  a ## _ ## b
+#define BPT_GEN_CAT(a, b)   BPT_GEN_CAT2 (a, b)
+#define BPT_GEN(x)          BPT_GEN_CAT (BPT_GEN_NAME, x)
+
+/* Fanout and leaf size follow from how big a key and a value are */
+#define BPT_GEN_FANOUT \
+    ((BPT_NODE_BYTES - 8) / (sizeof (BPT_GEN_KEY) + sizeof (void*)))
+#define BPT_GEN_SLOTS \
+    ((BPT_NODE_BYTES - 8 - 2 * sizeof (void*)) \
+     / (sizeof (BPT_GEN_KEY) + sizeof (BPT_GEN_VALUE)))
+#define BPT_GEN_LEAF_MIN    ((int) BPT_GEN_SLOTS / 2)
+#define BPT_GEN_INNER_MIN   ((int) (BPT_GEN_FANOUT - 1) / 2)
+
+#define BPT_GEN_EQUAL(a, b) (!BPT_GEN_LESS (a, b) && !BPT_GEN_LESS (b, a))
+
+struct BPT_GEN (node)
+{
+    uint16 count;       // entries in a leaf, keys in an inner node
+    bool leaf;
+};
+
+/* Every key under child I is below KEYS[I], and every key under child
+ * I + 1 is at or above it */
+struct BPT_GEN (inner)
+{
+    struct BPT_GEN (node) hdr;
+    BPT_GEN_KEY keys[BPT_GEN_FANOUT - 1];
+    struct BPT_GEN (node)* child[BPT_GEN_FANOUT];
+};
+
+struct BPT_GEN (leaf)
+{
+    struct BPT_GEN (node) hdr;
+    struct BPT_GEN (leaf)* prev;
+    struct BPT_GEN (leaf)* next;
+    BPT_GEN_KEY keys[BPT_GEN_SLOTS];
+    BPT_GEN_VALUE values[BPT_GEN_SLOTS];
+};
+
+struct BPT_GEN (tree)
+{
+    struct BPT_GEN (node)* root;
+    struct BPT_GEN (leaf)* first;
+    unsigned height;            // 0 when empty, 1 when the root is a leaf
+    size_t count;
+    struct node_pool pool;
+};
+
+struct BPT_GEN (iterator)
+{
+    struct BPT_GEN (leaf)* leaf;    // NULL once spent
+    int pos;
+};
+
+static inline void
+BPT_GEN (init) (struct BPT_GEN (tree)* tree)
+{
+    ASSERT (tree != NULL);
+
+    size_t size = sizeof (struct BPT_GEN (inner));
+    if (size < sizeof (struct BPT_GEN (leaf)))
+        size = sizeof (struct BPT_GEN (leaf));
+    memset (tree, 0, sizeof *tree);
+    pool_init (&tree->pool, size);
+};
+
+static inline void
+BPT_GEN (destroy) (struct BPT_GEN (tree)* tree)
+{
+    ASSERT (tree != NULL);
+
+    tree->root = NULL;
+    tree->first = NULL;
+    tree->height = 0;
+    tree->count = 0;
+    pool_destroy (&tree->pool);
+};
+
+/* The child of IN to follow for KEY */
+static inline int
+BPT_GEN (child_index) (const struct BPT_GEN (inner)* in, BPT_GEN_KEY key)
+{
+    int lo = 0, hi = in->hdr.count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (BPT_GEN_LESS (key, in->keys[mid]))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+};
+
+/* The position of the first key in LEAF not less than KEY */
+static inline int
+BPT_GEN (leaf_lower) (const struct BPT_GEN (leaf)* leaf, BPT_GEN_KEY key)
+{
+    int lo = 0, hi = leaf->hdr.count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (BPT_GEN_LESS (leaf->keys[mid], key))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+};
+
+static inline struct BPT_GEN (leaf)*
+BPT_GEN (descend) (const struct BPT_GEN (tree)* tree, BPT_GEN_KEY key,
+        struct BPT_GEN (inner)** path, int* idx)
+{
+    struct BPT_GEN (node)* node = tree->root;
+    int d = 0;
+    while (!node->leaf)
+    {
+        struct BPT_GEN (inner)* in = (struct BPT_GEN (inner)*) node;
+        int i = BPT_GEN (child_index) (in, key);
+        if (path)
+        {
+            path[d] = in;
+            idx[d] = i;
+        }
+        d++;
+        node = in->child[i];
+    }
+    return (struct BPT_GEN (leaf)*) node;
+};
+
+/* Returns a pointer to the value stored under KEY, or NULL.  The pointer
+ * is good until the next insert or delete. */
+static inline BPT_GEN_VALUE*
+BPT_GEN (find) (const struct BPT_GEN (tree)* tree, BPT_GEN_KEY key)
+{
+    ASSERT (tree != NULL);
+
+    if (tree->root == NULL)
+        return NULL;
+    struct BPT_GEN (leaf)* leaf = BPT_GEN (descend) (tree, key, NULL, NULL);
+    int pos = BPT_GEN (leaf_lower) (leaf, key);
+    if (pos < leaf->hdr.count && BPT_GEN_EQUAL (leaf->keys[pos], key))
+        return &leaf->values[pos];
+    return NULL;
+};
+
+/* Inserts VALUE under KEY.  Returns false if KEY is already there or
+ * memory ran out, and then TREE is unchanged. */
+static inline bool
+BPT_GEN (insert) (struct BPT_GEN (tree)* tree, BPT_GEN_KEY key,
+        BPT_GEN_VALUE value)
+{
+    ASSERT (tree != NULL);
+
+    struct BPT_GEN (inner)* path[BPT_MAX_HEIGHT];
+    int idx[BPT_MAX_HEIGHT];
+    void* spare[BPT_MAX_HEIGHT + 1];
+    int nspare, d;
+
+    if (tree->root == NULL)
+    {
+        struct BPT_GEN (leaf)* leaf = pool_alloc (&tree->pool);
+        if (leaf == NULL)
+            return false;
+        leaf->hdr.leaf = true;
+        leaf->hdr.count = 1;
+        leaf->prev = leaf->next = NULL;
+        leaf->keys[0] = key;
+        leaf->values[0] = value;
+        tree->root = &leaf->hdr;
+        tree->first = leaf;
+        tree->height = 1;
+        tree->count = 1;
+        return true;
+    }
+
+    ASSERT (tree->height < BPT_MAX_HEIGHT);
+    int depth = tree->height - 1;
+    struct BPT_GEN (leaf)* leaf = BPT_GEN (descend) (tree, key, path, idx);
+    int pos = BPT_GEN (leaf_lower) (leaf, key);
+    if (pos < leaf->hdr.count && BPT_GEN_EQUAL (leaf->keys[pos], key))
+        return false;
+
+    /* Take every node the splits will need up front */
+    int needed = 0;
+    if (leaf->hdr.count == BPT_GEN_SLOTS)
+    {
+        needed = 1;
+        for (d = depth - 1;
+                d >= 0 && path[d]->hdr.count == BPT_GEN_FANOUT - 1; d--)
+            needed++;
+        if (d < 0)
+            needed++;
+    }
+    for (nspare = 0; nspare < needed; nspare++)
+    {
+        spare[nspare] = pool_alloc (&tree->pool);
+        if (spare[nspare] == NULL)
+        {
+            while (nspare > 0)
+                pool_free (&tree->pool, spare[--nspare]);
+            return false;
+        }
+    }
+
+    tree->count++;
+    int n = leaf->hdr.count;
+    if (n < BPT_GEN_SLOTS)
+    {
+        memmove (leaf->keys + pos + 1, leaf->keys + pos,
+                (n - pos) * sizeof (BPT_GEN_KEY));
+        memmove (leaf->values + pos + 1, leaf->values + pos,
+                (n - pos) * sizeof (BPT_GEN_VALUE));
+        leaf->keys[pos] = key;
+        leaf->values[pos] = value;
+        leaf->hdr.count++;
+        return true;
+    }
+
+    /* Split the leaf, the new entry going to whichever half it sorts in */
+    struct BPT_GEN (leaf)* right = spare[--nspare];
+    int left = (BPT_GEN_SLOTS + 1) / 2;
+    int total = BPT_GEN_SLOTS + 1;
+    int i, from;
+    right->hdr.leaf = true;
+    for (i = total - 1, from = n - 1; i >= 0; i--)
+    {
+        BPT_GEN_KEY k;
+        BPT_GEN_VALUE v;
+        if (i == pos)
+        {
+            k = key;
+            v = value;
+        }
+        else
+        {
+            k = leaf->keys[from];
+            v = leaf->values[from];
+            from--;
+        }
+        if (i >= left)
+        {
+            right->keys[i - left] = k;
+            right->values[i - left] = v;
+        }
+        else
+        {
+            leaf->keys[i] = k;
+            leaf->values[i] = v;
+        }
+    }
+    leaf->hdr.count = left;
+    right->hdr.count = total - left;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+        leaf->next->prev = right;
+    leaf->next = right;
+
+    BPT_GEN_KEY up = right->keys[0];
+    struct BPT_GEN (node)* child = &right->hdr;
+
+    for (d = depth - 1; d >= 0; d--)
+    {
+        struct BPT_GEN (inner)* in = path[d];
+        int at = idx[d];
+        int kn = in->hdr.count;
+        if (kn < BPT_GEN_FANOUT - 1)
+        {
+            memmove (in->keys + at + 1, in->keys + at,
+                    (kn - at) * sizeof (BPT_GEN_KEY));
+            memmove (in->child + at + 2, in->child + at + 1,
+                    (kn - at) * sizeof (void*));
+            in->keys[at] = up;
+            in->child[at + 1] = child;
+            in->hdr.count++;
+            return true;
+        }
+
+        /* Split the inner node around its middle key */
+        BPT_GEN_KEY keys[BPT_GEN_FANOUT];
+        struct BPT_GEN (node)* kids[BPT_GEN_FANOUT + 1];
+        memcpy (keys, in->keys, at * sizeof (BPT_GEN_KEY));
+        keys[at] = up;
+        memcpy (keys + at + 1, in->keys + at,
+                (kn - at) * sizeof (BPT_GEN_KEY));
+        memcpy (kids, in->child, (at + 1) * sizeof (void*));
+        kids[at + 1] = child;
+        memcpy (kids + at + 2, in->child + at + 1, (kn - at) * sizeof (void*));
+
+        struct BPT_GEN (inner)* sib = spare[--nspare];
+        int half = BPT_GEN_FANOUT / 2;
+        memcpy (in->keys, keys, half * sizeof (BPT_GEN_KEY));
+        memcpy (in->child, kids, (half + 1) * sizeof (void*));
+        in->hdr.count = half;
+        memcpy (sib->keys, keys + half + 1, (kn - half) * sizeof (BPT_GEN_KEY));
+        memcpy (sib->child, kids + half + 1, (kn - half + 1) * sizeof (void*));
+        sib->hdr.count = kn - half;
+        sib->hdr.leaf = false;
+
+        up = keys[half];
+        child = &sib->hdr;
+    }
+
+    struct BPT_GEN (inner)* root = spare[--nspare];
+    ASSERT (nspare == 0);
+    root->hdr.leaf = false;
+    root->hdr.count = 1;
+    root->keys[0] = up;
+    root->child[0] = tree->root;
+    root->child[1] = child;
+    tree->root = &root->hdr;
+    tree->height++;
+    return true;
+};
+
+/* Child I of PARENT is one short of its minimum.  Borrow from a sibling
+ * that can spare one, or else merge with a sibling. */
+static inline void
+BPT_GEN (fix_underflow) (struct BPT_GEN (tree)* tree,
+        struct BPT_GEN (inner)* parent, int i)
+{
+    struct BPT_GEN (node)* node = parent->child[i];
+    struct BPT_GEN (node)* left = i > 0 ? parent->child[i - 1] : NULL;
+    struct BPT_GEN (node)* right =
+        i < parent->hdr.count ? parent->child[i + 1] : NULL;
+    int min = node->leaf ? BPT_GEN_LEAF_MIN : BPT_GEN_INNER_MIN;
+
+    if (left && left->count > min)
+    {
+        if (node->leaf)
+        {
+            struct BPT_GEN (leaf)* l = (struct BPT_GEN (leaf)*) left;
+            struct BPT_GEN (leaf)* n = (struct BPT_GEN (leaf)*) node;
+            memmove (n->keys + 1, n->keys, n->hdr.count * sizeof (BPT_GEN_KEY));
+            memmove (n->values + 1, n->values,
+                    n->hdr.count * sizeof (BPT_GEN_VALUE));
+            n->keys[0] = l->keys[l->hdr.count - 1];
+            n->values[0] = l->values[l->hdr.count - 1];
+            n->hdr.count++;
+            l->hdr.count--;
+            parent->keys[i - 1] = n->keys[0];
+        }
+        else
+        {
+            struct BPT_GEN (inner)* l = (struct BPT_GEN (inner)*) left;
+            struct BPT_GEN (inner)* n = (struct BPT_GEN (inner)*) node;
+            memmove (n->keys + 1, n->keys, n->hdr.count * sizeof (BPT_GEN_KEY));
+            memmove (n->child + 1, n->child,
+                    (n->hdr.count + 1) * sizeof (void*));
+            n->keys[0] = parent->keys[i - 1];
+            n->child[0] = l->child[l->hdr.count];
+            n->hdr.count++;
+            parent->keys[i - 1] = l->keys[l->hdr.count - 1];
+            l->hdr.count--;
+        }
+    }
+    else if (right && right->count > min)
+    {
+        if (node->leaf)
+        {
+            struct BPT_GEN (leaf)* r = (struct BPT_GEN (leaf)*) right;
+            struct BPT_GEN (leaf)* n = (struct BPT_GEN (leaf)*) node;
+            n->keys[n->hdr.count] = r->keys[0];
+            n->values[n->hdr.count] = r->values[0];
+            n->hdr.count++;
+            r->hdr.count--;
+            memmove (r->keys, r->keys + 1, r->hdr.count * sizeof (BPT_GEN_KEY));
+            memmove (r->values, r->values + 1,
+                    r->hdr.count * sizeof (BPT_GEN_VALUE));
+            parent->keys[i] = r->keys[0];
+        }
+        else
+        {
+            struct BPT_GEN (inner)* r = (struct BPT_GEN (inner)*) right;
+            struct BPT_GEN (inner)* n = (struct BPT_GEN (inner)*) node;
+            n->keys[n->hdr.count] = parent->keys[i];
+            n->child[n->hdr.count + 1] = r->child[0];
+            n->hdr.count++;
+            parent->keys[i] = r->keys[0];
+            r->hdr.count--;
+            memmove (r->keys, r->keys + 1, r->hdr.count * sizeof (BPT_GEN_KEY));
+            memmove (r->child, r->child + 1,
+                    (r->hdr.count + 1) * sizeof (void*));
+        }
+    }
+    else
+    {
+        /* Merge child J + 1 into child J */
+        int j = left ? i - 1 : i;
+        struct BPT_GEN (node)* a = parent->child[j];
+        struct BPT_GEN (node)* b = parent->child[j + 1];
+        if (a->leaf)
+        {
+            struct BPT_GEN (leaf)* l = (struct BPT_GEN (leaf)*) a;
+            struct BPT_GEN (leaf)* r = (struct BPT_GEN (leaf)*) b;
+            memcpy (l->keys + l->hdr.count, r->keys,
+                    r->hdr.count * sizeof (BPT_GEN_KEY));
+            memcpy (l->values + l->hdr.count, r->values,
+                    r->hdr.count * sizeof (BPT_GEN_VALUE));
+            l->hdr.count += r->hdr.count;
+            l->next = r->next;
+            if (r->next)
+                r->next->prev = l;
+        }
+        else
+        {
+            struct BPT_GEN (inner)* l = (struct BPT_GEN (inner)*) a;
+            struct BPT_GEN (inner)* r = (struct BPT_GEN (inner)*) b;
+            l->keys[l->hdr.count] = parent->keys[j];
+            memcpy (l->keys + l->hdr.count + 1, r->keys,
+                    r->hdr.count * sizeof (BPT_GEN_KEY));
+            memcpy (l->child + l->hdr.count + 1, r->child,
+                    (r->hdr.count + 1) * sizeof (void*));
+            l->hdr.count += r->hdr.count + 1;
+        }
+        int kn = parent->hdr.count;
+        memmove (parent->keys + j, parent->keys + j + 1,
+                (kn - j - 1) * sizeof (BPT_GEN_KEY));
+        memmove (parent->child + j + 1, parent->child + j + 2,
+                (kn - j - 1) * sizeof (void*));
+        parent->hdr.count--;
+        pool_free (&tree->pool, b);
+    }
+};
+
+/* Removes KEY, storing its value in VALUE if that is not NULL.  Returns
+ * false if KEY was not there. */
+static inline bool
+BPT_GEN (delete) (struct BPT_GEN (tree)* tree, BPT_GEN_KEY key,
+        BPT_GEN_VALUE* value)
+{
+    ASSERT (tree != NULL);
+
+    struct BPT_GEN (inner)* path[BPT_MAX_HEIGHT];
+    int idx[BPT_MAX_HEIGHT];
+    int depth = tree->height - 1;
+    int d;
+
+    if (tree->root == NULL)
+        return false;
+    struct BPT_GEN (leaf)* leaf = BPT_GEN (descend) (tree, key, path, idx);
+    int pos = BPT_GEN (leaf_lower) (leaf, key);
+    if (pos == leaf->hdr.count || !BPT_GEN_EQUAL (leaf->keys[pos], key))
+        return false;
+
+    if (value)
+        *value = leaf->values[pos];
+    leaf->hdr.count--;
+    memmove (leaf->keys + pos, leaf->keys + pos + 1,
+            (leaf->hdr.count - pos) * sizeof (BPT_GEN_KEY));
+    memmove (leaf->values + pos, leaf->values + pos + 1,
+            (leaf->hdr.count - pos) * sizeof (BPT_GEN_VALUE));
+    tree->count--;
+
+    /* Keys in inner nodes are copies, so they stay valid bounds even when
+     * the key they came from is gone */
+    struct BPT_GEN (node)* node = &leaf->hdr;
+    for (d = depth - 1; d >= 0; d--)
+    {
+        int min = node->leaf ? BPT_GEN_LEAF_MIN : BPT_GEN_INNER_MIN;
+        if (node->count >= min)
+            break;
+        BPT_GEN (fix_underflow) (tree, path[d], idx[d]);
+        node = &path[d]->hdr;
+    }
+
+    struct BPT_GEN (node)* root = tree->root;
+    if (root->count == 0)
+    {
+        if (root->leaf)
+        {
+            tree->root = NULL;
+            tree->first = NULL;
+            tree->height = 0;
+        }
+        else
+        {
+            tree->root = ((struct BPT_GEN (inner)*) root)->child[0];
+            tree->height--;
+        }
+        pool_free (&tree->pool, root);
+    }
+    return true;
+};
+
+/* Iterators, good until the next insert or delete */
+static inline bool
+BPT_GEN (iter_first) (const struct BPT_GEN (tree)* tree,
+        struct BPT_GEN (iterator)* it)
+{
+    it->leaf = tree->first;
+    it->pos = 0;
+    return it->leaf != NULL;
+};
+
+/* Points IT at the first key not less than KEY */
+static inline bool
+BPT_GEN (iter_seek) (const struct BPT_GEN (tree)* tree,
+        struct BPT_GEN (iterator)* it, BPT_GEN_KEY key)
+{
+    it->leaf = NULL;
+    it->pos = 0;
+    if (tree->root == NULL)
+        return false;
+    it->leaf = BPT_GEN (descend) (tree, key, NULL, NULL);
+    it->pos = BPT_GEN (leaf_lower) (it->leaf, key);
+    if (it->pos == it->leaf->hdr.count)
+    {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != NULL;
+};
+
+/* Moves IT along.  Returns false, leaving IT spent, past the end. */
+static inline bool
+BPT_GEN (iter_next) (struct BPT_GEN (iterator)* it)
+{
+    if (it->leaf == NULL)
+        return false;
+    if (++it->pos == it->leaf->hdr.count)
+    {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != NULL;
+};
+
+static inline BPT_GEN_KEY
+BPT_GEN (iter_key) (const struct BPT_GEN (iterator)* it)
+{
+    ASSERT (it->leaf != NULL);
+    return it->leaf->keys[it->pos];
+};
+
+static inline BPT_GEN_VALUE*
+BPT_GEN (iter_value) (const struct BPT_GEN (iterator)* it)
+{
+    ASSERT (it->leaf != NULL);
+    return &it->leaf->values[it->pos];
+};
+
+/* Checks every invariant of the subtree under NODE, whose keys must be at
+ * least LO and below HI where those are given */
+static inline bool
+BPT_GEN (check_helper) (const struct BPT_GEN (tree)* tree,
+        const struct BPT_GEN (node)* node, unsigned depth,
+        const BPT_GEN_KEY* lo, const BPT_GEN_KEY* hi, size_t* count,
+        struct BPT_GEN (leaf)** next_leaf)
+{
+    bool root = node == tree->root;
+    int i;
+
+    if (node->leaf)
+    {
+        struct BPT_GEN (leaf)* leaf = (struct BPT_GEN (leaf)*) node;
+        int n = leaf->hdr.count;
+        if (depth != tree->height - 1 || leaf != *next_leaf)
+            return false;
+        if (n < (root ? 1 : BPT_GEN_LEAF_MIN) || n > BPT_GEN_SLOTS)
+            return false;
+        for (i = 1; i < n; i++)
+            if (!BPT_GEN_LESS (leaf->keys[i - 1], leaf->keys[i]))
+                return false;
+        if ((lo && BPT_GEN_LESS (leaf->keys[0], *lo))
+                || (hi && !BPT_GEN_LESS (leaf->keys[n - 1], *hi)))
+            return false;
+        if (leaf->next && leaf->next->prev != leaf)
+            return false;
+        *next_leaf = leaf->next;
+        *count += n;
+        return true;
+    }
+
+    const struct BPT_GEN (inner)* in = (const struct BPT_GEN (inner)*) node;
+    int n = in->hdr.count;
+    if (n < (root ? 1 : BPT_GEN_INNER_MIN) || n > BPT_GEN_FANOUT - 1)
+        return false;
+    for (i = 0; i < n; i++)
+    {
+        if (i > 0 && !BPT_GEN_LESS (in->keys[i - 1], in->keys[i]))
+            return false;
+        if ((lo && BPT_GEN_LESS (in->keys[i], *lo))
+                || (hi && !BPT_GEN_LESS (in->keys[i], *hi)))
+            return false;
+    }
+    for (i = 0; i <= n; i++)
+        if (!BPT_GEN (check_helper) (tree, in->child[i], depth + 1,
+                    i > 0 ? &in->keys[i - 1] : lo, i < n ? &in->keys[i] : hi,
+                    count, next_leaf))
+            return false;
+    return true;
+};
+
+/* Same as bpt_check */
+static inline bool
+BPT_GEN (check) (const struct BPT_GEN (tree)* tree, size_t* count)
+{
+    size_t n = 0;
+    bool ok;
+    if (tree->root == NULL)
+        ok = tree->height == 0 && tree->first == NULL;
+    else
+    {
+        struct BPT_GEN (leaf)* next_leaf = tree->first;
+        ok = tree->first->prev == NULL
+            && BPT_GEN (check_helper) (tree, tree->root, 0, NULL, NULL, &n,
+                    &next_leaf)
+            && next_leaf == NULL;
+    }
+    if (count)
+        *count = n;
+    return ok && n == tree->count;
+};
+
+#undef BPT_GEN_NAME
+#undef BPT_GEN_KEY
+#undef BPT_GEN_VALUE
+#undef BPT_GEN_LESS
+#undef BPT_GEN_CAT2
+#undef BPT_GEN_CAT
+#undef BPT_GEN
+#undef BPT_GEN_FANOUT
+#undef BPT_GEN_SLOTS
+#undef BPT_GEN_LEAF_MIN
+#undef BPT_GEN_INNER_MIN
+#undef BPT_GEN_EQUAL
@@ -2,6 +2,7 @@
 #define BST_H  
 
 #include    "type.h"
+#include    "pool.h"
 
 struct bst_node;
 
@@ -31,6 +32,11 @@ struct bst_tree
     
     /* the comparator function */
     bst_tree_compare_func* comparator;
+
+    /* Nodes for bst_insert come from here.  Unused by intrusive trees,
+     * whose nodes belong to the elements. */
+    struct node_pool pool;
+    bool intrusive;
 };
 
 
@@ -43,6 +49,17 @@ struct bst_tree
  * */
 void bst_init (struct bst_tree* tree, bst_tree_compare_func* func);
 
+/* Initializes TREE for intrusive use: elements embed their own struct
+ * BST_NODE and are added with bst_insert_node, so the tree never allocates.
+ * Such a tree must not be used with bst_insert or bst_delete.
+ * */
+void bst_init_intrusive (struct bst_tree* tree, bst_tree_compare_func* func);
+
+/* Frees every node TREE allocated.  The elements themselves are left
+ * alone.
+ * */
+void bst_destroy (struct bst_tree* tree);
+
 /* Inserts the data pointed to by DATA into TREE
  * TREE must be a valid initialized tree
  * DATA must be a valid pointer
@@ -60,6 +77,16 @@ void* bst_delete (struct bst_tree* tree, void* data);
  * */
 void* bst_find (struct bst_tree* tree, const void* elem);
 
+/* Intrusive forms of the above.  NODE is embedded in the element DATA, and
+ * links DATA into TREE without allocating; it must not be in any tree
+ * already.  bst_remove_node unlinks NODE, which must be in TREE.
+ * bst_find_node works on any tree.
+ * */
+bool bst_insert_node (struct bst_tree* tree, struct bst_node* node, 
+        void* data);
+void bst_remove_node (struct bst_tree* tree, struct bst_node* node);
+struct bst_node* bst_find_node (struct bst_tree* tree, const void* elem);
+
 /* Prints out the contents of TREE using FUNC to print the data 
  * (if supplied)
  * TREE must be a valid initialized tree
@@ -75,13 +102,45 @@ struct bst_iterator
     struct bst_tree* tree;
 };
 
+/* Point IT, which usually lives on the caller's stack, at the first or
+ * last element of TREE, or with BST_ITER_SEEK at the first element
+ * not less than ELEM.  Return false if there is no such element.  None of
+ * them allocate.
+ * */
+bool bst_iter_first (struct bst_tree* tree, struct bst_iterator* it);
+bool bst_iter_last (struct bst_tree* tree, struct bst_iterator* it);
+bool bst_iter_seek (struct bst_tree* tree, struct bst_iterator* it, 
+        const void* elem);
+
+/* Same as BST_ITER_FIRST and BST_ITER_LAST, but the iterator is
+ * malloc'd and the caller must free it.  Return NULL for an empty tree.
+ * */
 struct bst_iterator* bst_get_iterator (struct bst_tree*);
 struct bst_iterator* bst_get_reverse_iterator (struct bst_tree*);
+/* Moving off either end returns NULL and leaves the iterator spent, so
+ * BST_GET returns NULL from then on */
 void* bst_get (struct bst_iterator*);
 void bst_itr_remove (struct bst_iterator*);
 void* bst_next (struct bst_iterator*);
 void* bst_prev (struct bst_iterator*);
 
+/* Called for each element by BST_WALK.  Returning false stops the
+ * walk. */
+typedef bool bst_visit_func (void* data, void* aux);
+
+/* Calls FUNC on every element of TREE in order, without allocating.
+ * Returns the number of elements visited.
+ * */
+size_t bst_walk (struct bst_tree* tree, bst_visit_func* func, void* aux);
+
+/* Copies pointers to the elements from LO to HI, both included, into OUT in
+ * order, in a single pass.  Either bound may be NULL for no bound.  At most
+ * MAX are stored, but all are counted: returns how many elements are in the
+ * range.  Run it under whatever lock protects TREE to get a snapshot.
+ * */
+size_t bst_range (struct bst_tree* tree, const void* lo, const void* hi, 
+        void** out, size_t max);
+
 
 
 #endif
@@ -9,7 +9,13 @@
 #include <semaphore.h>
 #include <stdio.h>
 
-#include "bst.h"
+#include "slab.h"
+#include "hash.h"
+
+/* Commands and the message layout shared with the client library */
+#include "../lib/messaging.h"
+
+struct idle_timer;
 
 /**
  * This structure defines a child record in the server's data index.  A child
@@ -19,6 +25,14 @@
  * - port
  * - protocol (ipv4, ipv6)
  * */
+
+/* A client's IP address.  IPv4 addresses are stored mapped into IPv6
+ * (::ffff:a.b.c.d), so both families compare and hash the same way. */
+struct child_addr
+{
+    unsigned char ip[16];
+};
+
 struct server_child
 {
     pid_t pid;          // child's pid
@@ -26,6 +40,18 @@ struct server_child
     int clientfd;       // the child's connection with the client
     int parentread;     // parent uses this to read
     int parentwrite;    // parent uses this to write
+    int syncslot;       // the child's process slot in the sync region
+    struct child_addr addr;     // the client's address
+    struct mailbox* mailbox;    // messages from siblings not yet received
+    uint32 trace;       // trace id of the connection, 0 if not traced
+    int execfd;         // reads end of file once the child has exec'd
+    uint64_t accepted;  // when the connection was accepted
+    uint64_t forked;    // when fork returned in the parent
+    int state;          // conn_state_t it last reported, 0 if none
+    uint64_t active;    // when its last command came or ended, in timer_now ms
+    uint32 busy;        // a command of it is in progress
+    struct idle_timer* idle;    // watching it for going idle, main thread only
+    uint32 refs;        // held by the index and the broker thread
     sem_t* logsem;
     sem_t* errsem;
     FILE* logfile;
@@ -33,74 +59,88 @@ struct server_child
 
     pthread_t thread;  // This child's communication thread
     pthread_mutex_t init_lock;// Lock that signals the thread is ready to start
+
+    struct hash_link pid_link;  // in the index by pid
+    struct hash_link addr_link; // in the index by client address
 };
 
 /**
- * Defines a data structure based on a BST for maintaining an index of all the
- * child processes that are running.  We must be able to query the index via the
- * child's proc_id and get a struct describing the child, namely struct
- * SERVER_CHILD.  This structure will need to support insertion, deletion, and
- * find. */
+ * Defines the index of all the child processes that are running.  We must be
+ * able to query the index via the child's proc_id and get a struct describing
+ * the child, namely struct SERVER_CHILD.  The proc_id is the child's slot in
+ * a slab table, so insertion, deletion and find are O(1), and an id kept
+ * after its child is gone is recognized as stale even once the slot is
+ * reused.  Connects and exits take LOCK; lookups take no lock at all and
+ * run inside an epoch read section instead, so a removed child is only
+ * freed once nobody can still be forwarding to it.
+ *
+ * Two hash tables index the same children by pid, so an exit reported by
+ * wait() finds its record directly, and by client address, so all the
+ * connections from one host can be counted.  They change together with the
+ * table under LOCK, and unlike the table they are only read under LOCK. */
 struct child_index
 {
-    struct bst_tree tree;    // TODO use avl or more efficient structure instead
-    pthread_mutex_t lock;   // keep accesses synchronized
+    struct slab_table table;
+    struct hash_table by_pid;
+    struct hash_table by_addr;
+    pthread_mutex_t lock;   // serializes inserts and removes
 };
 
 void init_child_index ();
 int child_compare (const void* child1, const void* child2, const void* AUX);
 void child_dump (const void* child);
-void add_child (struct server_child* child);
+/* Adds CHILD to the index and assigns its OURID.  Returns the id, or -1 if
+ * the index is full. */
+int add_child (struct server_child* child);
 struct server_child* remove_child (int our_id);
+
+/* Removes the child with PID, as remove_child does.  Returns NULL if there
+ * is none. */
+struct server_child* remove_child_by_pid (pid_t pid);
+
+/* Frees a child returned by remove_child once every thread that might have
+ * looked it up is done with it.  Closes its pipes. */
+void retire_child (struct server_child* child);
+
+/* A child record starts with two references: one for the index, dropped
+ * by whoever reaps the child, and one for its broker thread, which it
+ * drops once the child has closed its end of the pipe.  Drops one, and
+ * retires the child if it was the last. */
+void put_child (struct server_child* child);
+
+/* Starts CHILD's broker thread, running CHILD_COMM_THREAD.  Returns 0, or
+ * the error from pthread_create. */
+int start_broker (struct server_child* child);
+
+/* Waits up to TIMEOUT_MS for every broker thread to exit, as at shutdown
+ * once the children are gone.  Returns how many are still running. */
+int wait_brokers (int timeout_ms);
+
+/* Messages siblings sent that were still in a mailbox when its child went
+ * away, since the server started */
+uint64_t get_undelivered ();
+
+/* Looks up a child without locking.  Must be called inside epoch_enter and
+ * epoch_exit, which a child's communication thread does around each
+ * command. */
 struct server_child* get_child (int proc_id);
-void dump_child_index ();
+int get_child_ids (int* ids, int max);
 
-/* There are certain commands that can be sent from one child process to another
- * child process.  These commands will originate from the user command script,
- * but they will need to have some supporting implementation here.  Commands
- * include:
- *  - blocking/non-blocking send and recv operations
- *  - synchronization primatives: semaphores, mutexes, monitors
- *  - some way to have the parent store customized information for them all to
- *    access
- */
-enum command
-{
-    NOTHING = 0,
-    SEND_B = 1,
-    SEND_NB = 2,
-    SEND_WAIT = 3,
-    RECV_B = 4,
-    RECV_NB = 5,
-    RECV_WAIT = 6,
-    SEMA_INIT = 7,
-    SEMA_POST = 8,
-    SEMA_WAIT = 9,
-    SEMA_TRY_WAIT = 10,
-    LOCK_INIT = 11,
-    LOCK_ACQUIRE = 12,
-    LOCK_RELEASE = 13,
-    LOCK_TRY_ACQUIRE = 14,
-    MONITOR_INIT = 15,
-    MONITOR_WAIT = 16,
-    MONITOR_SIGNAL = 17,
-    MONITOR_BCAST = 18
-};
+/* Looks up a child by pid.  Takes the index lock, but the child is only
+ * kept from being freed inside an epoch read section, as with get_child. */
+struct server_child* get_child_by_pid (pid_t pid);
 
-#define NUM_COMMANDS 19
+/* Copies the ids of up to MAX children connected from ADDR into IDS.
+ * Returns how many there are, which may be more than MAX. */
+int get_child_ids_by_addr (const struct child_addr* addr, int* ids, int max);
 
-/* This struct defines an entire message that a child process could send to its
- * parent.  The message must include a command, and any of the other parameters
- * present in the structure. */
-struct message
-{
-    enum command command;   // The command to send
-    char identifier[16];    // An identifier for global synch objects
-    int id;                 // A numeric id for messaging sibling processes
-    size_t sz;              // Size of the information
-    char information[484];  // Information sent or received from the sibling
-                            // struct is arbitrarily 512 bytes long
-};
+/* Fills in ADDR from a socket address as returned by accept() */
+void child_addr_set (struct child_addr* addr, const struct sockaddr* sa);
+
+/* Delivers M to the child OURID without it having asked for it.  Returns -1
+ * if there is no such child or the write failed. */
+int message_child (int ourid, struct message* m);
+void dump_child_index ();
 
 /* This definition represents a generic function type to handle a command sent
  * to us by a child process.  We will use an array of functions, indexed by the
@@ -121,7 +161,7 @@ void* child_comm_thread (void* child);
  * passed in here as parameters, and this function will allocate space for an
  * array and fill it accordingly. */
 char** build_child_argv (const char* exe, char* scriptname, int newfd, 
-        int childread, int childwrite);
+        int childread, int childwrite, int syncfd, int syncslot, int logfd);
 
 ;
 #endif // CHILD_H
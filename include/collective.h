@@ -0,0 +1,75 @@
+#ifndef COLLECTIVE_H
+#define COLLECTIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "type.h"
+#include "../lib/messaging.h"
+
+/*
+ * Collective calls coordinated by the parent.
+ *
+ * The caller's communication thread registers a collective, sends the request
+ * to every sibling and then sleeps until all of them have answered or the
+ * timeout expires.  Answers arrive on the siblings' own communication threads
+ * and are folded into the collective as they come in, so nothing but the
+ * running result is kept.  Answers that arrive after the caller gave up are
+ * dropped.
+ * */
+
+/* Timeout used when the caller does not give one */
+#define COLL_DEFAULT_TIMEOUT    1000
+
+/* Where each sibling stands in a collective */
+enum coll_member_state
+{
+    COLL_ASKED = 0,
+    COLL_ANSWERED = 1,
+    COLL_UNREACHED = 2          // the request never got to it
+};
+
+/* A sibling asked.  Only these may answer, and each only once. */
+struct coll_member
+{
+    int ourid;
+    int state;                  // enum coll_member_state
+};
+
+struct collective
+{
+    uint32 id;
+    enum command command;       // COLL_BCAST, COLL_GATHER or COLL_REDUCE
+    enum coll_reducer reducer;
+    int expected;               // siblings asked
+    int received;               // siblings that answered so far
+    struct coll_member* members;        // sorted by ourid
+    int nmembers;
+
+    int64_t acc;                // running SUM, MIN or MAX
+    char result[484];           // gathered or concatenated answers
+    size_t len;
+
+    pthread_cond_t done;
+    struct collective* next;
+};
+
+/* Registers C, which lives on the caller's stack, and returns its id, or 0
+ * if out of memory.  IDS are the N siblings that are about to be asked. */
+uint32 collective_begin (struct collective* c, enum command command,
+        enum coll_reducer reducer, const int* ids, int n);
+
+/* Stops waiting for OURID, which the request could not be sent to */
+void collective_unreached (struct collective* c, int ourid);
+
+/* Folds the SZ bytes of DATA answered by OURID into collective ID.  Returns
+ * -1 if the collective is gone, or OURID was not asked or has answered
+ * already. */
+int collective_contribute (uint32 id, int ourid, const void* data, size_t sz);
+
+/* Waits up to TIMEOUT_MS for every answer, then unregisters C.  Returns the
+ * number of siblings that answered.  The result is left in C. */
+int collective_wait (struct collective* c, int timeout_ms);
+
+#endif //COLLECTIVE_H
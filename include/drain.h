@@ -0,0 +1,45 @@
+#ifndef DRAIN_H
+#define DRAIN_H
+
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * Shutting down without cutting off the clients that are being served.
+ *
+ * Once the server stops accepting, the children still running are given
+ * until DEADLINE to finish.  Workers have no client to finish with, so
+ * they are sent SIGTERM at once and are not replaced.  Children left at
+ * the deadline are sent SIGTERM, and those still left after GRACE more are
+ * killed.  A second SIGINT or SIGTERM skips to the next step.  Then the
+ * broker threads are given GRACE to pass on what they still hold and exit.
+ *
+ * Signals are handled from the server's signal descriptor the whole time,
+ * so children are reaped as usual and the drain ends as soon as the last
+ * one is gone.  Times are in ms.
+ * */
+
+/* How long children get to finish, and then to exit once told to */
+#define DRAIN_DEFAULT_DEADLINE  30000
+#define DRAIN_DEFAULT_GRACE     5000
+
+struct drain_stats
+{
+    int children;               // running when the drain started
+    int workers;                // of those, workers told to stop at once
+    int completed;              // exited by the deadline, workers included
+    int terminated;             // exited after SIGTERM
+    int killed;                 // still there after the grace period
+    int lost;                   // not reaped even after SIGKILL
+    int brokers;                // broker threads that did not exit
+    uint64_t undelivered;       // messages left in the mailboxes of those
+                                // that exited
+    uint64_t elapsed;
+};
+
+/* Drains the children, reading signals from SFD, and fills in STATS */
+void drain_children (int sfd, unsigned deadline, unsigned grace,
+        struct drain_stats* stats);
+
+#endif //DRAIN_H
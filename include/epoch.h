@@ -0,0 +1,47 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * Epoch-based reclamation, so readers can use shared structures without
+ * taking a lock.
+ *
+ * A reader brackets its use of shared pointers with epoch_enter and
+ * epoch_exit.  A writer unlinks an object so new readers can't reach it and
+ * hands it to epoch_retire instead of freeing it.  The object is destroyed
+ * once every reader that was inside when it was retired has left, so a
+ * reader never sees freed memory, and no reader ever waits for a writer.
+ *
+ * Read sections nest and may block, but an object can't be destroyed until
+ * the readers that might see it leave, so keep them short.
+ * */
+
+typedef void epoch_destroy_func (void* ptr);
+
+/* A thread taking part in reclamation.  Records are reused once their
+ * thread exits. */
+struct epoch_record
+{
+    uint64_t active;            // epoch the thread entered in, 0 if outside
+    int depth;                  // nesting depth, only used by its thread
+    int in_use;
+    struct epoch_record* next;
+};
+
+void epoch_enter ();
+void epoch_exit ();
+
+/* Destroys PTR with FUNC once no reader can still be using it */
+void epoch_retire (void* ptr, epoch_destroy_func* func);
+
+/* Destroys whatever retired objects are safe to destroy by now */
+void epoch_collect ();
+
+/* Gives up the calling thread's record.  Threads that used epoch_enter call
+ * this before they exit. */
+void epoch_thread_exit ();
+
+#endif //EPOCH_H
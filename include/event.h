@@ -0,0 +1,58 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "type.h"
+#include "../lib/messaging.h"
+
+/*
+ * Sibling events, kept by the parent.
+ *
+ * A child subscribes to the exits and state changes of one sibling or of
+ * all of them.  Each subscriber has a box of pending events with one entry
+ * per sibling, so a burst of changes to one sibling costs the subscriber a
+ * single entry holding the latest state and a count.  The first event in an
+ * empty box sends the subscriber an EVENT_NOTIFY, and no more are sent until
+ * it fetches the box with EVENT_POLL, so a subscriber never has more than one
+ * notice in its pipe however busy its siblings are.
+ * */
+
+#define EVENT_BUCKETS   256
+
+/* Sends M to the child OURID; used for notices */
+typedef int event_deliver_func (int ourid, struct message* m);
+
+struct event_stats
+{
+    uint64_t posted;        // events posted
+    uint64_t queued;        // events added to a box
+    uint64_t merged;        // of those, merged into an entry already there
+    uint64_t notices;       // EVENT_NOTIFYs sent
+    uint64_t lost;          // events dropped from full boxes
+};
+
+/* DELIVER is used to send notices */
+void init_events (event_deliver_func* deliver);
+
+/* Subscribes SUBSCRIBER to the events in MASK of TARGET, or of every
+ * sibling if TARGET is SIBLING_ANY_SOURCE, replacing what it subscribed to
+ * before.  A MASK of 0 unsubscribes.  Returns -1 if out of memory. */
+int event_subscribe (int subscriber, int target, uint32 mask);
+
+/* Posts EVENT (EVENT_EXIT or EVENT_STATE) of child OURID, whose state is
+ * now STATE, to its subscribers.  STATUS is the exit status. */
+void event_post (int ourid, uint32 event, int state, int status);
+
+/* Moves up to EVENT_MAX_BATCH of SUBSCRIBER's pending events into
+ * INFORMATION, as the answer to EVENT_POLL.  Returns how many. */
+int event_poll (int subscriber, char* information, size_t* sz);
+
+/* Drops the subscriptions of OURID, both its own and those to it, once it
+ * has exited */
+void event_forget (int ourid);
+
+void event_get_stats (struct event_stats* stats);
+
+#endif //EVENT_H
@@ -0,0 +1,58 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * An intrusive chained hash table.
+ *
+ * Elements embed a struct hash_link and are filed under a 64 bit hash the
+ * caller computes from its own key.  The table only knows hashes, so
+ * several elements may share one, either because their keys are equal or
+ * because they collide; callers walk the matches with hash_next and compare
+ * their real keys.  Nothing is allocated per element, and the bucket array
+ * doubles whenever the table gets as full as it is long, so lookups stay
+ * O(1) on average.  Not synchronized.
+ * */
+
+struct hash_link
+{
+    struct hash_link* next;     // next link in the bucket
+    uint64_t hash;
+};
+
+struct hash_table
+{
+    struct hash_link** buckets;
+    size_t nbuckets;            // always a power of two
+    size_t count;
+};
+
+/* Returns the element that owns LINK, where LINK is its MEMBER */
+#define hash_entry(LINK, STRUCT, MEMBER) \
+    ((STRUCT*) ((char*) (LINK) - offsetof (STRUCT, MEMBER)))
+
+/* Returns -1 if memory ran out */
+int hash_init (struct hash_table* h);
+
+/* Frees the buckets.  The elements belong to the caller. */
+void hash_destroy (struct hash_table* h);
+
+/* Files LINK under HASH.  Never fails: if the table can't grow its chains
+ * just get longer. */
+void hash_insert (struct hash_table* h, struct hash_link* link, uint64_t hash);
+void hash_remove (struct hash_table* h, struct hash_link* link);
+
+/* Return the first link filed under HASH, and the one after LINK filed
+ * under the same hash, or NULL when there are no more. */
+struct hash_link* hash_first (const struct hash_table* h, uint64_t hash);
+struct hash_link* hash_next (const struct hash_link* link);
+
+/* Hashes for common keys */
+uint64_t hash_int (uint64_t key);
+uint64_t hash_bytes (const void* data, size_t sz);
+
+#endif //HASH_H
@@ -0,0 +1,36 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+
+#include "child.h"
+
+/*
+ * Terminates clients' children that have gone idle.
+ *
+ * Each watched child has a timer on a wheel the main loop runs.  Its broker
+ * notes in the child's record when each command ends and whether one is in
+ * progress, and the timer only looks when it expires, so being busy costs
+ * nothing here.  A child heard from since the timer was armed is given the
+ * timeout again from then, and one blocked in a command, however long it
+ * waits, is left alone for another timeout.  Any other is sent SIGTERM.
+ * The timer goes when the child is reaped.
+ *
+ * Everything here runs on the main thread, from the main loop and the
+ * reaper, so nothing is locked.  Times are in timer_now ms.
+ * */
+
+/* Children are terminated after TIMEOUT_MS idle, or never if it is 0 */
+void init_idle (unsigned timeout_ms);
+
+/* Starts watching CHILD, which must be in the child index */
+void idle_watch (struct server_child* child);
+
+/* Stops watching CHILD, as when it is reaped */
+void idle_forget (struct server_child* child);
+
+/* Terminates the children that are due.  Returns how many ms until the
+ * next one is, or -1 if none is watched, for a poll timeout. */
+int idle_run (uint64_t now);
+
+#endif //IDLE_H
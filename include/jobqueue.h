@@ -0,0 +1,106 @@
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "type.h"
+#include "../lib/messaging.h"
+
+/*
+ * Named job queues hosted by the parent.
+ *
+ * Every child that touches a queue gets its own deque in it.  A producer's
+ * tasks go to the bottom of its own deque.  A worker pops from the bottom of
+ * its own deque first (newest work, warmest data) and, when that is empty,
+ * steals up to half of the fullest sibling deque from the top (oldest work).
+ * All deques of a queue share one lock: the broker is the only one touching
+ * them, so the point of the per-child deques is locality and fairness, not
+ * lock freedom.
+ * */
+
+/* Maximum number of named queues */
+#define JOBQ_MAX_QUEUES     64
+
+struct job
+{
+    uint32 jobid;
+    int producer;           // ourid of the child that pushed the job
+    size_t sz;
+    char data[];
+};
+
+/* Growable ring of jobs.  The owner works at the bottom, thieves take from
+ * the top. */
+struct job_deque
+{
+    struct job** ring;
+    size_t capacity;        // always a power of two
+    size_t top;
+    size_t bottom;
+};
+
+struct jobq_worker
+{
+    int ourid;
+    bool closed;            // its child is gone
+    struct job_deque deque;
+};
+
+struct job_queue
+{
+    char name[16];
+    bool used;
+
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+
+    struct jobq_worker* workers;
+    int nworkers;
+    int maxworkers;
+
+    uint32 next_jobid;
+    struct timespec opened;
+    struct jobq_stats stats;
+};
+
+/* Initializes the queue table */
+void init_jobqueues ();
+
+/* Finds or creates the queue NAME and returns its handle, or -1 if the table
+ * is full */
+int jobqueue_open (const char* name);
+
+/* Pushes a copy of DATA onto PRODUCER's deque.  Returns the new job's id, or
+ * -1 on error. */
+int jobqueue_push (int q, int producer, const void* data, size_t sz);
+
+/* Pops up to MAX jobs for WORKER into JOBS, stealing from a sibling if its
+ * own deque is empty.  Waits up to TIMEOUT_MS milliseconds for work (0 does
+ * not wait, a negative value waits forever).  Returns the number of jobs
+ * popped, which the caller must release with jobqueue_free_job, or -1 on
+ * error or once WORKER is closed. */
+int jobqueue_pop (int q, int worker, struct job** jobs, int max,
+        int timeout_ms);
+
+/* Puts JOB, popped by WORKER and not handed out, back on the bottom of its
+ * deque, keeping its id and producer.  Returns 0, or -1 if there was no
+ * room, in which case JOB is still the caller's. */
+int jobqueue_requeue (int q, int worker, struct job* job);
+
+/* Marks WORKER's child as gone in every queue: a pop it is waiting in
+ * returns -1 with errno ESRCH, as do any later ones.  Jobs left on its
+ * deque stay there for its siblings to steal. */
+void jobqueue_close_worker (int worker);
+
+/* Counts a completed job */
+void jobqueue_complete (int q);
+
+/* Copies the statistics of queue Q into STATS */
+int jobqueue_stats (int q, struct jobq_stats* stats);
+
+void jobqueue_free_job (struct job* job);
+
+#endif //JOBQUEUE_H
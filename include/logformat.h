@@ -0,0 +1,66 @@
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "type.h"
+
+/*
+ * Binary log records.
+ *
+ * In binary mode the writer mixes these entries into the log files with
+ * ordinary text lines (lines logged before the writer started, or by
+ * processes logging text).  Each entry starts with LOG_ENTRY_MAGIC, which
+ * never starts a text line, followed by the rest of struct log_entry and
+ * LEN bytes of body.  Numbers are in the byte order of the machine that
+ * wrote the file.
+ *
+ * A LINE names its format by an id the writer gives it.  The FORMAT entry
+ * for that id comes before the first LINE using it in the file.  LINE time
+ * stamps are CLOCK_MONOTONIC; the CLOCK entries before them map that to
+ * wall clock time.
+ * */
+
+#define LOG_ENTRY_MAGIC     0x1e
+
+enum log_entry_type
+{
+    LOG_ENTRY_FORMAT = 1,   // uint32 id, then the format string
+    LOG_ENTRY_CLOCK = 2,    // struct log_entry_clock
+    LOG_ENTRY_LINE = 3      // struct log_entry_line, then the arguments
+};
+
+struct log_entry
+{
+    uint8 magic;
+    uint8 type;
+    uint16 len;
+} __attribute__ ((packed));
+
+struct log_entry_clock
+{
+    uint64_t mono_ns;
+    uint64_t real_ns;
+} __attribute__ ((packed));
+
+struct log_entry_line
+{
+    uint64_t ts_ns;
+    sint32 pid;
+    uint32 id;
+} __attribute__ ((packed));
+
+/* Scans the conversion starting at the '%' at P, which must not be "%%".
+ * Appends the kind of each argument it takes (one for each '*', then one
+ * for the value) to KINDS, which holds MAX, and counts them in N.  Returns
+ * the character after the conversion, or NULL if it can't be stored in
+ * binary or KINDS is full. */
+const char* log_scan_spec (const char* p, uint8* kinds, int* n, int max);
+
+/* Writes the "[Day Mon D, YYYY HH:MM:SS] pid: " prefix of a text line for
+ * SEC and PID to BUF, which needs room for 64 bytes.  Returns its length. */
+size_t log_prefix (char* buf, time_t sec, pid_t pid);
+
+#endif //LOGFORMAT_H
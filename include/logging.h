@@ -2,21 +2,286 @@
 #define LOGGING_H
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdlib.h>
 
+#include "type.h"
+
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 600
+#endif
+
+/*
+ * Logging.
+ *
+ * SERVER_LOG and SERVER_ERR do not write anything themselves.  Every thread
+ * that logs gets its own bounded ring of lines; the caller formats its
+ * message into the next slot and publishes it with a single store, without
+ * taking a lock or entering the kernel.  A writer thread started by
+ * INIT_LOGGING drains all the rings, adds the time stamp and pid, and
+ * writes whole batches to the log files, which are opened with O_APPEND so
+ * batches from different processes never overwrite each other.
+ *
+ * Lines from one thread stay in order; lines from different threads may be
+ * written slightly out of order.  Until the writer is running (and in a
+ * child after fork, which does not inherit it) lines are written directly,
+ * one write each.
+ *
+ * Children log through a ring in shared memory instead.  The parent creates
+ * it with INIT_LOG_RING and its writer is the only one that drains it.
+ * Forked children inherit the mapping, and programs started with exec map
+ * it again from the descriptor with ATTACH_LOG_RING.  Any number of
+ * processes append to it, each claiming a slot with a compare-and-swap, so a
+ * child's log call makes no syscall unless the writer needs waking.
+ *
+ * In binary mode (SET_LOG_BINARY) the caller does not format anything.
+ * SERVER_LOG and SERVER_ERR are macros that give each call site a static
+ * struct log_format; the caller stores a coarse monotonic time stamp, a
+ * pointer to that struct and the raw arguments, and the writer writes them
+ * out as binary records (see logformat.h) that the logdecode tool turns
+ * back into the usual text.  Formats must be string literals.
+ *
+ * Every line has a level and a subsystem.  Calls above LOG_COMPILED_LEVEL
+ * are not compiled at all; the rest are skipped at run time, with one
+ * load and one branch, when their level is above the one set for their
+ * subsystem.  Each call site may also write only so many lines a second
+ * (SET_LOG_RATE).  Lines over that are counted rather than queued, and a
+ * summary of how many were suppressed is written once the second is over.
+ *
+ * The writer also rotates the files (SET_LOG_ROTATION) between batches,
+ * so callers never wait on it: the file is renamed aside and a new one
+ * opened at the same path under the same descriptor.  Children logging
+ * through the shared ring need nothing more, and processes writing
+ * directly check once a second that their files are still at their paths.
+ * REOPEN_LOGGING, meant for SIGHUP, has the writer open both paths again
+ * after something else has moved the files.
+ * */
+
+/* Lines a thread can have queued before the overflow policy applies */
+#define LOG_RING_SLOTS      128
+
+/* Longest message kept, including the terminating NUL.  Longer ones are
+ * cut.  Sized so a queued line fills 256 bytes. */
+#define LOG_LINE_MAX        224
+
+/* Which file a line goes to */
+#define LOG_STREAM          0
+#define ERR_STREAM          1
+
+/* Most arguments a format can take and still be logged in binary */
+#define LOG_MAX_ARGS        16
+
+/* How each argument is stored in a binary record */
+enum log_arg
+{
+    LOG_ARG_INT = 1,        // 4 bytes: d i u x X o c, with h or hh, and *
+    LOG_ARG_LONG = 2,       // 8 bytes: the same with l ll j z or t
+    LOG_ARG_DOUBLE = 3,     // 8 bytes: f e g a
+    LOG_ARG_STR = 4,        // 2 byte length, then the bytes
+    LOG_ARG_PTR = 5         // 8 bytes: p
+};
+
+enum log_format_state
+{
+    LOG_FORMAT_NEW = 0,     // not parsed yet
+    LOG_FORMAT_BINARY = 1,  // KINDS describes the arguments
+    LOG_FORMAT_TEXT = 2,    // something we can't store raw, like %n or %Lf
+    LOG_FORMAT_BUSY = 3     // being parsed by another thread
+};
+
+/* A logging call site */
+struct log_format
+{
+    const char* format;
+    uint32 state;
+    uint8 nargs;
+    uint8 kinds[LOG_MAX_ARGS];
+
+    /* Only touched by the writer: its id for this format and the file
+     * generation of each stream it was last defined in */
+    uint32 id;
+    uint32 defined[2];
+
+    /* Rate limiting: the second the current window began, lines let
+     * through in it, and lines suppressed since the last summary.  Sites
+     * that ever suppressed a line are kept on a list for the writer. */
+    uint32 window;
+    uint32 count;
+    uint32 suppressed;
+    uint32 listed;
+    uint8 stream;
+    struct log_format* next_limited;
+};
+
+/* Levels, most severe first */
+#define LOG_LEVEL_ERROR     0
+#define LOG_LEVEL_WARN      1
+#define LOG_LEVEL_INFO      2
+#define LOG_LEVEL_DEBUG     3
+
+/* Calls above this level are compiled out.  Build with, for example,
+ * -DLOG_COMPILED_LEVEL=LOG_LEVEL_INFO to drop the debug lines. */
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL  LOG_LEVEL_DEBUG
+#endif
+
+/* Level every subsystem starts at */
+#define LOG_DEFAULT_LEVEL   LOG_LEVEL_INFO
+
+/* Lines a call site may write each second unless SET_LOG_RATE says
+ * otherwise */
+#define LOG_DEFAULT_RATE    100
+
+enum log_subsystem
+{
+    LOG_SERVER = 0,         // start up, configuration and shut down
+    LOG_ACCEPT = 1,         // the accept loop
+    LOG_BROKER = 2,         // the threads passing messages between children
+    LOG_CHILD = 3,          // forking and running children
+    LOG_SIGNAL = 4,         // signal handlers
+    LOG_SUBSYSTEMS = 5
+};
+
+/* The level set for each subsystem.  Use SET_LOG_LEVEL to change it. */
+extern uint8 log_levels[LOG_SUBSYSTEMS];
+
+#define LOG_FIRST(first, ...)   first
+
+#define LOG_IF(level, sub, stream, ...)                                     \
+    do                                                                      \
+    {                                                                       \
+        if ((level) <= log_levels[sub])                                     \
+            LOG_AT (stream, __VA_ARGS__);                                   \
+    } while (0)
+
+/* Errors and warnings go to the error file, the rest to the log file */
+#define log_error(sub, ...)                                                 \
+    LOG_IF (LOG_LEVEL_ERROR, sub, ERR_STREAM, __VA_ARGS__)
+
+#if LOG_COMPILED_LEVEL >= LOG_LEVEL_WARN
+#define log_warn(sub, ...)                                                  \
+    LOG_IF (LOG_LEVEL_WARN, sub, ERR_STREAM, __VA_ARGS__)
+#else
+#define log_warn(sub, ...)  do { } while (0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= LOG_LEVEL_INFO
+#define log_info(sub, ...)                                                  \
+    LOG_IF (LOG_LEVEL_INFO, sub, LOG_STREAM, __VA_ARGS__)
+#else
+#define log_info(sub, ...)  do { } while (0)
+#endif
+
+#if LOG_COMPILED_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(sub, ...)                                                 \
+    LOG_IF (LOG_LEVEL_DEBUG, sub, LOG_STREAM, __VA_ARGS__)
+#else
+#define log_debug(sub, ...) do { } while (0)
+#endif
+
+#define server_log(...)     log_info (LOG_SERVER, __VA_ARGS__)
+#define server_err(...)     log_error (LOG_SERVER, __VA_ARGS__)
+#define print_err(err)      log_error (LOG_SERVER, "%s", strerror (err))
+
+#define LOG_AT(stream, ...)                                                 \
+    do                                                                      \
+    {                                                                       \
+        static struct log_format _log_format =                              \
+                { LOG_FIRST (__VA_ARGS__, 0) };                             \
+        log_at (&_log_format, (stream), __VA_ARGS__);                       \
+    } while (0)
+
+/* Lines the shared ring holds for all children together */
+#define LOG_SHARED_SLOTS    4096
+
+/* What a caller does when its ring is full */
+enum log_overflow
+{
+    LOG_OVERFLOW_DROP = 0,      // drop the line; the writer reports how many
+    LOG_OVERFLOW_BLOCK = 1      // wait for the writer to make room
+};
+
+struct log_stats
+{
+    unsigned long lines;        // lines written out
+    unsigned long dropped;      // lines dropped by LOG_OVERFLOW_DROP
+    unsigned long batches;      // write calls made by the writer
+    unsigned long suppressed;   // lines held back by rate limiting
+};
 
 int init_logging (char* logfile_path, char* errfile_path);
 
 void set_log_child (pid_t pid);
 
-void server_log (const char* format, ...);
-void server_err (const char* format, ...);
-void print_err (int);
+/* Creates the shared ring.  Called by the parent after INIT_LOGGING and
+ * before the first fork.  Returns a descriptor for children to hand to
+ * ATTACH_LOG_RING after exec, or -1 on failure, in which case children
+ * write their lines directly. */
+int init_log_ring ();
+
+/* Maps the shared ring from FD in a process started with exec.  From then
+ * on that process's lines go to the ring.  Returns -1 on failure. */
+int attach_log_ring (int fd);
+
+/* Sets the overflow policy for every thread.  LOG_OVERFLOW_BLOCK is the
+ * default, so no line is lost however fast they come.  LOG_OVERFLOW_DROP
+ * is for callers that would rather lose lines than wait for the disk.  A
+ * process on the shared ring whose parent is gone drops either way, since
+ * nothing is left to make room. */
+void set_log_overflow (enum log_overflow policy);
+
+/* Switches between text and binary records, here and in the children we
+ * fork afterwards.  Text is the default.  Processes that mapped the shared
+ * ring with ATTACH_LOG_RING always log text, since the writer can't read
+ * their call sites. */
+void set_log_binary (bool on);
+
+/* Sets the level of SUB.  Lines above it are skipped. */
+void set_log_level (enum log_subsystem sub, int level);
 
+/* Sets levels from SPEC, a comma separated list of SUBSYSTEM=LEVEL, or of
+ * just LEVEL for every subsystem, such as "info,accept=debug".  The
+ * subsystems are server, accept, broker, child and signal, and the levels
+ * error, warn, info and debug.  Returns -1 if SPEC has anything else. */
+int set_log_levels (const char* spec);
+
+/* Lets each call site write at most LINES_PER_SEC lines a second.  0 turns
+ * rate limiting off. */
+void set_log_rate (unsigned lines_per_sec);
+
+/* Has the writer rotate a file once it reaches MAX_BYTES or is MAX_SEC
+ * old; 0 leaves out either test.  Rotated files are named after the file
+ * with the time appended, and if COMPRESS they are compressed with gzip in
+ * a process running at idle priority.  Rotation is off by default. */
+void set_log_rotation (unsigned long max_bytes, unsigned max_sec,
+        bool compress);
+
+/* Has the writer open the log files at their paths again.  Safe to call
+ * from a signal handler. */
+void reopen_logging ();
+
+/* Tells the writer that PID, reaped by whoever handles SIGCHLD, has exited.
+ * Returns true if it was one of its compressors. */
+bool log_child_exited (pid_t pid);
+
+/* What the logging macros expand to */
+void log_at (struct log_format* site, int stream, const char* format, ...);
+
+/* The same without a call site, for callers that need a function.  Always
+ * text. */
+void (server_log) (const char* format, ...);
+void (server_err) (const char* format, ...);
+void (print_err) (int err);
+
+/* Returns once every line logged before the call has been written */
+void flush_logging ();
+
+void get_log_stats (struct log_stats* stats);
+
+/* Flushes and closes the log files and stops the writer.  Also runs at
+ * exit, so lines queued before a plain exit () are not lost. */
 void end_logging ();
 
 #endif //LOGGING_H
-
@@ -1,6 +1,8 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include "type.h"
+
 /* Number of interpreters that we support.  One of these will be invoked
  * when we receive a client connection */
 #define NUM_INTERPRETERS 3
@@ -23,6 +25,25 @@ struct options
     char* config_path;
     char* script_path;
 
+    /* Log rotation; 0 leaves out the test */
+    unsigned long log_max_bytes;
+    unsigned log_max_age;
+    bool log_compress;
+
+    /* Connection tracing; no path means none */
+    char* trace_path;
+    unsigned trace_sample;
+
+    /* Workers started without a client and replaced when they exit */
+    int workers;
+
+    /* ms children get to finish at shutdown, and then to exit once told */
+    unsigned drain_deadline;
+    unsigned drain_grace;
+
+    /* ms a client's child may go without a word to us; 0 for no limit */
+    unsigned idle_timeout;
+
     /* Networking */
     char* port;
     int max_instances;
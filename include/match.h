@@ -0,0 +1,128 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "type.h"
+
+/*
+ * Tagged message matching for sibling receives, in the style of MPI.
+ *
+ * Every message that arrives for a child is linked into four queues at once:
+ * the queue for its (sender, tag) pair, the queue for its sender, the queue
+ * for its tag and the child's queue of everything.  Each queue is kept in
+ * arrival order, so whatever combination of sender and wildcard a receive
+ * asks for, the oldest matching message is at the head of exactly one queue.
+ * Finding that queue is one hash lookup and unlinking the message from all
+ * four is constant time, so a receive costs O(1) on average no matter how
+ * many messages are buffered.
+ *
+ * Messages nobody has asked for yet are buffered up to a byte limit; past
+ * that the sender is refused instead of letting one slow receiver eat the
+ * parent's memory.
+ * */
+
+/* Matches any sender or any tag in a receive */
+#define MATCH_ANY           -1
+
+/* Default limit on buffered bytes per child */
+#define MAILBOX_DEFAULT_CAP (1024 * 1024)
+
+struct match_link
+{
+    struct match_link* prev;
+    struct match_link* next;
+};
+
+/* Which of a message's queues a link belongs to */
+enum match_list
+{
+    MATCH_PAIR = 0,
+    MATCH_SRC = 1,
+    MATCH_TAG = 2,
+    MATCH_ALL = 3
+};
+
+struct match_queue;
+
+struct match_msg
+{
+    struct match_link links[4];         // indexed by enum match_list
+    struct match_queue* queues[3];      // the hashed queues we are on
+    int src;
+    int tag;
+    size_t sz;
+    char data[];
+};
+
+/* A queue of messages with the same key.  Lives in the engine's hash table
+ * while it holds any messages. */
+struct match_queue
+{
+    uint64_t key;
+    struct match_link head;
+    struct match_queue* next;           // next queue in the hash bucket
+};
+
+/* The matching engine itself.  Not synchronized; see struct mailbox. */
+struct match_engine
+{
+    struct match_queue** buckets;
+    size_t nbuckets;                    // always a power of two
+    size_t nqueues;
+
+    struct match_link all;              // every message, oldest first
+    size_t count;
+    size_t bytes;
+    size_t cap;
+};
+
+int match_init (struct match_engine* e, size_t cap);
+void match_destroy (struct match_engine* e);
+
+/* Buffers a copy of the SZ bytes at DATA sent by SRC with TAG.  Returns -1
+ * if that would take the engine over its cap or memory runs out. */
+int match_put (struct match_engine* e, int src, int tag, const void* data,
+        size_t sz);
+
+/* Removes and returns the oldest message matching SRC and TAG, either of
+ * which may be MATCH_ANY, or NULL if there is none.  The caller frees the
+ * message with match_free. */
+struct match_msg* match_take (struct match_engine* e, int src, int tag);
+
+void match_free (struct match_engine* e, struct match_msg* msg);
+
+/* A child's mailbox: a matching engine its siblings put messages into from
+ * their communication threads, and that its own thread receives from. */
+struct mailbox
+{
+    struct match_engine engine;
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+    bool closed;                        // its child is gone
+};
+
+struct mailbox* mailbox_create (size_t cap);
+void mailbox_destroy (struct mailbox* mb);
+
+/* Marks MB's child as gone: receivers waiting on it wake up, and nothing
+ * more goes in or comes out */
+void mailbox_close (struct mailbox* mb);
+
+/* Same as match_put, but wakes up a receiver waiting on MB.  Fails once MB
+ * is closed. */
+int mailbox_put (struct mailbox* mb, int src, int tag, const void* data,
+        size_t sz);
+
+/* Same as match_take, but waits up to TIMEOUT_MS for a match to arrive (0
+ * does not wait, a negative value waits forever).  Free the message with
+ * mailbox_free.  On NULL, errno is EAGAIN if it did not wait, ETIMEDOUT if
+ * it timed out and ESRCH if MB was closed. */
+struct match_msg* mailbox_get (struct mailbox* mb, int src, int tag,
+        int timeout_ms);
+
+void mailbox_free (struct mailbox* mb, struct match_msg* msg);
+
+#endif //MATCH_H
@@ -3,12 +3,22 @@
 
 #include <signal.h>
 
-/* Initializes our signal handler function by setting up the necessary data
- * structures and mappings for handling signals */
+/* Blocks the signals the server handles and returns a descriptor they can
+ * be read from instead, or -1 on error.  It becomes readable when one is
+ * pending.  Call it before any thread is created, so they all inherit the
+ * mask. */
 int init_signal_handler ();
 
-/* Handles signals sent to the server process */
-void signal_handler (int sig);
+/* Puts back the signal mask from before INIT_SIGNAL_HANDLER, for a child
+ * that is about to exec */
+void restore_signal_mask ();
 
-#endif //SIGNAL_H
+/* Handles every signal pending on SFD, the descriptor from
+ * INIT_SIGNAL_HANDLER.  Returns how many children it reaped. */
+int handle_signals (int sfd);
+
+/* How many SIGINTs and SIGTERMs HANDLE_SIGNALS has read.  One more while
+ * the server drains means not to wait any longer. */
+unsigned stop_signals ();
 
+#endif //SIGNAL_H
@@ -0,0 +1,45 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#include "type.h"
+
+/*
+ * A pool of fixed-size objects.
+ *
+ * Objects are carved out of large chunks and freed objects go on a free
+ * list, so allocating and freeing are a couple of pointer moves and objects
+ * allocated together sit together in memory.  Memory only goes back to the
+ * system when the pool is destroyed.  Not synchronized; a pool belongs to one
+ * data structure, which already serializes access to it.
+ * */
+
+/* Size of each chunk taken from malloc */
+#define POOL_CHUNK_BYTES    (16 * 1024)
+
+struct pool_chunk
+{
+    struct pool_chunk* next;
+};
+
+struct node_pool
+{
+    size_t size;                // object size, rounded up to a pointer
+    void* free;                 // free list, linked through the objects
+    struct pool_chunk* chunks;
+    char* next;                 // unused space in the newest chunk
+    char* end;
+    size_t in_use;
+};
+
+void pool_init (struct node_pool* pool, size_t size);
+
+/* Frees every chunk, and with them every object still allocated */
+void pool_destroy (struct node_pool* pool);
+
+/* Returns an uninitialized object, or NULL if memory ran out */
+void* pool_alloc (struct node_pool* pool);
+void pool_free (struct node_pool* pool, void* obj);
+
+#endif //POOL_H
@@ -0,0 +1,72 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "type.h"
+#include "timer.h"
+#include "../lib/messaging.h"
+
+/*
+ * Request/response calls between siblings, routed by the parent.
+ *
+ * When a child calls a sibling the parent records the call under a call id
+ * of its own, together with the caller's correlation id and a deadline, and
+ * forwards the request.  The sibling's reply names the call id, so the
+ * parent can hand the result back to the right caller under the caller's
+ * correlation id however the replies are ordered.  A sweeper thread fails
+ * calls whose deadline passed with ETIMEDOUT and forgets them, so a late
+ * reply finds nothing and is refused.  Deadlines are kept on a timer
+ * wheel, and a call answered in time takes its deadline off with it.
+ * */
+
+/* Deadline used when the caller does not give one */
+#define RPC_DEFAULT_TIMEOUT     5000
+
+/* Sends M to the child OURID; used to deliver results and timeouts */
+typedef int rpc_deliver_func (int ourid, struct message* m);
+
+struct rpc_call
+{
+    uint32 callid;
+    int caller;             // ourid of the calling child
+    uint32 corr_id;         // the caller's correlation id
+    int callee;             // ourid of the child that must answer
+    struct timer deadline;
+    struct rpc_call* next;  // next call in the same hash bucket
+};
+
+struct rpc_stats
+{
+    uint64_t calls;
+    uint64_t replies;
+    uint64_t timeouts;
+    uint64_t late;          // replies that came after the deadline
+};
+
+/* Sets up the call table and starts the sweeper thread.  DELIVER is used to
+ * send results back to callers. */
+int init_rpc (rpc_deliver_func* deliver);
+
+/* Records a call from CALLER to CALLEE that must be answered within
+ * TIMEOUT_MS.  Returns the call id to forward to the callee, or 0 on
+ * error. */
+uint32 rpc_begin (int caller, uint32 corr_id, int callee, int timeout_ms);
+
+/* Completes call CALLID with the SZ bytes of DATA answered by CALLEE and
+ * delivers them to the caller.  Returns -1 if the call expired or CALLEE is
+ * not the child it was sent to. */
+int rpc_finish (uint32 callid, int callee, const void* data, size_t sz);
+
+/* Fails call CALLID right away with STATUS, for example when the request
+ * could not be forwarded */
+void rpc_abort (uint32 callid, int status);
+
+void rpc_get_stats (struct rpc_stats* stats);
+
+/* Stops the sweeper thread */
+void end_rpc ();
+
+#endif //RPC_H
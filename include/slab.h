@@ -0,0 +1,74 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * A table of pointers addressed by id.
+ *
+ * An id is a slot number plus the generation of that slot.  Every time a slot
+ * is emptied its generation goes up, so an id kept around after its entry was
+ * removed no longer matches once the slot is reused, and lookups with it
+ * fail instead of finding somebody else.  Empty slots are kept on a free
+ * list and handed out oldest first, which spaces out reuse of any one slot
+ * as much as possible.  Insert, find and remove are O(1).
+ *
+ * Writers must be serialized by the caller, but readers need no lock: the
+ * table grows a segment at a time so slots never move, and each slot is
+ * guarded by a sequence count so slab_find never pairs an entry with the
+ * wrong generation.  What a reader finds may be removed right after, so
+ * callers that free entries must defer it (see epoch.h).
+ * */
+
+/* Low bits of an id are the slot, the rest the generation */
+#define SLAB_INDEX_BITS     20
+#define SLAB_MAX_SLOTS      (1 << SLAB_INDEX_BITS)
+#define SLAB_GEN_MAX        ((1 << (31 - SLAB_INDEX_BITS)) - 1)
+
+/* Slots are allocated in segments of this many */
+#define SLAB_SEG_BITS       10
+#define SLAB_SEG_SIZE       (1 << SLAB_SEG_BITS)
+#define SLAB_MAX_SEGS       (SLAB_MAX_SLOTS / SLAB_SEG_SIZE)
+
+struct slab_slot
+{
+    void* data;             // NULL while the slot is free
+    uint32 gen;             // never 0, so no id is ever 0
+    uint32 seq;             // odd while a writer is changing the slot
+    uint32 next_free;       // slot number + 1 of the next free slot, or 0
+};
+
+struct slab_table
+{
+    struct slab_slot* segs[SLAB_MAX_SEGS];
+    uint32 nslots;
+    uint32 count;           // slots in use
+    uint32 free_head;       // slot number + 1, or 0 when no slot is free
+    uint32 free_tail;
+};
+
+void slab_init (struct slab_table* t);
+void slab_destroy (struct slab_table* t);
+
+/* Stores DATA in a free slot, growing the table if needed.  Returns its id,
+ * which is always above 0, or -1 if the table is full or memory ran out. */
+int slab_insert (struct slab_table* t, void* data);
+
+/* Returns what is stored under ID, or NULL if ID is stale or unused.  Safe
+ * to call without the writers' lock. */
+void* slab_find (const struct slab_table* t, int id);
+
+/* Removes and returns what is stored under ID, or NULL if ID is stale or
+ * unused */
+void* slab_remove (struct slab_table* t, int id);
+
+/* Returns the entry in the first used slot at or after *POS and moves *POS
+ * past it, or NULL when there are no more.  Start with *POS at 0.  Safe to
+ * call without the writers' lock, but then entries may come and go during
+ * the walk. */
+void* slab_next (const struct slab_table* t, uint32* pos);
+
+#endif //SLAB_H
@@ -0,0 +1,125 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "type.h"
+
+/*
+ * Supervisor for long-lived workers.
+ *
+ * A worker group keeps TARGET workers of one script running.  When one
+ * exits, the SIGCHLD reaper reports it here and it is replaced.  A worker
+ * that exits with an error, is killed, or exits sooner than MIN_UPTIME has
+ * crashed.  The first crash in a row is replaced at once, and each further
+ * one waits twice as long as the last, from BACKOFF_MIN up to BACKOFF_MAX.
+ * A worker that ran longer than MIN_UPTIME ends the run of crashes.
+ *
+ * On top of that, each group has a circuit breaker.  BREAKER_CRASHES
+ * crashes within BREAKER_WINDOW open it, and nothing is started for
+ * BREAKER_COOLDOWN.  After that a single worker is started as a probe.  If
+ * it lives MIN_UPTIME the breaker closes and the group is filled up again.
+ * If it crashes the breaker opens once more.  A script that dies as soon as
+ * it starts so costs a few forks per cooldown instead of a fork bomb.
+ *
+ * Everything here runs on the main thread, from the main loop and the
+ * reaper, so nothing is locked.  Times are in ms on the monotonic clock.
+ * */
+
+/* Most crashes the breaker can count */
+#define WORKER_BREAKER_MAX  32
+
+struct worker_policy
+{
+    unsigned min_uptime;        // ms a worker must live to count as healthy
+    unsigned backoff_min;       // ms before the second crash in a row
+    unsigned backoff_max;
+    unsigned breaker_crashes;   // crashes that open the breaker, 0 for none
+    unsigned breaker_window;    // ms they must happen within
+    unsigned breaker_cooldown;  // ms the breaker stays open
+};
+
+#define WORKER_DEFAULT_POLICY { 1000, 100, 30000, 5, 10000, 60000 }
+
+enum breaker_state
+{
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN           // a probe is running
+};
+
+struct worker_stats
+{
+    uint64_t spawns;
+    uint64_t spawn_failures;
+    uint64_t exits;
+    uint64_t crashes;
+    uint64_t trips;             // times the breaker opened
+    int last_exit;              // exit code, or minus the signal
+    uint64_t last_exit_time;
+    int running;
+    enum breaker_state breaker;
+};
+
+struct worker_slot
+{
+    pid_t pid;                  // 0 while waiting to be started
+    uint64_t started;
+    uint64_t due;               // when to start it
+};
+
+struct worker_group;
+
+/* Starts a worker for G and returns its pid, or -1 */
+typedef pid_t supervisor_spawn_func (struct worker_group* g);
+
+struct worker_group
+{
+    char* script;
+    void* aux;                  // for the spawn function
+    int target;
+    struct worker_policy policy;
+    struct worker_slot* slots;
+
+    unsigned consecutive;       // crashes in a row
+    uint64_t crash_times[WORKER_BREAKER_MAX];   // the latest, as a ring
+    unsigned crash_next;
+    uint64_t reopen;            // when an open breaker lets a probe through
+    int probe;                  // slot of the probe, -1 if none
+
+    struct worker_stats stats;
+    struct worker_group* next;
+};
+
+/* SPAWN starts workers.  Groups from before are forgotten, though their
+ * workers are left running. */
+void init_supervisor (supervisor_spawn_func* spawn);
+
+/* Keeps TARGET workers of SCRIPT running under POLICY, or the default
+ * policy if it is NULL.  AUX is kept for the spawn function.  The workers
+ * are started by the next SUPERVISOR_RUN.  Returns NULL if out of memory. */
+struct worker_group* supervise (const char* script, int target,
+        const struct worker_policy* policy, void* aux);
+
+/* Reports that PID exited with wait STATUS.  Returns false if it was not a
+ * worker. */
+bool supervisor_exited (pid_t pid, int status, uint64_t now);
+
+/* Starts the workers that are due.  Returns how many ms until the next one
+ * is, or -1 if none is waiting, for a poll timeout. */
+int supervisor_run (uint64_t now);
+
+/* Stops replacing workers, as when the server shuts down */
+void supervisor_stop ();
+
+/* Sends SIG to every running worker.  Returns how many it was sent to. */
+int supervisor_kill (int sig);
+
+void supervisor_get_stats (const struct worker_group* g,
+        struct worker_stats* stats);
+
+/* Now in ms on the monotonic clock */
+uint64_t supervisor_clock ();
+
+#endif //SUPERVISOR_H
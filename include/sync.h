@@ -0,0 +1,152 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * Shared memory synchronization primitives: reader-writer locks, barriers and
+ * countdown latches.
+ *
+ * The parent creates one shared region before it starts accepting
+ * connections and hands its file descriptor to every child on the command
+ * line.  Objects are created by name through the parent (RWLOCK_INIT,
+ * BARRIER_INIT and LATCH_INIT), which answers with the index of the object
+ * in the region.  From then on the child operates on the object directly in
+ * shared memory: an uncontended lock or unlock is a couple of atomic
+ * instructions and only a contended wait enters the kernel through a futex.
+ *
+ * Every child owns a process slot in the region.  Readers mark themselves in
+ * a per-lock bitmap indexed by that slot and writers store their pid in the
+ * lock, so the parent can release exactly what a child held when it dies
+ * (see SYNC_RELEASE_PID).
+ * */
+
+/* Maximum number of named objects in the region */
+#define SYNC_MAX_OBJECTS    256
+
+/* Maximum number of children that can use the region at the same time */
+#define SYNC_MAX_PROCS      1024
+
+/* Length of an object name, including the terminating NUL.  Matches the
+ * IDENTIFIER field of struct message. */
+#define SYNC_NAME_LEN       16
+
+#define SYNC_READER_WORDS   (SYNC_MAX_PROCS / 64)
+
+enum sync_type
+{
+    SYNC_FREE = 0,
+    SYNC_RWLOCK = 1,
+    SYNC_BARRIER = 2,
+    SYNC_LATCH = 3
+};
+
+/* Reader-writer lock.  Writers are preferred: once a writer has claimed
+ * WRITER, new readers back off until it releases. */
+struct sync_rwlock
+{
+    pid_t writer;           // pid of the writer holding or claiming the lock
+    uint32 seq;             // futex word, bumped on every wakeup
+    uint32 waiters;         // processes sleeping on SEQ
+    uint64_t readers[SYNC_READER_WORDS];  // one bit per process slot
+};
+
+/* Cyclic barrier for a fixed number of parties.  If a process dies while
+ * waiting, the barrier is marked broken and every waiter returns -1. */
+struct sync_barrier
+{
+    uint32 parties;         // number of processes that must arrive
+    uint32 arrived;         // processes that arrived in this generation
+    uint32 generation;      // futex word, bumped when the barrier trips
+    uint32 broken;          // set when a waiting party died
+};
+
+/* Countdown latch.  Waiters block until COUNT reaches zero. */
+struct sync_latch
+{
+    uint32 count;           // futex word
+    uint32 waiters;
+};
+
+struct sync_object
+{
+    enum sync_type type;
+    char name[SYNC_NAME_LEN];
+    union
+    {
+        struct sync_rwlock rwlock;
+        struct sync_barrier barrier;
+        struct sync_latch latch;
+    } u;
+} __attribute__ ((aligned (64)));
+
+/* Per-child bookkeeping.  WAITING_ON is set while the process sleeps on a
+ * barrier so the barrier can be broken if the process dies. */
+struct sync_proc
+{
+    pid_t pid;
+    int waiting_on;
+};
+
+struct sync_region
+{
+    struct sync_object objects[SYNC_MAX_OBJECTS];
+    struct sync_proc procs[SYNC_MAX_PROCS];
+};
+
+/* === Server side === */
+
+/* Creates the shared region and returns a file descriptor for it that
+ * survives exec, or -1 on error. */
+int init_sync_region ();
+
+/* Reserves a process slot for a child that is about to be forked.  Returns
+ * the slot, or -1 if every slot is taken. */
+int sync_alloc_proc ();
+
+/* Records the pid of the child that owns SLOT */
+void sync_set_proc (int slot, pid_t pid);
+
+/* Finds the object NAME, creating it with type TYPE and initial value ARG
+ * (parties for a barrier, count for a latch) if it does not exist.  Returns
+ * the object's index, or -1 if the name exists with a different type or the
+ * region is full. */
+int sync_create (enum sync_type type, const char* name, int arg);
+
+/* Releases every lock held by PID, breaks any barrier it was waiting on and
+ * frees its process slot.  Only uses atomics and futex wakeups, so it may be
+ * called from a signal handler. */
+void sync_release_pid (pid_t pid);
+
+/* Unmaps the region */
+void end_sync ();
+
+/* === Client side === */
+
+/* Maps the region inherited through FD and remembers our process SLOT */
+int sync_attach (int fd, int slot);
+
+/* Reader-writer lock operations on the object at index OBJ.  Return 0 on
+ * success and -1 on error; the try variants return 1 if the lock is busy. */
+int sync_rdlock (int obj);
+int sync_tryrdlock (int obj);
+int sync_rdunlock (int obj);
+int sync_wrlock (int obj);
+int sync_trywrlock (int obj);
+int sync_wrunlock (int obj);
+
+/* Waits until all parties arrive.  Returns 1 in exactly one of the
+ * processes (the last one to arrive), 0 in the others and -1 if the barrier
+ * is broken. */
+int sync_barrier_wait (int obj);
+
+/* Decrements the latch, waking waiters once it reaches zero */
+int sync_latch_count_down (int obj);
+
+/* Blocks until the latch reaches zero */
+int sync_latch_wait (int obj);
+
+#endif //SYNC_H
@@ -0,0 +1,89 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * Hierarchical timer wheel, for many timeouts of which few ever expire.
+ *
+ * Time is counted in ticks of 1 ms.  Level 0 has a slot for each of the
+ * next TIMER_SLOTS ticks, level 1 a slot for each of the next TIMER_SLOTS
+ * spans of TIMER_SLOTS ticks, and so on, so TIMER_LEVELS levels reach
+ * TIMER_SLOTS ** TIMER_LEVELS ticks ahead, about 12 days.  Timers further
+ * out than that wait in the last level until they come within reach.
+ *
+ * A timer goes in the slot its expiry falls in on the lowest level that
+ * reaches it, onto a doubly linked list, so arming and cancelling take
+ * constant time whatever the number of timers.  Each time level 0 comes
+ * round, the next slot of level 1 is spread over level 0, and so on up.
+ * Every timer of a slot on level 0 expires together.  A bitmap per level
+ * of the slots in use finds the next expiry without looking at any timer.
+ *
+ * Nothing here is locked.  A wheel belongs to one thread, or to whoever
+ * holds the lock guarding it; callbacks run with it held.
+ * */
+
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_LEVELS    5
+
+struct timer;
+struct timer_wheel;
+
+/* Called when T expires.  T is no longer armed and may be armed again. */
+typedef void timer_func (struct timer_wheel* w, struct timer* t, void* aux);
+
+struct timer
+{
+    uint64_t expires;           // the tick it expires on
+    timer_func* func;
+    void* aux;
+    struct timer* next;
+    struct timer** pprev;       // the link to us, NULL if not armed
+    uint16 slot;                // level * TIMER_SLOTS + slot, while armed
+};
+
+struct timer_wheel
+{
+    uint64_t now;               // the next tick to run
+    uint64_t pending[TIMER_LEVELS];     // bitmap of the slots in use
+    struct timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+    size_t armed;
+};
+
+/* Sets up W with nothing run before NOW */
+void timer_wheel_init (struct timer_wheel* w, uint64_t now);
+
+/* Sets up T to call FUNC with AUX when it expires */
+void timer_init (struct timer* t, timer_func* func, void* aux);
+
+/* Arms T to expire at tick EXPIRES, or moves it there if armed already.  A
+ * time already past expires on the next TIMER_ADVANCE. */
+void timer_arm (struct timer_wheel* w, struct timer* t, uint64_t expires);
+
+/* Disarms T if it is armed */
+void timer_cancel (struct timer_wheel* w, struct timer* t);
+
+static inline bool
+timer_armed (const struct timer* t)
+{
+    return t->pprev != NULL;
+};
+
+/* Runs the callbacks of every timer that expires by NOW.  Returns how many
+ * expired. */
+size_t timer_advance (struct timer_wheel* w, uint64_t now);
+
+/* How many ms from NOW until TIMER_ADVANCE may next have something to run,
+ * or -1 if nothing is armed, for a poll timeout.  It may be early for a
+ * timer far out, which only moves down a level then. */
+int timer_next (const struct timer_wheel* w, uint64_t now);
+
+/* Now in ms on the monotonic clock */
+uint64_t timer_now ();
+
+#endif //TIMER_H
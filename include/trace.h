@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "type.h"
+
+/*
+ * Connection tracing.
+ *
+ * Connections are sampled as they are accepted, and each sampled one gets
+ * an id.  The code handling it records spans (accept, fork, exec, each
+ * broker command, and so on) against that id.  A span goes into a buffer
+ * of the calling thread, without a lock or a syscall.  The thread writes
+ * its buffer out itself, in one write, once the buffer fills or the thread
+ * exits.  END_TRACING writes whatever is left.
+ *
+ * The file is Chrome trace event JSON, to load into chrome://tracing or
+ * Perfetto.  Every connection is shown as a thread of its own, with the
+ * connection id as its tid.  That way the spans the accept loop and the
+ * broker thread record for it line up on one track.
+ * */
+
+/* Spans a thread holds before it writes them out */
+#define TRACE_BUFFER_SPANS  512
+
+/* Starts a trace in PATH, replacing what was there, and traces one
+ * connection in SAMPLE_EVERY; 0 traces none.  Returns -1 if PATH can't be
+ * opened. */
+int init_tracing (const char* path, unsigned sample_every);
+
+void set_trace_sampling (unsigned sample_every);
+
+/* An id for a new connection, or 0 if it is not sampled */
+uint32 trace_connection ();
+
+/* Now, in ns on the monotonic clock, for the bounds of a span */
+uint64_t trace_now ();
+
+/* Records a span of connection CONN from START to END.  If ARG_NAME is not
+ * NULL, ARG is shown with the span under that name.  NAME and ARG_NAME
+ * must stay valid until tracing ends and must not need escaping in JSON;
+ * string literals do.  Does nothing if CONN is 0. */
+void trace_span (uint32 conn, const char* name, uint64_t start, uint64_t end,
+        const char* arg_name, long arg);
+
+/* Writes every thread's spans and closes the trace.  Spans recorded while
+ * it runs may be lost.  Also runs at exit. */
+void end_tracing ();
+
+#endif //TRACE_H
@@ -0,0 +1,248 @@
+#ifndef LIB_MESSAGING_H
+#define LIB_MESSAGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* There are certain commands that can be sent from one child process to another
+ * child process.  These commands will originate from the user command script,
+ * but they will need to have some supporting implementation here.  Commands
+ * include:
+ *  - blocking/non-blocking send and recv operations, matched by sender and
+ *    tag (see match.h)
+ *  - synchronization primatives: semaphores, mutexes, monitors
+ *  - reader-writer locks, barriers and countdown latches (see sync.h)
+ *  - named job queues with work stealing between children
+ *  - collective calls that ask every sibling at once and aggregate the answers
+ *  - request/response calls to a sibling with correlation ids and deadlines
+ *  - notices when a sibling exits or changes its connection state
+ *  - some way to have the parent store customized information for them all to
+ *    access
+ *
+ * This header is shared between the server and the client library so that
+ * both sides agree on the layout of a message.
+ */
+enum command
+{
+    NOTHING = 0,
+    SEND_B = 1,
+    SEND_NB = 2,
+    SEND_WAIT = 3,
+    RECV_B = 4,
+    RECV_NB = 5,
+    RECV_WAIT = 6,
+    SEMA_INIT = 7,
+    SEMA_POST = 8,
+    SEMA_WAIT = 9,
+    SEMA_TRY_WAIT = 10,
+    LOCK_INIT = 11,
+    LOCK_ACQUIRE = 12,
+    LOCK_RELEASE = 13,
+    LOCK_TRY_ACQUIRE = 14,
+    MONITOR_INIT = 15,
+    MONITOR_WAIT = 16,
+    MONITOR_SIGNAL = 17,
+    MONITOR_BCAST = 18,
+    RWLOCK_INIT = 19,
+    BARRIER_INIT = 20,
+    LATCH_INIT = 21,
+    JOBQ_OPEN = 22,
+    JOBQ_PUSH = 23,
+    JOBQ_POP = 24,
+    JOBQ_COMPLETE = 25,
+    JOBQ_STATS = 26,
+    COLL_BCAST = 27,
+    COLL_GATHER = 28,
+    COLL_REDUCE = 29,
+    COLL_RESPOND = 30,
+    RPC_CALL = 31,
+    RPC_REPLY = 32,
+    EVENT_SUBSCRIBE = 33,
+    EVENT_POLL = 34,
+    CONN_STATE = 35,        // the only command the parent doesn't answer
+
+    /* The commands below are never sent by a child.  The parent uses them
+     * to deliver messages the child did not ask for, so the child must be
+     * prepared to receive them while it waits for an answer. */
+    JOBQ_RESULT = 36,
+    COLL_REQUEST = 37,
+    RPC_REQUEST = 38,
+    RPC_RESULT = 39,
+    EVENT_NOTIFY = 40
+};
+
+#define NUM_COMMANDS 41
+
+/* This struct defines an entire message that a child process could send to its
+ * parent.  The message must include a command, and any of the other parameters
+ * present in the structure.  The parent answers a command by sending the same
+ * structure back with ID set to the result of the command. */
+struct message
+{
+    enum command command;   // The command to send
+    char identifier[16];    // An identifier for global synch objects
+    int id;                 // A numeric id for messaging sibling processes
+    size_t sz;              // Size of the information
+    char information[484];  // Information sent or received from the sibling
+                            // struct is arbitrarily 512 bytes long
+};
+
+/* Largest task or result that fits in a single message */
+#define JOBQ_MAX_TASK   (484 - sizeof (struct jobq_task_header))
+
+/* Arguments of JOBQ_POP, carried in INFORMATION */
+struct jobq_pop_args
+{
+    int max;                // most tasks to return in one answer
+    int timeout_ms;         // 0 to poll, negative to wait forever
+};
+
+/* Precedes every task in the answer to JOBQ_POP, the result in
+ * JOBQ_COMPLETE and the result delivered to the producer in JOBQ_RESULT.
+ * Tasks in a JOBQ_POP answer are packed back to back, each padded to a
+ * multiple of 8 bytes. */
+struct jobq_task_header
+{
+    uint32_t jobid;
+    int32_t producer;       // ourid of the child that pushed the task
+    uint32_t sz;
+    uint32_t pad;
+};
+
+/* Answer to JOBQ_STATS */
+struct jobq_stats
+{
+    uint64_t pushed;
+    uint64_t popped;
+    uint64_t stolen;        // tasks popped from another child's deque
+    uint64_t completed;
+    uint64_t pending;       // tasks waiting in any deque
+    double elapsed;         // seconds since the queue was created
+    double throughput;      // completed tasks per second
+};
+
+/* Reducers for COLL_REDUCE.  SUM, MIN and MAX combine one int64_t from each
+ * sibling; CONCAT appends every answer in the order they arrive. */
+enum coll_reducer
+{
+    COLL_SUM = 0,
+    COLL_MIN = 1,
+    COLL_MAX = 2,
+    COLL_CONCAT = 3
+};
+
+/* Arguments of COLL_BCAST, COLL_GATHER and COLL_REDUCE, followed in
+ * INFORMATION by SZ bytes of request sent to every sibling.  The answer's ID
+ * is the number of siblings that answered before the timeout. */
+struct coll_args
+{
+    int32_t reducer;        // enum coll_reducer, COLL_REDUCE only
+    int32_t timeout_ms;     // how long to wait for stragglers
+    uint32_t sz;
+    uint32_t pad;
+};
+
+/* Precedes the request delivered to each sibling in COLL_REQUEST.  The
+ * sibling answers with COLL_RESPOND, ID set to COLLID. */
+struct coll_request_header
+{
+    uint32_t collid;
+    int32_t caller;         // ourid of the child that asked
+    int32_t command;        // COLL_BCAST, COLL_GATHER or COLL_REDUCE
+    uint32_t sz;
+};
+
+/* Precedes each sibling's answer in the answer to COLL_GATHER.  Entries are
+ * packed back to back, each padded to a multiple of 8 bytes. */
+struct coll_entry
+{
+    int32_t ourid;
+    uint32_t sz;
+};
+
+/* Precedes the payload of every RPC message:
+ *  RPC_CALL: ID is the callee; CORR_ID is chosen by the caller and
+ *      TIMEOUT_MS is the call's deadline.
+ *  RPC_REQUEST: ID and CORR_ID are the parent's call id, PEER is the caller
+ *      and TIMEOUT_MS is what is left of the deadline.
+ *  RPC_REPLY: ID is the call id from the request.
+ *  RPC_RESULT: ID and CORR_ID are the caller's correlation id, PEER is the
+ *      callee and STATUS is 0 or an errno value such as ETIMEDOUT. */
+struct rpc_header
+{
+    uint32_t corr_id;
+    int32_t peer;
+    int32_t status;
+    int32_t timeout_ms;
+    uint32_t sz;
+    uint32_t pad;
+};
+
+/* Largest request or response that fits in a single message */
+#define RPC_MAX_PAYLOAD (484 - sizeof (struct rpc_header))
+
+/* Events a child can subscribe to for a sibling */
+#define EVENT_EXIT      0x1     // its process exited
+#define EVENT_STATE     0x2     // it reported a new connection state
+
+/* Sibling events:
+ *  EVENT_SUBSCRIBE: ID is the sibling or SIBLING_ANY_SOURCE for all of
+ *      them, and INFORMATION holds a struct event_args.  A mask of 0
+ *      unsubscribes.  Answered with -1 if the sibling is gone.
+ *  CONN_STATE: ID is the child's new conn_state_t.  Not answered.
+ *  EVENT_NOTIFY: sent once events are waiting for the child, and not again
+ *      until it has fetched them with EVENT_POLL.
+ *  EVENT_POLL: answered with a struct event_header followed by its N
+ *      entries, ID set to N.  Events for one sibling are merged into one
+ *      entry until fetched, so a child that falls behind sees the latest
+ *      state of each sibling and a count of the changes it missed. */
+struct event_args
+{
+    uint32_t mask;          // EVENT_EXIT and EVENT_STATE
+    uint32_t pad;
+};
+
+struct event_header
+{
+    uint32_t n;
+    uint32_t lost;          // entries dropped for want of room
+};
+
+struct event_entry
+{
+    int32_t ourid;          // the sibling
+    uint16_t events;        // what happened since the last poll
+    uint16_t count;         // how many times, up to UINT16_MAX
+    int32_t state;          // its latest conn_state_t, 0 if none yet
+    int32_t status;         // exit code, or minus the signal that killed it
+};
+
+/* Most entries an answer to EVENT_POLL holds, and so most a child has
+ * waiting at once */
+#define EVENT_MAX_BATCH \
+    ((484 - sizeof (struct event_header)) / sizeof (struct event_entry))
+
+/* Matches any sibling or any tag in a receive */
+#define SIBLING_ANY_SOURCE  -1
+#define SIBLING_ANY_TAG     -1
+
+/* Precedes the payload of sibling sends and receives:
+ *  SEND_B: ID is the receiver, TAG is any value 0 or above.
+ *  RECV_B, RECV_NB: ID is the sender or SIBLING_ANY_SOURCE, TAG may be
+ *      SIBLING_ANY_TAG and TIMEOUT_MS bounds the wait (negative waits for
+ *      good).  The answer carries the matched SRC, TAG and payload, with ID
+ *      set to the payload size, or -1 and an errno value in STATUS. */
+struct sibling_header
+{
+    int32_t src;
+    int32_t tag;
+    int32_t timeout_ms;
+    int32_t status;
+    uint32_t sz;
+    uint32_t pad;
+};
+
+/* Largest sibling message that fits in a single message */
+#define SIBLING_MAX_PAYLOAD (484 - sizeof (struct sibling_header))
+
+#endif //LIB_MESSAGING_H
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 
 // sockets
 #include <sys/socket.h>
@@ -19,7 +20,9 @@
 
 
 #include "server.h"
+#include "messaging.h"
 #include "../include/debug.h"
+#include "../include/sync.h"
 
 
 
@@ -39,6 +42,58 @@ static int check_fd (int fd);
 /* Closes the given file descriptor. */
 static void close_fd (int fd);
 
+/* Sends M to the parent and waits for its answer, which overwrites M.
+ * Returns the result the parent stored in the message's ID, or -1 if the
+ * pipe failed. */
+static int parent_command (struct message* m);
+
+/* Gets the next message of type CMD from the parent into M, taking it from
+ * the inbox if one was already set aside.  If ID is not ANY_ID, only a
+ * message with that ID matches.  Any other message that arrives in the
+ * meantime goes into the inbox.  If BLOCK is false and nothing is waiting,
+ * returns 0 right away.  Returns 1 when M was filled, -1 on error. */
+static int next_message (enum command cmd, int id, struct message* m, 
+        bool block);
+#define ANY_ID -1
+
+/* Reads one whole message from the parent */
+static int read_message (struct message* m);
+
+/* Correlation id of our next RPC call */
+static int next_corr_id = 1;
+
+/* Our connection state, as last reported to the parent */
+static conn_state_t conn_state = CONN_CONNECTED;
+
+/* Sibling events fetched from the parent and not handed out yet */
+static struct event_entry events[EVENT_MAX_BATCH];
+static int events_next = 0;
+static int events_len = 0;
+static uint32_t events_lost = 0;
+
+/* Fetches pending sibling events from the parent */
+static int poll_events (bool block);
+
+/* Notes that the client went away */
+static void check_lost (int ret);
+
+/* Messages the parent sent us that nobody has asked for yet, oldest first */
+struct inbox_entry
+{
+    struct message m;
+    struct inbox_entry* next;
+};
+static struct inbox_entry* inbox_head = NULL;
+static struct inbox_entry* inbox_tail = NULL;
+
+/* Runs the collective CMD and copies its answer to RESULT */
+static int collective (enum command cmd, enum coll_reducer reducer, 
+        void* req, size_t sz, void* result, size_t* result_sz, 
+        int timeout_ms);
+
+/* Asks the parent for the sync object NAME of type CMD */
+static sync_handle_t sync_object_init (enum command cmd, char* name, int arg);
+
 /* Convert an ip address from a string to type IP_ADDR_T.
  * It is assumed that an ip address of type 4 will have the format XX.XX.XX.XX
  * while an ip address of type 6 will have the type 
@@ -52,12 +107,20 @@ static FILE* errfile;
 
 void
 init (char* logfile_path, char* errfile_path, 
-        int p_clientfd, int p_childread, int p_childwrite,
+        int p_clientfd, int p_childread, int p_childwrite, 
+        int p_syncfd, int p_syncslot,
         char* ipaddr, int ipver, int port)
 {
-    ASSERT (check_fd (p_clientfd));
+    /* Workers are started without a client */
+    ASSERT (p_clientfd == -1 || check_fd (p_clientfd));
     ASSERT (check_fd (p_childread));
     ASSERT (check_fd (p_childwrite));
+    ASSERT (check_fd (p_syncfd));
+
+    /* A child without a slot can still run, it just can't use shared locks */
+    if (p_syncslot >= 0)
+        sync_attach (p_syncfd, p_syncslot);
+    close_fd (p_syncfd);
 
     logfile = fopen (logfile_path, "a");
     errfile = fopen (errfile_path, "a");
@@ -109,6 +172,7 @@ client_send_b (void* data, size_t sz)
 {
     int ret = send (clientfd, data, sz, 0);
     set_serverr (ret);
+    check_lost (ret);
     return ret;
 };
 
@@ -129,6 +193,7 @@ client_recv_b (void* data, size_t sz)
 {
     int ret = recv (clientfd, data, sz, 0);    
     set_serverr (ret);
+    check_lost (ret);
     return ret;
 };
 
@@ -154,15 +219,530 @@ int
 reset_connection (void* msg, int msg_sz, void* response, int resp_sz);
 
 /* [ IPC ] */
-int proc_send_b (int procid, void* data, size_t sz);
-int proc_send_nb (int procid, void* data, size_t sz);
-int proc_recv_b (int procid, void* data, size_t sz);
-int proc_recv_nb (int procid, void* data, size_t sz);
+int
+sibling_send_tagged (int procid, int tag, void* data, size_t sz)
+{
+    struct message m;
+    struct sibling_header h;
+
+    if (tag < 0 || sz > SIBLING_MAX_PAYLOAD)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = SEND_B;
+    m.id = procid;
+    memset (&h, 0, sizeof h);
+    h.tag = tag;
+    h.sz = sz;
+    memcpy (m.information, &h, sizeof h);
+    memcpy (m.information + sizeof h, data, sz);
+    m.sz = sizeof h + sz;
+
+    return parent_command (&m) == 0 ? 0 : -1;
+};
+
+int
+sibling_recv_tagged (int procid, int tag, void* data, size_t sz, 
+        int timeout_ms, struct sibling_status* status)
+{
+    struct message m;
+    struct sibling_header h;
+
+    memset (&m, 0, sizeof m);
+    m.command = timeout_ms == 0 ? RECV_NB : RECV_B;
+    m.id = procid;
+    memset (&h, 0, sizeof h);
+    h.tag = tag;
+    h.timeout_ms = timeout_ms;
+    memcpy (m.information, &h, sizeof h);
+    m.sz = sizeof h;
+
+    int ret = parent_command (&m);
+    memcpy (&h, m.information, sizeof h);
+    if (ret == -1)
+    {
+        if (h.status != 0)
+            serverr = h.status;
+        return -1;
+    }
+
+    memcpy (data, m.information + sizeof h, h.sz < sz ? h.sz : sz);
+    if (status != NULL)
+    {
+        status->src = h.src;
+        status->tag = h.tag;
+        status->sz = h.sz;
+    }
+    return h.sz;
+};
+
+int
+sibling_send_b (int procid, void* data, size_t sz)
+{
+    return sibling_send_tagged (procid, 0, data, sz);
+};
+
+int
+sibling_recv_b (int procid, void* data, size_t sz)
+{
+    return sibling_recv_tagged (procid, SIBLING_ANY_TAG, data, sz, -1, NULL);
+};
+
 void log_message (char* format, ...);
 void log_error (char* format, ...);
 
+/* [ Shared Synchronization ] */
+sync_handle_t
+rwlock_init (char* name)
+{
+    return sync_object_init (RWLOCK_INIT, name, 0);
+};
+
+int
+rwlock_rdlock (sync_handle_t lock)
+{
+    return sync_rdlock (lock);
+};
+
+int
+rwlock_tryrdlock (sync_handle_t lock)
+{
+    return sync_tryrdlock (lock);
+};
+
+int
+rwlock_rdunlock (sync_handle_t lock)
+{
+    return sync_rdunlock (lock);
+};
+
+int
+rwlock_wrlock (sync_handle_t lock)
+{
+    return sync_wrlock (lock);
+};
+
+int
+rwlock_trywrlock (sync_handle_t lock)
+{
+    return sync_trywrlock (lock);
+};
+
+int
+rwlock_wrunlock (sync_handle_t lock)
+{
+    return sync_wrunlock (lock);
+};
+
+sync_handle_t
+barrier_init (char* name, int parties)
+{
+    return sync_object_init (BARRIER_INIT, name, parties);
+};
+
+int 
+barrier_wait (sync_handle_t barrier)
+{
+    return sync_barrier_wait (barrier);
+};
+
+sync_handle_t
+latch_init (char* name, int count)
+{
+    return sync_object_init (LATCH_INIT, name, count);
+};
+
+int 
+latch_count_down (sync_handle_t latch)
+{
+    return sync_latch_count_down (latch);
+};
+
+int
+latch_wait (sync_handle_t latch)
+{
+    return sync_latch_wait (latch);
+};
+
+/* [ Job Queues ] */
+jobq_handle_t
+jobq_open (char* name)
+{
+    struct message m;
+
+    if (name == NULL || strlen (name) >= sizeof m.identifier)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = JOBQ_OPEN;
+    strcpy (m.identifier, name);
+
+    return parent_command (&m);
+};
+
+int
+jobq_push (jobq_handle_t q, void* task, size_t sz)
+{
+    struct message m;
+
+    if (sz > JOBQ_MAX_TASK)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = JOBQ_PUSH;
+    m.id = q;
+    m.sz = sz;
+    memcpy (m.information, task, sz);
+
+    return parent_command (&m);
+};
+
+int
+jobq_pop (jobq_handle_t q, struct jobq_task* tasks, int max, int timeout_ms)
+{
+    struct message m;
+    struct jobq_pop_args args;
+
+    if (tasks == NULL || max <= 0)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = JOBQ_POP;
+    m.id = q;
+    args.max = max;
+    args.timeout_ms = timeout_ms;
+    memcpy (m.information, &args, sizeof args);
+
+    int n = parent_command (&m);
+
+    /* Unpack the batch */
+    size_t off = 0;
+    int i;
+    for (i = 0; i < n && i < max; i++)
+    {
+        struct jobq_task_header h;
+        memcpy (&h, m.information + off, sizeof h);
+        tasks[i].jobid = h.jobid;
+        tasks[i].producer = h.producer;
+        tasks[i].sz = h.sz;
+        memcpy (tasks[i].data, m.information + off + sizeof h, h.sz);
+        off += sizeof h + ((h.sz + 7) & ~(size_t) 7);
+    }
+    return n;
+};
+
+int
+jobq_complete (jobq_handle_t q, struct jobq_task* task, void* result, 
+        size_t sz)
+{
+    struct message m;
+    struct jobq_task_header h;
+
+    if (task == NULL || sz > JOBQ_MAX_TASK)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = JOBQ_COMPLETE;
+    m.id = q;
+    h.jobid = task->jobid;
+    h.producer = task->producer;
+    h.sz = sz;
+    h.pad = 0;
+    memcpy (m.information, &h, sizeof h);
+    memcpy (m.information + sizeof h, result, sz);
+    m.sz = sizeof h + sz;
+
+    return parent_command (&m);
+};
+
+int
+jobq_result (jobq_handle_t q, int* jobid, void* result, size_t sz, int block)
+{
+    struct message m;
+    struct jobq_task_header h;
+
+    if (q < 0)
+        return -1;
+
+    /* Results for other queues stay in the inbox for their own callers */
+    int ret = next_message (JOBQ_RESULT, q, &m, block);
+    if (ret != 1)
+        return ret;
+
+    memcpy (&h, m.information, sizeof h);
+    if (jobid != NULL)
+        *jobid = h.jobid;
+    memcpy (result, m.information + sizeof h, h.sz < sz ? h.sz : sz);
+    return h.sz;
+};
+
+int
+jobq_stats (jobq_handle_t q, struct jobq_stats* stats)
+{
+    struct message m;
+
+    if (stats == NULL)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = JOBQ_STATS;
+    m.id = q;
+
+    int ret = parent_command (&m);
+    memcpy (stats, m.information, sizeof *stats);
+    return ret;
+};
+
+/* [ Collective Calls ] */
+int
+coll_bcast (void* req, size_t sz, int timeout_ms)
+{
+    return collective (COLL_BCAST, COLL_SUM, req, sz, NULL, NULL, timeout_ms);
+};
+
+int
+coll_gather (void* req, size_t sz, void* answers, size_t* answers_sz, 
+        int timeout_ms)
+{
+    return collective (COLL_GATHER, COLL_SUM, req, sz, answers, answers_sz, 
+            timeout_ms);
+};
+
+int
+coll_reduce (enum coll_reducer reducer, void* req, size_t sz, 
+        void* result, size_t* result_sz, int timeout_ms)
+{
+    return collective (COLL_REDUCE, reducer, req, sz, result, result_sz, 
+            timeout_ms);
+};
+
+int
+coll_next_request (struct coll_request* req, int block)
+{
+    struct message m;
+    struct coll_request_header h;
+
+    if (req == NULL)
+        return -1;
+
+    int ret = next_message (COLL_REQUEST, ANY_ID, &m, block);
+    if (ret != 1)
+        return ret;
+
+    memcpy (&h, m.information, sizeof h);
+    req->collid = h.collid;
+    req->caller = h.caller;
+    req->command = h.command;
+    req->sz = h.sz;
+    memcpy (req->data, m.information + sizeof h, h.sz);
+    return 1;
+};
+
+int
+coll_respond (struct coll_request* req, void* data, size_t sz)
+{
+    struct message m;
+
+    if (req == NULL || sz > sizeof m.information)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = COLL_RESPOND;
+    m.id = req->collid;
+    m.sz = sz;
+    memcpy (m.information, data, sz);
+
+    return parent_command (&m);
+};
+
+/* [ Remote Procedure Calls ] */
+message_handle_t
+rpc_call_nb (int procid, void* req, size_t sz, int timeout_ms)
+{
+    struct message m;
+    struct rpc_header h;
+
+    if (sz > RPC_MAX_PAYLOAD)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = RPC_CALL;
+    m.id = procid;
+    memset (&h, 0, sizeof h);
+    h.corr_id = next_corr_id++;
+    if (next_corr_id <= 0)
+        next_corr_id = 1;
+    h.timeout_ms = timeout_ms;
+    h.sz = sz;
+    memcpy (m.information, &h, sizeof h);
+    memcpy (m.information + sizeof h, req, sz);
+    m.sz = sizeof h + sz;
+
+    if (0 != parent_command (&m))
+        return -1;
+    return h.corr_id;
+};
+
+int
+rpc_wait (message_handle_t mh, void* resp, size_t sz)
+{
+    struct message m;
+    struct rpc_header h;
+
+    if (mh <= 0)
+        return -1;
+
+    /* Results of other calls go to the inbox until they are waited for */
+    if (1 != next_message (RPC_RESULT, mh, &m, true))
+        return -1;
+
+    memcpy (&h, m.information, sizeof h);
+    if (h.status != 0)
+    {
+        serverr = h.status;
+        return -1;
+    }
+    memcpy (resp, m.information + sizeof h, h.sz < sz ? h.sz : sz);
+    return h.sz;
+};
+
+int
+rpc_call (int procid, void* req, size_t req_sz, void* resp, size_t resp_sz,
+        int timeout_ms)
+{
+    message_handle_t mh = rpc_call_nb (procid, req, req_sz, timeout_ms);
+    if (mh == -1)
+        return -1;
+    return rpc_wait (mh, resp, resp_sz);
+};
+
+int
+rpc_next_request (struct rpc_request* req, int block)
+{
+    struct message m;
+    struct rpc_header h;
+
+    if (req == NULL)
+        return -1;
+
+    int ret = next_message (RPC_REQUEST, ANY_ID, &m, block);
+    if (ret != 1)
+        return ret;
+
+    memcpy (&h, m.information, sizeof h);
+    req->callid = m.id;
+    req->caller = h.peer;
+    req->timeout_ms = h.timeout_ms;
+    req->sz = h.sz;
+    memcpy (req->data, m.information + sizeof h, h.sz);
+    return 1;
+};
+
+int
+rpc_reply (struct rpc_request* req, void* resp, size_t sz)
+{
+    struct message m;
+    struct rpc_header h;
+
+    if (req == NULL || sz > RPC_MAX_PAYLOAD)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = RPC_REPLY;
+    m.id = req->callid;
+    memset (&h, 0, sizeof h);
+    h.corr_id = req->callid;
+    h.sz = sz;
+    memcpy (m.information, &h, sizeof h);
+    memcpy (m.information + sizeof h, resp, sz);
+    m.sz = sizeof h + sz;
+
+    return parent_command (&m);
+};
+
+/* [ Sibling Events ] */
+int
+event_subscribe (int procid, int events)
+{
+    struct message m;
+    struct event_args args;
+
+    memset (&m, 0, sizeof m);
+    m.command = EVENT_SUBSCRIBE;
+    m.id = procid;
+    args.mask = events;
+    args.pad = 0;
+    memcpy (m.information, &args, sizeof args);
+    m.sz = sizeof args;
+
+    return parent_command (&m);
+};
+
+int
+event_next (struct sibling_event* ev, int block)
+{
+    if (ev == NULL)
+        return -1;
+
+    while (events_next == events_len && events_lost == 0)
+    {
+        int ret = poll_events (block);
+        if (ret != 1)
+            return ret;
+    }
+
+    memset (ev, 0, sizeof *ev);
+    if (events_next == events_len)
+    {
+        ev->procid = SIBLING_ANY_SOURCE;
+        ev->count = events_lost;
+        events_lost = 0;
+        return 1;
+    }
+
+    struct event_entry* e = &events[events_next++];
+    ev->procid = e->ourid;
+    ev->events = e->events;
+    ev->count = e->count;
+    ev->state = e->state;
+    ev->status = e->status;
+    return 1;
+};
+
+int
+event_fd ()
+{
+    return childread;
+};
+
 /* [ Miscellaneous Functions ] */
-conn_status_t* get_connection_status (conn_status_t* status);
+conn_state_t
+get_connection_status ()
+{
+    return conn_state;
+};
+
+int
+set_connection_status (conn_state_t state)
+{
+    struct message m;
+
+    if (state == conn_state)
+        return 0;
+    conn_state = state;
+
+    /* The parent doesn't answer this one */
+    memset (&m, 0, sizeof m);
+    m.command = CONN_STATE;
+    m.id = state;
+    if (sizeof m != write (childwrite, &m, sizeof m))
+    {
+        set_serverr (-1);
+        return -1;
+    }
+    return 0;
+};
+
 int get_procid ();
 ip_addr_t get_client_ip ();
 
@@ -181,6 +761,169 @@ close_fd (int fd)
     close (fd);
 };
 
+int
+parent_command (struct message* m)
+{
+    if (sizeof *m != write (childwrite, m, sizeof *m))
+    {
+        set_serverr (-1);
+        return -1;
+    }
+
+    /* The parent answers every command with the same command, and we never
+     * have more than one outstanding, so the first one back is ours. */
+    if (1 != next_message (m->command, ANY_ID, m, true))
+        return -1;
+    return m->id;
+};
+
+int
+next_message (enum command cmd, int id, struct message* m, bool block)
+{
+    struct inbox_entry* prev = NULL;
+    struct inbox_entry* e;
+    for (e = inbox_head; e != NULL; prev = e, e = e->next)
+    {
+        if (e->m.command != cmd || (id != ANY_ID && e->m.id != id))
+            continue;
+
+        if (prev == NULL)   inbox_head = e->next;
+        else                prev->next = e->next;
+        if (inbox_tail == e)
+            inbox_tail = prev;
+
+        memcpy (m, &e->m, sizeof *m);
+        free (e);
+        return 1;
+    }
+
+    while (true)
+    {
+        if (!block)
+        {
+            struct pollfd pfd = { childread, POLLIN, 0 };
+            if (poll (&pfd, 1, 0) <= 0)
+                return 0;
+        }
+
+        struct message in;
+        if (-1 == read_message (&in))
+            return -1;
+        if (in.command == cmd && (id == ANY_ID || in.id == id))
+        {
+            memcpy (m, &in, sizeof *m);
+            return 1;
+        }
+
+        e = malloc (sizeof *e);
+        if (e == NULL)
+        {
+            set_serverr (-1);
+            return -1;
+        }
+        memcpy (&e->m, &in, sizeof in);
+        e->next = NULL;
+        if (inbox_tail == NULL) inbox_head = e;
+        else                    inbox_tail->next = e;
+        inbox_tail = e;
+    }
+};
+
+int
+poll_events (bool block)
+{
+    struct message m;
+    struct event_header h;
+
+    /* The parent sends one notice, and no more until we poll */
+    int ret = next_message (EVENT_NOTIFY, ANY_ID, &m, block);
+    if (ret != 1)
+        return ret;
+
+    memset (&m, 0, sizeof m);
+    m.command = EVENT_POLL;
+    if (-1 == parent_command (&m))
+        return -1;
+
+    memcpy (&h, m.information, sizeof h);
+    if (h.n > EVENT_MAX_BATCH)
+        h.n = EVENT_MAX_BATCH;
+    memcpy (events, m.information + sizeof h, h.n * sizeof events[0]);
+    events_next = 0;
+    events_len = h.n;
+    events_lost += h.lost;
+    return 1;
+};
+
+void
+check_lost (int ret)
+{
+    if (ret == 0 || (ret == -1 && (errno == EPIPE || errno == ECONNRESET)))
+        set_connection_status (CONN_DISCONNECTED);
+};
+
+int
+read_message (struct message* m)
+{
+    size_t got = 0;
+    while (got < sizeof *m)
+    {
+        ssize_t ret = read (childread, (char*) m + got, sizeof *m - got);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            set_serverr (-1);
+            return -1;
+        }
+        got += ret;
+    }
+    return 0;
+};
+
+int
+collective (enum command cmd, enum coll_reducer reducer, void* req, 
+        size_t sz, void* result, size_t* result_sz, int timeout_ms)
+{
+    struct message m;
+    struct coll_args args;
+
+    if (sz > sizeof m.information - sizeof (struct coll_request_header))
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = cmd;
+    args.reducer = reducer;
+    args.timeout_ms = timeout_ms;
+    args.sz = sz;
+    args.pad = 0;
+    memcpy (m.information, &args, sizeof args);
+    memcpy (m.information + sizeof args, req, sz);
+
+    int ret = parent_command (&m);
+    if (ret >= 0 && result != NULL)
+        memcpy (result, m.information, m.sz);
+    if (ret >= 0 && result_sz != NULL)
+        *result_sz = m.sz;
+    return ret;
+};
+
+sync_handle_t
+sync_object_init (enum command cmd, char* name, int arg)
+{
+    struct message m;
+
+    if (name == NULL || strlen (name) >= sizeof m.identifier)
+        return -1;
+
+    memset (&m, 0, sizeof m);
+    m.command = cmd;
+    strcpy (m.identifier, name);
+    m.id = arg;
+
+    return parent_command (&m);
+};
+
 void 
 convert_ip_address (ip_addr_t* ipaddr, char* str_ipaddr, int ipver)
 {
@@ -41,6 +41,9 @@
  *          setting events for status changes.
  * */
 
+/* Message layouts shared with the server */
+#include "messaging.h"
+
 
 /* Holds an ip address.  ip_ver specifies 4 or 6, and each octet is stored in
  * o1 - o4.  For an IPv4 address like 192.168.1.126, you would have:
@@ -123,12 +126,14 @@ struct child_message
  *  CLIENTFD - the integer file descriptor to our client connection
  *  CHILDREAD - the integer file handle to our read-only pipe to the parent
  *  CHILDWRITE - the integer file handle to our write-only pipe to the parent
+ *  SYNCFD - the integer file handle to the shared sync region
+ *  SYNCSLOT - our process slot in the shared sync region
  *  IPADDR - the ip address of the client
  *  IPVER - the ip address version: 4 or 6
  *  port - the port the child is connected to 
  * */
 void init (char* logfile_path, char* errfile_path, 
-        int clientfd, int childread, int childwrite,
+        int clientfd, int childread, int childwrite, int syncfd, int syncslot,
         char* ipaddr, int ipver, int port);
 
 /* Log a message to the custom log file */
@@ -148,15 +153,280 @@ typedef int message_handle_t;
 /* *
  * *                    [ Inter Process Communication ]
  * */
+
+/* Messages between siblings are matched the way MPI matches them: every
+ * message carries a tag, and a receive names the sender and tag it wants,
+ * either of which may be a wildcard (SIBLING_ANY_SOURCE, SIBLING_ANY_TAG).
+ * Among the messages that match, the one that arrived first is received.
+ * Messages wait in the parent until they are received, up to a limit, after
+ * which sends to that sibling fail. */
+
+/* Where a received message came from */
+struct sibling_status
+{
+    int src;
+    int tag;
+    size_t sz;
+};
+
+/**
+ * Sends the SZ bytes at DATA to sibling PROCID with tag TAG (0 or above).
+ * Returns once the message is queued for the sibling, which does not need to
+ * be receiving yet.  Returns 0 on success, -1 on error. */
+int sibling_send_tagged (int procid, int tag, void* data, size_t sz);
+/**
+ * Receives the oldest message from PROCID with tag TAG, waiting up to
+ * TIMEOUT_MS milliseconds for one (negative waits for good, 0 not at all).
+ * Up to SZ bytes are stored in DATA and, if STATUS is not NULL, where it came
+ * from is stored there.  Returns the size of the message, or -1 with the
+ * reason (EAGAIN, ETIMEDOUT) in serverr. */
+int sibling_recv_tagged (int procid, int tag, void* data, size_t sz, 
+        int timeout_ms, struct sibling_status* status);
+/**
+ * Same as SIBLING_SEND_TAGGED with tag 0. */
 int sibling_send_b (int procid, void* data, size_t sz);
 message_handle_t sibling_send_nb (int procid, void* data, size_t sz);
 int sibling_wait_send (message_handle_t mh);
+/**
+ * Waits for the oldest message from PROCID with any tag.  Returns its size,
+ * or -1 on error. */
 int sibling_recv_b (int procid, void* data, size_t sz);
 message_handle_t sibling_recv_nb (int procid, void* data, size_t sz);
 int sibling_wait_recv (message_handle_t mh);
 void log_message (char* format, ...);
 void log_error (char* format, ...);
 
+/* *
+ * *                    [ Shared Synchronization ]
+ * */
+
+/* Reader-writer locks, barriers and countdown latches shared by every child.
+ * Each object is looked up by NAME (at most 15 characters) through the
+ * parent, which creates it on first use, and the returned handle is then used
+ * for all operations.  Locking and unlocking happen in shared memory without
+ * talking to the parent; only a contended wait sleeps in the kernel.  If a
+ * child dies the parent releases whatever locks it held.  None of the locks
+ * are recursive. */
+typedef int sync_handle_t;
+
+/**
+ * Gets a handle to the reader-writer lock NAME.  Returns -1 on error, such as
+ * when NAME already names a barrier or latch. */
+sync_handle_t rwlock_init (char* name);
+/**
+ * Acquire and release LOCK for reading or writing.  The blocking calls return
+ * 0 on success and -1 on error.  The try variants return 1 instead of
+ * blocking when the lock is busy. */
+int rwlock_rdlock (sync_handle_t lock);
+int rwlock_tryrdlock (sync_handle_t lock);
+int rwlock_rdunlock (sync_handle_t lock);
+int rwlock_wrlock (sync_handle_t lock);
+int rwlock_trywrlock (sync_handle_t lock);
+int rwlock_wrunlock (sync_handle_t lock);
+
+/**
+ * Gets a handle to the barrier NAME for PARTIES processes.  Calling it on a
+ * broken barrier resets it. */
+sync_handle_t barrier_init (char* name, int parties);
+/**
+ * Blocks until PARTIES processes have called this function.  Returns 1 in the
+ * last process to arrive, 0 in the others, or -1 if a waiting process died
+ * and broke the barrier. */
+int barrier_wait (sync_handle_t barrier);
+
+/**
+ * Gets a handle to the countdown latch NAME that opens after COUNT calls to
+ * LATCH_COUNT_DOWN.  COUNT is ignored if the latch already exists. */
+sync_handle_t latch_init (char* name, int count);
+int latch_count_down (sync_handle_t latch);
+/**
+ * Blocks until the latch has been counted down to zero. */
+int latch_wait (sync_handle_t latch);
+
+/* *
+ * *                    [ Job Queues ]
+ * */
+
+/* Named job queues hosted by the parent.  A producer pushes tasks; any child
+ * pops them, taking its own tasks first and stealing from siblings once it
+ * runs out.  Each task's result is sent back to the child that pushed it. */
+typedef int jobq_handle_t;
+
+/* A task as handed to a worker by JOBQ_POP */
+struct jobq_task
+{
+    int jobid;
+    int producer;           // child id of the producer
+    size_t sz;
+    char data[JOBQ_MAX_TASK];
+};
+
+/**
+ * Gets a handle to the job queue NAME, creating it if needed.  Returns -1 on
+ * error. */
+jobq_handle_t jobq_open (char* name);
+/**
+ * Pushes a task of SZ bytes (at most JOBQ_MAX_TASK) stored at TASK.  Returns
+ * the job id, which is handed back with the task's result, or -1 on error. */
+int jobq_push (jobq_handle_t q, void* task, size_t sz);
+/**
+ * Pops up to MAX tasks into TASKS with a single round trip to the parent.
+ * Waits up to TIMEOUT_MS milliseconds for work if there is none; 0 does not
+ * wait and a negative value waits forever.  Returns the number of tasks
+ * popped, or -1 on error. */
+int jobq_pop (jobq_handle_t q, struct jobq_task* tasks, int max, 
+        int timeout_ms);
+/**
+ * Reports TASK as done, sending the SZ bytes of RESULT back to its producer.
+ * Returns 0 on success, -1 if the producer is gone. */
+int jobq_complete (jobq_handle_t q, struct jobq_task* task, void* result, 
+        size_t sz);
+/**
+ * Gets the next result for a task we pushed to Q.  Its job id is stored in
+ * JOBID and up to SZ bytes of it in RESULT.  Blocks if BLOCK is nonzero,
+ * otherwise returns 0 when no result is ready.  Returns the size of the
+ * result, or -1 on error. */
+int jobq_result (jobq_handle_t q, int* jobid, void* result, size_t sz, 
+        int block);
+/**
+ * Gets throughput and steal counts for Q. */
+int jobq_stats (jobq_handle_t q, struct jobq_stats* stats);
+
+/* *
+ * *                    [ Collective Calls ]
+ * */
+
+/* A collective sends one request to every sibling through the parent and
+ * returns a single aggregated answer.  Siblings that haven't answered after
+ * TIMEOUT_MS milliseconds (0 for the server's default) are left out, so one
+ * slow sibling can't hold up the result.  Each call returns the number of
+ * siblings that answered, or -1 on error. */
+
+/* A request from a sibling's collective, as seen by the siblings asked */
+struct coll_request
+{
+    int collid;
+    int caller;             // child id of the sibling that asked
+    enum command command;   // COLL_BCAST, COLL_GATHER or COLL_REDUCE
+    size_t sz;
+    char data[484 - sizeof (struct coll_request_header)];
+};
+
+/**
+ * Sends the SZ bytes at REQ to every sibling and waits for their
+ * acknowledgements. */
+int coll_bcast (void* req, size_t sz, int timeout_ms);
+/**
+ * Sends REQ to every sibling and collects their answers into ANSWERS, which
+ * must hold at least 484 bytes.  Answers are packed one after another, each
+ * preceded by a struct coll_entry and padded to a multiple of 8 bytes; the
+ * total size is stored in ANSWERS_SZ.  Answers that don't fit are dropped. */
+int coll_gather (void* req, size_t sz, void* answers, size_t* answers_sz, 
+        int timeout_ms);
+/**
+ * Sends REQ to every sibling and combines their answers with REDUCER.  For
+ * COLL_SUM, COLL_MIN and COLL_MAX each sibling answers with an int64_t and
+ * RESULT receives the combined int64_t.  For COLL_CONCAT RESULT receives the
+ * answers back to back (at most 484 bytes) and RESULT_SZ their total size. */
+int coll_reduce (enum coll_reducer reducer, void* req, size_t sz, 
+        void* result, size_t* result_sz, int timeout_ms);
+/**
+ * Gets the next collective request a sibling sent us.  Blocks if BLOCK is
+ * nonzero, otherwise returns 0 when there is none.  Returns 1 when REQ was
+ * filled, -1 on error. */
+int coll_next_request (struct coll_request* req, int block);
+/**
+ * Answers REQ with the SZ bytes at DATA. */
+int coll_respond (struct coll_request* req, void* data, size_t sz);
+
+/* *
+ * *                    [ Remote Procedure Calls ]
+ * */
+
+/* Request/response calls to a single sibling.  Every call carries a
+ * correlation id and a deadline.  Any number of calls can be outstanding and
+ * replies are matched to their call whatever order they come back in.  If
+ * the sibling doesn't answer by the deadline the parent fails the call with
+ * ETIMEDOUT and refuses the late reply. */
+
+/* A call from a sibling, as seen by the sibling being called */
+struct rpc_request
+{
+    int callid;
+    int caller;             // child id of the caller
+    int timeout_ms;         // what was left of the deadline when forwarded
+    size_t sz;
+    char data[RPC_MAX_PAYLOAD];
+};
+
+/**
+ * Calls sibling PROCID with the SZ bytes at REQ without waiting for the
+ * answer.  The call fails unless answered within TIMEOUT_MS milliseconds
+ * (0 for the server's default).  Returns a handle to pass to RPC_WAIT, or -1
+ * on error. */
+message_handle_t rpc_call_nb (int procid, void* req, size_t sz, 
+        int timeout_ms);
+/**
+ * Waits for the answer to call MH and stores up to SZ bytes of it in RESP.
+ * Returns the size of the answer, or -1 if the call failed, with the reason
+ * (such as ETIMEDOUT) in serverr. */
+int rpc_wait (message_handle_t mh, void* resp, size_t sz);
+/**
+ * Calls sibling PROCID and waits for the answer.  Same as RPC_CALL_NB
+ * followed by RPC_WAIT. */
+int rpc_call (int procid, void* req, size_t req_sz, void* resp, 
+        size_t resp_sz, int timeout_ms);
+/**
+ * Gets the next call a sibling made to us.  Blocks if BLOCK is nonzero,
+ * otherwise returns 0 when there is none.  Returns 1 when REQ was filled, -1
+ * on error. */
+int rpc_next_request (struct rpc_request* req, int block);
+/**
+ * Answers REQ with the SZ bytes at RESP.  Returns -1 if the call already
+ * expired. */
+int rpc_reply (struct rpc_request* req, void* resp, size_t sz);
+
+/* *
+ * *                    [ Sibling Events ]
+ * */
+
+/* Instead of polling its siblings, a child can subscribe to their exits and
+ * to the changes of their connection state.  Events for the same sibling are
+ * merged until they are read, so a child gets the latest state of each
+ * sibling that changed, and how many changes that took, however far behind
+ * it is.  The parent sends a notice over the usual pipe when events are
+ * waiting, which other calls set aside until EVENT_NEXT is called. */
+
+/* What a sibling did since we last looked.  If PROCID is SIBLING_ANY_SOURCE,
+ * COUNT siblings had too many events to keep, and the others must be asked
+ * directly. */
+struct sibling_event
+{
+    int procid;
+    int events;             // EVENT_EXIT and EVENT_STATE
+    int count;              // how many events were merged into this one
+    conn_state_t state;     // its latest state, 0 if it never reported one
+    int status;             // exit code, or minus the signal that killed it
+};
+
+/**
+ * Subscribes to EVENTS (EVENT_EXIT, EVENT_STATE or both) of sibling PROCID,
+ * or of all siblings if PROCID is SIBLING_ANY_SOURCE, replacing what we
+ * subscribed to before.  0 unsubscribes.  Returns -1 if PROCID has already
+ * exited. */
+int event_subscribe (int procid, int events);
+/**
+ * Gets the next event into EV.  Blocks if BLOCK is nonzero, otherwise
+ * returns 0 when there is none.  Returns 1 when EV was filled, -1 on
+ * error. */
+int event_next (struct sibling_event* ev, int block);
+/**
+ * A descriptor that is readable when the parent has sent us something,
+ * such as a notice of events, to use with poll or select.  Other calls may
+ * already have read the notice, so call EVENT_NEXT without blocking before
+ * waiting on it. */
+int event_fd ();
+
 /* *
  * *                    [ Client Communication ] 
  * */
@@ -234,6 +504,12 @@ int change_port (int new_port);
  * terminating or normal.  */
 conn_state_t get_connection_status ();
 
+/**
+ * Sets the status of the connection and tells siblings subscribed to our
+ * state, without waiting for the parent.  A lost connection is reported by
+ * the client calls themselves. */
+int set_connection_status (conn_state_t state);
+
 /**
  * Get the port to which the client is connected. */
 int get_port ();
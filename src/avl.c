@@ -5,22 +5,24 @@
 #include    "avl.h"
 
 /* helper functions for tree operations */
-static bool insert_helper (struct avl_node** node, struct avl_node* parent, 
-        void* data, bool* taller, avl_tree_compare_func* func);
-
-static bfactor adjust_balance (struct avl_node* node, bfactor balance);
-static void rotate_left (struct avl_node** node);
-static void rotate_right (struct avl_node** node);
-static void balance_left (struct avl_node** node);
-static void balance_right (struct avl_node** node);
+static void rotate_left (struct avl_tree* tree, struct avl_node* node);
+static void rotate_right (struct avl_tree* tree, struct avl_node* node);
+static struct avl_node* rebalance (struct avl_tree* tree, 
+        struct avl_node* node);
+static void replace_child (struct avl_tree* tree, struct avl_node* parent,
+        struct avl_node* old, struct avl_node* new);
+static bool link_node (struct avl_tree* tree, struct avl_node* node);
+static void unlink_node (struct avl_tree* tree, struct avl_node* del);
 
 static struct avl_node* find_helper (struct avl_node*, const void*, 
         avl_tree_compare_func*);
+static int check_helper (struct avl_node* node, struct avl_node* parent, 
+        avl_tree_compare_func* func, size_t* count);
 
+static struct avl_node* lower_bound (struct avl_node* node, const void* elem,
+        avl_tree_compare_func* func);
 static void dump_helper (struct avl_node* node, unsigned, avl_tree_dump_func*);
 
-static void dump_node (struct avl_node* node, unsigned level);
-
 void 
 avl_init (struct avl_tree* tree, avl_tree_compare_func* func)
 {
@@ -28,14 +30,43 @@ avl_init (struct avl_tree* tree, avl_tree_compare_func* func)
     
     tree->root = NULL;
     tree->comparator = func;
+    tree->intrusive = false;
+    pool_init (&tree->pool, sizeof (struct avl_node));
+};
+
+void 
+avl_init_intrusive (struct avl_tree* tree, avl_tree_compare_func* func)
+{
+    avl_init (tree, func);
+    if (tree && func)
+        tree->intrusive = true;
+};
+
+void
+avl_destroy (struct avl_tree* tree)
+{
+    if (!tree)  return;
+
+    tree->root = NULL;
+    pool_destroy (&tree->pool);
 };
 
 bool 
 avl_insert (struct avl_tree* tree, void* data)
 {
-    if (!data)  return false;
-    bool taller = false;
-    return insert_helper (&(tree->root), NULL, data, &taller, tree->comparator);
+    if (!tree || !data)  return false;
+    ASSERT (!tree->intrusive);
+
+    struct avl_node* node = pool_alloc (&tree->pool);
+    if (node == NULL)   return false;
+    node->data = data;
+
+    if (!link_node (tree, node))
+    {
+        pool_free (&tree->pool, node);
+        return false;
+    }
+    return true;
 };
 
 void* 
@@ -43,59 +74,44 @@ avl_delete (struct avl_tree* tree, void* data)
 {
     if (!data || !tree)
         return NULL;
+    ASSERT (!tree->intrusive);
 
-    struct avl_node* del = avl_find (tree, data);
+    struct avl_node* del = find_helper (tree->root, data, tree->comparator);
+    if (del == NULL)
+        return NULL;
 
-    /* Case 1: Node is a leaf */
-    if (del->left == NULL && del->right == NULL)
-    {
-        if (!del->parent)   tree->root = NULL;
-        else if (del->parent->right == del) del->parent->right = NULL;
-        else                                del->parent->left = NULL;
-    }
+    void* ret = del->data;
+    unlink_node (tree, del);
+    pool_free (&tree->pool, del);
+    return ret;
+};
 
-    /* Case 2: Node has one child */
-    else if (del->left)
-    {
-        if (del->parent == NULL)    tree->root = del->left;
-        else if (del->parent->right == del) del->parent->right = del->left;
-        else                                del->parent->left = del->left;
-    }
-    else if (del->right)
-    {
-        if (del->parent == NULL)    tree->root = del->right;
-        else if (del->parent->right == del) del->parent->right = del->right;
-        else                                del->parent->left = del->left;
-    }
+bool
+avl_insert_node (struct avl_tree* tree, struct avl_node* node, void* data)
+{
+    if (!tree || !node || !data)    return false;
+    ASSERT (tree->intrusive);
 
-    /* Case 3: Node has both children */
-    else
-    {
-        ASSERT (del->left);
-        ASSERT (del->right);
-
-        struct avl_node* right = del->right;
-        /* Find the leftmost child */
-        struct avl_node* n = right;
-        while (n->left)
-            n = n->left;
-        ASSERT (n->left == NULL);
-        if (n->right)
-        {
-            n->parent->left = n->right;
-            n->right->parent = n->parent;
-        }
-        n->right = del->right;
-        n->left = del->left;
-        n->parent = del->parent;
-        if (del->parent == NULL)    tree->root = n;
-        else if (del->parent->right == del) del->parent->right = n;
-        else                                del->parent->left = n;
-    }
+    node->data = data;
+    return link_node (tree, node);
+};
 
-    void* ret = del->data;
-    free (del);
-    return ret;
+void
+avl_remove_node (struct avl_tree* tree, struct avl_node* node)
+{
+    if (!tree || !node) return;
+    ASSERT (tree->intrusive);
+
+    unlink_node (tree, node);
+};
+
+struct avl_node*
+avl_find_node (struct avl_tree* tree, const void* elem)
+{
+    ASSERT (tree != NULL);
+
+    if (elem == NULL)   return NULL;
+    return find_helper (tree->root, elem, tree->comparator);
 };
 
 void*
@@ -117,59 +133,109 @@ avl_dump (struct avl_tree* tree, avl_tree_dump_func* func)
     dump_helper (tree->root, 0, func);   
 };
 
+bool
+avl_check (struct avl_tree* tree, size_t* count)
+{
+    ASSERT (tree != NULL);
+
+    size_t n = 0;
+    int height = check_helper (tree->root, NULL, tree->comparator, &n);
+    if (count)
+        *count = n;
+    return height >= 0;
+};
+
 
 /*******
   Iterator Functions
   *********/
-struct avl_iterator* 
-avl_get_iterator (struct avl_tree* tree)
+bool
+avl_iter_first (struct avl_tree* tree, struct avl_iterator* it)
 {
-    if (tree == NULL || tree->root == NULL) return NULL;
-    struct avl_iterator* it = malloc (sizeof (struct avl_iterator));
-    if (it == NULL)
-        return NULL;
-    it->node = tree->root;
+    ASSERT (it != NULL);
+
     it->tree = tree;
+    it->node = tree ? tree->root : NULL;
+    if (it->node == NULL)
+        return false;
     /* Go to the smallest element in the tree... The left-most. */
     while (it->node->left)
         it->node = it->node->left;
-    return it;
+    return true;
 };
 
-struct avl_iterator* 
-avl_get_reverse_iterator (struct avl_tree* tree)
+bool
+avl_iter_last (struct avl_tree* tree, struct avl_iterator* it)
 {
-    if (tree == NULL)   return NULL;
-    struct avl_iterator* it = malloc (sizeof (struct avl_iterator));
-    if (it == NULL) return NULL;
-    it->node = tree->root;
+    ASSERT (it != NULL);
+
     it->tree = tree;
+    it->node = tree ? tree->root : NULL;
+    if (it->node == NULL)
+        return false;
     /* Go to the largest element in the tree... The right-most. */
     while (it->node->right)
         it->node = it->node->right;
-    return it;
+    return true;
+};
+
+bool
+avl_iter_seek (struct avl_tree* tree, struct avl_iterator* it, 
+        const void* elem)
+{
+    ASSERT (it != NULL);
+
+    it->tree = tree;
+    it->node = tree ? lower_bound (tree->root, elem, tree->comparator) : NULL;
+    return it->node != NULL;
+};
+
+struct avl_iterator* 
+avl_get_iterator (struct avl_tree* tree)
+{
+    struct avl_iterator it;
+    if (!avl_iter_first (tree, &it))    return NULL;
+    struct avl_iterator* copy = malloc (sizeof (struct avl_iterator));
+    if (copy)
+        *copy = it;
+    return copy;
+};
+
+struct avl_iterator* 
+avl_get_reverse_iterator (struct avl_tree* tree)
+{
+    struct avl_iterator it;
+    if (!avl_iter_last (tree, &it))     return NULL;
+    struct avl_iterator* copy = malloc (sizeof (struct avl_iterator));
+    if (copy)
+        *copy = it;
+    return copy;
 };
 
 void* 
 avl_get (struct avl_iterator* it)
 {
-    if (it == NULL) return NULL;
+    if (it == NULL || it->node == NULL) return NULL;
     return it->node->data;
 };
 
 void 
 avl_itr_remove (struct avl_iterator* it)
 {
-    if (it == NULL) return;
+    if (it == NULL || it->node == NULL) return;
     struct avl_node* node = it->node;
+
+    /* Nodes are never moved, only relinked, so the next node stays valid */
     avl_next (it);
-    avl_delete (it->tree, node->data);
+    unlink_node (it->tree, node);
+    if (!it->tree->intrusive)
+        pool_free (&it->tree->pool, node);
 };
 
 void* 
 avl_next (struct avl_iterator* it)
 {
-    if (it == NULL) return NULL;
+    if (it == NULL || it->node == NULL) return NULL;
     if (it->node->right)
     {
         it->node = it->node->right;
@@ -187,13 +253,18 @@ avl_next (struct avl_iterator* it)
             {
                 it->node = it->node->parent;
                 if (!it->node->parent)
+                {
+                    it->node = NULL;
                     return NULL;
+                }
             }
             it->node = it->node->parent;
         }
     }
     else
     {
+        /* Fell off the end; the iterator is spent. */
+        it->node = NULL;
         return NULL;
     }
     return it->node->data;
@@ -202,7 +273,7 @@ avl_next (struct avl_iterator* it)
 void* 
 avl_prev (struct avl_iterator* it)
 {
-    if (it == NULL) return NULL;
+    if (it == NULL || it->node == NULL) return NULL;
     if (it->node->left)
     {
         it->node = it->node->left;
@@ -219,13 +290,18 @@ avl_prev (struct avl_iterator* it)
             {
                 it->node = it->node->parent;
                 if (!it->node->parent)
+                {
+                    it->node = NULL;
                     return NULL;
+                }
             }
             it->node = it->node->parent;
         }
     }
     else
     {
+        /* Fell off the end; the iterator is spent. */
+        it->node = NULL;
         return NULL;
     }
     return it->node->data;
@@ -233,219 +309,320 @@ avl_prev (struct avl_iterator* it)
 
 
 
-/* ===  HELPER FUNCTIONS === */
-static bfactor 
-adjust_balance (struct avl_node* node, bfactor balance)
+size_t
+avl_walk (struct avl_tree* tree, avl_visit_func* func, void* aux)
 {
-    ASSERT (node != NULL);
-    ASSERT (balance >= -1);
-    ASSERT (balance <= 1);
+    ASSERT (func != NULL);
 
-    node->balance += balance;
-    return node->balance;
+    struct avl_iterator it;
+    size_t n = 0;
+    if (!avl_iter_first (tree, &it))
+        return 0;
+    do
+    {
+        n++;
+        if (!func (it.node->data, aux))
+            break;
+    }
+    while (avl_next (&it) != NULL);
+    return n;
 };
 
+size_t
+avl_range (struct avl_tree* tree, const void* lo, const void* hi, 
+        void** out, size_t max)
+{
+    ASSERT (tree != NULL);
+    ASSERT (out != NULL || max == 0);
+
+    struct avl_iterator it;
+    size_t n = 0;
+    if (!avl_iter_seek (tree, &it, lo))
+        return 0;
+    do
+    {
+        if (hi && tree->comparator (it.node->data, hi, NULL) > 0)
+            break;
+        if (n < max)
+            out[n] = it.node->data;
+        n++;
+    }
+    while (avl_next (&it) != NULL);
+    return n;
+};
+
+
+
+/* ===  HELPER FUNCTIONS === */
+
+/* Balance factors are the height of the right subtree minus the height of
+ * the left.  The rotations work out the new factors from the old ones, so
+ * they are right whatever the factors were, which deletion relies on. */
 static void 
-rotate_left (struct avl_node** node)
+rotate_left (struct avl_tree* tree, struct avl_node* node)
 {
     ASSERT (node != NULL);
-    ASSERT ((*node)->right != NULL);
+    ASSERT (node->right != NULL);
+
+    struct avl_node* top = node->right;
+    node->right = top->left;
+    if (top->left)  top->left->parent = node;
+    replace_child (tree, node->parent, node, top);
+    top->left = node;
+    node->parent = top;
 
-    struct avl_node* temp = *node;
-    *node = (*node)->right;
-    temp->right = (*node)->left;
-    (*node)->left = temp;
+    node->balance = node->balance - 1 - (top->balance > 0 ? top->balance : 0);
+    top->balance = top->balance - 1 + (node->balance < 0 ? node->balance : 0);
 };
 
 static void
-rotate_right (struct avl_node** node)
+rotate_right (struct avl_tree* tree, struct avl_node* node)
 {
     ASSERT (node != NULL);
-    ASSERT ((*node)->left != NULL);
+    ASSERT (node->left != NULL);
 
-    struct avl_node* temp = *node;
-    *node = (*node)->left;
-    temp->left = (*node)->right;
-    (*node)->right = temp;
+    struct avl_node* top = node->left;
+    node->left = top->right;
+    if (top->right) top->right->parent = node;
+    replace_child (tree, node->parent, node, top);
+    top->right = node;
+    node->parent = top;
+
+    node->balance = node->balance + 1 - (top->balance < 0 ? top->balance : 0);
+    top->balance = top->balance + 1 + (node->balance > 0 ? node->balance : 0);
 };
 
-static void
-balance_right (struct avl_node** node)
+/* Rotates NODE, whose balance factor is 2 or -2, back into balance.  Returns
+ * the new root of the subtree. */
+static struct avl_node*
+rebalance (struct avl_tree* tree, struct avl_node* node)
 {
-    if (node == NULL || *node == NULL || (*node)->right == NULL)    return;
-    struct avl_node* right_sub_node = (*node)->right;
-    struct avl_node* left_sub_right_sub_node;
-    switch (right_sub_node->balance)
+    ASSERT (node != NULL);
+
+    if (node->balance == 2)
     {
-    case 1:
-        (*node)->balance = 0;
-        right_sub_node->balance = 0;
-        rotate_left (node);
-        break;
-    case -1:
-        left_sub_right_sub_node = right_sub_node->left;
-        switch (left_sub_right_sub_node->balance)
-        {
-            case -1:
-                (*node)->balance = 0;
-                break;
-            case 1:
-                (*node)->balance = -1;
-                break;
-            default:
-                (*node)->balance = 0;
-                break;
-        }
-        left_sub_right_sub_node->balance = 0;
-        right_sub_node->balance = 0;
-        rotate_right (&(*node)->right);
-        rotate_left (node);
-        break;
+        if (node->right->balance < 0)
+            rotate_right (tree, node->right);
+        rotate_left (tree, node);
+    }
+    else
+    {
+        ASSERT (node->balance == -2);
+        if (node->left->balance > 0)
+            rotate_left (tree, node->left);
+        rotate_right (tree, node);
     }
+    return node->parent;
 };
 
+/* Makes NEW take OLD's place under PARENT, or at the root */
 static void
-balance_left (struct avl_node** node)
+replace_child (struct avl_tree* tree, struct avl_node* parent,
+        struct avl_node* old, struct avl_node* new)
 {
-    if (node == NULL || *node == NULL || (*node)->left == NULL)     return;
-    struct avl_node* left_sub_node = (*node)->left;
-    struct avl_node* right_sub_left_sub_node;
-    switch (left_sub_node->balance)
+    if (new)    new->parent = parent;
+    if (parent == NULL)             tree->root = new;
+    else if (parent->left == old)   parent->left = new;
+    else                            parent->right = new;
+};
+
+/* Links NODE, whose data is set, into TREE and rebalances.  Returns false
+ * if an equal element is already there. */
+static bool
+link_node (struct avl_tree* tree, struct avl_node* node)
+{
+    /* Find where it goes */
+    struct avl_node* parent = NULL;
+    struct avl_node** link = &tree->root;
+    while (*link)
     {
-    case -1:
-        (*node)->balance = 0;
-        left_sub_node->balance = 0;
-        rotate_right (node);
-        break;
-    case 1:
-        right_sub_left_sub_node = left_sub_node->right;
-        switch (right_sub_left_sub_node->balance)
+        parent = *link;
+        int cmp = tree->comparator (node->data, parent->data, NULL);
+        if (cmp < 0)        link = &parent->left;
+        else if (cmp > 0)   link = &parent->right;
+        else                return false;
+    }
+
+    node->left      = NULL;
+    node->right     = NULL;
+    node->parent    = parent;
+    node->balance   = 0;
+    *link = node;
+
+    /* Walk back up until a subtree's height stops changing.  One rotation
+     * at most is needed, and it restores the height the subtree had before
+     * the insert. */
+    struct avl_node* child = node;
+    while (parent)
+    {
+        parent->balance += (child == parent->left) ? -1 : 1;
+        if (parent->balance == 0)
+            break;
+        if (parent->balance == 2 || parent->balance == -2)
         {
-            case 1: 
-                (*node)->balance = 0;
-                break;
-            case -1:
-                (*node)->balance = 1;
-                break;
-            default:
-                (*node)->balance = 0;
-                break;
+            rebalance (tree, parent);
+            break;
         }
-        right_sub_left_sub_node->balance = 0;
-        left_sub_node->balance = 0;
-        rotate_left (&(*node)->left);
-        rotate_right (node);
-        break;
+        child = parent;
+        parent = parent->parent;
     }
+    return true;
 };
 
-bool 
-insert_helper (struct avl_node** node, struct avl_node* parent, void* data, 
-        bool* taller, avl_tree_compare_func* func)
+/* Unlinks DEL from TREE and rebalances.  DEL itself is left alone. */
+static void
+unlink_node (struct avl_tree* tree, struct avl_node* del)
 {
-    ASSERT (node != NULL);
-    ASSERT (data != NULL);
+    ASSERT (del != NULL);
 
-    struct avl_node* new_node = NULL;
-    if (*node == NULL)  
-    {
-        new_node = malloc (sizeof (struct avl_node));
-        if (new_node == NULL)   return false;
-        new_node->left      = NULL;
-        new_node->right     = NULL;
-        new_node->parent    = parent;
-        new_node->data      = data;
-        new_node->balance   = 0;
-    
-        (*node) = new_node;
+    /* Where the tree got shorter, and on which side */
+    struct avl_node* parent;
+    bool left;
 
-        return true;
-    }   
-    else    
+    if (del->left && del->right)
     {
-        new_node = (*node);
-        ASSERT (new_node->data != NULL);
+        /* Both children: DEL's successor takes its place.  The successor
+         * has no left child, so taking it out is easy. */
+        struct avl_node* succ = del->right;
+        while (succ->left)
+            succ = succ->left;
 
-        int compare_result = func (data, (*node)->data, NULL);
-            
-        if (compare_result < 0) 
+        if (succ->parent == del)
         {
-            if (!insert_helper (&(*node)->left, *node, data, taller, func))
-            {
-                return false;
-            }
-            if (taller)
-            {
-                adjust_balance (new_node, -1);
-                switch ((*node)->balance)
-                {
-                case 0:
-                    *taller = false;
-                    break;
-                case -1:
-                    *taller = true;
-                    break;
-                case -2:
-                    balance_left (&new_node);
-                    *taller = false;
-                    break;
-                }
-            }
-        }   
-        else if (compare_result < 0) 
+            parent = succ;
+            left = false;
+        }
+        else
         {
-            if (!insert_helper (&(*node)->right, *node, data, taller, func))
-            {
-                return false;
-            }
-            if (taller)
-            {
-                adjust_balance (new_node, 1);
-                switch ((*node)->balance)
-                {
-                case 0:
-                    *taller = false;
-                    break;
-                case 1:
-                    *taller = true;
-                    break;
-                case 2:
-                    balance_right (&new_node);
-                    *taller = false;
-                    break;
-                }
-            }
+            parent = succ->parent;
+            left = true;
+            parent->left = succ->right;
+            if (succ->right)    succ->right->parent = parent;
+            succ->right = del->right;
+            del->right->parent = succ;
         }
+        succ->left = del->left;
+        del->left->parent = succ;
+        succ->balance = del->balance;
+        replace_child (tree, del->parent, del, succ);
+    }
+    else
+    {
+        /* At most one child, which moves up */
+        struct avl_node* child = del->left ? del->left : del->right;
+        parent = del->parent;
+        left = parent && parent->left == del;
+        replace_child (tree, parent, del, child);
+    }
+
+    /* Walk back up while subtrees keep getting shorter.  Unlike insert, a
+     * rotation may leave its subtree shorter too, so we may rotate all the
+     * way to the root. */
+    while (parent)
+    {
+        parent->balance += left ? 1 : -1;
+        if (parent->balance == 1 || parent->balance == -1)
+            break;
+        if (parent->balance == 2 || parent->balance == -2)
+        {
+            struct avl_node* sibling = 
+                parent->balance == 2 ? parent->right : parent->left;
+            bool shorter = sibling->balance != 0;
+            parent = rebalance (tree, parent);
+            if (!shorter)
+                break;
+        }
+
+        struct avl_node* up = parent->parent;
+        if (up)
+            left = up->left == parent;
+        parent = up;
     }
-    return true;
 };
 
-struct avl_node*
+/* Checks the subtree at NODE and returns its height, or -1 if something is
+ * wrong with it: out of order, a stale balance factor or parent pointer, or
+ * out of balance.  Adds the number of nodes to COUNT. */
+static int
+check_helper (struct avl_node* node, struct avl_node* parent, 
+        avl_tree_compare_func* func, size_t* count)
+{
+    if (node == NULL)
+        return 0;
+    if (node->parent != parent || node->data == NULL)
+        return -1;
+    if (node->left && func (node->left->data, node->data, NULL) >= 0)
+        return -1;
+    if (node->right && func (node->right->data, node->data, NULL) <= 0)
+        return -1;
+
+    int lh = check_helper (node->left, node, func, count);
+    int rh = check_helper (node->right, node, func, count);
+    if (lh < 0 || rh < 0 || rh - lh != node->balance || 
+            node->balance < -1 || node->balance > 1)
+        return -1;
+
+    /* Children only bound their parent; the whole subtree must too */
+    if (node->left)
+    {
+        struct avl_node* max = node->left;
+        while (max->right)
+            max = max->right;
+        if (func (max->data, node->data, NULL) >= 0)
+            return -1;
+    }
+    if (node->right)
+    {
+        struct avl_node* min = node->right;
+        while (min->left)
+            min = min->left;
+        if (func (min->data, node->data, NULL) <= 0)
+            return -1;
+    }
+
+    (*count)++;
+    return (lh > rh ? lh : rh) + 1;
+};
+
+static struct avl_node*
 find_helper (struct avl_node* node, const void* elem, 
         avl_tree_compare_func* func)
 {
     ASSERT (elem != NULL);
 
-    if (node == NULL)   return NULL;
-
-    ASSERT (node->data != NULL);
-    int cmp = func (elem, node->data, NULL);
-
-    if (cmp > 0)
-    {
-        return find_helper (node->right, elem, func);
-    }
-    else if (cmp < 0) 
+    while (node)
     {
-        return find_helper (node->left, elem, func);
+        ASSERT (node->data != NULL);
+        int cmp = func (elem, node->data, NULL);
+
+        if (cmp > 0)        node = node->right;
+        else if (cmp < 0)   node = node->left;
+        else                return node;
     }
-    else
+    return NULL;
+};
+
+/* Returns the first node at or after ELEM, or the first node if ELEM is
+ * NULL */
+static struct avl_node*
+lower_bound (struct avl_node* node, const void* elem, 
+        avl_tree_compare_func* func)
+{
+    struct avl_node* best = NULL;
+    while (node)
     {
-        return node;
+        if (elem == NULL || func (node->data, elem, NULL) >= 0)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+            node = node->right;
     }
+    return best;
 };
 
-void 
+static void 
 dump_helper (struct avl_node* node, unsigned level, 
         avl_tree_dump_func* func)
 {
@@ -470,9 +647,3 @@ dump_helper (struct avl_node* node, unsigned level,
         dump_helper (node->right, level + 1, func);
     }
 };
-
-void
-dump_node (struct avl_node* node, unsigned level)
-{
-    
-};
@@ -0,0 +1,766 @@
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    "debug.h"
+#include    "bptree.h"
+
+/* Fewest elements in a leaf and keys in an inner node, the root aside */
+#define LEAF_MIN    (BPT_LEAF_SLOTS / 2)
+#define INNER_MIN   ((BPT_FANOUT - 1) / 2)
+
+static struct bpt_leaf* descend (struct bpt_tree* tree, const void* elem,
+        struct bpt_inner** path, int* idx);
+static int child_index (struct bpt_tree* tree, struct bpt_inner* in,
+        const void* elem);
+static int leaf_lower (struct bpt_tree* tree, struct bpt_leaf* leaf,
+        const void* elem);
+static bool leaf_has (struct bpt_tree* tree, struct bpt_leaf* leaf, int pos,
+        const void* elem);
+static void split_leaf (struct bpt_tree* tree, struct bpt_leaf* leaf,
+        struct bpt_leaf* right, int pos, void* data);
+static void* split_inner (struct bpt_inner* in, struct bpt_inner* sib,
+        int i, void* key, struct bpt_node* child);
+static void fix_underflow (struct bpt_tree* tree, struct bpt_inner* parent,
+        int i);
+static void merge (struct bpt_tree* tree, struct bpt_inner* parent, int j);
+static int min_count (const struct bpt_node* node);
+static void insert_at (void** a, int n, int pos, void* v);
+static void remove_at (void** a, int n, int pos);
+static bool check_helper (struct bpt_tree* tree, struct bpt_node* node,
+        unsigned depth, void** min, void** max, size_t* count,
+        struct bpt_leaf** next_leaf);
+
+void
+bpt_init (struct bpt_tree* tree, bpt_tree_compare_func* func)
+{
+    if (!tree || !func)   return;
+    ASSERT (sizeof (struct bpt_inner) <= BPT_NODE_BYTES);
+    ASSERT (sizeof (struct bpt_leaf) <= BPT_NODE_BYTES);
+
+    memset (tree, 0, sizeof *tree);
+    tree->comparator = func;
+    pool_init (&tree->pool, BPT_NODE_BYTES);
+};
+
+void
+bpt_destroy (struct bpt_tree* tree)
+{
+    if (!tree)  return;
+
+    tree->root = NULL;
+    tree->first = tree->last = NULL;
+    tree->height = 0;
+    tree->count = 0;
+    pool_destroy (&tree->pool);
+};
+
+bool
+bpt_insert (struct bpt_tree* tree, void* data)
+{
+    if (!tree || !data)  return false;
+
+    struct bpt_inner* path[BPT_MAX_HEIGHT];
+    int idx[BPT_MAX_HEIGHT];
+    struct bpt_node* spare[BPT_MAX_HEIGHT + 1];
+    int nspare, d;
+
+    if (tree->root == NULL)
+    {
+        struct bpt_leaf* leaf = pool_alloc (&tree->pool);
+        if (leaf == NULL)
+            return false;
+        leaf->hdr.leaf = true;
+        leaf->hdr.count = 1;
+        leaf->prev = leaf->next = NULL;
+        leaf->data[0] = data;
+        tree->root = &leaf->hdr;
+        tree->first = tree->last = leaf;
+        tree->height = 1;
+        tree->count = 1;
+        return true;
+    }
+
+    ASSERT (tree->height < BPT_MAX_HEIGHT);
+    int depth = tree->height - 1;
+    struct bpt_leaf* leaf = descend (tree, data, path, idx);
+    int pos = leaf_lower (tree, leaf, data);
+    if (leaf_has (tree, leaf, pos, data))
+        return false;
+
+    /* Take every node the splits will need up front, so running out of
+     * memory can't leave the tree half split */
+    int needed = 0;
+    if (leaf->hdr.count == BPT_LEAF_SLOTS)
+    {
+        needed = 1;
+        for (d = depth - 1; d >= 0 && path[d]->hdr.count == BPT_FANOUT - 1;
+                d--)
+            needed++;
+        if (d < 0)
+            needed++;       // a new root
+    }
+    for (nspare = 0; nspare < needed; nspare++)
+    {
+        spare[nspare] = pool_alloc (&tree->pool);
+        if (spare[nspare] == NULL)
+        {
+            while (nspare > 0)
+                pool_free (&tree->pool, spare[--nspare]);
+            return false;
+        }
+    }
+
+    tree->count++;
+    if (leaf->hdr.count < BPT_LEAF_SLOTS)
+    {
+        insert_at (leaf->data, leaf->hdr.count, pos, data);
+        leaf->hdr.count++;
+        return true;
+    }
+
+    struct bpt_leaf* right = (struct bpt_leaf*) spare[--nspare];
+    split_leaf (tree, leaf, right, pos, data);
+    void* key = right->data[0];
+    struct bpt_node* child = &right->hdr;
+
+    /* Hand the new node up until someone has room for it */
+    for (d = depth - 1; d >= 0; d--)
+    {
+        struct bpt_inner* in = path[d];
+        int i = idx[d];
+        if (in->hdr.count < BPT_FANOUT - 1)
+        {
+            insert_at (in->keys, in->hdr.count, i, key);
+            insert_at ((void**) in->child, in->hdr.count + 1, i + 1, child);
+            in->hdr.count++;
+            return true;
+        }
+        struct bpt_inner* sib = (struct bpt_inner*) spare[--nspare];
+        key = split_inner (in, sib, i, key, child);
+        child = &sib->hdr;
+    }
+
+    /* The root split */
+    struct bpt_inner* root = (struct bpt_inner*) spare[--nspare];
+    ASSERT (nspare == 0);
+    root->hdr.leaf = false;
+    root->hdr.count = 1;
+    root->keys[0] = key;
+    root->child[0] = tree->root;
+    root->child[1] = child;
+    tree->root = &root->hdr;
+    tree->height++;
+    return true;
+};
+
+void*
+bpt_delete (struct bpt_tree* tree, const void* data)
+{
+    if (!tree || !data || !tree->root)  return NULL;
+
+    struct bpt_inner* path[BPT_MAX_HEIGHT];
+    int idx[BPT_MAX_HEIGHT];
+    int depth = tree->height - 1;
+    int d;
+
+    struct bpt_leaf* leaf = descend (tree, data, path, idx);
+    int pos = leaf_lower (tree, leaf, data);
+    if (!leaf_has (tree, leaf, pos, data))
+        return NULL;
+
+    void* result = leaf->data[pos];
+    remove_at (leaf->data, leaf->hdr.count, pos);
+    leaf->hdr.count--;
+    tree->count--;
+
+    /* RESULT may be the key before this leaf in an ancestor.  Keys must
+     * point at elements in the tree, so use the leaf's new first one. */
+    if (pos == 0 && leaf->hdr.count > 0)
+        for (d = 0; d < depth; d++)
+            if (idx[d] > 0 && path[d]->keys[idx[d] - 1] == result)
+                path[d]->keys[idx[d] - 1] = leaf->data[0];
+
+    struct bpt_node* node = &leaf->hdr;
+    for (d = depth - 1; d >= 0 && node->count < min_count (node); d--)
+    {
+        fix_underflow (tree, path[d], idx[d]);
+        node = &path[d]->hdr;
+    }
+
+    /* The root gives up its last key or element */
+    struct bpt_node* root = tree->root;
+    if (!root->leaf && root->count == 0)
+    {
+        tree->root = ((struct bpt_inner*) root)->child[0];
+        tree->height--;
+        pool_free (&tree->pool, root);
+    }
+    else if (root->leaf && root->count == 0)
+    {
+        tree->root = NULL;
+        tree->first = tree->last = NULL;
+        tree->height = 0;
+        pool_free (&tree->pool, root);
+    }
+    return result;
+};
+
+void*
+bpt_find (struct bpt_tree* tree, const void* elem)
+{
+    if (!tree || !elem || !tree->root)  return NULL;
+
+    struct bpt_leaf* leaf = descend (tree, elem, NULL, NULL);
+    int pos = leaf_lower (tree, leaf, elem);
+    return leaf_has (tree, leaf, pos, elem) ? leaf->data[pos] : NULL;
+};
+
+bool
+bpt_load (struct bpt_tree* tree, void** sorted, size_t n)
+{
+    if (!tree || tree->root != NULL)    return false;
+    ASSERT (sorted != NULL || n == 0);
+
+    size_t i, j;
+    for (i = 1; i < n; i++)
+        if (tree->comparator (sorted[i - 1], sorted[i], NULL) >= 0)
+            return false;
+    if (n == 0)
+        return true;
+
+    /* Build the leaves, then each level of inner nodes over the one below,
+     * spreading the entries evenly so no node is under its minimum */
+    size_t m = (n + BPT_LEAF_SLOTS - 1) / BPT_LEAF_SLOTS;
+    struct bpt_node** level = malloc (m * sizeof *level);
+    void** mins = malloc (m * sizeof *mins);
+    if (level == NULL || mins == NULL)
+        goto fail;
+
+    struct bpt_leaf* prev = NULL;
+    size_t at = 0;
+    for (i = 0; i < m; i++)
+    {
+        struct bpt_leaf* leaf = pool_alloc (&tree->pool);
+        if (leaf == NULL)
+            goto fail;
+        size_t take = n / m + (i < n % m);
+        leaf->hdr.leaf = true;
+        leaf->hdr.count = take;
+        memcpy (leaf->data, sorted + at, take * sizeof (void*));
+        leaf->prev = prev;
+        leaf->next = NULL;
+        if (prev)
+            prev->next = leaf;
+        else
+            tree->first = leaf;
+        prev = leaf;
+        level[i] = &leaf->hdr;
+        mins[i] = sorted[at];
+        at += take;
+    }
+    tree->last = prev;
+
+    unsigned height = 1;
+    while (m > 1)
+    {
+        size_t groups = (m + BPT_FANOUT - 1) / BPT_FANOUT;
+        size_t g, k = 0;
+        for (g = 0; g < groups; g++)
+        {
+            size_t take = m / groups + (g < m % groups);
+            struct bpt_inner* in = pool_alloc (&tree->pool);
+            if (in == NULL)
+                goto fail;
+            in->hdr.leaf = false;
+            in->hdr.count = take - 1;
+            for (j = 0; j < take; j++)
+            {
+                in->child[j] = level[k + j];
+                if (j > 0)
+                    in->keys[j - 1] = mins[k + j];
+            }
+            /* G never passes K, so this only overwrites entries already
+             * used */
+            mins[g] = mins[k];
+            level[g] = &in->hdr;
+            k += take;
+        }
+        m = groups;
+        height++;
+    }
+
+    tree->root = level[0];
+    tree->height = height;
+    tree->count = n;
+    free (level);
+    free (mins);
+    return true;
+
+fail:
+    /* The tree was empty, so every node in the pool is one of ours */
+    free (level);
+    free (mins);
+    pool_destroy (&tree->pool);
+    tree->first = tree->last = NULL;
+    return false;
+};
+
+bool
+bpt_check (struct bpt_tree* tree, size_t* count)
+{
+    ASSERT (tree != NULL);
+
+    size_t n = 0;
+    bool ok;
+    if (tree->root == NULL)
+        ok = tree->height == 0 && tree->first == NULL && tree->last == NULL;
+    else
+    {
+        void* min;
+        void* max;
+        struct bpt_leaf* next_leaf = tree->first;
+        ok = tree->first != NULL && tree->first->prev == NULL
+            && check_helper (tree, tree->root, 0, &min, &max, &n, &next_leaf)
+            && next_leaf == NULL;
+    }
+    ok = ok && n == tree->count;
+
+    if (count)
+        *count = n;
+    return ok;
+};
+
+
+/*******
+  Iterator Functions
+  *********/
+bool
+bpt_iter_first (struct bpt_tree* tree, struct bpt_iterator* it)
+{
+    ASSERT (it != NULL);
+
+    it->tree = tree;
+    it->leaf = tree ? tree->first : NULL;
+    it->pos = 0;
+    return it->leaf != NULL;
+};
+
+bool
+bpt_iter_last (struct bpt_tree* tree, struct bpt_iterator* it)
+{
+    ASSERT (it != NULL);
+
+    it->tree = tree;
+    it->leaf = tree ? tree->last : NULL;
+    it->pos = it->leaf ? it->leaf->hdr.count - 1 : 0;
+    return it->leaf != NULL;
+};
+
+bool
+bpt_iter_seek (struct bpt_tree* tree, struct bpt_iterator* it,
+        const void* elem)
+{
+    ASSERT (it != NULL);
+
+    if (!tree || !tree->root || !elem)
+        return bpt_iter_first (tree, it);
+
+    it->tree = tree;
+    it->leaf = descend (tree, elem, NULL, NULL);
+    it->pos = leaf_lower (tree, it->leaf, elem);
+    if (it->pos == it->leaf->hdr.count)
+    {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != NULL;
+};
+
+void*
+bpt_get (struct bpt_iterator* it)
+{
+    if (it == NULL || it->leaf == NULL) return NULL;
+    return it->leaf->data[it->pos];
+};
+
+void*
+bpt_next (struct bpt_iterator* it)
+{
+    if (it == NULL || it->leaf == NULL) return NULL;
+    if (++it->pos == it->leaf->hdr.count)
+    {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+        if (it->leaf == NULL)
+            return NULL;
+    }
+    return it->leaf->data[it->pos];
+};
+
+void*
+bpt_prev (struct bpt_iterator* it)
+{
+    if (it == NULL || it->leaf == NULL) return NULL;
+    if (--it->pos < 0)
+    {
+        it->leaf = it->leaf->prev;
+        if (it->leaf == NULL)
+            return NULL;
+        it->pos = it->leaf->hdr.count - 1;
+    }
+    return it->leaf->data[it->pos];
+};
+
+size_t
+bpt_walk (struct bpt_tree* tree, bpt_visit_func* func, void* aux)
+{
+    ASSERT (func != NULL);
+
+    struct bpt_leaf* leaf;
+    size_t n = 0;
+    int i;
+    for (leaf = tree ? tree->first : NULL; leaf != NULL; leaf = leaf->next)
+        for (i = 0; i < leaf->hdr.count; i++)
+        {
+            n++;
+            if (!func (leaf->data[i], aux))
+                return n;
+        }
+    return n;
+};
+
+size_t
+bpt_range (struct bpt_tree* tree, const void* lo, const void* hi,
+        void** out, size_t max)
+{
+    ASSERT (tree != NULL);
+    ASSERT (out != NULL || max == 0);
+
+    struct bpt_iterator it;
+    size_t n = 0;
+    if (!bpt_iter_seek (tree, &it, lo))
+        return 0;
+
+    struct bpt_leaf* leaf;
+    int i = it.pos;
+    for (leaf = it.leaf; leaf != NULL; leaf = leaf->next, i = 0)
+    {
+        int count = leaf->hdr.count;
+
+        /* Only the leaf holding HI needs comparing element by element */
+        bool last = hi && tree->comparator (leaf->data[count - 1], hi, NULL) > 0;
+        for (; i < count; i++)
+        {
+            if (last && tree->comparator (leaf->data[i], hi, NULL) > 0)
+                return n;
+            if (n < max)
+                out[n] = leaf->data[i];
+            n++;
+        }
+    }
+    return n;
+};
+
+
+
+/* ===  HELPER FUNCTIONS === */
+
+/* Walks down to the leaf where ELEM is or would be, recording each inner
+ * node in PATH and the child taken from it in IDX if they are not NULL */
+static struct bpt_leaf*
+descend (struct bpt_tree* tree, const void* elem, struct bpt_inner** path,
+        int* idx)
+{
+    struct bpt_node* node = tree->root;
+    int d = 0;
+    while (!node->leaf)
+    {
+        struct bpt_inner* in = (struct bpt_inner*) node;
+        int i = child_index (tree, in, elem);
+        if (path)
+        {
+            path[d] = in;
+            idx[d] = i;
+        }
+        d++;
+        node = in->child[i];
+    }
+    return (struct bpt_leaf*) node;
+};
+
+/* The child to follow for ELEM: the number of keys not greater than it,
+ * since each key is the smallest element under the child after it */
+static int
+child_index (struct bpt_tree* tree, struct bpt_inner* in, const void* elem)
+{
+    int lo = 0, hi = in->hdr.count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (tree->comparator (in->keys[mid], elem, NULL) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+};
+
+/* The position of the first element in LEAF not less than ELEM */
+static int
+leaf_lower (struct bpt_tree* tree, struct bpt_leaf* leaf, const void* elem)
+{
+    int lo = 0, hi = leaf->hdr.count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (tree->comparator (leaf->data[mid], elem, NULL) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+};
+
+static bool
+leaf_has (struct bpt_tree* tree, struct bpt_leaf* leaf, int pos,
+        const void* elem)
+{
+    return pos < leaf->hdr.count
+        && tree->comparator (leaf->data[pos], elem, NULL) == 0;
+};
+
+/* Splits the full LEAF in two with DATA inserted at POS, moving the upper
+ * half into the new leaf RIGHT */
+static void
+split_leaf (struct bpt_tree* tree, struct bpt_leaf* leaf,
+        struct bpt_leaf* right, int pos, void* data)
+{
+    void* all[BPT_LEAF_SLOTS + 1];
+    int total = BPT_LEAF_SLOTS + 1;
+    int left = total / 2;
+
+    memcpy (all, leaf->data, pos * sizeof (void*));
+    all[pos] = data;
+    memcpy (all + pos + 1, leaf->data + pos,
+            (BPT_LEAF_SLOTS - pos) * sizeof (void*));
+
+    memcpy (leaf->data, all, left * sizeof (void*));
+    leaf->hdr.count = left;
+    memcpy (right->data, all + left, (total - left) * sizeof (void*));
+    right->hdr.count = total - left;
+    right->hdr.leaf = true;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+        leaf->next->prev = right;
+    else
+        tree->last = right;
+    leaf->next = right;
+};
+
+/* Splits the full inner node IN in two with KEY and CHILD inserted after
+ * child I, moving the upper half into SIB.  Returns the middle key, which
+ * goes up to the parent. */
+static void*
+split_inner (struct bpt_inner* in, struct bpt_inner* sib, int i, void* key,
+        struct bpt_node* child)
+{
+    void* keys[BPT_FANOUT];
+    struct bpt_node* kids[BPT_FANOUT + 1];
+    int n = in->hdr.count;
+    int left = BPT_FANOUT / 2;
+
+    memcpy (keys, in->keys, i * sizeof (void*));
+    keys[i] = key;
+    memcpy (keys + i + 1, in->keys + i, (n - i) * sizeof (void*));
+    memcpy (kids, in->child, (i + 1) * sizeof (void*));
+    kids[i + 1] = child;
+    memcpy (kids + i + 2, in->child + i + 1, (n - i) * sizeof (void*));
+
+    memcpy (in->keys, keys, left * sizeof (void*));
+    memcpy (in->child, kids, (left + 1) * sizeof (void*));
+    in->hdr.count = left;
+
+    memcpy (sib->keys, keys + left + 1, (n - left) * sizeof (void*));
+    memcpy (sib->child, kids + left + 1, (n - left + 1) * sizeof (void*));
+    sib->hdr.count = n - left;
+    sib->hdr.leaf = false;
+
+    return keys[left];
+};
+
+/* Child I of PARENT is one short of its minimum.  Borrow from a sibling
+ * that can spare one, or else merge with a sibling. */
+static void
+fix_underflow (struct bpt_tree* tree, struct bpt_inner* parent, int i)
+{
+    struct bpt_node* node = parent->child[i];
+    struct bpt_node* left = i > 0 ? parent->child[i - 1] : NULL;
+    struct bpt_node* right = i < parent->hdr.count ? parent->child[i + 1] : NULL;
+
+    if (left && left->count > min_count (left))
+    {
+        if (node->leaf)
+        {
+            struct bpt_leaf* l = (struct bpt_leaf*) left;
+            struct bpt_leaf* n = (struct bpt_leaf*) node;
+            insert_at (n->data, n->hdr.count, 0, l->data[l->hdr.count - 1]);
+            n->hdr.count++;
+            l->hdr.count--;
+            parent->keys[i - 1] = n->data[0];
+        }
+        else
+        {
+            struct bpt_inner* l = (struct bpt_inner*) left;
+            struct bpt_inner* n = (struct bpt_inner*) node;
+            insert_at (n->keys, n->hdr.count, 0, parent->keys[i - 1]);
+            insert_at ((void**) n->child, n->hdr.count + 1, 0,
+                    l->child[l->hdr.count]);
+            n->hdr.count++;
+            parent->keys[i - 1] = l->keys[l->hdr.count - 1];
+            l->hdr.count--;
+        }
+    }
+    else if (right && right->count > min_count (right))
+    {
+        if (node->leaf)
+        {
+            struct bpt_leaf* r = (struct bpt_leaf*) right;
+            struct bpt_leaf* n = (struct bpt_leaf*) node;
+            n->data[n->hdr.count++] = r->data[0];
+            remove_at (r->data, r->hdr.count, 0);
+            r->hdr.count--;
+            parent->keys[i] = r->data[0];
+        }
+        else
+        {
+            struct bpt_inner* r = (struct bpt_inner*) right;
+            struct bpt_inner* n = (struct bpt_inner*) node;
+            n->keys[n->hdr.count] = parent->keys[i];
+            n->child[n->hdr.count + 1] = r->child[0];
+            n->hdr.count++;
+            parent->keys[i] = r->keys[0];
+            remove_at (r->keys, r->hdr.count, 0);
+            remove_at ((void**) r->child, r->hdr.count + 1, 0);
+            r->hdr.count--;
+        }
+    }
+    else if (left)
+        merge (tree, parent, i - 1);
+    else
+        merge (tree, parent, i);
+};
+
+/* Moves everything in child J + 1 of PARENT into child J and frees it */
+static void
+merge (struct bpt_tree* tree, struct bpt_inner* parent, int j)
+{
+    struct bpt_node* left = parent->child[j];
+    struct bpt_node* right = parent->child[j + 1];
+
+    if (left->leaf)
+    {
+        struct bpt_leaf* l = (struct bpt_leaf*) left;
+        struct bpt_leaf* r = (struct bpt_leaf*) right;
+        ASSERT (l->hdr.count + r->hdr.count <= BPT_LEAF_SLOTS);
+        memcpy (l->data + l->hdr.count, r->data,
+                r->hdr.count * sizeof (void*));
+        l->hdr.count += r->hdr.count;
+        l->next = r->next;
+        if (r->next)
+            r->next->prev = l;
+        else
+            tree->last = l;
+    }
+    else
+    {
+        struct bpt_inner* l = (struct bpt_inner*) left;
+        struct bpt_inner* r = (struct bpt_inner*) right;
+        ASSERT (l->hdr.count + r->hdr.count + 1 <= BPT_FANOUT - 1);
+        l->keys[l->hdr.count] = parent->keys[j];
+        memcpy (l->keys + l->hdr.count + 1, r->keys,
+                r->hdr.count * sizeof (void*));
+        memcpy (l->child + l->hdr.count + 1, r->child,
+                (r->hdr.count + 1) * sizeof (void*));
+        l->hdr.count += r->hdr.count + 1;
+    }
+
+    remove_at (parent->keys, parent->hdr.count, j);
+    remove_at ((void**) parent->child, parent->hdr.count + 1, j + 1);
+    parent->hdr.count--;
+    pool_free (&tree->pool, right);
+};
+
+static int
+min_count (const struct bpt_node* node)
+{
+    return node->leaf ? LEAF_MIN : INNER_MIN;
+};
+
+/* Inserts V at POS in the N entries of A */
+static void
+insert_at (void** a, int n, int pos, void* v)
+{
+    memmove (a + pos + 1, a + pos, (n - pos) * sizeof (void*));
+    a[pos] = v;
+};
+
+/* Removes the entry at POS from the N entries of A */
+static void
+remove_at (void** a, int n, int pos)
+{
+    memmove (a + pos, a + pos + 1, (n - pos - 1) * sizeof (void*));
+};
+
+/* Checks the subtree under NODE, at DEPTH below the root, and stores its
+ * smallest and largest elements in MIN and MAX.  NEXT_LEAF is the leaf the
+ * list says comes next. */
+static bool
+check_helper (struct bpt_tree* tree, struct bpt_node* node, unsigned depth,
+        void** min, void** max, size_t* count, struct bpt_leaf** next_leaf)
+{
+    bool root = node == tree->root;
+    int i;
+
+    if (node->leaf)
+    {
+        struct bpt_leaf* leaf = (struct bpt_leaf*) node;
+        if (depth != tree->height - 1 || leaf != *next_leaf)
+            return false;
+        if (leaf->hdr.count < (root ? 1 : LEAF_MIN)
+                || leaf->hdr.count > BPT_LEAF_SLOTS)
+            return false;
+        for (i = 1; i < leaf->hdr.count; i++)
+            if (tree->comparator (leaf->data[i - 1], leaf->data[i], NULL) >= 0)
+                return false;
+        if (leaf->next ? leaf->next->prev != leaf : tree->last != leaf)
+            return false;
+
+        *next_leaf = leaf->next;
+        *min = leaf->data[0];
+        *max = leaf->data[leaf->hdr.count - 1];
+        *count += leaf->hdr.count;
+        return true;
+    }
+
+    struct bpt_inner* in = (struct bpt_inner*) node;
+    if (in->hdr.count < (root ? 1 : INNER_MIN)
+            || in->hdr.count > BPT_FANOUT - 1)
+        return false;
+    for (i = 0; i <= in->hdr.count; i++)
+    {
+        void* cmin;
+        void* cmax;
+        if (!check_helper (tree, in->child[i], depth + 1, &cmin, &cmax, count,
+                    next_leaf))
+            return false;
+        if (i == 0)
+            *min = cmin;
+        else if (in->keys[i - 1] != cmin
+                || tree->comparator (*max, cmin, NULL) >= 0)
+            return false;
+        *max = cmax;
+    }
+    return true;
+};
@@ -3,11 +3,16 @@
 #include    <stdlib.h>
 #include    "debug.h"
 #include    "bst.h"
+#include    "pool.h"
 
 /* helper functions for tree operations */
-bool insert_helper (struct bst_node** node, struct bst_node* parent, void* data, 
-        bst_tree_compare_func* func);
+static bool link_node (struct bst_tree* tree, struct bst_node* node);
+static void unlink_node (struct bst_tree* tree, struct bst_node* del);
+static void replace_child (struct bst_tree* tree, struct bst_node* parent,
+        struct bst_node* old, struct bst_node* new);
 struct bst_node* find_helper (struct bst_node*, const void*, bst_tree_compare_func*);
+static struct bst_node* lower_bound (struct bst_node* node, const void* elem,
+        bst_tree_compare_func* func);
 void dump_helper (struct bst_node* node, unsigned, bst_tree_dump_func*);
 void dump_node (struct bst_node* node, unsigned level);
 
@@ -18,13 +23,43 @@ bst_init (struct bst_tree* tree, bst_tree_compare_func* func)
     
     tree->root = NULL;
     tree->comparator = func;
+    tree->intrusive = false;
+    pool_init (&tree->pool, sizeof (struct bst_node));
+};
+
+void 
+bst_init_intrusive (struct bst_tree* tree, bst_tree_compare_func* func)
+{
+    bst_init (tree, func);
+    if (tree && func)
+        tree->intrusive = true;
+};
+
+void
+bst_destroy (struct bst_tree* tree)
+{
+    if (!tree)  return;
+
+    tree->root = NULL;
+    pool_destroy (&tree->pool);
 };
 
 bool 
 bst_insert (struct bst_tree* tree, void* data)
 {
-    if (!data)  return false;
-    return insert_helper (&(tree->root), NULL, data, tree->comparator);
+    if (!tree || !data)  return false;
+    ASSERT (!tree->intrusive);
+
+    struct bst_node* node = pool_alloc (&tree->pool);
+    if (node == NULL)   return false;
+    node->data = data;
+
+    if (!link_node (tree, node))
+    {
+        pool_free (&tree->pool, node);
+        return false;
+    }
+    return true;
 };
 
 void* 
@@ -32,59 +67,44 @@ bst_delete (struct bst_tree* tree, void* data)
 {
     if (!data || !tree)
         return NULL;
+    ASSERT (!tree->intrusive);
 
-    struct bst_node* del = bst_find (tree, data);
+    struct bst_node* del = find_helper (tree->root, data, tree->comparator);
+    if (del == NULL)
+        return NULL;
 
-    /* Case 1: Node is a leaf */
-    if (del->left == NULL && del->right == NULL)
-    {
-        if (!del->parent)   tree->root = NULL;
-        else if (del->parent->right == del) del->parent->right = NULL;
-        else                                del->parent->left = NULL;
-    }
+    void* ret = del->data;
+    unlink_node (tree, del);
+    pool_free (&tree->pool, del);
+    return ret;
+};
 
-    /* Case 2: Node has one child */
-    else if (del->left)
-    {
-        if (del->parent == NULL)    tree->root = del->left;
-        else if (del->parent->right == del) del->parent->right = del->left;
-        else                                del->parent->left = del->left;
-    }
-    else if (del->right)
-    {
-        if (del->parent == NULL)    tree->root = del->right;
-        else if (del->parent->right == del) del->parent->right = del->right;
-        else                                del->parent->left = del->left;
-    }
+bool
+bst_insert_node (struct bst_tree* tree, struct bst_node* node, void* data)
+{
+    if (!tree || !node || !data)    return false;
+    ASSERT (tree->intrusive);
 
-    /* Case 3: Node has both children */
-    else
-    {
-        ASSERT (del->left);
-        ASSERT (del->right);
-
-        struct bst_node* right = del->right;
-        /* Find the leftmost child */
-        struct bst_node* n = right;
-        while (n->left)
-            n = n->left;
-        ASSERT (n->left == NULL);
-        if (n->right)
-        {
-            n->parent->left = n->right;
-            n->right->parent = n->parent;
-        }
-        n->right = del->right;
-        n->left = del->left;
-        n->parent = del->parent;
-        if (del->parent == NULL)    tree->root = n;
-        else if (del->parent->right == del) del->parent->right = n;
-        else                                del->parent->left = n;
-    }
+    node->data = data;
+    return link_node (tree, node);
+};
 
-    void* ret = del->data;
-    free (del);
-    return ret;
+void
+bst_remove_node (struct bst_tree* tree, struct bst_node* node)
+{
+    if (!tree || !node) return;
+    ASSERT (tree->intrusive);
+
+    unlink_node (tree, node);
+};
+
+struct bst_node*
+bst_find_node (struct bst_tree* tree, const void* elem)
+{
+    ASSERT (tree != NULL);
+
+    if (elem == NULL)   return NULL;
+    return find_helper (tree->root, elem, tree->comparator);
 };
 
 void*
@@ -110,55 +130,93 @@ bst_dump (struct bst_tree* tree, bst_tree_dump_func* func)
 /*******
   Iterator Functions
   *********/
-struct bst_iterator* 
-bst_get_iterator (struct bst_tree* tree)
+bool
+bst_iter_first (struct bst_tree* tree, struct bst_iterator* it)
 {
-    if (tree == NULL || tree->root == NULL) return NULL;
-    struct bst_iterator* it = malloc (sizeof (struct bst_iterator));
-    if (it == NULL)
-        return NULL;
-    it->node = tree->root;
+    ASSERT (it != NULL);
+
     it->tree = tree;
+    it->node = tree ? tree->root : NULL;
+    if (it->node == NULL)
+        return false;
     /* Go to the smallest element in the tree... The left-most. */
     while (it->node->left)
         it->node = it->node->left;
-    return it;
+    return true;
 };
 
-struct bst_iterator* 
-bst_get_reverse_iterator (struct bst_tree* tree)
+bool
+bst_iter_last (struct bst_tree* tree, struct bst_iterator* it)
 {
-    if (tree == NULL)   return NULL;
-    struct bst_iterator* it = malloc (sizeof (struct bst_iterator));
-    if (it == NULL) return NULL;
-    it->node = tree->root;
+    ASSERT (it != NULL);
+
     it->tree = tree;
+    it->node = tree ? tree->root : NULL;
+    if (it->node == NULL)
+        return false;
     /* Go to the largest element in the tree... The right-most. */
     while (it->node->right)
         it->node = it->node->right;
-    return it;
+    return true;
+};
+
+bool
+bst_iter_seek (struct bst_tree* tree, struct bst_iterator* it, 
+        const void* elem)
+{
+    ASSERT (it != NULL);
+
+    it->tree = tree;
+    it->node = tree ? lower_bound (tree->root, elem, tree->comparator) : NULL;
+    return it->node != NULL;
+};
+
+struct bst_iterator* 
+bst_get_iterator (struct bst_tree* tree)
+{
+    struct bst_iterator it;
+    if (!bst_iter_first (tree, &it))    return NULL;
+    struct bst_iterator* copy = malloc (sizeof (struct bst_iterator));
+    if (copy)
+        *copy = it;
+    return copy;
+};
+
+struct bst_iterator* 
+bst_get_reverse_iterator (struct bst_tree* tree)
+{
+    struct bst_iterator it;
+    if (!bst_iter_last (tree, &it))     return NULL;
+    struct bst_iterator* copy = malloc (sizeof (struct bst_iterator));
+    if (copy)
+        *copy = it;
+    return copy;
 };
 
 void* 
 bst_get (struct bst_iterator* it)
 {
-    if (it == NULL) return NULL;
+    if (it == NULL || it->node == NULL) return NULL;
     return it->node->data;
 };
 
 void 
 bst_itr_remove (struct bst_iterator* it)
 {
-    if (it == NULL) return;
+    if (it == NULL || it->node == NULL) return;
     struct bst_node* node = it->node;
+
+    /* Nodes are never moved, only relinked, so the next node stays valid */
     bst_next (it);
-    bst_delete (it->tree, node->data);
+    unlink_node (it->tree, node);
+    if (!it->tree->intrusive)
+        pool_free (&it->tree->pool, node);
 };
 
 void* 
 bst_next (struct bst_iterator* it)
 {
-    if (it == NULL) return NULL;
+    if (it == NULL || it->node == NULL) return NULL;
     if (it->node->right)
     {
         it->node = it->node->right;
@@ -176,13 +234,18 @@ bst_next (struct bst_iterator* it)
             {
                 it->node = it->node->parent;
                 if (!it->node->parent)
+                {
+                    it->node = NULL;
                     return NULL;
+                }
             }
             it->node = it->node->parent;
         }
     }
     else
     {
+        /* Fell off the end; the iterator is spent. */
+        it->node = NULL;
         return NULL;
     }
     return it->node->data;
@@ -191,7 +254,7 @@ bst_next (struct bst_iterator* it)
 void* 
 bst_prev (struct bst_iterator* it)
 {
-    if (it == NULL) return NULL;
+    if (it == NULL || it->node == NULL) return NULL;
     if (it->node->left)
     {
         it->node = it->node->left;
@@ -208,13 +271,18 @@ bst_prev (struct bst_iterator* it)
             {
                 it->node = it->node->parent;
                 if (!it->node->parent)
+                {
+                    it->node = NULL;
                     return NULL;
+                }
             }
             it->node = it->node->parent;
         }
     }
     else
     {
+        /* Fell off the end; the iterator is spent. */
+        it->node = NULL;
         return NULL;
     }
     return it->node->data;
@@ -222,72 +290,154 @@ bst_prev (struct bst_iterator* it)
 
 
 
-/* ===  HELPER FUNCTIONS === */
-bool 
-insert_helper (struct bst_node** node, struct bst_node* parent, void* data, 
-        bst_tree_compare_func* func)
+size_t
+bst_walk (struct bst_tree* tree, bst_visit_func* func, void* aux)
 {
-    ASSERT (node != NULL);
-    ASSERT (data != NULL);
+    ASSERT (func != NULL);
 
-    struct bst_node* new_node = NULL;
-    if (*node == NULL)  
+    struct bst_iterator it;
+    size_t n = 0;
+    if (!bst_iter_first (tree, &it))
+        return 0;
+    do
     {
-        new_node = malloc (sizeof (struct bst_node));
-        new_node->left      = NULL;
-        new_node->right     = NULL;
-        new_node->parent    = parent;
-        new_node->data      = data;
-    
-        (*node) = new_node;
+        n++;
+        if (!func (it.node->data, aux))
+            break;
+    }
+    while (bst_next (&it) != NULL);
+    return n;
+};
+
+size_t
+bst_range (struct bst_tree* tree, const void* lo, const void* hi, 
+        void** out, size_t max)
+{
+    ASSERT (tree != NULL);
+    ASSERT (out != NULL || max == 0);
 
-        return true;
-    }   
-    else    
+    struct bst_iterator it;
+    size_t n = 0;
+    if (!bst_iter_seek (tree, &it, lo))
+        return 0;
+    do
     {
-        new_node = (*node);
-        ASSERT (new_node->data != NULL);
+        if (hi && tree->comparator (it.node->data, hi, NULL) > 0)
+            break;
+        if (n < max)
+            out[n] = it.node->data;
+        n++;
+    }
+    while (bst_next (&it) != NULL);
+    return n;
+};
 
-        int compare_result = func (data, (*node)->data, NULL);
-            
-        if (compare_result > 0) 
-        {
-            return insert_helper (&(*node)->right, *node, data, func);
-        }   
-        else if (compare_result < 0) 
-        {
-            return insert_helper (&(*node)->left, *node, data, func);
-        }
-        else
+
+
+/* ===  HELPER FUNCTIONS === */
+
+/* Links NODE, whose data is set, into TREE.  Returns false if an equal
+ * element is already there. */
+static bool
+link_node (struct bst_tree* tree, struct bst_node* node)
+{
+    struct bst_node* parent = NULL;
+    struct bst_node** link = &tree->root;
+    while (*link)
+    {
+        parent = *link;
+        ASSERT (parent->data != NULL);
+        int cmp = tree->comparator (node->data, parent->data, NULL);
+        if (cmp > 0)        link = &parent->right;
+        else if (cmp < 0)   link = &parent->left;
+        else                return false;
+    }
+
+    node->left      = NULL;
+    node->right     = NULL;
+    node->parent    = parent;
+    *link = node;
+    return true;
+};
+
+/* Unlinks DEL from TREE.  DEL itself is left alone. */
+static void
+unlink_node (struct bst_tree* tree, struct bst_node* del)
+{
+    if (del->left && del->right)
+    {
+        /* Both children: DEL's successor, which has no left child, takes
+         * its place */
+        struct bst_node* succ = del->right;
+        while (succ->left)
+            succ = succ->left;
+
+        if (succ->parent != del)
         {
-            return false;
+            succ->parent->left = succ->right;
+            if (succ->right)    succ->right->parent = succ->parent;
+            succ->right = del->right;
+            del->right->parent = succ;
         }
+        succ->left = del->left;
+        del->left->parent = succ;
+        replace_child (tree, del->parent, del, succ);
+    }
+    else
+    {
+        /* At most one child, which moves up */
+        replace_child (tree, del->parent, del, 
+                del->left ? del->left : del->right);
     }
 };
 
+/* Makes NEW take OLD's place under PARENT, or at the root */
+static void
+replace_child (struct bst_tree* tree, struct bst_node* parent,
+        struct bst_node* old, struct bst_node* new)
+{
+    if (new)    new->parent = parent;
+    if (parent == NULL)             tree->root = new;
+    else if (parent->left == old)   parent->left = new;
+    else                            parent->right = new;
+};
+
 struct bst_node*
 find_helper (struct bst_node* node, const void* elem, 
         bst_tree_compare_func* func)
 {
     ASSERT (elem != NULL);
 
-    if (node == NULL)   return NULL;
-
-    ASSERT (node->data != NULL);
-    int cmp = func (elem, node->data, NULL);
-
-    if (cmp > 0)
+    while (node)
     {
-        return find_helper (node->right, elem, func);
-    }
-    else if (cmp < 0) 
-    {
-        return find_helper (node->left, elem, func);
+        ASSERT (node->data != NULL);
+        int cmp = func (elem, node->data, NULL);
+
+        if (cmp > 0)        node = node->right;
+        else if (cmp < 0)   node = node->left;
+        else                return node;
     }
-    else
+    return NULL;
+};
+
+/* Returns the first node at or after ELEM, or the first node if ELEM is
+ * NULL */
+static struct bst_node*
+lower_bound (struct bst_node* node, const void* elem, 
+        bst_tree_compare_func* func)
+{
+    struct bst_node* best = NULL;
+    while (node)
     {
-        return node;
+        if (elem == NULL || func (node->data, elem, NULL) >= 0)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+            node = node->right;
     }
+    return best;
 };
 
 void 
@@ -1,6 +1,18 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include "child.h"
-#include "bst.h"
+#include "slab.h"
+#include "hash.h"
+#include "epoch.h"
+#include "sync.h"
+#include "jobqueue.h"
+#include "collective.h"
+#include "rpc.h"
+#include "event.h"
+#include "match.h"
 #include "logging.h"
+#include "trace.h"
+#include "timer.h"
 #include "debug.h"
 
 /* Includes commands and message headers that can be passed back and forth */
@@ -8,8 +20,10 @@
 
 #include <sys/types.h>
 #include <string.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
 
 
 
@@ -34,6 +48,51 @@ static int monitor_init_command (struct server_child*, struct message*);
 static int monitor_wait_command (struct server_child*, struct message*);
 static int monitor_signal_command (struct server_child*, struct message*);
 static int monitor_bcast_command (struct server_child*, struct message*);
+static int rwlock_init_command (struct server_child*, struct message*);
+static int barrier_init_command (struct server_child*, struct message*);
+static int latch_init_command (struct server_child*, struct message*);
+static int jobq_open_command (struct server_child*, struct message*);
+static int jobq_push_command (struct server_child*, struct message*);
+static int jobq_pop_command (struct server_child*, struct message*);
+static int jobq_complete_command (struct server_child*, struct message*);
+static int jobq_stats_command (struct server_child*, struct message*);
+static int coll_bcast_command (struct server_child*, struct message*);
+static int coll_gather_command (struct server_child*, struct message*);
+static int coll_reduce_command (struct server_child*, struct message*);
+static int coll_respond_command (struct server_child*, struct message*);
+static int rpc_call_command (struct server_child*, struct message*);
+static int rpc_reply_command (struct server_child*, struct message*);
+static int event_subscribe_command (struct server_child*, struct message*);
+static int event_poll_command (struct server_child*, struct message*);
+static int conn_state_command (struct server_child*, struct message*);
+
+/* Runs the collective in M on behalf of ME */
+static int run_collective (struct server_child* me, struct message* m);
+
+/* Answers the receive in M from ME's mailbox, waiting up to TIMEOUT_MS */
+static int recv_sibling (struct server_child* me, struct message* m,
+        int timeout_ms);
+
+/* File CHILD in the secondary indexes, or take it out of them.  The caller
+ * holds the index lock. */
+static void link_child (struct server_child* child);
+static void unlink_child (struct server_child* child);
+
+/* Wakes CHILD's broker from any wait for its mailbox or a job queue, now
+ * that the child is out of the index */
+static void close_child (struct server_child* child);
+static uint64_t pid_hash (pid_t pid);
+static uint64_t addr_hash (const struct child_addr* addr);
+
+/* Frees a child's record once no thread can be using it anymore */
+static void destroy_child (void* child);
+
+/* Same as get_child_by_pid, for a caller holding the index lock */
+static struct server_child* get_child_by_pid_locked (pid_t pid);
+
+/* Sends M back to the child that issued it, with RESULT stored in its ID */
+static int reply_child (struct server_child* child, struct message* m, 
+        int result);
 
 
 
@@ -41,29 +100,70 @@ static int monitor_bcast_command (struct server_child*, struct message*);
 /* The child index */
 static struct child_index index;
 
+/* Broker threads that have not exited yet, so shutdown can wait for them */
+static int brokers = 0;
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t broker_exited;
+
+/* Messages still in a mailbox when its child was freed */
+static uint64_t undelivered = 0;
+
 /* The command index */
 static commandfunc* runcommand[NUM_COMMANDS];
 
+/* Command names, for traces */
+static const char* command_names[NUM_COMMANDS] = {
+    [NOTHING] = "NOTHING", [SEND_B] = "SEND_B", [SEND_NB] = "SEND_NB",
+    [SEND_WAIT] = "SEND_WAIT", [RECV_B] = "RECV_B", [RECV_NB] = "RECV_NB",
+    [RECV_WAIT] = "RECV_WAIT", [SEMA_INIT] = "SEMA_INIT",
+    [SEMA_POST] = "SEMA_POST", [SEMA_WAIT] = "SEMA_WAIT",
+    [SEMA_TRY_WAIT] = "SEMA_TRY_WAIT", [LOCK_INIT] = "LOCK_INIT",
+    [LOCK_ACQUIRE] = "LOCK_ACQUIRE", [LOCK_RELEASE] = "LOCK_RELEASE",
+    [LOCK_TRY_ACQUIRE] = "LOCK_TRY_ACQUIRE", [MONITOR_INIT] = "MONITOR_INIT",
+    [MONITOR_WAIT] = "MONITOR_WAIT", [MONITOR_SIGNAL] = "MONITOR_SIGNAL",
+    [MONITOR_BCAST] = "MONITOR_BCAST", [RWLOCK_INIT] = "RWLOCK_INIT",
+    [BARRIER_INIT] = "BARRIER_INIT", [LATCH_INIT] = "LATCH_INIT",
+    [JOBQ_OPEN] = "JOBQ_OPEN", [JOBQ_PUSH] = "JOBQ_PUSH",
+    [JOBQ_POP] = "JOBQ_POP", [JOBQ_COMPLETE] = "JOBQ_COMPLETE",
+    [JOBQ_STATS] = "JOBQ_STATS", [COLL_BCAST] = "COLL_BCAST",
+    [COLL_GATHER] = "COLL_GATHER", [COLL_REDUCE] = "COLL_REDUCE",
+    [COLL_RESPOND] = "COLL_RESPOND", [RPC_CALL] = "RPC_CALL",
+    [RPC_REPLY] = "RPC_REPLY", [EVENT_SUBSCRIBE] = "EVENT_SUBSCRIBE",
+    [EVENT_POLL] = "EVENT_POLL", [CONN_STATE] = "CONN_STATE",
+    [JOBQ_RESULT] = "JOBQ_RESULT", [COLL_REQUEST] = "COLL_REQUEST",
+    [RPC_REQUEST] = "RPC_REQUEST", [RPC_RESULT] = "RPC_RESULT",
+    [EVENT_NOTIFY] = "EVENT_NOTIFY" };
+
 char**
 build_child_argv (const char* exe, char* scriptname, int newfd, 
-        int childread, int childwrite)
+        int childread, int childwrite, int syncfd, int syncslot, int logfd)
 {
-    char** argv = (char**) malloc (6 * sizeof (char*));
+    char** argv = (char**) malloc (9 * sizeof (char*));
 
     char* str_newfd = (char*) malloc (7 * sizeof (char));
     char* str_childread = (char*) malloc (7 * sizeof (char));
     char* str_childwrite = (char*) malloc (7 * sizeof (char));
+    char* str_syncfd = (char*) malloc (7 * sizeof (char));
+    char* str_syncslot = (char*) malloc (7 * sizeof (char));
+    char* str_logfd = (char*) malloc (7 * sizeof (char));
 
     if (argv == NULL || str_newfd == NULL || str_childread == NULL ||
-            str_childwrite == NULL ||
+            str_childwrite == NULL || str_syncfd == NULL ||
+            str_syncslot == NULL || str_logfd == NULL ||
         0 >= sprintf (str_newfd, "%d", newfd) ||
         0 >= sprintf (str_childread, "%d", childread) ||
-        0 >= sprintf (str_childwrite, "%d", childwrite))
+        0 >= sprintf (str_childwrite, "%d", childwrite) ||
+        0 >= sprintf (str_syncfd, "%d", syncfd) ||
+        0 >= sprintf (str_syncslot, "%d", syncslot) ||
+        0 >= sprintf (str_logfd, "%d", logfd))
     {
         free (argv);
         free (str_newfd);
         free (str_childread);
         free (str_childwrite);
+        free (str_syncfd);
+        free (str_syncslot);
+        free (str_logfd);
 
         return NULL;
     }
@@ -73,6 +173,9 @@ build_child_argv (const char* exe, char* scriptname, int newfd,
      * 2. newfd
      * 3. childread
      * 4. childwrite
+     * 5. syncfd
+     * 6. syncslot
+     * 7. logfd, -1 if there is no shared log ring
      * ...
      * */
     argv[0] = exe;
@@ -80,8 +183,11 @@ build_child_argv (const char* exe, char* scriptname, int newfd,
     argv[2] = str_newfd;
     argv[3] = str_childread;
     argv[4] = str_childwrite;
+    argv[5] = str_syncfd;
+    argv[6] = str_syncslot;
+    argv[7] = str_logfd;
     // ...
-    argv[5] = NULL;
+    argv[8] = NULL;
 
     return argv;
 };
@@ -92,7 +198,19 @@ init_child_index ()
 {
     /* Init the child index data structure */
     pthread_mutex_init (&index.lock, NULL);
-    bst_init (&index.tree, &child_compare);
+    slab_init (&index.table);
+    if (-1 == hash_init (&index.by_pid) || -1 == hash_init (&index.by_addr))
+    {
+        log_error (LOG_BROKER, "Could not allocate the child index");
+        exit (EXIT_FAILURE);
+    }
+
+    /* Shutdown waits for the brokers on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&broker_exited, &attr);
+    pthread_condattr_destroy (&attr);
 
     /* Initialize the run commands index */
     runcommand[NOTHING] = &nothing_command;
@@ -107,13 +225,37 @@ init_child_index ()
     runcommand[SEMA_WAIT] = &sema_wait_command;
     runcommand[SEMA_TRY_WAIT] = &sema_try_wait_command;
     runcommand[LOCK_INIT] = &lock_init_command;
-    runcommand[LOCK_ACQIRE] = &lock_acquire_command;
+    runcommand[LOCK_ACQUIRE] = &lock_acquire_command;
     runcommand[LOCK_RELEASE] = &lock_release_command;
     runcommand[LOCK_TRY_ACQUIRE] = &lock_try_acquire_command;
     runcommand[MONITOR_INIT] = &monitor_init_command;
     runcommand[MONITOR_WAIT] = &monitor_wait_command;
     runcommand[MONITOR_SIGNAL] = &monitor_signal_command;
     runcommand[MONITOR_BCAST] = &monitor_bcast_command;
+    runcommand[RWLOCK_INIT] = &rwlock_init_command;
+    runcommand[BARRIER_INIT] = &barrier_init_command;
+    runcommand[LATCH_INIT] = &latch_init_command;
+    runcommand[JOBQ_OPEN] = &jobq_open_command;
+    runcommand[JOBQ_PUSH] = &jobq_push_command;
+    runcommand[JOBQ_POP] = &jobq_pop_command;
+    runcommand[JOBQ_COMPLETE] = &jobq_complete_command;
+    runcommand[JOBQ_STATS] = &jobq_stats_command;
+    runcommand[COLL_BCAST] = &coll_bcast_command;
+    runcommand[COLL_GATHER] = &coll_gather_command;
+    runcommand[COLL_REDUCE] = &coll_reduce_command;
+    runcommand[COLL_RESPOND] = &coll_respond_command;
+    runcommand[RPC_CALL] = &rpc_call_command;
+    runcommand[RPC_REPLY] = &rpc_reply_command;
+    runcommand[EVENT_SUBSCRIBE] = &event_subscribe_command;
+    runcommand[EVENT_POLL] = &event_poll_command;
+    runcommand[CONN_STATE] = &conn_state_command;
+
+    /* Children never send these, treat them like NOTHING if they do */
+    runcommand[JOBQ_RESULT] = &nothing_command;
+    runcommand[COLL_REQUEST] = &nothing_command;
+    runcommand[RPC_REQUEST] = &nothing_command;
+    runcommand[RPC_RESULT] = &nothing_command;
+    runcommand[EVENT_NOTIFY] = &nothing_command;
 };
 
 int
@@ -138,14 +280,18 @@ child_dump (const void* child_elem)
     printf ("[ ID: %d ]", child->ourid);
 };
 
-void
+int
 add_child (struct server_child* child)
 {
     ASSERT (child != NULL);
         
     pthread_mutex_lock (&index.lock);
-    bst_insert (&index.tree, child);
+    child->ourid = slab_insert (&index.table, child);
+    if (child->ourid != -1)
+        link_child (child);
     pthread_mutex_unlock (&index.lock);
+
+    return child->ourid;
 };
 
 struct server_child*
@@ -153,39 +299,191 @@ remove_child (int ourid)
 {
     ASSERT (ourid > 0);
     
-    /* This is used only to compare with and find the correct element */
-    struct server_child temp;
-    temp.ourid = ourid;
-
     pthread_mutex_lock (&index.lock);
     struct server_child* result =
-        (struct server_child*) bst_delete (&index.tree, &temp);
+        (struct server_child*) slab_remove (&index.table, ourid);
+    if (result != NULL)
+        unlink_child (result);
     pthread_mutex_unlock (&index.lock);
 
+    if (result != NULL)
+        close_child (result);
     return result;
 };
 
+struct server_child*
+remove_child_by_pid (pid_t pid)
+{
+    pthread_mutex_lock (&index.lock);
+    struct server_child* result = get_child_by_pid_locked (pid);
+    if (result != NULL)
+    {
+        slab_remove (&index.table, result->ourid);
+        unlink_child (result);
+    }
+    pthread_mutex_unlock (&index.lock);
+
+    if (result != NULL)
+        close_child (result);
+    return result;
+};
+
+/* Ids come straight from children, so a bad one just finds nothing.  No
+ * lock is taken; the child stays valid until the caller's read section
+ * ends. */
 struct server_child*
 get_child (int ourid)
 {
-    ASSERT (ourid > 0);
+    return (struct server_child*) slab_find (&index.table, ourid);
+};
+
+void
+retire_child (struct server_child* child)
+{
+    ASSERT (child != NULL);
+
+    epoch_retire (child, &destroy_child);
+};
+
+int
+start_broker (struct server_child* child)
+{
+    ASSERT (child != NULL);
 
-    struct server_child temp;
-    temp.ourid = ourid;
+    pthread_mutex_lock (&broker_lock);
+    int result = pthread_create (&child->thread, NULL, &child_comm_thread,
+            child);
+    if (result == 0)
+        brokers++;
+    pthread_mutex_unlock (&broker_lock);
+
+    return result;
+};
+
+int
+wait_brokers (int timeout_ms)
+{
+    struct timespec until;
+
+    clock_gettime (CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock (&broker_lock);
+    while (brokers > 0 && 0 == pthread_cond_timedwait (&broker_exited,
+                &broker_lock, &until))
+        ;
+    int left = brokers;
+    pthread_mutex_unlock (&broker_lock);
+
+    return left;
+};
+
+uint64_t
+get_undelivered ()
+{
+    return __atomic_load_n (&undelivered, __ATOMIC_RELAXED);
+};
+
+void
+put_child (struct server_child* child)
+{
+    ASSERT (child != NULL);
+
+    if (__atomic_sub_fetch (&child->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        retire_child (child);
+};
+
+/* Copies the ids of up to MAX children into IDS.  Returns how many children
+ * there are, which may be more than MAX. */
+int
+get_child_ids (int* ids, int max)
+{
+    ASSERT (ids != NULL || max == 0);
+
+    int n = 0;
+    uint32 pos = 0;
+    struct server_child* child;
 
     pthread_mutex_lock (&index.lock);
-    struct server_child* result =
-        (struct server_child*) bst_find (&index.tree, &temp);
+    while ((child = slab_next (&index.table, &pos)) != NULL)
+    {
+        if (n < max)
+            ids[n] = child->ourid;
+        n++;
+    }
+    pthread_mutex_unlock (&index.lock);
+
+    return n;
+};
+
+struct server_child*
+get_child_by_pid (pid_t pid)
+{
+    pthread_mutex_lock (&index.lock);
+    struct server_child* result = get_child_by_pid_locked (pid);
     pthread_mutex_unlock (&index.lock);
 
     return result;
 };
 
+int
+get_child_ids_by_addr (const struct child_addr* addr, int* ids, int max)
+{
+    ASSERT (addr != NULL);
+    ASSERT (ids != NULL || max == 0);
+
+    int n = 0;
+    struct hash_link* l;
+
+    pthread_mutex_lock (&index.lock);
+    for (l = hash_first (&index.by_addr, addr_hash (addr)); l != NULL;
+            l = hash_next (l))
+    {
+        struct server_child* child =
+            hash_entry (l, struct server_child, addr_link);
+        if (memcmp (&child->addr, addr, sizeof *addr) != 0)
+            continue;
+        if (n < max)
+            ids[n] = child->ourid;
+        n++;
+    }
+    pthread_mutex_unlock (&index.lock);
+
+    return n;
+};
+
+void
+child_addr_set (struct child_addr* addr, const struct sockaddr* sa)
+{
+    ASSERT (addr != NULL);
+    ASSERT (sa != NULL);
+
+    memset (addr, 0, sizeof *addr);
+    if (sa->sa_family == AF_INET6)
+        memcpy (addr->ip, &((const struct sockaddr_in6*) sa)->sin6_addr, 16);
+    else if (sa->sa_family == AF_INET)
+    {
+        addr->ip[10] = addr->ip[11] = 0xff;
+        memcpy (addr->ip + 12, &((const struct sockaddr_in*) sa)->sin_addr, 4);
+    }
+};
+
 void
 dump_child_index ()
 {
+    uint32 pos = 0;
+    struct server_child* child;
+
     pthread_mutex_lock (&index.lock);
-    bst_dump (&index.tree, &child_dump);
+    while ((child = slab_next (&index.table, &pos)) != NULL)
+        child_dump (child);
+    printf ("\n");
     pthread_mutex_unlock (&index.lock);
 };
 
@@ -197,28 +495,94 @@ child_comm_thread (void* chld)
 
     struct server_child* child = (struct server_child*) chld;
 
-    server_log ("New thread for child %u, before lock", child->pid);
+    log_debug (LOG_BROKER, "New thread for child %u, before lock", child->pid);
 
     /* Once this call returns, the thread is good to go */
     pthread_mutex_lock (&child->init_lock);
 
-    server_log ("%u, beginning loop", child->pid);
+    log_debug (LOG_BROKER, "%u, beginning loop", child->pid);
+
+    /* A traced child's end of EXECFD closes when it calls exec, or exits
+     * before it gets there */
+    uint64_t ready = 0;
+    if (child->trace != 0)
+    {
+        char c;
+        while (child->execfd != -1
+                && -1 == read (child->execfd, &c, 1) && errno == EINTR)
+            ;
+        if (child->execfd != -1)
+            close (child->execfd);
+        ready = trace_now ();
+        trace_span (child->trace, "exec", child->forked, ready, NULL, 0);
+    }
 
     /* Main loop */
     while (true)
     {
         struct message msg;
 
-        /* Wait for the child to send us something */
-        read (child->parentread, &msg, sizeof msg);
-        enum command cmd = msg.message;   
-
-        /* Now run the child's command or otherwise interpret its message */
-        int result = runcommand[cmd](child, &message);
+        /* Wait for the child to send us something.  End of file means it
+         * has exited. */
+        ssize_t n = read (child->parentread, &msg, sizeof msg);
+        if (-1 == n && errno == EINTR)
+            continue;
+        if (n != sizeof msg)
+            break;
+        enum command cmd = msg.command;   
+        __atomic_store_n (&child->active, timer_now (), __ATOMIC_RELAXED);
+        __atomic_store_n (&child->busy, 1, __ATOMIC_RELAXED);
+
+        /* It comes straight from the child */
+        if ((int) cmd < 0 || cmd >= NUM_COMMANDS || runcommand[cmd] == NULL)
+        {
+            log_warn (LOG_BROKER, "Child %d (pid %d) sent unknown command %d",
+                    child->ourid, child->pid, (int) cmd);
+            reply_child (child, &msg, -1);
+            __atomic_store_n (&child->busy, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        uint64_t start = 0;
+        if (child->trace != 0)
+        {
+            start = trace_now ();
+            if (ready != 0)
+                trace_span (child->trace, "start-up", ready, start, NULL, 0);
+            ready = 0;
+        }
+
+        /* Now run the child's command or otherwise interpret its message.
+         * Commands may wait as long as the child asks, so each one keeps
+         * its own read section around the siblings it looks up. */
+        int result = runcommand[cmd](child, &msg);
+
+        /* However long it waited, it was not idle */
+        __atomic_store_n (&child->active, timer_now (), __ATOMIC_RELAXED);
+        __atomic_store_n (&child->busy, 0, __ATOMIC_RELEASE);
+
+        if (child->trace != 0)
+            trace_span (child->trace, command_names[cmd], start, trace_now (),
+                    "result", result);
     }
 
+    if (child->trace != 0)
+        trace_span (child->trace, "connection", child->accepted, trace_now (),
+                "pid", child->pid);
+
     pthread_mutex_unlock (&child->init_lock);
 
+    /* Its record stays in the index until the child is reaped */
+    put_child (child);
+
+    pthread_mutex_lock (&broker_lock);
+    if (--brokers == 0)
+        pthread_cond_broadcast (&broker_exited);
+    pthread_mutex_unlock (&broker_lock);
+
+    /* Nobody joins us */
+    pthread_detach (pthread_self ());
+    epoch_thread_exit ();
     pthread_exit ((void*) NULL);
 };
 
@@ -232,6 +596,7 @@ static int
 nothing_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
@@ -239,126 +604,665 @@ send_b_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
 
-    /* Information for sending */
-    int child_id = m->id;
-    void* data = &m->information;
-    size_t sz = m->sz;
+    struct sibling_header h;
+    memcpy (&h, m->information, sizeof h);
+    if (h.sz > SIBLING_MAX_PAYLOAD || h.tag < 0)
+        return reply_child (me, m, -1);
 
-    /* Grab information for the specified child */
-    struct server_child* sendto = get_child (child_id);
-    if (sendto == NULL)
+    /* Grab information for the specified child.  It stays valid until we
+     * leave the read section, and putting never waits. */
+    epoch_enter ();
+    struct server_child* sendto = get_child (m->id);
+    if (sendto == NULL || sendto->mailbox == NULL)
     {
-        server_err ("Received a bad child ID from child %d (pid %d) during SEND_B command", 
-            me->ourid, me->pid);
-        return -1;
+        epoch_exit ();
+        log_error (LOG_BROKER, "Received a bad child ID from child %d "
+                "(pid %d) during SEND_B command", me->ourid, me->pid);
+        return reply_child (me, m, -1);
     }
 
-    // TODO: need to decide if this data needs to be wrapped in a message to the
-    // child or not
-    return send (sendto->parent_write, data, sz);
+    /* The message waits in the receiver's mailbox until it asks for it.  If
+     * the mailbox is full the sender hears about it instead of the parent
+     * buffering without bound. */
+    int result = mailbox_put (sendto->mailbox, me->ourid, h.tag, 
+                m->information + sizeof h, h.sz);
+    epoch_exit ();
+    if (-1 == result)
+    {
+        log_warn (LOG_BROKER, "Mailbox of child %d is full, dropped message "
+                "from %d", m->id, me->ourid);
+        return reply_child (me, m, -1);
+    }
+    return reply_child (me, m, 0);
 };
 
 static int 
 send_nb_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 send_wait_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 recv_b_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+
+    struct sibling_header h;
+    memcpy (&h, m->information, sizeof h);
+    return recv_sibling (me, m, h.timeout_ms);
 };
 
 static int 
 recv_nb_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+
+    return recv_sibling (me, m, 0);
 };
 
 static int 
 recv_wait_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 sema_init_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 sema_post_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 sema_wait_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 sema_try_wait_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 lock_init_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 lock_acquire_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 lock_release_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 lock_try_acquire_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 monitor_init_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 monitor_wait_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 monitor_signal_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
 };
 
 static int 
 monitor_bcast_command (struct server_child* me, struct message* m)
 {
     ASSERT (m != NULL);
+    return 0;
+};
+
+/* The reader-writer lock, barrier and latch commands only look up or create
+ * the named object in the sync region.  The child then operates on it
+ * directly in shared memory. */
+static int
+rwlock_init_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    m->identifier[sizeof m->identifier - 1] = '\0';
+    return reply_child (me, m, sync_create (SYNC_RWLOCK, m->identifier, 0));
+};
+
+static int
+barrier_init_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    m->identifier[sizeof m->identifier - 1] = '\0';
+    return reply_child (me, m, 
+            sync_create (SYNC_BARRIER, m->identifier, m->id));
+};
+
+static int
+latch_init_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    m->identifier[sizeof m->identifier - 1] = '\0';
+    return reply_child (me, m, 
+            sync_create (SYNC_LATCH, m->identifier, m->id));
+};
+
+static int
+jobq_open_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    m->identifier[sizeof m->identifier - 1] = '\0';
+    return reply_child (me, m, jobqueue_open (m->identifier));
+};
+
+static int
+jobq_push_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    if (m->sz > JOBQ_MAX_TASK)
+        return reply_child (me, m, -1);
+    return reply_child (me, m, 
+            jobqueue_push (m->id, me->ourid, m->information, m->sz));
+};
+
+/* Pops a batch of tasks for the child and packs them all into the answer, so
+ * a worker pays for one round trip per batch instead of one per task */
+static int
+jobq_pop_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    struct jobq_pop_args args;
+    memcpy (&args, m->information, sizeof args);
+
+    /* Even the smallest tasks take a header each */
+    int most = sizeof m->information / sizeof (struct jobq_task_header);
+    if (args.max <= 0 || args.max > most)
+        args.max = most;
+
+    struct job* jobs[most];
+    int n = jobqueue_pop (m->id, me->ourid, jobs, args.max, args.timeout_ms);
+    if (n < 0 && errno == ESRCH)
+        return -1;          // nobody left to answer
+    if (n < 0)
+        return reply_child (me, m, -1);
+
+    /* Pack as many as fit.  Whatever doesn't fit goes back on our own deque,
+     * where we will find it first next time. */
+    size_t off = 0;
+    int i, packed = 0;
+    for (i = 0; i < n; i++)
+    {
+        size_t rec = sizeof (struct jobq_task_header) + 
+            ((jobs[i]->sz + 7) & ~(size_t) 7);
+        if (off + rec > sizeof m->information)
+        {
+            if (0 != jobqueue_requeue (m->id, me->ourid, jobs[i]))
+            {
+                log_error (LOG_BROKER, "Lost job %u of child %d: no room to "
+                        "put it back", jobs[i]->jobid, jobs[i]->producer);
+                jobqueue_free_job (jobs[i]);
+            }
+            continue;
+        }
+
+        struct jobq_task_header h;
+        h.jobid = jobs[i]->jobid;
+        h.producer = jobs[i]->producer;
+        h.sz = jobs[i]->sz;
+        h.pad = 0;
+        memcpy (m->information + off, &h, sizeof h);
+        memcpy (m->information + off + sizeof h, jobs[i]->data, jobs[i]->sz);
+        off += rec;
+        packed++;
+
+        jobqueue_free_job (jobs[i]);
+    }
+
+    m->id = packed;
+    m->sz = off;
+    return write (me->parentwrite, m, sizeof *m) == sizeof *m ? packed : -1;
+};
+
+/* Routes the result of a task back to the child that produced it */
+static int
+jobq_complete_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    struct jobq_task_header h;
+    memcpy (&h, m->information, sizeof h);
+    if (h.sz > JOBQ_MAX_TASK)
+        return reply_child (me, m, -1);
+
+    jobqueue_complete (m->id);
+
+    struct message result;
+    memset (&result, 0, sizeof result);
+    result.command = JOBQ_RESULT;
+    result.id = m->id;
+    result.sz = sizeof h + h.sz;
+    memcpy (result.information, m->information, result.sz);
+
+    if (-1 == message_child (h.producer, &result))
+    {
+        log_error (LOG_BROKER, "Result of job %u from child %d has nowhere "
+                "to go", h.jobid, me->ourid);
+        return reply_child (me, m, -1);
+    }
+    return reply_child (me, m, 0);
+};
+
+static int
+jobq_stats_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    struct jobq_stats stats;
+    int result = jobqueue_stats (m->id, &stats);
+    m->id = result;
+    m->sz = sizeof stats;
+    memcpy (m->information, &stats, sizeof stats);
+    return write (me->parentwrite, m, sizeof *m) == sizeof *m ? result : -1;
+};
+
+static int
+coll_bcast_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+    return run_collective (me, m);
+};
+
+static int
+coll_gather_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+    return run_collective (me, m);
+};
+
+static int
+coll_reduce_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+    return run_collective (me, m);
+};
+
+/* A sibling's answer to a collective.  Late answers are dropped. */
+static int
+coll_respond_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    if (m->sz > sizeof m->information)
+        return reply_child (me, m, -1);
+    return reply_child (me, m, 
+            collective_contribute (m->id, me->ourid, m->information, m->sz));
+};
+
+/* Sends the request to every sibling at once and answers the caller with
+ * the aggregate once they have all answered or the timeout runs out.  Only
+ * this child's communication thread waits; the siblings' answers are folded
+ * in by their own threads. */
+static int
+run_collective (struct server_child* me, struct message* m)
+{
+    struct coll_args args;
+    memcpy (&args, m->information, sizeof args);
+    size_t most = sizeof m->information - sizeof (struct coll_request_header);
+    if (args.sz > most || args.sz > sizeof m->information - sizeof args ||
+        (m->command == COLL_REDUCE && 
+            (args.reducer < COLL_SUM || args.reducer > COLL_CONCAT)))
+    {
+        return reply_child (me, m, -1);
+    }
+
+    int max = 256;
+    int* ids = NULL;
+    int n;
+    while (true)
+    {
+        int* more = realloc (ids, max * sizeof *ids);
+        if (more == NULL)
+        {
+            free (ids);
+            return reply_child (me, m, -1);
+        }
+        ids = more;
+        if ((n = get_child_ids (ids, max)) <= max)
+            break;
+        max = n * 2;
+    }
+
+    /* Everyone but us is asked */
+    int i, asked = 0;
+    for (i = 0; i < n; i++)
+        if (ids[i] != me->ourid)
+            ids[asked++] = ids[i];
+
+    struct collective c;
+    uint32 collid = collective_begin (&c, m->command, args.reducer, ids,
+            asked);
+    if (collid == 0)
+    {
+        free (ids);
+        return reply_child (me, m, -1);
+    }
+
+    struct message request;
+    struct coll_request_header h;
+    memset (&request, 0, sizeof request);
+    request.command = COLL_REQUEST;
+    request.id = collid;
+    h.collid = collid;
+    h.caller = me->ourid;
+    h.command = m->command;
+    h.sz = args.sz;
+    memcpy (request.information, &h, sizeof h);
+    memcpy (request.information + sizeof h, m->information + sizeof args,
+            args.sz);
+    request.sz = sizeof h + args.sz;
+
+    for (i = 0; i < asked; i++)
+        if (0 != message_child (ids[i], &request))
+            collective_unreached (&c, ids[i]);
+    free (ids);
+
+    int received = collective_wait (&c, args.timeout_ms);
+
+    m->id = received;
+    m->sz = c.len;
+    memcpy (m->information, c.result, c.len);
+    return write (me->parentwrite, m, sizeof *m) == sizeof *m ? received : -1;
+};
+
+/* Records the call and forwards it to the callee.  The caller only waits for
+ * the call to be accepted; the result comes later as an RPC_RESULT, so a
+ * child can have any number of calls outstanding. */
+static int
+rpc_call_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    struct rpc_header h;
+    memcpy (&h, m->information, sizeof h);
+    if (h.sz > RPC_MAX_PAYLOAD || m->id == me->ourid)
+        return reply_child (me, m, -1);
+
+    int callee = m->id;
+    uint32 callid = rpc_begin (me->ourid, h.corr_id, callee, h.timeout_ms);
+    if (callid == 0)
+        return reply_child (me, m, -1);
+
+    /* Accept before forwarding, so the answer to RPC_CALL always reaches
+     * the caller ahead of the result */
+    struct message request;
+    memcpy (&request, m, sizeof request);
+    reply_child (me, m, 0);
+
+    request.command = RPC_REQUEST;
+    request.id = callid;
+    h.corr_id = callid;
+    h.peer = me->ourid;
+    h.status = 0;
+    memcpy (request.information, &h, sizeof h);
+    if (-1 == message_child (callee, &request))
+    {
+        /* No such sibling; fail the call now instead of at its deadline */
+        rpc_abort (callid, ESRCH);
+    }
+    return 0;
+};
+
+static int
+rpc_reply_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    struct rpc_header h;
+    memcpy (&h, m->information, sizeof h);
+    if (h.sz > RPC_MAX_PAYLOAD)
+        return reply_child (me, m, -1);
+
+    return reply_child (me, m, rpc_finish (m->id, me->ourid, 
+                m->information + sizeof h, h.sz));
+};
+
+static int
+event_subscribe_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    struct event_args args;
+    memcpy (&args, m->information, sizeof args);
+    int target = m->id;
+    if (target == me->ourid
+            || -1 == event_subscribe (me->ourid, target, args.mask))
+        return reply_child (me, m, -1);
+
+    /* A sibling removed from the index has posted its exit already, and
+     * one removed after we subscribed will post it to us */
+    if (target != SIBLING_ANY_SOURCE && args.mask != 0
+            && get_child (target) == NULL)
+    {
+        event_subscribe (me->ourid, target, 0);
+        return reply_child (me, m, -1);
+    }
+    return reply_child (me, m, 0);
+};
+
+static int
+event_poll_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    int result = event_poll (me->ourid, m->information, &m->sz);
+    m->id = result;
+    return write (me->parentwrite, m, sizeof *m) == sizeof *m ? result : -1;
+};
+
+/* Not answered, so reporting a state costs the child a single write */
+static int
+conn_state_command (struct server_child* me, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    if (m->id == me->state)
+        return 0;
+    me->state = m->id;
+    event_post (me->ourid, EVENT_STATE, me->state, 0);
+    return 0;
+};
+
+static int
+recv_sibling (struct server_child* me, struct message* m, int timeout_ms)
+{
+    struct sibling_header h;
+    memcpy (&h, m->information, sizeof h);
+
+    if (me->mailbox == NULL)
+        return reply_child (me, m, -1);
+
+    /* Only this thread receives from our mailbox, so it is fine to sit on
+     * it; the child can't send another command until this one is answered */
+    struct match_msg* msg = mailbox_get (me->mailbox, 
+            m->id < 0 ? MATCH_ANY : m->id, h.tag < 0 ? MATCH_ANY : h.tag,
+            timeout_ms);
+
+    memset (&h, 0, sizeof h);
+    if (msg == NULL && errno == ESRCH)
+        return -1;          // nobody left to answer
+    if (msg == NULL)
+    {
+        h.status = errno;
+        memcpy (m->information, &h, sizeof h);
+        return reply_child (me, m, -1);
+    }
+
+    h.src = msg->src;
+    h.tag = msg->tag;
+    h.sz = msg->sz;
+    memcpy (m->information, &h, sizeof h);
+    memcpy (m->information + sizeof h, msg->data, msg->sz);
+    mailbox_free (me->mailbox, msg);
+
+    m->id = h.sz;
+    m->sz = sizeof h + h.sz;
+    if (sizeof *m != write (me->parentwrite, m, sizeof *m))
+    {
+        log_error (LOG_BROKER, "Could not reply to child %d (pid %d)", 
+                me->ourid, me->pid);
+        return -1;
+    }
+    return 0;
+};
+
+static void
+link_child (struct server_child* child)
+{
+    hash_insert (&index.by_pid, &child->pid_link, pid_hash (child->pid));
+    hash_insert (&index.by_addr, &child->addr_link, addr_hash (&child->addr));
+};
+
+static void
+unlink_child (struct server_child* child)
+{
+    hash_remove (&index.by_pid, &child->pid_link);
+    hash_remove (&index.by_addr, &child->addr_link);
+};
+
+static struct server_child*
+get_child_by_pid_locked (pid_t pid)
+{
+    struct hash_link* l;
+    for (l = hash_first (&index.by_pid, pid_hash (pid)); l != NULL;
+            l = hash_next (l))
+    {
+        struct server_child* child =
+            hash_entry (l, struct server_child, pid_link);
+        if (child->pid == pid)
+            return child;
+    }
+    return NULL;
+};
+
+static uint64_t
+pid_hash (pid_t pid)
+{
+    return hash_int ((uint64_t) pid);
+};
+
+static uint64_t
+addr_hash (const struct child_addr* addr)
+{
+    return hash_bytes (addr->ip, sizeof addr->ip);
+};
+
+static void
+close_child (struct server_child* child)
+{
+    if (child->mailbox != NULL)
+        mailbox_close (child->mailbox);
+    jobqueue_close_worker (child->ourid);
+};
+
+static void
+destroy_child (void* chld)
+{
+    struct server_child* child = (struct server_child*) chld;
+
+    close (child->parentread);
+    close (child->parentwrite);
+    if (child->mailbox != NULL)
+    {
+        __atomic_add_fetch (&undelivered, child->mailbox->engine.count,
+                __ATOMIC_RELAXED);
+    }
+    mailbox_destroy (child->mailbox);
+    pthread_mutex_destroy (&child->init_lock);
+    free (child);
+};
+
+static int
+reply_child (struct server_child* child, struct message* m, int result)
+{
+    ASSERT (child != NULL);
+    ASSERT (m != NULL);
+
+    m->id = result;
+    m->sz = 0;
+
+    /* A message is smaller than PIPE_BUF, so this write is atomic even if
+     * another thread is writing to the same child. */
+    if (sizeof *m != write (child->parentwrite, m, sizeof *m))
+    {
+        log_error (LOG_BROKER, "Could not reply to child %d (pid %d)", 
+                child->ourid, child->pid);
+        return -1;
+    }
+    return result;
 };
 
+int
+message_child (int ourid, struct message* m)
+{
+    ASSERT (m != NULL);
+
+    if (ourid <= 0)
+        return -1;
+
+    epoch_enter ();
+    struct server_child* child = get_child (ourid);
+    int result = -1;
+    if (child != NULL)
+        result = sizeof *m == write (child->parentwrite, m, sizeof *m) ? 0 : -1;
+    epoch_exit ();
 
+    return result;
+};
 
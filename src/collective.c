@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "collective.h"
+#include "debug.h"
+
+/* Collectives in progress */
+static struct collective* active = NULL;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Ids are never 0 */
+static uint32 next_id = 1;
+
+static struct collective* find_collective (uint32 id);
+static struct coll_member* find_member (struct collective* c, int ourid);
+static int compare_members (const void* a, const void* b);
+static void fold (struct collective* c, int ourid, const void* data,
+        size_t sz);
+
+uint32
+collective_begin (struct collective* c, enum command command,
+        enum coll_reducer reducer, const int* ids, int n)
+{
+    int i;
+
+    ASSERT (c != NULL);
+    ASSERT (ids != NULL || n == 0);
+
+    memset (c, 0, sizeof *c);
+    c->members = malloc ((n > 0 ? n : 1) * sizeof *c->members);
+    if (c->members == NULL)
+        return 0;
+    for (i = 0; i < n; i++)
+    {
+        c->members[i].ourid = ids[i];
+        c->members[i].state = COLL_ASKED;
+    }
+    qsort (c->members, n, sizeof *c->members, &compare_members);
+    c->nmembers = n;
+
+    c->command = command;
+    c->reducer = reducer;
+    c->expected = n;
+    if (reducer == COLL_MIN)
+        c->acc = INT64_MAX;
+    else if (reducer == COLL_MAX)
+        c->acc = INT64_MIN;
+    pthread_cond_init (&c->done, NULL);
+
+    pthread_mutex_lock (&active_lock);
+    c->id = next_id++;
+    if (next_id == 0)
+        next_id = 1;
+    c->next = active;
+    active = c;
+    pthread_mutex_unlock (&active_lock);
+
+    return c->id;
+};
+
+void
+collective_unreached (struct collective* c, int ourid)
+{
+    ASSERT (c != NULL);
+
+    pthread_mutex_lock (&active_lock);
+    struct coll_member* member = find_member (c, ourid);
+    if (member != NULL && member->state == COLL_ASKED)
+    {
+        member->state = COLL_UNREACHED;
+        if (c->received >= --c->expected)
+            pthread_cond_signal (&c->done);
+    }
+    pthread_mutex_unlock (&active_lock);
+};
+
+int
+collective_contribute (uint32 id, int ourid, const void* data, size_t sz)
+{
+    pthread_mutex_lock (&active_lock);
+    struct collective* c = find_collective (id);
+    struct coll_member* member = c != NULL ? find_member (c, ourid) : NULL;
+    if (member == NULL || member->state != COLL_ASKED)
+    {
+        pthread_mutex_unlock (&active_lock);
+        return -1;
+    }
+
+    member->state = COLL_ANSWERED;
+    fold (c, ourid, data, sz);
+    if (++c->received == c->expected)
+        pthread_cond_signal (&c->done);
+    pthread_mutex_unlock (&active_lock);
+
+    return 0;
+};
+
+int
+collective_wait (struct collective* c, int timeout_ms)
+{
+    ASSERT (c != NULL);
+
+    if (timeout_ms <= 0)
+        timeout_ms = COLL_DEFAULT_TIMEOUT;
+
+    struct timespec deadline;
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock (&active_lock);
+    while (c->received < c->expected)
+    {
+        if (ETIMEDOUT == pthread_cond_timedwait (&c->done, &active_lock,
+                    &deadline))
+            break;
+    }
+
+    /* Unregister so stragglers find nothing to write into */
+    struct collective** p;
+    for (p = &active; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == c)
+        {
+            *p = c->next;
+            break;
+        }
+    }
+    int received = c->received;
+    pthread_mutex_unlock (&active_lock);
+
+    pthread_cond_destroy (&c->done);
+    free (c->members);
+    c->members = NULL;
+
+    /* Nobody answered a MIN or MAX, so there is nothing to report */
+    if (received == 0 && c->command == COLL_REDUCE &&
+            (c->reducer == COLL_MIN || c->reducer == COLL_MAX))
+        c->acc = 0;
+    if (c->command == COLL_REDUCE && c->reducer != COLL_CONCAT)
+    {
+        memcpy (c->result, &c->acc, sizeof c->acc);
+        c->len = sizeof c->acc;
+    }
+
+    return received;
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+/* ACTIVE_LOCK must be held */
+static struct collective*
+find_collective (uint32 id)
+{
+    struct collective* c;
+    for (c = active; c != NULL; c = c->next)
+        if (c->id == id)
+            return c;
+    return NULL;
+};
+
+/* The sibling OURID of C, or NULL if it was not asked */
+static struct coll_member*
+find_member (struct collective* c, int ourid)
+{
+    struct coll_member key = { ourid, 0 };
+    return bsearch (&key, c->members, c->nmembers, sizeof key,
+            &compare_members);
+};
+
+static int
+compare_members (const void* a, const void* b)
+{
+    int x = ((const struct coll_member*) a)->ourid;
+    int y = ((const struct coll_member*) b)->ourid;
+    return x < y ? -1 : x > y;
+};
+
+/* Folds one answer into C.  ACTIVE_LOCK must be held.  Answers that don't
+ * fit in the result anymore are counted but dropped. */
+static void
+fold (struct collective* c, int ourid, const void* data, size_t sz)
+{
+    int64_t v = 0;
+
+    switch (c->command)
+    {
+    case COLL_GATHER:
+    {
+        struct coll_entry e;
+        size_t rec = sizeof e + ((sz + 7) & ~(size_t) 7);
+        if (c->len + rec > sizeof c->result)
+            return;
+        e.ourid = ourid;
+        e.sz = sz;
+        memcpy (c->result + c->len, &e, sizeof e);
+        memcpy (c->result + c->len + sizeof e, data, sz);
+        c->len += rec;
+        break;
+    }
+    case COLL_REDUCE:
+        if (c->reducer == COLL_CONCAT)
+        {
+            if (c->len + sz > sizeof c->result)
+                return;
+            memcpy (c->result + c->len, data, sz);
+            c->len += sz;
+            break;
+        }
+
+        memcpy (&v, data, sz < sizeof v ? sz : sizeof v);
+        if (c->reducer == COLL_SUM)
+            c->acc += v;
+        else if (c->reducer == COLL_MIN && v < c->acc)
+            c->acc = v;
+        else if (c->reducer == COLL_MAX && v > c->acc)
+            c->acc = v;
+        break;
+    default:
+        /* A broadcast only counts acknowledgements */
+        break;
+    }
+};
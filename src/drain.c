@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "drain.h"
+#include "mysignal.h"
+#include "child.h"
+#include "epoch.h"
+#include "supervisor.h"
+#include "logging.h"
+#include "debug.h"
+
+/* How long killed children get to be reaped */
+#define DRAIN_KILL_WAIT     1000
+
+static int wait_children (int sfd, uint64_t until, bool stoppable);
+static void signal_children (int sig);
+
+void
+drain_children (int sfd, unsigned deadline, unsigned grace,
+        struct drain_stats* stats)
+{
+    uint64_t start = supervisor_clock ();
+    uint64_t undelivered = get_undelivered ();
+
+    ASSERT (stats != NULL);
+
+    memset (stats, 0, sizeof *stats);
+    supervisor_stop ();
+    stats->children = get_child_ids (NULL, 0);
+    stats->workers = supervisor_kill (SIGTERM);
+    log_info (LOG_SERVER, "Draining %d children, %d of them workers, for "
+            "up to %u ms", stats->children, stats->workers, deadline);
+
+    int left = wait_children (sfd, start + deadline, true);
+    stats->completed = stats->children - left;
+    if (left > 0)
+    {
+        log_warn (LOG_SERVER, "%d children still running, terminating them",
+                left);
+        signal_children (SIGTERM);
+        int after = wait_children (sfd, supervisor_clock () + grace, true);
+        stats->terminated = left - after;
+        left = after;
+    }
+    if (left > 0)
+    {
+        log_error (LOG_SERVER, "Killing %d children that would not exit",
+                left);
+        signal_children (SIGKILL);
+        stats->killed = left;
+        stats->lost = wait_children (sfd,
+                supervisor_clock () + DRAIN_KILL_WAIT, false);
+    }
+
+    /* With the children gone their brokers read end of file, drop their
+     * records and exit.  What was left in the mailboxes goes with them. */
+    stats->brokers = wait_brokers (grace);
+    epoch_collect ();
+    stats->undelivered = get_undelivered () - undelivered;
+    stats->elapsed = supervisor_clock () - start;
+
+    log_info (LOG_SERVER, "Drained in %llu ms: %d completed, %d terminated, "
+            "%d killed, %llu messages undelivered",
+            (unsigned long long) stats->elapsed, stats->completed,
+            stats->terminated, stats->killed,
+            (unsigned long long) stats->undelivered);
+    if (stats->lost > 0 || stats->brokers > 0)
+    {
+        log_error (LOG_SERVER, "%d children not reaped and %d brokers still "
+                "running at exit", stats->lost, stats->brokers);
+    }
+};
+
+/* === HELPER FUNCTIONS === */
+
+/* Handles signals from SFD until every child is reaped or UNTIL.  If
+ * STOPPABLE, one more SIGINT or SIGTERM ends it early.  Returns how many
+ * children are left. */
+static int
+wait_children (int sfd, uint64_t until, bool stoppable)
+{
+    struct pollfd pfd = { sfd, POLLIN, 0 };
+    unsigned stops = stop_signals ();
+    int left;
+
+    while ((left = get_child_ids (NULL, 0)) > 0)
+    {
+        uint64_t now = supervisor_clock ();
+        if (now >= until || (stoppable && stop_signals () != stops))
+            break;
+        if (poll (&pfd, 1, until - now) > 0)
+            handle_signals (sfd);
+    }
+    return left;
+};
+
+/* Sends SIG to every child in the index */
+static void
+signal_children (int sig)
+{
+    int n = get_child_ids (NULL, 0);
+    int* ids = n > 0 ? malloc (n * sizeof *ids) : NULL;
+    int i;
+
+    if (n == 0)
+        return;
+    if (ids == NULL)
+    {
+        log_error (LOG_SERVER, "Out of memory signalling children");
+        return;
+    }
+
+    /* Some may have gone since we counted, or come */
+    int now = get_child_ids (ids, n);
+    n = now < n ? now : n;
+
+    epoch_enter ();
+    for (i = 0; i < n; i++)
+    {
+        struct server_child* child = get_child (ids[i]);
+        if (child != NULL)
+            kill (child->pid, sig);
+    }
+    epoch_exit ();
+    free (ids);
+};
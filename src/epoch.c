@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "epoch.h"
+#include "debug.h"
+
+/* An object waiting to be destroyed */
+struct retired
+{
+    void* ptr;
+    epoch_destroy_func* func;
+    uint64_t epoch;             // global epoch when it was retired
+    struct retired* next;
+};
+
+/* Never 0, since 0 means outside */
+static uint64_t global_epoch = 1;
+
+/* Every record ever made.  Records are only ever added, at the head. */
+static struct epoch_record* records = NULL;
+
+static struct retired* retired_list = NULL;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct epoch_record* self = NULL;
+
+static struct epoch_record* get_record ();
+static uint64_t oldest_active ();
+
+void
+epoch_enter ()
+{
+    struct epoch_record* r = self ? self : get_record ();
+    if (r->depth++ > 0)
+        return;
+
+    /* Announce ourselves before reading anything shared.  The fence pairs
+     * with the one in epoch_collect: either the writer sees us, or we see
+     * the object already unlinked. */
+    __atomic_store_n (&r->active, __atomic_load_n (&global_epoch,
+                __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+};
+
+void
+epoch_exit ()
+{
+    struct epoch_record* r = self;
+    ASSERT (r != NULL && r->depth > 0);
+
+    if (--r->depth == 0)
+        __atomic_store_n (&r->active, 0, __ATOMIC_RELEASE);
+};
+
+void
+epoch_retire (void* ptr, epoch_destroy_func* func)
+{
+    ASSERT (func != NULL);
+
+    struct retired* r = malloc (sizeof *r);
+    if (r == NULL)
+    {
+        /* Nowhere to keep it; leaking beats a use after free */
+        return;
+    }
+    r->ptr = ptr;
+    r->func = func;
+
+    /* Readers that enter from now on get a later epoch and can't see PTR */
+    r->epoch = __atomic_fetch_add (&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock (&retired_lock);
+    r->next = retired_list;
+    retired_list = r;
+    pthread_mutex_unlock (&retired_lock);
+
+    epoch_collect ();
+};
+
+void
+epoch_collect ()
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    uint64_t oldest = oldest_active ();
+
+    /* Take what is safe off the list, destroy it outside the lock */
+    struct retired* ready = NULL;
+    pthread_mutex_lock (&retired_lock);
+    struct retired** p = &retired_list;
+    while (*p != NULL)
+    {
+        struct retired* r = *p;
+        if (oldest == 0 || r->epoch < oldest)
+        {
+            *p = r->next;
+            r->next = ready;
+            ready = r;
+        }
+        else
+            p = &r->next;
+    }
+    pthread_mutex_unlock (&retired_lock);
+
+    while (ready != NULL)
+    {
+        struct retired* r = ready;
+        ready = r->next;
+        r->func (r->ptr);
+        free (r);
+    }
+};
+
+void
+epoch_thread_exit ()
+{
+    struct epoch_record* r = self;
+    if (r == NULL)
+        return;
+
+    ASSERT (r->depth == 0);
+    self = NULL;
+    __atomic_store_n (&r->in_use, 0, __ATOMIC_RELEASE);
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+/* Finds the calling thread a record, reusing one from a thread that exited
+ * if there is one */
+static struct epoch_record*
+get_record ()
+{
+    struct epoch_record* r;
+    for (r = __atomic_load_n (&records, __ATOMIC_ACQUIRE); r != NULL;
+            r = r->next)
+    {
+        int expected = 0;
+        if (__atomic_load_n (&r->in_use, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n (&r->in_use, &expected, 1, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            self = r;
+            return r;
+        }
+    }
+
+    r = calloc (1, sizeof *r);
+    ASSERT (r != NULL);
+    r->in_use = 1;
+    r->next = __atomic_load_n (&records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&records, &r->next, r, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    self = r;
+    return r;
+};
+
+/* Returns the oldest epoch any reader is in, or 0 if none is inside */
+static uint64_t
+oldest_active ()
+{
+    uint64_t oldest = 0;
+    struct epoch_record* r;
+    for (r = __atomic_load_n (&records, __ATOMIC_ACQUIRE); r != NULL;
+            r = r->next)
+    {
+        uint64_t e = __atomic_load_n (&r->active, __ATOMIC_SEQ_CST);
+        if (e != 0 && (oldest == 0 || e < oldest))
+            oldest = e;
+    }
+    return oldest;
+};
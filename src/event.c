@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "debug.h"
+
+/* A subscription of SUBSCRIBER to TARGET, or to every sibling */
+struct event_sub
+{
+    int subscriber;
+    int target;
+    uint32 mask;
+    struct event_box* box;      // SUBSCRIBER's
+    struct event_sub* next;     // in the bucket of TARGET
+};
+
+/* Events waiting for SUBSCRIBER, one entry per sibling */
+struct event_box
+{
+    int subscriber;
+    bool notified;              // sent an EVENT_NOTIFY it hasn't polled yet
+    uint64_t seq;               // the last post queued here
+    uint32 n;
+    uint32 lost;
+    struct event_entry entries[EVENT_MAX_BATCH];
+    struct event_box* next;     // in the bucket of SUBSCRIBER
+};
+
+/* Subscriptions to one sibling, hashed by the sibling, and to all */
+static struct event_sub* subs[EVENT_BUCKETS];
+static struct event_sub* any_subs = NULL;
+
+/* Boxes hashed by subscriber */
+static struct event_box* boxes[EVENT_BUCKETS];
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static event_deliver_func* deliver = NULL;
+static uint64_t next_seq = 1;
+static struct event_stats stats;
+
+static struct event_sub** find_sub (struct event_sub** list, int subscriber,
+        int target);
+static struct event_box* find_box (int subscriber);
+static bool queue_event (struct event_box* b, uint64_t seq, int ourid,
+        uint32 event, int state, int status);
+static void drop_subs (struct event_sub** list, int ourid);
+
+void
+init_events (event_deliver_func* func)
+{
+    ASSERT (func != NULL);
+
+    deliver = func;
+    memset (subs, 0, sizeof subs);
+    memset (boxes, 0, sizeof boxes);
+    memset (&stats, 0, sizeof stats);
+};
+
+int
+event_subscribe (int subscriber, int target, uint32 mask)
+{
+    struct event_sub** list = target == SIBLING_ANY_SOURCE
+        ? &any_subs : &subs[(uint32) target % EVENT_BUCKETS];
+
+    pthread_mutex_lock (&event_lock);
+    struct event_sub** s = find_sub (list, subscriber, target);
+    if (mask == 0)
+    {
+        if (*s != NULL)
+        {
+            struct event_sub* old = *s;
+            *s = old->next;
+            free (old);
+        }
+        pthread_mutex_unlock (&event_lock);
+        return 0;
+    }
+
+    /* The box comes with the first subscription, so posting never has to
+     * allocate */
+    struct event_box* b = find_box (subscriber);
+    if (b == NULL && (b = calloc (1, sizeof *b)) != NULL)
+    {
+        struct event_box** bucket =
+            &boxes[(uint32) subscriber % EVENT_BUCKETS];
+        b->subscriber = subscriber;
+        b->next = *bucket;
+        *bucket = b;
+    }
+    if (*s == NULL && b != NULL && (*s = malloc (sizeof **s)) != NULL)
+    {
+        (*s)->subscriber = subscriber;
+        (*s)->target = target;
+        (*s)->box = b;
+        (*s)->next = NULL;
+    }
+    if (*s != NULL)
+        (*s)->mask = mask;
+    int result = *s != NULL ? 0 : -1;
+    pthread_mutex_unlock (&event_lock);
+
+    return result;
+};
+
+void
+event_post (int ourid, uint32 event, int state, int status)
+{
+    int notify[64];
+    int* more = notify;
+    size_t n = 0, max = sizeof notify / sizeof notify[0];
+    struct event_sub* s;
+    size_t i;
+
+    pthread_mutex_lock (&event_lock);
+    uint64_t seq = next_seq++;
+    stats.posted++;
+
+    /* Subscribers to this sibling first, then those to all of them; one
+     * that is both only gets the event once */
+    struct event_sub* lists[2] = { subs[(uint32) ourid % EVENT_BUCKETS],
+        any_subs };
+    for (i = 0; i < 2; i++)
+    {
+        for (s = lists[i]; s != NULL; s = s->next)
+        {
+            if (!(s->mask & event) || s->subscriber == ourid
+                    || (i == 0 && s->target != ourid))
+                continue;
+
+            struct event_box* b = s->box;
+            if (!queue_event (b, seq, ourid, event, state, status))
+                continue;
+
+            /* Notices go out once the lock is dropped, since a write to a
+             * full pipe would hold up everyone posting */
+            if (n == max)
+            {
+                int* grown = malloc (2 * max * sizeof *grown);
+                if (grown == NULL)
+                {
+                    b->notified = false;
+                    continue;
+                }
+                memcpy (grown, more, n * sizeof *grown);
+                if (more != notify)
+                    free (more);
+                more = grown;
+                max *= 2;
+            }
+            more[n++] = s->subscriber;
+        }
+    }
+    stats.notices += n;
+    pthread_mutex_unlock (&event_lock);
+
+    for (i = 0; i < n; i++)
+    {
+        struct message m;
+        memset (&m, 0, sizeof m);
+        m.command = EVENT_NOTIFY;
+        m.id = ourid;
+        deliver (more[i], &m);
+    }
+    if (more != notify)
+        free (more);
+};
+
+int
+event_poll (int subscriber, char* information, size_t* sz)
+{
+    struct event_header h = { 0, 0 };
+
+    pthread_mutex_lock (&event_lock);
+    struct event_box* b = find_box (subscriber);
+    if (b != NULL)
+    {
+        h.n = b->n;
+        h.lost = b->lost;
+        memcpy (information + sizeof h, b->entries,
+                b->n * sizeof b->entries[0]);
+        b->n = 0;
+        b->lost = 0;
+        b->notified = false;
+    }
+    pthread_mutex_unlock (&event_lock);
+
+    memcpy (information, &h, sizeof h);
+    *sz = sizeof h + h.n * sizeof (struct event_entry);
+    return h.n;
+};
+
+void
+event_forget (int ourid)
+{
+    int i;
+
+    pthread_mutex_lock (&event_lock);
+    for (i = 0; i < EVENT_BUCKETS; i++)
+        drop_subs (&subs[i], ourid);
+    drop_subs (&any_subs, ourid);
+
+    struct event_box** b = &boxes[(uint32) ourid % EVENT_BUCKETS];
+    for (; *b != NULL; b = &(*b)->next)
+    {
+        if ((*b)->subscriber == ourid)
+        {
+            struct event_box* old = *b;
+            *b = old->next;
+            free (old);
+            break;
+        }
+    }
+    pthread_mutex_unlock (&event_lock);
+};
+
+void
+event_get_stats (struct event_stats* out)
+{
+    pthread_mutex_lock (&event_lock);
+    memcpy (out, &stats, sizeof stats);
+    pthread_mutex_unlock (&event_lock);
+};
+
+/* === HELPER FUNCTIONS === */
+
+/* The link to the subscription of SUBSCRIBER to TARGET in LIST, which holds
+ * NULL if there is none */
+static struct event_sub**
+find_sub (struct event_sub** list, int subscriber, int target)
+{
+    while (*list != NULL && ((*list)->subscriber != subscriber
+                || (*list)->target != target))
+        list = &(*list)->next;
+    return list;
+};
+
+static struct event_box*
+find_box (int subscriber)
+{
+    struct event_box* b = boxes[(uint32) subscriber % EVENT_BUCKETS];
+    while (b != NULL && b->subscriber != subscriber)
+        b = b->next;
+    return b;
+};
+
+/* Merges the event into B's entry for OURID, or adds one.  Returns true if
+ * B's subscriber must now be notified. */
+static bool
+queue_event (struct event_box* b, uint64_t seq, int ourid, uint32 event,
+        int state, int status)
+{
+    uint32 i;
+
+    if (b->seq == seq)
+        return false;
+    b->seq = seq;
+    stats.queued++;
+
+    for (i = 0; i < b->n && b->entries[i].ourid != ourid; i++)
+        ;
+    if (i < b->n)
+        stats.merged++;
+    else if (b->n < EVENT_MAX_BATCH)
+    {
+        memset (&b->entries[i], 0, sizeof b->entries[i]);
+        b->entries[i].ourid = ourid;
+        b->n++;
+    }
+    else
+    {
+        b->lost++;
+        stats.lost++;
+    }
+
+    if (i < b->n)
+    {
+        struct event_entry* e = &b->entries[i];
+        e->events |= event;
+        if (e->count < UINT16_MAX)
+            e->count++;
+        e->state = state;
+        if (event & EVENT_EXIT)
+            e->status = status;
+    }
+
+    if (b->notified)
+        return false;
+    b->notified = true;
+    return true;
+};
+
+/* Frees the subscriptions in LIST of or to OURID */
+static void
+drop_subs (struct event_sub** list, int ourid)
+{
+    while (*list != NULL)
+    {
+        if ((*list)->subscriber == ourid || (*list)->target == ourid)
+        {
+            struct event_sub* old = *list;
+            *list = old->next;
+            free (old);
+        }
+        else
+            list = &(*list)->next;
+    }
+};
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "debug.h"
+
+#define HASH_MIN_BUCKETS    64
+
+static size_t bucket_of (uint64_t hash, size_t nbuckets);
+static bool grow (struct hash_table* h);
+
+int
+hash_init (struct hash_table* h)
+{
+    ASSERT (h != NULL);
+
+    h->buckets = calloc (HASH_MIN_BUCKETS, sizeof *h->buckets);
+    if (h->buckets == NULL)
+        return -1;
+    h->nbuckets = HASH_MIN_BUCKETS;
+    h->count = 0;
+    return 0;
+};
+
+void
+hash_destroy (struct hash_table* h)
+{
+    ASSERT (h != NULL);
+
+    free (h->buckets);
+    h->buckets = NULL;
+    h->nbuckets = 0;
+    h->count = 0;
+};
+
+void
+hash_insert (struct hash_table* h, struct hash_link* link, uint64_t hash)
+{
+    ASSERT (h != NULL);
+    ASSERT (link != NULL);
+
+    if (h->count >= h->nbuckets)
+        grow (h);
+
+    struct hash_link** bucket = &h->buckets[bucket_of (hash, h->nbuckets)];
+    link->hash = hash;
+    link->next = *bucket;
+    *bucket = link;
+    h->count++;
+};
+
+void
+hash_remove (struct hash_table* h, struct hash_link* link)
+{
+    ASSERT (h != NULL);
+    ASSERT (link != NULL);
+
+    struct hash_link** p;
+    for (p = &h->buckets[bucket_of (link->hash, h->nbuckets)]; *p != NULL;
+            p = &(*p)->next)
+    {
+        if (*p == link)
+        {
+            *p = link->next;
+            link->next = NULL;
+            h->count--;
+            return;
+        }
+    }
+    ASSERT (false);
+};
+
+struct hash_link*
+hash_first (const struct hash_table* h, uint64_t hash)
+{
+    ASSERT (h != NULL);
+
+    struct hash_link* l = h->buckets[bucket_of (hash, h->nbuckets)];
+    while (l != NULL && l->hash != hash)
+        l = l->next;
+    return l;
+};
+
+struct hash_link*
+hash_next (const struct hash_link* link)
+{
+    ASSERT (link != NULL);
+
+    struct hash_link* l = link->next;
+    while (l != NULL && l->hash != link->hash)
+        l = l->next;
+    return l;
+};
+
+/* The 64 bit finalizer from MurmurHash3 */
+uint64_t
+hash_int (uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+};
+
+/* FNV-1a, finalized so the low bits are usable as a bucket number */
+uint64_t
+hash_bytes (const void* data, size_t sz)
+{
+    ASSERT (data != NULL || sz == 0);
+
+    const unsigned char* p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < sz; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return hash_int (h);
+};
+
+
+
+/* ===  HELPER FUNCTIONS === */
+
+static size_t
+bucket_of (uint64_t hash, size_t nbuckets)
+{
+    return hash & (nbuckets - 1);
+};
+
+static bool
+grow (struct hash_table* h)
+{
+    size_t n = h->nbuckets * 2;
+    struct hash_link** buckets = calloc (n, sizeof *buckets);
+    if (buckets == NULL)
+        return false;
+
+    size_t i;
+    for (i = 0; i < h->nbuckets; i++)
+    {
+        struct hash_link* l = h->buckets[i];
+        while (l != NULL)
+        {
+            struct hash_link* next = l->next;
+            size_t b = bucket_of (l->hash, n);
+            l->next = buckets[b];
+            buckets[b] = l;
+            l = next;
+        }
+    }
+
+    free (h->buckets);
+    h->buckets = buckets;
+    h->nbuckets = n;
+    return true;
+};
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "idle.h"
+#include "timer.h"
+#include "logging.h"
+#include "debug.h"
+
+/* Watches one child.  Freed when the child is reaped, so the child, which
+ * the index holds until then, is always there to look at. */
+struct idle_timer
+{
+    struct timer timer;
+    struct server_child* child;
+};
+
+static struct timer_wheel wheel;
+static unsigned timeout = 0;
+
+static void expired (struct timer_wheel* w, struct timer* t, void* aux);
+
+void
+init_idle (unsigned timeout_ms)
+{
+    timer_wheel_init (&wheel, timer_now ());
+    timeout = timeout_ms;
+};
+
+void
+idle_watch (struct server_child* child)
+{
+    ASSERT (child->idle == NULL);
+
+    if (timeout == 0)
+        return;
+    struct idle_timer* idle = malloc (sizeof *idle);
+    if (idle == NULL)
+    {
+        log_warn (LOG_CHILD, "Out of memory, child %d is never terminated "
+                "for being idle", child->ourid);
+        return;
+    }
+    idle->child = child;
+    child->active = timer_now ();
+    child->idle = idle;
+    timer_init (&idle->timer, &expired, idle);
+    timer_arm (&wheel, &idle->timer, child->active + timeout);
+};
+
+void
+idle_forget (struct server_child* child)
+{
+    if (child->idle == NULL)
+        return;
+    timer_cancel (&wheel, &child->idle->timer);
+    free (child->idle);
+    child->idle = NULL;
+};
+
+int
+idle_run (uint64_t now)
+{
+    timer_advance (&wheel, now);
+    return timer_next (&wheel, now);
+};
+
+/* === HELPER FUNCTIONS === */
+
+static void
+expired (struct timer_wheel* w, struct timer* t, void* aux)
+{
+    struct idle_timer* idle = (struct idle_timer*) aux;
+    struct server_child* child = idle->child;
+
+    /* The broker clears BUSY only after stamping ACTIVE */
+    uint32 busy = __atomic_load_n (&child->busy, __ATOMIC_ACQUIRE);
+    uint64_t active = __atomic_load_n (&child->active, __ATOMIC_RELAXED);
+
+    if (busy)
+    {
+        timer_arm (w, t, timer_now () + timeout);
+        return;
+    }
+    /* Heard from since it was armed, so it has that long again */
+    if (active + timeout > t->expires)
+    {
+        timer_arm (w, t, active + timeout);
+        return;
+    }
+
+    /* Its timer stays until it is reaped */
+    log_info (LOG_CHILD, "Child %d (pid %d) idle for %u ms, terminating it",
+            child->ourid, (int) child->pid, timeout);
+    kill (child->pid, SIGTERM);
+};
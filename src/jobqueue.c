@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "jobqueue.h"
+#include "debug.h"
+
+/* The queue table */
+static struct job_queue queues[JOBQ_MAX_QUEUES];
+
+/* Serializes creation of queues */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct job_queue* get_queue (int q);
+static struct jobq_worker* get_worker (struct job_queue* queue, int ourid);
+static size_t deque_size (struct job_deque* dq);
+static bool deque_push_bottom (struct job_deque* dq, struct job* job);
+static struct job* deque_pop_bottom (struct job_deque* dq);
+static struct job* deque_steal_top (struct job_deque* dq);
+static int pop_locked (struct job_queue* queue, struct jobq_worker* me,
+        struct job** jobs, int max);
+static double seconds_since (const struct timespec* start);
+
+void
+init_jobqueues ()
+{
+    memset (queues, 0, sizeof queues);
+};
+
+int
+jobqueue_open (const char* name)
+{
+    ASSERT (name != NULL);
+
+    int i, free_q = -1;
+
+    pthread_mutex_lock (&table_lock);
+    for (i = 0; i < JOBQ_MAX_QUEUES; i++)
+    {
+        if (!queues[i].used)
+        {
+            if (free_q == -1)
+                free_q = i;
+        }
+        else if (strncmp (queues[i].name, name, sizeof queues[i].name) == 0)
+        {
+            pthread_mutex_unlock (&table_lock);
+            return i;
+        }
+    }
+
+    if (free_q != -1)
+    {
+        struct job_queue* queue = &queues[free_q];
+        memset (queue, 0, sizeof *queue);
+        strncpy (queue->name, name, sizeof queue->name - 1);
+        pthread_mutex_init (&queue->lock, NULL);
+        pthread_cond_init (&queue->nonempty, NULL);
+        queue->next_jobid = 1;
+        clock_gettime (CLOCK_MONOTONIC, &queue->opened);
+        queue->used = true;
+    }
+    pthread_mutex_unlock (&table_lock);
+
+    return free_q;
+};
+
+int
+jobqueue_push (int q, int producer, const void* data, size_t sz)
+{
+    struct job_queue* queue = get_queue (q);
+    if (queue == NULL || (data == NULL && sz > 0))
+        return -1;
+
+    struct job* job = malloc (sizeof (struct job) + sz);
+    if (job == NULL)
+        return -1;
+    job->producer = producer;
+    job->sz = sz;
+    memcpy (job->data, data, sz);
+
+    pthread_mutex_lock (&queue->lock);
+    struct jobq_worker* me = get_worker (queue, producer);
+    if (me == NULL || !deque_push_bottom (&me->deque, job))
+    {
+        pthread_mutex_unlock (&queue->lock);
+        free (job);
+        return -1;
+    }
+
+    /* Job ids are never 0, so callers can use it as "no job" */
+    job->jobid = queue->next_jobid++;
+    if (queue->next_jobid == 0)
+        queue->next_jobid = 1;
+
+    queue->stats.pushed++;
+    queue->stats.pending++;
+    int jobid = job->jobid;
+    pthread_cond_signal (&queue->nonempty);
+    pthread_mutex_unlock (&queue->lock);
+
+    return jobid;
+};
+
+int
+jobqueue_pop (int q, int worker, struct job** jobs, int max, int timeout_ms)
+{
+    struct job_queue* queue = get_queue (q);
+    if (queue == NULL || jobs == NULL || max <= 0)
+        return -1;
+
+    struct timespec deadline;
+    if (timeout_ms > 0)
+    {
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock (&queue->lock);
+    struct jobq_worker* me = get_worker (queue, worker);
+    if (me == NULL)
+    {
+        pthread_mutex_unlock (&queue->lock);
+        return -1;
+    }
+
+    /* Workers joining while we wait may move the array, but never our
+     * place in it */
+    size_t slot = me - queue->workers;
+    int n;
+    while ((n = me->closed ? -1 : pop_locked (queue, me, jobs, max)) == 0
+            && timeout_ms != 0)
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait (&queue->nonempty, &queue->lock);
+        }
+        else if (ETIMEDOUT == pthread_cond_timedwait (&queue->nonempty,
+                    &queue->lock, &deadline))
+        {
+            me = &queue->workers[slot];
+            n = me->closed ? -1 : pop_locked (queue, me, jobs, max);
+            break;
+        }
+        me = &queue->workers[slot];
+    }
+    pthread_mutex_unlock (&queue->lock);
+
+    if (n < 0)
+        errno = ESRCH;
+    return n;
+};
+
+int
+jobqueue_requeue (int q, int worker, struct job* job)
+{
+    struct job_queue* queue = get_queue (q);
+    if (queue == NULL || job == NULL)
+        return -1;
+
+    pthread_mutex_lock (&queue->lock);
+    struct jobq_worker* me = get_worker (queue, worker);
+    if (me == NULL || !deque_push_bottom (&me->deque, job))
+    {
+        pthread_mutex_unlock (&queue->lock);
+        return -1;
+    }
+
+    /* It was never really popped */
+    queue->stats.popped--;
+    queue->stats.pending++;
+    pthread_cond_signal (&queue->nonempty);
+    pthread_mutex_unlock (&queue->lock);
+
+    return 0;
+};
+
+void
+jobqueue_close_worker (int worker)
+{
+    int q, i;
+
+    for (q = 0; q < JOBQ_MAX_QUEUES; q++)
+    {
+        struct job_queue* queue = get_queue (q);
+        if (queue == NULL)
+            continue;
+
+        /* Only queues it has used know it */
+        pthread_mutex_lock (&queue->lock);
+        for (i = 0; i < queue->nworkers; i++)
+        {
+            if (queue->workers[i].ourid == worker)
+            {
+                queue->workers[i].closed = true;
+                pthread_cond_broadcast (&queue->nonempty);
+                break;
+            }
+        }
+        pthread_mutex_unlock (&queue->lock);
+    }
+};
+
+void
+jobqueue_complete (int q)
+{
+    struct job_queue* queue = get_queue (q);
+    if (queue == NULL)
+        return;
+
+    pthread_mutex_lock (&queue->lock);
+    queue->stats.completed++;
+    pthread_mutex_unlock (&queue->lock);
+};
+
+int
+jobqueue_stats (int q, struct jobq_stats* stats)
+{
+    struct job_queue* queue = get_queue (q);
+    if (queue == NULL || stats == NULL)
+        return -1;
+
+    pthread_mutex_lock (&queue->lock);
+    *stats = queue->stats;
+    pthread_mutex_unlock (&queue->lock);
+
+    stats->elapsed = seconds_since (&queue->opened);
+    stats->throughput = stats->elapsed > 0 ?
+        stats->completed / stats->elapsed : 0;
+    return 0;
+};
+
+void
+jobqueue_free_job (struct job* job)
+{
+    free (job);
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+static struct job_queue*
+get_queue (int q)
+{
+    if (q < 0 || q >= JOBQ_MAX_QUEUES || !queues[q].used)
+        return NULL;
+    return &queues[q];
+};
+
+/* Finds the deque of OURID in QUEUE, adding one if this is the first time
+ * the child uses the queue.  QUEUE must be locked. */
+static struct jobq_worker*
+get_worker (struct job_queue* queue, int ourid)
+{
+    int i;
+    for (i = 0; i < queue->nworkers; i++)
+        if (queue->workers[i].ourid == ourid)
+            return &queue->workers[i];
+
+    if (queue->nworkers == queue->maxworkers)
+    {
+        int max = queue->maxworkers ? queue->maxworkers * 2 : 8;
+        struct jobq_worker* w = realloc (queue->workers, max * sizeof *w);
+        if (w == NULL)
+            return NULL;
+        queue->workers = w;
+        queue->maxworkers = max;
+    }
+
+    struct jobq_worker* w = &queue->workers[queue->nworkers++];
+    memset (w, 0, sizeof *w);
+    w->ourid = ourid;
+    return w;
+};
+
+/* Pops up to MAX jobs for ME: its own newest jobs first, then up to half of
+ * the fullest sibling deque.  QUEUE must be locked. */
+static int
+pop_locked (struct job_queue* queue, struct jobq_worker* me,
+        struct job** jobs, int max)
+{
+    int n = 0;
+    while (n < max && deque_size (&me->deque) > 0)
+        jobs[n++] = deque_pop_bottom (&me->deque);
+
+    if (n == 0)
+    {
+        struct job_deque* victim = NULL;
+        size_t most = 0;
+        int i;
+        for (i = 0; i < queue->nworkers; i++)
+        {
+            size_t size = deque_size (&queue->workers[i].deque);
+            if (size > most)
+            {
+                most = size;
+                victim = &queue->workers[i].deque;
+            }
+        }
+
+        if (victim != NULL)
+        {
+            size_t take = (most + 1) / 2;
+            while (n < max && take-- > 0)
+                jobs[n++] = deque_steal_top (victim);
+            queue->stats.stolen += n;
+        }
+    }
+
+    queue->stats.popped += n;
+    queue->stats.pending -= n;
+    return n;
+};
+
+static size_t
+deque_size (struct job_deque* dq)
+{
+    return dq->bottom - dq->top;
+};
+
+static bool
+deque_push_bottom (struct job_deque* dq, struct job* job)
+{
+    if (deque_size (dq) == dq->capacity)
+    {
+        size_t capacity = dq->capacity ? dq->capacity * 2 : 16;
+        struct job** ring = malloc (capacity * sizeof *ring);
+        if (ring == NULL)
+            return false;
+
+        size_t i;
+        for (i = dq->top; i != dq->bottom; i++)
+            ring[i & (capacity - 1)] = dq->ring[i & (dq->capacity - 1)];
+        free (dq->ring);
+        dq->ring = ring;
+        dq->capacity = capacity;
+    }
+
+    dq->ring[dq->bottom++ & (dq->capacity - 1)] = job;
+    return true;
+};
+
+static struct job*
+deque_pop_bottom (struct job_deque* dq)
+{
+    ASSERT (deque_size (dq) > 0);
+    return dq->ring[--dq->bottom & (dq->capacity - 1)];
+};
+
+static struct job*
+deque_steal_top (struct job_deque* dq)
+{
+    ASSERT (deque_size (dq) > 0);
+    return dq->ring[dq->top++ & (dq->capacity - 1)];
+};
+
+static double
+seconds_since (const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_nsec - start->tv_nsec) / 1e9;
+};
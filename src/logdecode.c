@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "logging.h"
+#include "logformat.h"
+#include "type.h"
+
+/* logdecode [FILE]
+ *
+ * Writes a log file written in binary mode, or standard input, to standard
+ * output as the text the server would have written.  Text lines in the
+ * file are copied as they are. */
+
+/* Format strings by id, as defined so far in the file */
+static char** formats = NULL;
+static uint32 nformats = 0;
+
+/* The last CLOCK entry */
+static struct log_entry_clock anchor;
+static bool anchored = false;
+
+static void decode (FILE* in, FILE* out);
+static void define_format (const char* body, size_t len);
+static void print_line (FILE* out, const char* body, size_t len);
+static bool print_arg (FILE* out, const char* spec, const uint8* kinds,
+        int n, const char** args, const char* end);
+static void make_spec (char* spec, const char* start, const char* end,
+        int kind);
+
+int
+main (int argc, char** argv)
+{
+    FILE* in = stdin;
+
+    if (argc > 1 && (in = fopen (argv[1], "r")) == NULL)
+    {
+        perror (argv[1]);
+        return EXIT_FAILURE;
+    }
+    decode (in, stdout);
+    return 0;
+};
+
+static void
+decode (FILE* in, FILE* out)
+{
+    static char body[UINT16_MAX];
+    struct log_entry e;
+    int c;
+
+    while ((c = getc (in)) != EOF)
+    {
+        if (c != LOG_ENTRY_MAGIC)
+        {
+            /* A text line */
+            do
+                putc (c, out);
+            while (c != '\n' && (c = getc (in)) != EOF);
+            continue;
+        }
+
+        e.magic = c;
+        if (fread ((char*) &e + 1, sizeof e - 1, 1, in) != 1
+                || fread (body, 1, e.len, in) != e.len)
+        {
+            fprintf (stderr, "logdecode: truncated entry at the end\n");
+            return;
+        }
+
+        switch (e.type)
+        {
+            case LOG_ENTRY_FORMAT:
+                define_format (body, e.len);
+                break;
+            case LOG_ENTRY_CLOCK:
+                if (e.len >= sizeof anchor)
+                {
+                    memcpy (&anchor, body, sizeof anchor);
+                    anchored = true;
+                }
+                break;
+            case LOG_ENTRY_LINE:
+                print_line (out, body, e.len);
+                break;
+            default:
+                /* Newer than us; skip it */
+                break;
+        }
+    }
+};
+
+static void
+define_format (const char* body, size_t len)
+{
+    uint32 id;
+
+    if (len < sizeof id)
+        return;
+    memcpy (&id, body, sizeof id);
+    if (id >= nformats)
+    {
+        uint32 n = id + 64;
+        formats = realloc (formats, n * sizeof *formats);
+        memset (formats + nformats, 0, (n - nformats) * sizeof *formats);
+        nformats = n;
+    }
+    free (formats[id]);
+    formats[id] = strndup (body + sizeof id, len - sizeof id);
+};
+
+static void
+print_line (FILE* out, const char* body, size_t len)
+{
+    struct log_entry_line line;
+    char prefix[64];
+
+    if (len < sizeof line)
+        return;
+    memcpy (&line, body, sizeof line);
+
+    /* Time stamps are monotonic; the anchor maps them to the wall clock */
+    int64_t real = line.ts_ns;
+    if (anchored)
+        real = anchor.real_ns + ((int64_t) line.ts_ns - (int64_t) anchor.mono_ns);
+    log_prefix (prefix, real / 1000000000, line.pid);
+    fputs (prefix, out);
+
+    const char* format = line.id < nformats ? formats[line.id] : NULL;
+    if (format == NULL)
+    {
+        fprintf (out, "<format %u is not defined>\n", line.id);
+        return;
+    }
+
+    const char* args = body + sizeof line;
+    const char* end = body + len;
+    const char* p = format;
+    while (*p != '\0')
+    {
+        if (*p != '%')
+        {
+            putc (*p++, out);
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            putc ('%', out);
+            p += 2;
+            continue;
+        }
+
+        uint8 kinds[3];
+        int n = 0;
+        const char* next = log_scan_spec (p, kinds, &n, 3);
+        char spec[64];
+        if (next == NULL || next - p >= (long) sizeof spec - 3)
+        {
+            fprintf (out, "<bad conversion>");
+            break;
+        }
+        make_spec (spec, p, next, kinds[n - 1]);
+        if (!print_arg (out, spec, kinds, n, &args, end))
+        {
+            fprintf (out, "<missing arguments>");
+            break;
+        }
+        p = next;
+    }
+    putc ('\n', out);
+};
+
+/* Prints one conversion, taking its arguments from *ARGS */
+static bool
+print_arg (FILE* out, const char* spec, const uint8* kinds, int n,
+        const char** args, const char* end)
+{
+    int star[2] = { 0, 0 };
+    int i;
+
+    for (i = 0; i < n - 1; i++)
+    {
+        if (end - *args < (long) sizeof (int))
+            return false;
+        memcpy (&star[i], *args, sizeof (int));
+        *args += sizeof (int);
+    }
+
+#define PRINT(v)                                                        \
+    (n == 1 ? fprintf (out, spec, v)                                    \
+     : n == 2 ? fprintf (out, spec, star[0], v)                         \
+     : fprintf (out, spec, star[0], star[1], v))
+
+    switch (kinds[n - 1])
+    {
+        case LOG_ARG_INT:
+        {
+            int v;
+            if (end - *args < (long) sizeof v)
+                return false;
+            memcpy (&v, *args, sizeof v);
+            *args += sizeof v;
+            PRINT (v);
+            break;
+        }
+        case LOG_ARG_LONG:
+        {
+            long long v;
+            if (end - *args < (long) sizeof v)
+                return false;
+            memcpy (&v, *args, sizeof v);
+            *args += sizeof v;
+            PRINT (v);
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double v;
+            if (end - *args < (long) sizeof v)
+                return false;
+            memcpy (&v, *args, sizeof v);
+            *args += sizeof v;
+            PRINT (v);
+            break;
+        }
+        case LOG_ARG_PTR:
+        {
+            uint64_t v;
+            if (end - *args < (long) sizeof v)
+                return false;
+            memcpy (&v, *args, sizeof v);
+            *args += sizeof v;
+            PRINT ((void*) (uintptr_t) v);
+            break;
+        }
+        case LOG_ARG_STR:
+        {
+            char str[LOG_LINE_MAX + 1];
+            uint16 len;
+            if (end - *args < (long) sizeof len)
+                return false;
+            memcpy (&len, *args, sizeof len);
+            if (end - *args - (long) sizeof len < len || len > LOG_LINE_MAX)
+                return false;
+            memcpy (str, *args + sizeof len, len);
+            str[len] = '\0';
+            *args += sizeof len + len;
+            PRINT (str);
+            break;
+        }
+        default:
+            return false;
+    }
+#undef PRINT
+    return true;
+};
+
+/* Copies the conversion from START to END into SPEC, with its length
+ * modifier replaced by what the stored argument needs: ll for a LONG,
+ * which is always stored as long long, and none otherwise.  An INT keeps
+ * h or hh, since it is stored as the promoted int and printf must narrow
+ * it just as it did for the text log. */
+static void
+make_spec (char* spec, const char* start, const char* end, int kind)
+{
+    const char* p;
+
+    for (p = start; p < end - 1; p++)
+    {
+        if (strchr ("ljzt", *p) == NULL && (*p != 'h' || kind == LOG_ARG_INT))
+            *spec++ = *p;
+    }
+    if (kind == LOG_ARG_LONG)
+    {
+        *spec++ = 'l';
+        *spec++ = 'l';
+    }
+    *spec++ = end[-1];
+    *spec = '\0';
+};
@@ -1,67 +1,387 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "logging.h"
+#include "logformat.h"
+#include "type.h"
+
+/* Size of the writer's batch buffer for each file */
+#define LOG_BATCH_BYTES (64 * 1024)
+
+/* Longest the writer sleeps before looking at the rings again */
+#define LOG_FLUSH_MS    10
+
+/* Room for the time stamp and pid in front of a line */
+#define LOG_PREFIX_MAX  64
+
+/* How long a claimed slot in the shared ring may stay unfilled before the
+ * writer gives up on it */
+#define LOG_STALL_MS    1000
+
+/* How often the writer ties the monotonic clock of binary records to the
+ * wall clock again */
+#define LOG_ANCHOR_SEC  60
+
+/* Longest format string written to a binary log */
+#define LOG_FORMAT_MAX  4096
+
+#define LOG_OPEN_FLAGS  (O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC)
+#define LOG_OPEN_MODE   (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/* What compresses rotated files, and how many may run at once */
+#define LOG_COMPRESS_CMD    "gzip"
+#define LOG_COMPRESS_MAX    4
+
+/* The summary written for a call site that went over its rate */
+#define LOG_SUPPRESSED  "%u more lines like this were suppressed: %.*s"
+
+#define LOAD(p)         __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v)     __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+
+/* A line waiting for the writer.  FORMAT is NULL for a text line; for a
+ * binary one TEXT holds the raw arguments and TS is CLOCK_MONOTONIC_COARSE
+ * rather than CLOCK_REALTIME. */
+struct log_record
+{
+    struct timespec ts;
+    struct log_format* format;
+    pid_t pid;
+    uint16 len;
+    uint8 stream;
+    char text[LOG_LINE_MAX];
+};
+
+enum ring_state
+{
+    RING_FREE = 0,          // on the list, waiting for a thread
+    RING_LIVE = 1,          // owned by a running thread
+    RING_DEAD = 2           // owner exited; the writer frees it once empty
+};
+
+/* Single producer, single consumer ring.  Only the owning thread moves
+ * TAIL and only the writer moves HEAD; they live on separate cache lines so
+ * the two do not bounce one line between them. */
+struct log_ring
+{
+    uint32 head __attribute__ ((aligned (64)));
+    uint32 tail __attribute__ ((aligned (64)));
+    uint32 dropped;
+    uint32 state;
+    struct log_ring* next;
+    struct log_record slots[LOG_RING_SLOTS];
+};
 
-static FILE* logfile;
-static FILE* errfile;
+/* How the writer is put to sleep and woken.  Lives in the shared ring once
+ * there is one, so children can wake the parent's writer. */
+struct log_wake
+{
+    uint32 asleep;
+    uint32 seq;             // futex word
+};
 
-static time_t t;
-static struct tm* local;
+/* A slot of the shared ring.  SEQ is the position the slot is free for,
+ * that plus one once it is filled, and moves on a lap when it is drained. */
+struct log_slot
+{
+    uint32 seq;
+    pid_t owner;            // process filling the slot
+    struct log_record rec;
+};
+
+/* Shared multi-producer ring.  Producers claim a position by moving TAIL;
+ * only the parent's writer moves HEAD. */
+struct log_region
+{
+    struct log_wake wake __attribute__ ((aligned (64)));
+    uint32 tail __attribute__ ((aligned (64)));
+    uint32 dropped __attribute__ ((aligned (64)));
+    uint32 head __attribute__ ((aligned (64)));
+    struct log_slot slots[LOG_SHARED_SLOTS];
+};
+
+/* A formatted time stamp, redone only when the second changes */
+struct stamp
+{
+    time_t sec;
+    int len;
+    char text[48];
+};
 
 static char* days[7] = {
         "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
 static char* months[12] = {
-        "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
 /* PID to write to the log */
 static pid_t pid = 0;
 
-static void print_time (FILE* fd);
-static void print_pid (FILE* fd);
+/* The log files, indexed by stream */
+static int fds[2] = { -1, -1 };
 
-/* Keep our file accesses synchronized */
-static sem_t* logsem = NULL;
-static sem_t* errsem = NULL;
+/* Every ring ever handed out.  Rings are recycled, never freed, so the
+ * writer can walk the list without a lock; the lock only serializes
+ * threads claiming a ring. */
+static struct log_ring* rings = NULL;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
 
-int 
+static __thread struct log_ring* myring = NULL;
+
+/* Set while this thread is filling a slot, so a signal handler that logs
+ * on the same thread writes directly instead of racing for the slot */
+static __thread bool in_log = false;
+
+static enum log_overflow overflow = LOG_OVERFLOW_BLOCK;
+
+/* Binary mode, and whether the writer can read our call sites */
+static bool binary = false;
+static bool binary_ok = true;
+
+/* The paths the log files were opened at */
+static char* paths[2] = { NULL, NULL };
+
+/* When to rotate, 0 meaning never, and whether to compress what we
+ * rotated */
+static unsigned long rotate_bytes = 0;
+static unsigned rotate_sec = 0;
+static bool rotate_compress = false;
+
+/* Only touched by the writer: how long each file is and when we opened
+ * it */
+static unsigned long file_bytes[2];
+static time_t file_opened[2];
+
+/* The compressors the writer started that have not been reaped.  We never
+ * wait for them ourselves: whoever handles SIGCHLD reaps every child and
+ * tells us through LOG_CHILD_EXITED, and a pid we waited for by name could
+ * already be somebody else's. */
+static pid_t compressors[LOG_COMPRESS_MAX];
+static pthread_mutex_t compressors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set by REOPEN_LOGGING for the writer */
+static uint32 reopen_wanted = 0;
+
+/* When a process writing directly last made sure its files are still the
+ * ones at their paths */
+static time_t checked[2];
+
+/* Bumped each time the log files are opened.  Binary entries the writer
+ * keeps per file (formats and clock anchors) are tagged with it. */
+static uint32 file_gen = 0;
+static uint32 next_format_id = 1;
+static uint32 anchor_gen[2];
+static time_t anchor_sec[2];
+
+/* The shared ring, and whether we are the process that drains it */
+static struct log_region* region = NULL;
+static bool region_owner = false;
+
+/* The process whose writer empties the shared ring, for one attached to it */
+static pid_t region_parent = 0;
+
+/* Our pid, cached since getpid is a syscall */
+static pid_t self = 0;
+
+/* Slot the writer is waiting on in the shared ring, and since when */
+static uint32 stall_pos;
+static struct timespec stall_start;
+
+/* The writer thread */
+static pthread_t writer;
+static bool writer_running = false;
+static bool writer_stop = false;
+static struct log_wake local_wake;
+static struct log_wake* waker = &local_wake;
+static unsigned long passes = 0;
+
+static unsigned long lines_written = 0;
+static unsigned long lines_dropped = 0;
+static unsigned long batches_written = 0;
+static unsigned long lines_suppressed = 0;
+
+uint8 log_levels[LOG_SUBSYSTEMS] = {
+        LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL,
+        LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL};
+
+static const char* subsystem_names[LOG_SUBSYSTEMS] = {
+        "server", "accept", "broker", "child", "signal"};
+static const char* level_names[LOG_LEVEL_DEBUG + 1] = {
+        "error", "warn", "info", "debug"};
+
+/* Lines a call site may write each second, or 0 for no limit */
+static uint32 rate_limit = LOG_DEFAULT_RATE;
+
+/* Call sites that have suppressed lines at some point */
+static struct log_format* limited = NULL;
+
+static void setup_once ();
+static void before_fork ();
+static void after_fork_parent ();
+static void after_fork_child ();
+static void release_ring (void* ring);
+static struct log_ring* claim_ring ();
+static bool rate_ok (struct log_format* site, int stream);
+static void report_suppressed (struct log_format* site);
+static void log_text (int stream, const char* format, ...);
+static int find_name (const char** names, int n, const char* name,
+        size_t len);
+static void log_line (struct log_format* site, int stream,
+        const char* format, va_list args);
+static void fill_record (struct log_record* rec, struct log_format* site,
+        int stream, const char* format, va_list args);
+static bool format_ready (struct log_format* site);
+static int capture_args (const struct log_format* site, char* out,
+        size_t room, va_list args);
+static void write_now (int stream, const char* format, va_list args);
+static void note_now (int stream, const char* format, ...);
+static void write_shared (struct log_format* site, int stream,
+        const char* format, va_list args);
+static void wake_writer ();
+static void kick_writer (struct log_wake* w);
+static void* writer_main (void* aux);
+static bool drain_rings (char** batch, size_t* used);
+static bool drain_shared (char** batch, size_t* used, struct stamp* s);
+static bool shared_stalled (struct log_slot* slot, uint32 pos);
+static bool rings_empty ();
+static void add_record (char** batch, size_t* used, struct stamp* s,
+        const struct log_record* rec);
+static void add_dropped (char** batch, size_t* used, struct stamp* s,
+        uint32 dropped);
+static bool add_suppressed (char** batch, size_t* used, struct stamp* s);
+static void add_binary (char** batch, size_t* used,
+        const struct log_record* rec);
+static void add_entry (char** batch, size_t* used, int stream, int type,
+        const void* head, size_t head_len, const void* body,
+        size_t body_len);
+static uint64_t to_ns (const struct timespec* ts);
+static void flush_batch (int stream, char* batch, size_t* used);
+static size_t format_prefix (char* buf, struct stamp* s,
+        const struct timespec* ts, pid_t p);
+static void write_all (int fd, const char* buf, size_t len);
+static void maintain_files ();
+static void rotate_file (int stream, time_t now);
+static bool name_taken (const char* name);
+static void compress_file (const char* name);
+static void check_file (int stream);
+static int reopen_file (int stream);
+static void stat_file (int stream);
+
+int
 init_logging (char* logfile_path, char* errfile_path)
 {
-    logfile = fopen (logfile_path, "a");
-    errfile = fopen (errfile_path, "a");
+    pthread_once (&once, &setup_once);
 
-    int try = 0;
-    do {
-        if (!logsem || logsem == SEM_FAILED)
-        {
-            logsem = sem_open ("/server_logsem", O_CREAT);
-        }
-        if (!errsem || errsem == SEM_FAILED)
-        {
-            errsem = sem_open ("/server_errsem", O_CREAT);
-        }
-        try++;
-    } while ((logsem == SEM_FAILED || errsem == SEM_FAILED) &&
-            try < 10);
+    if (fds[LOG_STREAM] != -1)
+        end_logging ();
 
-    if (logsem == SEM_FAILED || errsem == SEM_FAILED)
+    fds[LOG_STREAM] = open (logfile_path, LOG_OPEN_FLAGS, LOG_OPEN_MODE);
+    fds[ERR_STREAM] = open (errfile_path, LOG_OPEN_FLAGS, LOG_OPEN_MODE);
+    if (fds[LOG_STREAM] == -1 || fds[ERR_STREAM] == -1)
     {
+        if (fds[LOG_STREAM] != -1)
+            close (fds[LOG_STREAM]);
+        if (fds[ERR_STREAM] != -1)
+            close (fds[ERR_STREAM]);
+        fds[LOG_STREAM] = fds[ERR_STREAM] = -1;
         return -1;
     }
 
+    free (paths[LOG_STREAM]);
+    free (paths[ERR_STREAM]);
+    paths[LOG_STREAM] = strdup (logfile_path);
+    paths[ERR_STREAM] = strdup (errfile_path);
+    stat_file (LOG_STREAM);
+    stat_file (ERR_STREAM);
+
+    /* If the writer can't be started we still log, just synchronously */
+    file_gen++;
+    STORE (&writer_stop, false);
+    STORE (&writer_running, true);
+    if (pthread_create (&writer, NULL, &writer_main, NULL) != 0)
+        STORE (&writer_running, false);
+
     server_log ("\n--------------------------------------------------\n");
     return 0;
 };
 
+int
+init_log_ring ()
+{
+    char name[32];
+    snprintf (name, sizeof name, "/server_log.%d", (int) getpid ());
+
+    int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return -1;
+
+    /* Children get the ring through the inherited descriptor */
+    shm_unlink (name);
+
+    struct log_region* r;
+    if (ftruncate (fd, sizeof *r) == -1
+            || (r = mmap (NULL, sizeof *r, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close (fd);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < LOG_SHARED_SLOTS; i++)
+        r->slots[i].seq = i;
+
+    /* shm_open sets close-on-exec, but scripts attach after exec */
+    fcntl (fd, F_SETFD, fcntl (fd, F_GETFD) & ~FD_CLOEXEC);
+
+    region = r;
+    region_owner = true;
+
+    /* The writer may be asleep on the old word */
+    struct log_wake* old = waker;
+    STORE (&waker, &r->wake);
+    STORE (&old->asleep, 1);
+    kick_writer (old);
+    return fd;
+};
+
+int
+attach_log_ring (int fd)
+{
+    struct log_region* r = mmap (NULL, sizeof *r, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (r == MAP_FAILED)
+        return -1;
+
+    region = r;
+    region_owner = false;
+    region_parent = getppid ();
+    binary_ok = false;
+    waker = &r->wake;
+    self = getpid ();
+    return 0;
+};
+
 void
 set_log_child (pid_t p)
 {
@@ -69,95 +389,1302 @@ set_log_child (pid_t p)
 };
 
 void
-server_log (const char* format, ...)
+set_log_overflow (enum log_overflow policy)
 {
-    va_list args;
+    STORE (&overflow, policy);
+};
 
-    sem_wait (logsem);
+void
+set_log_binary (bool on)
+{
+    STORE (&binary, on);
+};
 
-    /* Since another process may have written to this file, we need to
-     * make sure the current pos is at the end */
-    fseek (logfile, 0, SEEK_END);
+void
+set_log_level (enum log_subsystem sub, int level)
+{
+    if (sub >= 0 && sub < LOG_SUBSYSTEMS)
+        STORE (&log_levels[sub], level);
+};
 
-    print_time (logfile);
-    print_pid (logfile);
+int
+set_log_levels (const char* spec)
+{
+    const char* p = spec;
 
-    va_start (args, format);
-    vfprintf (logfile, format, args);
-    va_end (args);
+    while (*p != '\0')
+    {
+        const char* end = p + strcspn (p, ",");
+        const char* eq = memchr (p, '=', end - p);
+        int sub = -1;
+        int level;
+
+        if (eq != NULL)
+        {
+            sub = find_name (subsystem_names, LOG_SUBSYSTEMS, p, eq - p);
+            if (sub == -1)
+                return -1;
+            p = eq + 1;
+        }
+        level = find_name (level_names, LOG_LEVEL_DEBUG + 1, p, end - p);
+        if (level == -1)
+            return -1;
 
-    fprintf (logfile, "\n");
+        if (sub != -1)
+        {
+            set_log_level (sub, level);
+        }
+        else
+        {
+            for (sub = 0; sub < LOG_SUBSYSTEMS; sub++)
+                set_log_level (sub, level);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+};
+
+void
+set_log_rate (unsigned lines_per_sec)
+{
+    STORE (&rate_limit, lines_per_sec);
+};
 
-    sem_post (logsem);
+void
+set_log_rotation (unsigned long max_bytes, unsigned max_sec, bool compress)
+{
+    STORE (&rotate_bytes, max_bytes);
+    STORE (&rotate_sec, max_sec);
+    STORE (&rotate_compress, compress);
+};
+
+void
+reopen_logging ()
+{
+    STORE (&reopen_wanted, 1);
+    kick_writer (LOAD (&waker));
+};
+
+bool
+log_child_exited (pid_t pid)
+{
+    bool found = false;
+    int i;
+
+    if (pid <= 0)
+        return false;
+    pthread_mutex_lock (&compressors_lock);
+    for (i = 0; i < LOG_COMPRESS_MAX && !found; i++)
+    {
+        if (compressors[i] == pid)
+        {
+            compressors[i] = 0;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock (&compressors_lock);
+    return found;
 };
 
-void 
-server_err (const char* format, ...)
+void
+log_at (struct log_format* site, int stream, const char* format, ...)
 {
     va_list args;
 
-    sem_wait (errsem);
+    if (LOAD (&rate_limit) != 0 && !rate_ok (site, stream))
+        return;
 
-    fseek (errfile, 0, SEEK_END);
+    va_start (args, format);
+    log_line (site, stream, format, args);
+    va_end (args);
+};
 
-    print_time (errfile);
-    print_pid (errfile);
+void
+(server_log) (const char* format, ...)
+{
+    va_list args;
 
     va_start (args, format);
-    vfprintf (errfile, format, args);
+    log_line (NULL, LOG_STREAM, format, args);
     va_end (args);
+};
 
-    fprintf (errfile, "\n");
+void
+(server_err) (const char* format, ...)
+{
+    va_list args;
 
-    sem_post (errsem);
+    va_start (args, format);
+    log_line (NULL, ERR_STREAM, format, args);
+    va_end (args);
 };
 
 void
-print_err (int err)
+(print_err) (int err)
 {
-//    char buf[256];
-//    strerror (err, buf, sizeof buf);    
-//    server_err ("%s", buf);
-    server_err ("%s", strerror (err));
+    (server_err) ("%s", strerror (err));
 };
 
 void
-end_logging ()
+flush_logging ()
 {
-    fclose (logfile);
-    fclose (errfile);
+    /* Two full passes after this point have picked up everything queued
+     * before it */
+    unsigned long target = LOAD (&passes) + 2;
+    while (LOAD (&writer_running) && LOAD (&passes) < target)
+    {
+        kick_writer (waker);
+        sched_yield ();
+    }
+};
 
-    sem_close (logsem);
-    sem_close (errsem);
+void
+get_log_stats (struct log_stats* stats)
+{
+    stats->lines = LOAD (&lines_written);
+    stats->dropped = LOAD (&lines_dropped);
+    stats->batches = LOAD (&batches_written);
+    stats->suppressed = LOAD (&lines_suppressed);
 };
 
 void
-print_time (FILE* fd)
+end_logging ()
 {
-    struct tm* l;
+    struct log_format* f;
+
+    /* Summaries of whatever is still held back go out with the rest */
+    for (f = LOAD (&limited); f != NULL; f = f->next_limited)
+        report_suppressed (f);
 
-    t = time (NULL);
-    l = local = localtime (&t);
- 
-    // format the time like [YYYY/MM/DD HH:MM:SS]
-    const char* format = "[%s %s %d, %d %02d:%02d:%02d] ";
-    const char* day = days[l->tm_wday];
-    const char* month = months[l->tm_mon];
-    fprintf (fd, format, 
-            day, month, l->tm_mday, (1900 + l->tm_year), 
-            l->tm_hour, l->tm_min, l->tm_sec);
+    /* Callers from here on write directly; the writer drains what is
+     * queued before it exits */
+    if (LOAD (&writer_running))
+    {
+        STORE (&writer_running, false);
+        STORE (&writer_stop, true);
+        kick_writer (waker);
+        pthread_join (writer, NULL);
+    }
+
+    if (fds[LOG_STREAM] != -1)
+        close (fds[LOG_STREAM]);
+    if (fds[ERR_STREAM] != -1)
+        close (fds[ERR_STREAM]);
+    fds[LOG_STREAM] = fds[ERR_STREAM] = -1;
 };
 
-void
-print_pid (FILE* fd)
+
+const char*
+log_scan_spec (const char* p, uint8* kinds, int* n, int max)
+{
+    bool wide = false;
+
+    /* Flags, then width and precision, either of which may be '*' */
+    for (p++; *p != '\0' && strchr ("-+ #0'", *p) != NULL; p++)
+        ;
+    if (*p == '*')
+    {
+        if (*n >= max)
+            return NULL;
+        kinds[(*n)++] = LOG_ARG_INT;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            if (*n >= max)
+                return NULL;
+            kinds[(*n)++] = LOG_ARG_INT;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    /* Length.  h and hh arguments arrive as int anyway. */
+    while (*p == 'h')
+        p++;
+    if (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't')
+    {
+        wide = true;
+        p += p[0] == 'l' && p[1] == 'l' ? 2 : 1;
+    }
+    else if (*p == 'L' || *p == 'q')
+    {
+        return NULL;
+    }
+
+    if (*n >= max)
+        return NULL;
+    switch (*p)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            kinds[(*n)++] = wide ? LOG_ARG_LONG : LOG_ARG_INT;
+            break;
+        case 'c':
+            if (wide)
+                return NULL;
+            kinds[(*n)++] = LOG_ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+        case 'a': case 'A':
+            kinds[(*n)++] = LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            if (wide)
+                return NULL;
+            kinds[(*n)++] = LOG_ARG_STR;
+            break;
+        case 'p':
+            kinds[(*n)++] = LOG_ARG_PTR;
+            break;
+        default:
+            return NULL;
+    }
+    return p + 1;
+};
+
+size_t
+log_prefix (char* buf, time_t sec, pid_t p)
+{
+    struct stamp s = { .sec = -1 };
+    struct timespec ts = { sec, 0 };
+
+    return format_prefix (buf, &s, &ts, p);
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+static void
+setup_once ()
+{
+    pthread_key_create (&ring_key, &release_ring);
+    pthread_atfork (&before_fork, &after_fork_parent, &after_fork_child);
+    atexit (&end_logging);
+};
+
+static void
+before_fork ()
+{
+    pthread_mutex_lock (&ring_lock);
+};
+
+static void
+after_fork_parent ()
+{
+    pthread_mutex_unlock (&ring_lock);
+};
+
+/* The child has no writer thread, and whatever is queued in the rings is
+ * the parent's to write.  From here on the child logs to the shared ring,
+ * or directly if there is none; INIT_LOGGING starts a writer of our own if
+ * we need one. */
+static void
+after_fork_child ()
+{
+    pthread_mutex_unlock (&ring_lock);
+    rings = NULL;
+    myring = NULL;
+    writer_running = false;
+    region_owner = false;
+    self = getpid ();
+
+    /* Lines suppressed so far are the parent's to report */
+    struct log_format* f;
+    for (f = limited; f != NULL; f = f->next_limited)
+        f->suppressed = 0;
+};
+
+/* Thread exit.  The writer recycles the ring once it has drained it. */
+static void
+release_ring (void* ring)
+{
+    STORE (&((struct log_ring*) ring)->state, RING_DEAD);
+};
+
+static struct log_ring*
+claim_ring ()
+{
+    struct log_ring* r;
+
+    pthread_mutex_lock (&ring_lock);
+    for (r = rings; r != NULL; r = r->next)
+    {
+        if (LOAD (&r->state) == RING_FREE)
+            break;
+    }
+    if (r == NULL)
+    {
+        if (posix_memalign ((void**) &r, 64, sizeof *r) != 0)
+        {
+            pthread_mutex_unlock (&ring_lock);
+            return NULL;
+        }
+        memset (r, 0, sizeof *r);
+        r->next = rings;
+        STORE (&rings, r);
+    }
+    STORE (&r->state, RING_LIVE);
+    pthread_mutex_unlock (&ring_lock);
+
+    pthread_setspecific (ring_key, r);
+    myring = r;
+    return r;
+};
+
+/* Counts a line against SITE's rate for the current second.  Returns
+ * false if it is over, in which case the line is only counted.  Whoever
+ * starts the next second writes the summary for the last one, unless the
+ * writer gets there first. */
+static bool
+rate_ok (struct log_format* site, int stream)
 {
-    if (pid == 0)
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &now);
+    uint32 window = __atomic_load_n (&site->window, __ATOMIC_RELAXED);
+    if (window != (uint32) now.tv_sec
+            && __atomic_compare_exchange_n (&site->window, &window,
+                now.tv_sec, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n (&site->count, 0, __ATOMIC_RELAXED);
+        report_suppressed (site);
+    }
+
+    if (__atomic_fetch_add (&site->count, 1, __ATOMIC_RELAXED)
+            < LOAD (&rate_limit))
+        return true;
+
+    uint32 listed = 0;
+    if (__atomic_compare_exchange_n (&site->listed, &listed, 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        site->stream = stream;
+        site->next_limited = LOAD (&limited);
+        while (!__atomic_compare_exchange_n (&limited, &site->next_limited,
+                    site, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            ;
+    }
+    __atomic_add_fetch (&site->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+};
+
+/* Logs how many lines SITE has suppressed since the last summary, if
+ * any */
+static void
+report_suppressed (struct log_format* site)
+{
+    uint32 n = __atomic_exchange_n (&site->suppressed, 0, __ATOMIC_RELAXED);
+
+    if (n > 0)
     {
-        fprintf (fd, "server: ");
+        __atomic_add_fetch (&lines_suppressed, n, __ATOMIC_RELAXED);
+        log_text (site->stream, LOG_SUPPRESSED, n,
+                (int) strlen (site->format), site->format);
+    }
+};
+
+static void
+log_text (int stream, const char* format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    log_line (NULL, stream, format, args);
+    va_end (args);
+};
+
+/* Index of the first N NAMES that is the LEN bytes at NAME, or -1 */
+static int
+find_name (const char** names, int n, const char* name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (strlen (names[i]) == len && strncmp (names[i], name, len) == 0)
+            return i;
+    }
+    return -1;
+};
+
+static void
+log_line (struct log_format* site, int stream, const char* format,
+        va_list args)
+{
+    if (in_log || !LOAD (&writer_running))
+    {
+        if (region != NULL && !in_log)
+            write_shared (site, stream, format, args);
+        else
+            write_now (stream, format, args);
+        return;
+    }
+
+    struct log_ring* r = myring != NULL ? myring : claim_ring ();
+    if (r == NULL)
+    {
+        write_now (stream, format, args);
+        return;
+    }
+
+    in_log = true;
+    uint32 tail = r->tail;
+    uint32 head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    while (tail - head >= LOG_RING_SLOTS)
+    {
+        if (overflow == LOG_OVERFLOW_DROP || !LOAD (&writer_running))
+        {
+            __atomic_add_fetch (&r->dropped, 1, __ATOMIC_RELAXED);
+            in_log = false;
+            wake_writer ();
+            return;
+        }
+        wake_writer ();
+        sched_yield ();
+        head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    }
+
+    fill_record (&r->slots[tail % LOG_RING_SLOTS], site, stream, format,
+            args);
+    __atomic_store_n (&r->tail, tail + 1, __ATOMIC_RELEASE);
+    in_log = false;
+
+    /* No fence here, so a writer just going to sleep can miss this; it
+     * wakes on its own within LOG_FLUSH_MS anyway */
+    if (tail + 1 - head == LOG_RING_SLOTS / 2)
+        wake_writer ();
+};
+
+/* Fills REC with a binary record if we are in binary mode and SITE's
+ * arguments can be stored raw, and with the formatted text otherwise */
+static void
+fill_record (struct log_record* rec, struct log_format* site, int stream,
+        const char* format, va_list args)
+{
+    int n = -1;
+
+    if (site != NULL && LOAD (&binary) && binary_ok && format_ready (site))
+    {
+        va_list copy;
+        va_copy (copy, args);
+        n = capture_args (site, rec->text, sizeof rec->text, copy);
+        va_end (copy);
+        if (n >= 0)
+        {
+            clock_gettime (CLOCK_MONOTONIC_COARSE, &rec->ts);
+            rec->format = site;
+        }
+    }
+    if (n < 0)
+    {
+        clock_gettime (CLOCK_REALTIME, &rec->ts);
+        rec->format = NULL;
+        n = vsnprintf (rec->text, sizeof rec->text, format, args);
+        n = n < 0 ? 0 : n >= (int) sizeof rec->text ?
+            sizeof rec->text - 1 : n;
+    }
+    rec->len = n;
+    rec->pid = pid;
+    rec->stream = stream;
+};
+
+/* Parses SITE's format the first time it is used.  Returns true if its
+ * arguments can be stored raw.  A thread that finds another one parsing
+ * just logs text this once. */
+static bool
+format_ready (struct log_format* site)
+{
+    uint32 state = __atomic_load_n (&site->state, __ATOMIC_ACQUIRE);
+
+    if (state == LOG_FORMAT_NEW
+            && __atomic_compare_exchange_n (&site->state, &state,
+                LOG_FORMAT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        const char* p = site->format;
+        bool ok = p != NULL;
+        int n = 0;
+
+        /* One conversion we can't store sends the whole format to text */
+        while (ok && (p = strchr (p, '%')) != NULL)
+        {
+            if (p[1] == '%')
+                p += 2;
+            else if ((p = log_scan_spec (p, site->kinds, &n,
+                            LOG_MAX_ARGS)) == NULL)
+                ok = false;
+        }
+        site->nargs = n;
+        state = ok ? LOG_FORMAT_BINARY : LOG_FORMAT_TEXT;
+        __atomic_store_n (&site->state, state, __ATOMIC_RELEASE);
+    }
+    return state == LOG_FORMAT_BINARY;
+};
+
+/* Copies the arguments SITE describes into OUT.  Strings are cut so the
+ * rest still fits.  Returns the bytes used, or -1 if even that fails. */
+static int
+capture_args (const struct log_format* site, char* out, size_t room,
+        va_list args)
+{
+    char* p = out;
+    char* end = out + room;
+    int i;
+
+    for (i = 0; i < site->nargs; i++)
+    {
+        /* Room the arguments after this one need at most */
+        size_t rest = (site->nargs - i - 1) * sizeof (uint64_t);
+
+        switch (site->kinds[i])
+        {
+            case LOG_ARG_INT:
+            {
+                int v = va_arg (args, int);
+                if (end - p < (long) (sizeof v + rest))
+                    return -1;
+                memcpy (p, &v, sizeof v);
+                p += sizeof v;
+                break;
+            }
+            case LOG_ARG_LONG:
+            {
+                long long v = va_arg (args, long long);
+                if (end - p < (long) (sizeof v + rest))
+                    return -1;
+                memcpy (p, &v, sizeof v);
+                p += sizeof v;
+                break;
+            }
+            case LOG_ARG_DOUBLE:
+            {
+                double v = va_arg (args, double);
+                if (end - p < (long) (sizeof v + rest))
+                    return -1;
+                memcpy (p, &v, sizeof v);
+                p += sizeof v;
+                break;
+            }
+            case LOG_ARG_PTR:
+            {
+                uint64_t v = (uintptr_t) va_arg (args, void*);
+                if (end - p < (long) (sizeof v + rest))
+                    return -1;
+                memcpy (p, &v, sizeof v);
+                p += sizeof v;
+                break;
+            }
+            case LOG_ARG_STR:
+            {
+                const char* str = va_arg (args, const char*);
+                long max = end - p - (long) (sizeof (uint16) + rest);
+                if (max < 0)
+                    return -1;
+                if (str == NULL)
+                    str = "(null)";
+                uint16 len = strnlen (str, max);
+                memcpy (p, &len, sizeof len);
+                memcpy (p + sizeof len, str, len);
+                p += sizeof len + len;
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+    return p - out;
+};
+
+/* One line straight to the file.  A single write to an O_APPEND file, so
+ * it does not interleave with the writer's batches or other processes. */
+static void
+write_now (int stream, const char* format, va_list args)
+{
+    char buf[LOG_PREFIX_MAX + LOG_LINE_MAX + 1];
+    struct stamp s = { .sec = -1 };
+    struct timespec ts;
+
+    if (fds[stream] == -1)
+        return;
+
+    /* No writer of ours tells us when the file is rotated, so look once a
+     * second */
+    clock_gettime (CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != checked[stream])
+    {
+        checked[stream] = ts.tv_sec;
+        check_file (stream);
+    }
+
+    size_t len = format_prefix (buf, &s, &ts, pid);
+    int n = vsnprintf (buf + len, LOG_LINE_MAX, format, args);
+    len += n < 0 ? 0 : n >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : n;
+    buf[len++] = '\n';
+    write_all (fds[stream], buf, len);
+};
+
+/* For the writer, which can't queue a line for itself */
+static void
+note_now (int stream, const char* format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    write_now (stream, format, args);
+    va_end (args);
+};
+
+/* Appends a line to the shared ring.  The slot is claimed by moving the
+ * tail with a CAS and published by moving its SEQ on, so the writer never
+ * reads a half filled slot. */
+static void
+write_shared (struct log_format* site, int stream, const char* format,
+        va_list args)
+{
+    struct log_slot* slot;
+    uint32 pos = __atomic_load_n (&region->tail, __ATOMIC_RELAXED);
+
+    in_log = true;
+    for (;;)
+    {
+        slot = &region->slots[pos % LOG_SHARED_SLOTS];
+        uint32 seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+        int diff = (int) (seq - pos);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n (&region->tail, &pos, pos + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            /* Full: the slot still holds a line from the last lap.  Only
+             * wait while there is a writer to empty it. */
+            if (overflow == LOG_OVERFLOW_DROP || (region_parent != 0
+                        && getppid () != region_parent))
+            {
+                __atomic_add_fetch (&region->dropped, 1, __ATOMIC_RELAXED);
+                in_log = false;
+                wake_writer ();
+                return;
+            }
+            wake_writer ();
+            sched_yield ();
+            pos = __atomic_load_n (&region->tail, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            pos = __atomic_load_n (&region->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->owner = self;
+    fill_record (&slot->rec, site, stream, format, args);
+
+    /* Fails only if the writer gave up on us; the line is lost then */
+    uint32 expected = pos;
+    __atomic_compare_exchange_n (&slot->seq, &expected, pos + 1, false,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    in_log = false;
+
+    if (pos + 1 - __atomic_load_n (&region->head, __ATOMIC_RELAXED)
+            == LOG_SHARED_SLOTS / 2)
+        wake_writer ();
+};
+
+/* Wakes the writer if it is asleep.  Cheap when it is not. */
+static void
+wake_writer ()
+{
+    struct log_wake* w = LOAD (&waker);
+    if (LOAD (&w->asleep))
+        kick_writer (w);
+};
+
+/* The futex is not private, so a child can wake the parent's writer */
+static void
+kick_writer (struct log_wake* w)
+{
+    STORE (&w->asleep, 0);
+    __atomic_add_fetch (&w->seq, 1, __ATOMIC_SEQ_CST);
+    syscall (SYS_futex, &w->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+};
+
+static void*
+writer_main (void* aux)
+{
+    char* batch[2];
+    size_t used[2] = { 0, 0 };
+    struct timespec timeout = { 0, LOG_FLUSH_MS * 1000000L };
+
+    batch[LOG_STREAM] = malloc (LOG_BATCH_BYTES);
+    batch[ERR_STREAM] = malloc (LOG_BATCH_BYTES);
+    if (batch[LOG_STREAM] == NULL || batch[ERR_STREAM] == NULL)
+    {
+        free (batch[LOG_STREAM]);
+        free (batch[ERR_STREAM]);
+        STORE (&writer_running, false);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        /* Read the flag before draining, so the last pass sees every line
+         * queued before END_LOGGING asked us to stop */
+        bool stopping = LOAD (&writer_stop);
+        bool found = drain_rings (batch, used);
+        flush_batch (LOG_STREAM, batch[LOG_STREAM], &used[LOG_STREAM]);
+        flush_batch (ERR_STREAM, batch[ERR_STREAM], &used[ERR_STREAM]);
+        maintain_files ();
+        __atomic_add_fetch (&passes, 1, __ATOMIC_SEQ_CST);
+
+        if (found)
+            continue;
+        if (stopping)
+            break;
+
+        struct log_wake* w = LOAD (&waker);
+        uint32 seq = LOAD (&w->seq);
+        STORE (&w->asleep, 1);
+        if (rings_empty () && !LOAD (&writer_stop))
+            syscall (SYS_futex, &w->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+        STORE (&w->asleep, 0);
+    }
+
+    free (batch[LOG_STREAM]);
+    free (batch[ERR_STREAM]);
+    return NULL;
+};
+
+/* Moves every queued line into the batches, writing a batch out whenever
+ * it fills.  Returns true if there was anything to move. */
+static bool
+drain_rings (char** batch, size_t* used)
+{
+    static struct stamp s = { .sec = -1 };
+    struct log_ring* r;
+    bool found = false;
+
+    for (r = LOAD (&rings); r != NULL; r = r->next)
+    {
+        uint32 head = r->head;
+        uint32 tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+        uint32 dropped = __atomic_exchange_n (&r->dropped, 0,
+                __ATOMIC_RELAXED);
+
+        for (; head != tail; head++)
+        {
+            add_record (batch, used, &s, &r->slots[head % LOG_RING_SLOTS]);
+            found = true;
+        }
+        /* The slots are copied out, so the owner may reuse them */
+        __atomic_store_n (&r->head, head, __ATOMIC_RELEASE);
+
+        if (dropped > 0)
+        {
+            add_dropped (batch, used, &s, dropped);
+            found = true;
+        }
+
+        if (LOAD (&r->state) == RING_DEAD
+                && head == __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE))
+            STORE (&r->state, RING_FREE);
+    }
+
+    if (region_owner && drain_shared (batch, used, &s))
+        found = true;
+    if (add_suppressed (batch, used, &s))
+        found = true;
+    return found;
+};
+
+static bool
+drain_shared (char** batch, size_t* used, struct stamp* s)
+{
+    bool found = false;
+    uint32 dropped;
+
+    for (;;)
+    {
+        uint32 pos = region->head;
+        struct log_slot* slot = &region->slots[pos % LOG_SHARED_SLOTS];
+        uint32 seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos + 1)
+        {
+            add_record (batch, used, s, &slot->rec);
+            found = true;
+        }
+        else if (seq != pos || pos == LOAD (&region->tail)
+                || !shared_stalled (slot, pos)
+                || !__atomic_compare_exchange_n (&slot->seq, &seq,
+                        pos + LOG_SHARED_SLOTS, false, __ATOMIC_SEQ_CST,
+                        __ATOMIC_SEQ_CST))
+        {
+            /* Nothing more, or the next line is still being written */
+            break;
+        }
+        else
+        {
+            /* Its owner died or hung after claiming it; skip it */
+            __atomic_add_fetch (&region->dropped, 1, __ATOMIC_RELAXED);
+            __atomic_store_n (&region->head, pos + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        slot->owner = 0;
+        __atomic_store_n (&slot->seq, pos + LOG_SHARED_SLOTS,
+                __ATOMIC_RELEASE);
+        __atomic_store_n (&region->head, pos + 1, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_exchange_n (&region->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        add_dropped (batch, used, s, dropped);
+        found = true;
+    }
+    return found;
+};
+
+/* Whether the claimed but unfilled slot at POS should be given up: its
+ * owner is gone, or it has been waiting longer than LOG_STALL_MS. */
+static bool
+shared_stalled (struct log_slot* slot, uint32 pos)
+{
+    struct timespec now;
+    pid_t owner = LOAD (&slot->owner);
+
+    if (owner != 0 && kill (owner, 0) == -1 && errno == ESRCH)
+        return true;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    if (pos != stall_pos || (stall_start.tv_sec == 0
+                && stall_start.tv_nsec == 0))
+    {
+        stall_pos = pos;
+        stall_start = now;
+        return false;
+    }
+    return (now.tv_sec - stall_start.tv_sec) * 1000
+        + (now.tv_nsec - stall_start.tv_nsec) / 1000000 >= LOG_STALL_MS;
+};
+
+static bool
+rings_empty ()
+{
+    struct log_ring* r;
+
+    for (r = LOAD (&rings); r != NULL; r = r->next)
+    {
+        if (r->head != LOAD (&r->tail) || LOAD (&r->dropped) != 0)
+            return false;
+    }
+    if (region_owner)
+    {
+        uint32 pos = region->head;
+        if (LOAD (&region->slots[pos % LOG_SHARED_SLOTS].seq) == pos + 1
+                || LOAD (&region->dropped) != 0)
+            return false;
+    }
+    return true;
+};
+
+/* Formats REC onto the end of its batch */
+static void
+add_record (char** batch, size_t* used, struct stamp* s,
+        const struct log_record* rec)
+{
+    size_t need = LOG_PREFIX_MAX + rec->len + 1;
+    char* out;
+
+    if (rec->format != NULL)
+    {
+        add_binary (batch, used, rec);
+        return;
+    }
+    if (used[rec->stream] + need > LOG_BATCH_BYTES)
+        flush_batch (rec->stream, batch[rec->stream], &used[rec->stream]);
+    out = batch[rec->stream] + used[rec->stream];
+    out += format_prefix (out, s, &rec->ts, rec->pid);
+    memcpy (out, rec->text, rec->len);
+    out += rec->len;
+    *out++ = '\n';
+    used[rec->stream] = out - batch[rec->stream];
+    __atomic_add_fetch (&lines_written, 1, __ATOMIC_RELAXED);
+};
+
+static void
+add_dropped (char** batch, size_t* used, struct stamp* s, uint32 dropped)
+{
+    struct timespec now;
+    char* out;
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    if (used[LOG_STREAM] + LOG_PREFIX_MAX + 64 > LOG_BATCH_BYTES)
+        flush_batch (LOG_STREAM, batch[LOG_STREAM], &used[LOG_STREAM]);
+    out = batch[LOG_STREAM] + used[LOG_STREAM];
+    out += format_prefix (out, s, &now, 0);
+    out += sprintf (out, "%u log lines dropped\n", dropped);
+    used[LOG_STREAM] = out - batch[LOG_STREAM];
+    __atomic_add_fetch (&lines_dropped, dropped, __ATOMIC_RELAXED);
+};
+
+/* Writes the summary of every call site that suppressed lines in a second
+ * that is now over.  Returns true if there were any. */
+static bool
+add_suppressed (char** batch, size_t* used, struct stamp* s)
+{
+    struct log_format* f = LOAD (&limited);
+    struct timespec now, real;
+    bool found = false;
+
+    if (f == NULL)
+        return false;
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &now);
+    clock_gettime (CLOCK_REALTIME, &real);
+    for (; f != NULL; f = f->next_limited)
+    {
+        /* Its callers are still counting this second */
+        if (__atomic_load_n (&f->window, __ATOMIC_RELAXED)
+                == (uint32) now.tv_sec)
+            continue;
+
+        uint32 n = __atomic_exchange_n (&f->suppressed, 0, __ATOMIC_RELAXED);
+        if (n == 0)
+            continue;
+
+        int stream = f->stream;
+        if (used[stream] + LOG_PREFIX_MAX + LOG_LINE_MAX + 1 > LOG_BATCH_BYTES)
+            flush_batch (stream, batch[stream], &used[stream]);
+        char* out = batch[stream] + used[stream];
+        out += format_prefix (out, s, &real, pid);
+        int len = snprintf (out, LOG_LINE_MAX, LOG_SUPPRESSED, n,
+                (int) strlen (f->format), f->format);
+        out += len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len;
+        *out++ = '\n';
+        used[stream] = out - batch[stream];
+        __atomic_add_fetch (&lines_suppressed, n, __ATOMIC_RELAXED);
+        found = true;
+    }
+    return found;
+};
+
+/* Writes REC as a LINE entry, after the CLOCK and FORMAT entries the file
+ * still needs */
+static void
+add_binary (char** batch, size_t* used, const struct log_record* rec)
+{
+    struct log_format* f = rec->format;
+    int stream = rec->stream;
+
+    if (anchor_gen[stream] != file_gen
+            || rec->ts.tv_sec - anchor_sec[stream] >= LOG_ANCHOR_SEC)
+    {
+        struct log_entry_clock c;
+        struct timespec mono, real;
+
+        clock_gettime (CLOCK_MONOTONIC, &mono);
+        clock_gettime (CLOCK_REALTIME, &real);
+        c.mono_ns = to_ns (&mono);
+        c.real_ns = to_ns (&real);
+        add_entry (batch, used, stream, LOG_ENTRY_CLOCK, &c, sizeof c,
+                NULL, 0);
+        anchor_gen[stream] = file_gen;
+        anchor_sec[stream] = mono.tv_sec;
+    }
+
+    if (f->defined[stream] != file_gen)
+    {
+        if (f->id == 0)
+            f->id = next_format_id++;
+        add_entry (batch, used, stream, LOG_ENTRY_FORMAT, &f->id,
+                sizeof f->id, f->format, strnlen (f->format, LOG_FORMAT_MAX));
+        f->defined[stream] = file_gen;
+    }
+
+    struct log_entry_line line;
+    line.ts_ns = to_ns (&rec->ts);
+    line.pid = rec->pid;
+    line.id = f->id;
+    add_entry (batch, used, stream, LOG_ENTRY_LINE, &line, sizeof line,
+            rec->text, rec->len);
+    __atomic_add_fetch (&lines_written, 1, __ATOMIC_RELAXED);
+};
+
+static void
+add_entry (char** batch, size_t* used, int stream, int type,
+        const void* head, size_t head_len, const void* body, size_t body_len)
+{
+    struct log_entry e;
+    size_t need = sizeof e + head_len + body_len;
+
+    if (used[stream] + need > LOG_BATCH_BYTES)
+        flush_batch (stream, batch[stream], &used[stream]);
+
+    char* out = batch[stream] + used[stream];
+    e.magic = LOG_ENTRY_MAGIC;
+    e.type = type;
+    e.len = head_len + body_len;
+    memcpy (out, &e, sizeof e);
+    memcpy (out + sizeof e, head, head_len);
+    if (body_len > 0)
+        memcpy (out + sizeof e + head_len, body, body_len);
+    used[stream] += need;
+};
+
+static uint64_t
+to_ns (const struct timespec* ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+};
+
+static void
+flush_batch (int stream, char* batch, size_t* used)
+{
+    if (*used == 0)
+        return;
+    if (fds[stream] != -1)
+    {
+        write_all (fds[stream], batch, *used);
+        file_bytes[stream] += *used;
+        __atomic_add_fetch (&batches_written, 1, __ATOMIC_RELAXED);
+    }
+    *used = 0;
+};
+
+/* Writes the time stamp and pid in front of a line into BUF, which must
+ * have room for LOG_PREFIX_MAX bytes.  Returns the length written. */
+static size_t
+format_prefix (char* buf, struct stamp* s, const struct timespec* ts,
+        pid_t p)
+{
+    size_t len;
+
+    if (ts->tv_sec != s->sec)
+    {
+        struct tm l;
+
+        localtime_r (&ts->tv_sec, &l);
+        // format the time like [Day Mon DD, YYYY HH:MM:SS]
+        s->len = snprintf (s->text, sizeof s->text,
+                "[%s %s %d, %d %02d:%02d:%02d] ",
+                days[l.tm_wday], months[l.tm_mon], l.tm_mday,
+                (1900 + l.tm_year), l.tm_hour, l.tm_min, l.tm_sec);
+        s->sec = ts->tv_sec;
+    }
+    memcpy (buf, s->text, s->len);
+    len = s->len;
+
+    if (p == 0)
+    {
+        memcpy (buf + len, "server: ", 8);
+        len += 8;
     }
     else
     {
-        fprintf (fd, "%u: ", pid);
+        len += sprintf (buf + len, "%u: ", p);
     }
+    return len;
 };
 
+static void
+write_all (int fd, const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write (fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+};
+
+/* Done by the writer after each pass, with nothing left in its batches:
+ * reopens the files if asked to, and rotates the ones that are due */
+static void
+maintain_files ()
+{
+    time_t now = time (NULL);
+    unsigned long max_bytes = LOAD (&rotate_bytes);
+    unsigned max_sec = LOAD (&rotate_sec);
+    int stream;
+
+    if (__atomic_exchange_n (&reopen_wanted, 0, __ATOMIC_SEQ_CST))
+    {
+        for (stream = LOG_STREAM; stream <= ERR_STREAM; stream++)
+        {
+            if (reopen_file (stream) == -1)
+                note_now (stream, "Could not reopen %s: %s", paths[stream],
+                        strerror (errno));
+            stat_file (stream);
+        }
+        file_gen++;
+    }
+
+    for (stream = LOG_STREAM; stream <= ERR_STREAM; stream++)
+    {
+        bool old = max_sec != 0 && now - file_opened[stream] >= max_sec;
+
+        /* An empty file is not worth keeping; it just starts over */
+        if (old && file_bytes[stream] == 0)
+            file_opened[stream] = now;
+        else if (old || (max_bytes != 0 && file_bytes[stream] >= max_bytes))
+            rotate_file (stream, now);
+    }
+};
+
+/* Moves STREAM's file aside, to its path with the time appended, and
+ * carries on in a new file at the path.  Processes writing directly notice
+ * within a second; everyone else writes through us. */
+static void
+rotate_file (int stream, time_t now)
+{
+    char name[PATH_MAX];
+    struct tm t;
+    int i;
+
+    localtime_r (&now, &t);
+    int n = snprintf (name, sizeof name - 32, "%s.", paths[stream]);
+    n += strftime (name + n, sizeof name - n, "%Y%m%d-%H%M%S", &t);
+
+    /* More than one rotation in a second */
+    for (i = 1; name_taken (name) && i < 100; i++)
+        snprintf (name + n, sizeof name - n, ".%d", i);
+
+    /* Either way, don't try again before another period */
+    file_bytes[stream] = 0;
+    file_opened[stream] = now;
+
+    if (rename (paths[stream], name) == -1 || reopen_file (stream) == -1)
+    {
+        note_now (stream, "Could not rotate %s: %s", paths[stream],
+                strerror (errno));
+        return;
+    }
+    file_gen++;
+
+    if (LOAD (&rotate_compress))
+        compress_file (name);
+};
+
+/* Whether NAME, or what compressing it would make, exists already */
+static bool
+name_taken (const char* name)
+{
+    char gz[PATH_MAX];
+
+    snprintf (gz, sizeof gz, "%s.gz", name);
+    return access (name, F_OK) == 0 || access (gz, F_OK) == 0;
+};
+
+/* Starts LOG_COMPRESS_CMD on NAME under SCHED_IDLE, so it only gets the
+ * CPU nobody else wants.  The writer doesn't wait for it. */
+static void
+compress_file (const char* name)
+{
+    char* argv[] = { LOG_COMPRESS_CMD, "-q", "--", (char*) name, NULL };
+    struct sched_param param = { 0 };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int i;
+
+    /* Held until the pid is stored, so it is found even if the compressor
+     * is reaped before posix_spawnp returns */
+    pthread_mutex_lock (&compressors_lock);
+    for (i = 0; i < LOG_COMPRESS_MAX && compressors[i] != 0; i++)
+        ;
+    if (i == LOG_COMPRESS_MAX)
+    {
+        pthread_mutex_unlock (&compressors_lock);
+        note_now (LOG_STREAM, "Too many compressors running, leaving %s",
+                name);
+        return;
+    }
+
+    /* It must not inherit the signals the server keeps blocked */
+    sigset_t none;
+    sigemptyset (&none);
+    posix_spawnattr_init (&attr);
+    posix_spawnattr_setflags (&attr,
+            POSIX_SPAWN_SETSCHEDULER | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigmask (&attr, &none);
+    posix_spawnattr_setschedpolicy (&attr, SCHED_IDLE);
+    posix_spawnattr_setschedparam (&attr, &param);
+    posix_spawn_file_actions_init (&actions);
+#if __GLIBC_PREREQ (2, 34)
+    /* Client sockets and pipes stay with their owners */
+    posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+#endif
+
+    int err = posix_spawnp (&compressors[i], LOG_COMPRESS_CMD, &actions,
+            &attr, argv, environ);
+    if (err != 0)
+        compressors[i] = 0;
+    pthread_mutex_unlock (&compressors_lock);
+    if (err != 0)
+    {
+        note_now (LOG_STREAM, "Could not compress %s: %s", name,
+                strerror (err));
+    }
+    posix_spawn_file_actions_destroy (&actions);
+    posix_spawnattr_destroy (&attr);
+};
+
+/* Reopens STREAM's file if its path names another file now, or none, as
+ * after the writer rotated it */
+static void
+check_file (int stream)
+{
+    struct stat at_path, ours;
+
+    if (paths[stream] == NULL || fstat (fds[stream], &ours) == -1)
+        return;
+    if (stat (paths[stream], &at_path) == -1
+            || at_path.st_ino != ours.st_ino
+            || at_path.st_dev != ours.st_dev)
+        reopen_file (stream);
+};
+
+/* Opens STREAM's path again under the same descriptor.  The number never
+ * changes, so a write racing with us goes to one file or the other. */
+static int
+reopen_file (int stream)
+{
+    if (fds[stream] == -1 || paths[stream] == NULL)
+        return -1;
+
+    int fd = open (paths[stream], LOG_OPEN_FLAGS, LOG_OPEN_MODE);
+    if (fd == -1)
+        return -1;
+    if (dup3 (fd, fds[stream], O_CLOEXEC) == -1)
+    {
+        close (fd);
+        return -1;
+    }
+    close (fd);
+    return 0;
+};
+
+/* Starts the writer's count of STREAM's size and age over */
+static void
+stat_file (int stream)
+{
+    struct stat st;
+
+    file_bytes[stream] = fstat (fds[stream], &st) == 0 ? st.st_size : 0;
+    file_opened[stream] = time (NULL);
+};
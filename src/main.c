@@ -18,14 +18,25 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <string.h>
+#include <poll.h>
 
 #include "main.h"
 #include "defaults.h"
 #include "mysignal.h"
 #include "debug.h"
 #include "logging.h"
+#include "trace.h"
 #include "type.h"
 #include "child.h"
+#include "sync.h"
+#include "jobqueue.h"
+#include "match.h"
+#include "rpc.h"
+#include "event.h"
+#include "supervisor.h"
+#include "drain.h"
+#include "idle.h"
+#include "timer.h"
 
 /* Parse the configuration file and set the options as our global program
  * options, overwriting any default options */
@@ -57,6 +68,13 @@ static int bind_to_localhost (const char* port, int ipver, int* sockfd);
 /* Exits the program gracefully.  Should only be called by a child process */
 static void exit_child (int status);
 
+/* Forks a child for a client connection or as a worker */
+static pid_t start_child (int clientfd, const struct sockaddr_storage* addr,
+        uint32 trace, uint64_t accepted);
+
+/* Starts a worker for the supervisor */
+static pid_t spawn_worker (struct worker_group* g);
+
 /* Global program options.  These get read both from the command line and from a
  * configuration file */
 static struct options global_options;
@@ -69,8 +87,17 @@ static char** interpreters;
  * client connections are made. */
 static int sockfd, newfd;
 
-/* The next process ID to assign */
-static int procid = 1;
+/* File descriptor of the shared sync region, inherited by every child */
+static int syncfd = -1;
+
+/* File descriptor of the shared log ring, also inherited by every child */
+static int logfd = -1;
+
+/* Signals to the server are read from this */
+static int sigfd = -1;
+
+/* The environment children are started with, the same as ours */
+static char** environment;
 
 /* Set to false to quit */
 bool run = true;
@@ -79,6 +106,7 @@ int
 main (int argc, char** argv, char** envp)
 {
     printf ("server by Kyle Racette \n");
+    environment = envp;
 
     init_defaults ();
 
@@ -96,18 +124,75 @@ main (int argc, char** argv, char** envp)
     /* Prepare to be a daemon */
     //daemonize_prep (); 
 
+    /* Initialize our signal handlers.  This blocks the signals we handle,
+     * and must come before the log writer or any other thread starts. */
+    sigfd = init_signal_handler ();
+    if (-1 == sigfd)
+    {
+        perror ("Failed to set up signal handling");
+        exit (EXIT_FAILURE);
+    }
+
     /* Open our log files */
     if (-1 == init_logging (global_options.logfile_path, global_options.errfile_path))
     {
         perror ("Failed to initialize our logs");
         exit_program (EXIT_FAILURE);
     };
+    set_log_rotation (global_options.log_max_bytes,
+            global_options.log_max_age, global_options.log_compress);
     server_log ("Logs initialized...");
 
+    if (global_options.trace_path != NULL && -1 == init_tracing (
+                global_options.trace_path, global_options.trace_sample))
+    {
+        log_error (LOG_SERVER, "Could not open the trace file `%s': %s",
+                global_options.trace_path, strerror (errno));
+    }
+
+    /* Children log through a ring we drain.  Without it they write their
+     * lines to the files themselves. */
+    logfd = init_log_ring ();
+    if (-1 == logfd)
+    {
+        server_err ("Failed to create the shared log ring");
+        print_err (errno);
+    }
+
     /* Initialize our system environment */
 
-    /* Initialize our signal handlers */
-    init_signal_handler ();
+    /* Set up the shared memory region for the reader-writer locks, barriers
+     * and latches children create through us */
+    syncfd = init_sync_region ();
+    if (-1 == syncfd)
+    {
+        server_err ("Failed to create the shared sync region");
+        print_err (errno);
+        exit_program (EXIT_FAILURE);
+    }
+
+    init_jobqueues ();
+
+    init_child_index ();
+
+    if (-1 == init_rpc (&message_child))
+    {
+        server_err ("Failed to start the RPC sweeper thread");
+        exit_program (EXIT_FAILURE);
+    }
+
+    init_events (&message_child);
+
+    /* Workers run the script without a client, and are replaced when
+     * they exit */
+    init_idle (global_options.idle_timeout);
+    init_supervisor (&spawn_worker);
+    if (global_options.workers > 0 && NULL == supervise (
+                global_options.script_path, global_options.workers, NULL,
+                NULL))
+    {
+        server_err ("Could not set up the workers");
+    }
 
     /* Set up the network to listen for clients */
     struct sockaddr_storage client_addr;    // Client's address info
@@ -130,204 +215,352 @@ main (int argc, char** argv, char** envp)
         exit_program (EXIT_FAILURE);
     }
 
+    /* We only accept once poll says a connection is waiting, but it may be
+     * gone again by then, and accept must not block us if it is */
+    fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK);
+
     server_log ("waiting for client connections...");
 
+    struct pollfd fds[2];
+    fds[0].fd = sigfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sockfd;
+    fds[1].events = POLLIN;
+
     /* Loop to start listening for client connections */
     while (run)   
     {
         sin_size = sizeof their_addr;
 
-        /* Block until a connection is received */
+        /* Replace workers that are due, then block until a connection is
+         * received, a signal is pending, or the next worker or timeout is
+         * due */
+        int timeout = supervisor_run (supervisor_clock ());
+        int next = idle_run (timer_now ());
+        if (next != -1 && (timeout == -1 || next < timeout))
+            timeout = next;
+        uint64_t waited = trace_now ();
+        if (-1 == poll (fds, 2, timeout))
+        {
+            if (errno != EINTR)
+            {
+                log_error (LOG_SERVER, "poll failed: %s", strerror (errno));
+                exit_program (EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+            handle_signals (sigfd);
+        if (!run || !(fds[1].revents & POLLIN))
+            continue;
+
         newfd = accept (sockfd, (struct sockaddr*) &their_addr, &sin_size);
+        uint64_t accepted = trace_now ();
         if (-1 == newfd)
         {
-            server_err ("Failed to accept connection attempt");
-            print_err (errno);    
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                log_error (LOG_ACCEPT,
+                        "Failed to accept connection attempt: %s",
+                        strerror (errno));
+            }
             continue;
         }
 
+        /* Whether this connection is traced, and under which id */
+        uint32 trace = trace_connection ();
+        trace_span (trace, "accept", waited, accepted, "fd", newfd);
+
         // TODO: probably will need to get the client's connection information..
         // like IP address and all...
 
-        server_log ("got connection");
-
-        /* 
-         * parent reads from readpipe[0]
-         * child writes to readpipe[1]
-         * child reads from writepipe[0]
-         * */
-        int writepipe[2] = {-1, -1};
-        int readpipe[2] = {-1, -1};
+        log_info (LOG_ACCEPT, "got connection");
 
-        if (pipe (readpipe) < 0 || pipe (writepipe) < 0)
-        {
-            server_err ("Could not create pipes for child. Terminating");
+        if (-1 == start_child (newfd, &their_addr, trace, accepted))
             run = false;
-        }
+    }
 
-        int childread = writepipe[0];
-        int childwrite = readpipe[1];
-        int parentread = readpipe[0];
-        int parentwrite = writepipe[1];
+    /* Stop accepting, so new clients are refused instead of left waiting,
+     * and give the ones we have time to be served */
+    close (sockfd);
+    sockfd = -1;
+    struct drain_stats drained;
+    drain_children (sigfd, global_options.drain_deadline,
+            global_options.drain_grace, &drained);
 
-        struct server_child* new_child = 
-               (struct server_child*) malloc (sizeof (struct server_child));
+    exit_program (EXIT_SUCCESS);
+    printf ("END \n");
+}
 
-        if (new_child == NULL)
-        {
-            server_err ("Could not allocate space for a new child record");
-            
-            close (childread);
-            close (childwrite);
-            close (parentread);
-            close (parentwrite);
-
-            /* Just continue... maybe more memory will free up, but this 
-             * should not be a show-stopper. */
-            continue;
-        }
+/* Forks a child running the script, with CLIENTFD as its connection to
+ * the client, from ADDR, accepted at ACCEPTED and traced as TRACE.  A
+ * worker has no client, and CLIENTFD -1.  Returns the child's pid, 0 if it
+ * could not be started but the server can go on, or -1 if the server can't
+ * go on. */
+static pid_t
+start_child (int clientfd, const struct sockaddr_storage* addr, uint32 trace,
+        uint64_t accepted)
+{
+    /* 
+     * parent reads from readpipe[0]
+     * child writes to readpipe[1]
+     * child reads from writepipe[0]
+     * */
+    int writepipe[2] = {-1, -1};
+    int readpipe[2] = {-1, -1};
 
+    if (pipe (readpipe) < 0 || pipe (writepipe) < 0)
+    {
+        log_error (LOG_CHILD,
+                "Could not create pipes for child. Terminating");
+        close (readpipe[0]);
+        close (readpipe[1]);
+        close (clientfd);
+        return -1;
+    }
 
-        /* Keep a record of this child here */
-        new_child->ourid = procid++;
-        new_child->clientfd = newfd;
-        new_child->parentread = parentread;
-        new_child->parentwrite = parentwrite;
+    int childread = writepipe[0];
+    int childwrite = readpipe[1];
+    int parentread = readpipe[0];
+    int parentwrite = writepipe[1];
 
-        /* This lock will allow the new thread that is about to be created to 
-         * begin its execution loop.  We should create and acquire the lock
-         * before creating the thread so that we can be sure to get the lock
-         * before the new thread does, forcing the thread to block until we are
-         * sure we want the thread running. */
-        int result = pthread_mutex_init (&new_child->init_lock, NULL);
-        if (result)
-        {
-            server_err ("Error initializing init_lock for new thread: %d", result);
-            close (newfd);
-            close (childread);
-            close (childwrite);
-            close (parentread);
-            close (parentwrite);
-            free (new_child);
-            continue;
-        }
-        /* The first thing the new thread will do is try to acquire this.  We
-         * make it block until after the fork succeeds. */
-        pthread_mutex_lock (&new_child->init_lock);
-
-        /* Create a thread for communication with the new child we're about to
-         * fork. */
-        result = pthread_create (&new_child->thread, NULL, 
-                &child_comm_thread, new_child);
-        if (result)
-        {
-            server_err ("Error creating the child communications thread: %d", result);
-            close (newfd);
-            close (childread);
-            close (childwrite);
-            close (parentread);
-            close (parentwrite);
-            free (new_child);
-            continue;
-        }
+    struct server_child* new_child = 
+           (struct server_child*) malloc (sizeof (struct server_child));
 
-        /* Fork a child for this connection */
-        pid_t pid = fork ();
-        if (pid < 0)
-        {
-            close (newfd);
-            close (childread);
-            close (childwrite);
-            close (parentread);
-            close (parentwrite);
-            pthread_mutex_unlock (&new_child->init_lock);
-            pthread_join (new_child->thread, NULL);
-            free (new_child);
-            server_err ("Could not fork a child! Terminating server...");
-            run = false;
-        }
-        else if (pid == 0)
-        {
-            free (new_child);
-            /* Child */
-
-            /* Don't need this since it was used for listening for new
-             * connections */
-            close (sockfd);
-
-            /* Close the parent's pipes since we won't need them here */
-            close (parentwrite);
-            close (parentread);
-
-            /* Set logging to write this child's pid in front of all
-             * messages */
-            set_log_child (getpid ());
-
-            /* Grab the executable name */
-            const char* exe = interpreters[global_options.interpreter];
-
-            /* Build the argument list.  Here we will need to pass the
-             * values of all our file descriptors so they are accessible
-             * from the child script */
-            char** _argv = build_child_argv (exe, global_options.script_path, 
-                    newfd, childread, childwrite);
-
-            /* The environment array.  This is simply the same that was
-             * passed to our main function. */
-            char** _envp = envp;
-
-            server_log ("Dumping our child's variables...");
-            server_log ("Executable: %s", exe);
-            server_log ("newfd: %d", newfd);
-            server_log ("childread: %d", childread);
-            server_log ("childwrite: %d", childwrite);
-
-            /* Close all our logging resources */
-            end_logging ();
-
-            /* Initialize the child and get it started doing it's thing.
-             * If that routine returns, then kill the process because
-             * it means there was an error. */
-            if (-1 == execve (exe, _argv, _envp))
-            {
-                /* Start logging again so we can report our status */
-                init_logging (global_options.logfile_path,
-                        global_options.errfile_path);
-                server_err ("Failed to call exec:");
-                print_err (errno);
-
-                /* Kill the child process */
-                exit_child (EXIT_FAILURE);
-            }
-            NOT_REACHED
-        }
-        else
-        {
-            /* Parent */
+    if (new_child == NULL)
+    {
+        log_error (LOG_CHILD,
+                "Could not allocate space for a new child record");
+        
+        close (childread);
+        close (childwrite);
+        close (parentread);
+        close (parentwrite);
+
+        /* Just continue... maybe more memory will free up, but this 
+         * should not be a show-stopper. */
+        close (clientfd);
+        return 0;
+    }
 
-            /* We don't need this resource anymore */
-            close (newfd);
 
-            /* Close the child's pipes */
-            close (childread);
-            close (childwrite);
+    /* Keep a record of this child here.  Its id is assigned when it is
+     * added to the child index. */
+    new_child->ourid = 0;
+    new_child->clientfd = clientfd;
+    child_addr_set (&new_child->addr, (const struct sockaddr*) addr);
+    new_child->parentread = parentread;
+    new_child->parentwrite = parentwrite;
+    new_child->trace = trace;
+    new_child->execfd = -1;
+    new_child->accepted = accepted;
+    new_child->state = 0;
+    new_child->active = 0;
+    new_child->busy = 0;
+    new_child->idle = NULL;
+    new_child->refs = 2;
+
+    /* Reserve the child's slot in the sync region.  Without one it can't
+     * take part in any shared locks, but it can still serve its client */
+    new_child->syncslot = sync_alloc_proc ();
+    if (new_child->syncslot == -1)
+    {
+        log_error (LOG_CHILD, "No free sync slot for a new child");
+    }
+
+    /* Messages its siblings send it wait here until it receives them.
+     * Without a mailbox sends to it are refused. */
+    new_child->mailbox = mailbox_create (MAILBOX_DEFAULT_CAP);
+    if (new_child->mailbox == NULL)
+    {
+        log_error (LOG_CHILD, "No mailbox for a new child");
+    }
+
+    /* This lock will allow the new thread that is about to be created to 
+     * begin its execution loop.  We should create and acquire the lock
+     * before creating the thread so that we can be sure to get the lock
+     * before the new thread does, forcing the thread to block until we are
+     * sure we want the thread running. */
+    int result = pthread_mutex_init (&new_child->init_lock, NULL);
+    if (result)
+    {
+        log_error (LOG_CHILD,
+                "Error initializing init_lock for new thread: %d", result);
+        close (clientfd);
+        close (childread);
+        close (childwrite);
+        close (parentread);
+        close (parentwrite);
+        if (new_child->syncslot != -1)
+            sync_set_proc (new_child->syncslot, 0);
+        mailbox_destroy (new_child->mailbox);
+        free (new_child);
+        return 0;
+    }
+    /* The first thing the new thread will do is try to acquire this.  We
+     * make it block until after the fork succeeds. */
+    pthread_mutex_lock (&new_child->init_lock);
+
+    /* Create a thread for communication with the new child we're about to
+     * fork. */
+    result = start_broker (new_child);
+    if (result)
+    {
+        log_error (LOG_CHILD,
+                "Error creating the child communications thread: %d",
+                result);
+        close (clientfd);
+        close (childread);
+        close (childwrite);
+        close (parentread);
+        close (parentwrite);
+        if (new_child->syncslot != -1)
+            sync_set_proc (new_child->syncslot, 0);
+        mailbox_destroy (new_child->mailbox);
+        pthread_mutex_unlock (&new_child->init_lock);
+        pthread_mutex_destroy (&new_child->init_lock);
+        free (new_child);
+        return 0;
+    }
 
-            new_child->pid = pid;
-            
-            /* We'll add this child record to a data structure so that we can 
-             * access certain information about the child later, such as the
-             * pipes we use to communicate with the process, the child's client
-             * ip address, and the pid. */
-            add_child (new_child);
+    /* For a traced child, a pipe whose write end is closed on exec, so
+     * the broker thread can tell when the child got there */
+    int execpipe[2] = {-1, -1};
+    if (trace != 0 && 0 == pipe (execpipe))
+        fcntl (execpipe[1], F_SETFD, FD_CLOEXEC);
+    uint64_t forking = trace_now ();
+    trace_span (trace, "child record", accepted, forking, NULL, 0);
 
-            /* Let the thread begin */
-            pthread_mutex_unlock (&new_child->init_lock);
+    /* Fork a child for this connection */
+    pid_t pid = fork ();
+    if (pid < 0)
+    {
+        close (execpipe[0]);
+        close (execpipe[1]);
+        close (clientfd);
+        close (childread);
+        close (childwrite);
+        if (new_child->syncslot != -1)
+            sync_set_proc (new_child->syncslot, 0);
+
+        /* With the child's end of its pipe closed, the thread reads end
+         * of file at once and drops its reference.  The record never
+         * made it into the index, so we drop that one. */
+        pthread_mutex_unlock (&new_child->init_lock);
+        put_child (new_child);
+        log_error (LOG_CHILD,
+                "Could not fork a child! Terminating server...");
+        return -1;
+    }
+    else if (pid == 0)
+    {
+        int syncslot = new_child->syncslot;
+        free (new_child);
+        /* Child */
+
+        /* Don't need this since it was used for listening for new
+         * connections */
+        close (sockfd);
+
+        /* Close the parent's pipes since we won't need them here */
+        close (parentwrite);
+        close (parentread);
+        close (execpipe[0]);
+
+        /* Set logging to write this child's pid in front of all
+         * messages */
+        set_log_child (getpid ());
+
+        /* Grab the executable name */
+        const char* exe = interpreters[global_options.interpreter];
+
+        /* Build the argument list.  Here we will need to pass the
+         * values of all our file descriptors so they are accessible
+         * from the child script */
+        char** _argv = build_child_argv (exe, global_options.script_path, 
+                clientfd, childread, childwrite, syncfd, syncslot, logfd);
+
+        /* The environment array.  This is simply the same that was
+         * passed to our main function. */
+        char** _envp = environment;
+
+        log_debug (LOG_CHILD, "Dumping our child's variables...");
+        log_debug (LOG_CHILD, "Executable: %s", exe);
+        log_debug (LOG_CHILD, "newfd: %d", clientfd);
+        log_debug (LOG_CHILD, "childread: %d", childread);
+        log_debug (LOG_CHILD, "childwrite: %d", childwrite);
+
+        /* Close all our logging resources */
+        end_logging ();
+
+        /* The script gets the signals we take over */
+        restore_signal_mask ();
+
+        /* Initialize the child and get it started doing it's thing.
+         * If that routine returns, then kill the process because
+         * it means there was an error. */
+        if (-1 == execve (exe, _argv, _envp))
+        {
+            /* Start logging again so we can report our status */
+            init_logging (global_options.logfile_path,
+                    global_options.errfile_path);
+            log_error (LOG_CHILD, "Failed to call exec: %s",
+                    strerror (errno));
+
+            /* Kill the child process */
+            exit_child (EXIT_FAILURE);
         }
+        NOT_REACHED
     }
+    else
+    {
+        /* Parent */
 
-    exit_program (EXIT_SUCCESS);
-    printf ("END \n");
-}
+        /* We don't need this resource anymore */
+        close (clientfd);
+
+        /* Close the child's pipes */
+        close (childread);
+        close (childwrite);
+        close (execpipe[1]);
+
+        new_child->pid = pid;
+        new_child->execfd = execpipe[0];
+        new_child->forked = trace_now ();
+        trace_span (trace, "fork", forking, new_child->forked, "pid", pid);
+        if (new_child->syncslot != -1)
+            sync_set_proc (new_child->syncslot, pid);
+        
+        /* We'll add this child record to a data structure so that we can 
+         * access certain information about the child later, such as the
+         * pipes we use to communicate with the process, the child's client
+         * ip address, and the pid. */
+        if (-1 == add_child (new_child))
+        {
+            log_error (LOG_CHILD, "Child index is full, child with pid "
+                    "%d can't be reached by its siblings", pid);
+
+            /* Nor found when it is reaped, so the index's reference
+             * goes now */
+            put_child (new_child);
+        }
+        else if (clientfd != -1)
+            idle_watch (new_child);
+
+        /* Let the thread begin */
+        pthread_mutex_unlock (&new_child->init_lock);
+    }
+    return pid;
+};
+
+static pid_t
+spawn_worker (struct worker_group* g)
+{
+    static const struct sockaddr_storage noaddr;
+
+    pid_t pid = start_child (-1, &noaddr, 0, trace_now ());
+    return pid > 0 ? pid : -1;
+};
 
 static void 
 parse_config_file ()
@@ -412,6 +645,20 @@ init_defaults ()
     global_options.config_path = "/home/kyle/Projects/server/test/server.conf";
     global_options.script_path = "/home/kyle/Projects/server/test/command.pl";
 
+    global_options.log_max_bytes = 10 * 1024 * 1024;
+    global_options.log_max_age = 24 * 60 * 60;
+    global_options.log_compress = false;
+
+    global_options.trace_path = NULL;
+    global_options.trace_sample = 1;
+
+    global_options.workers = 0;
+
+    global_options.drain_deadline = DRAIN_DEFAULT_DEADLINE;
+    global_options.drain_grace = DRAIN_DEFAULT_GRACE;
+
+    global_options.idle_timeout = 0;
+
     global_options.port = "20171";
     
     global_options.ipver = 4;
@@ -431,7 +678,36 @@ init_defaults ()
 static void
 read_env_variables (char** envp)
 {
-
+    /* Log levels, such as SERVER_LOG_LEVELS=info,accept=debug */
+    const char* levels = getenv ("SERVER_LOG_LEVELS");
+    if (levels != NULL && -1 == set_log_levels (levels))
+        printf ("Ignoring bad SERVER_LOG_LEVELS `%s' \n", levels);
+
+    /* Where to trace connections to, and one in how many to trace */
+    global_options.trace_path = getenv ("SERVER_TRACE");
+    const char* sample = getenv ("SERVER_TRACE_SAMPLE");
+    if (sample != NULL)
+        global_options.trace_sample = atoi (sample);
+
+    /* How many workers to keep running besides the children of clients */
+    const char* workers = getenv ("SERVER_WORKERS");
+    if (workers != NULL)
+        global_options.workers = atoi (workers);
+
+    /* How long to wait for children at shutdown, before and after telling
+     * them to exit */
+    const char* deadline = getenv ("SERVER_DRAIN_DEADLINE");
+    if (deadline != NULL)
+        global_options.drain_deadline = atoi (deadline);
+    const char* grace = getenv ("SERVER_DRAIN_GRACE");
+    if (grace != NULL)
+        global_options.drain_grace = atoi (grace);
+
+    /* How long a client's child may go without a word before it is
+     * terminated */
+    const char* idle = getenv ("SERVER_IDLE_TIMEOUT");
+    if (idle != NULL)
+        global_options.idle_timeout = atoi (idle);
 };
 
 int
@@ -525,9 +801,18 @@ bind_to_localhost (const char* port, int ipver, int* sockfd)
 void
 exit_program (int status)
 {
-    end_logging ();
+    end_tracing ();
+    end_rpc ();
+    end_sync ();
+    close (syncfd);
     close (sockfd);
     close (newfd);
+    close (sigfd);
+
+    /* Last, so whatever the rest had to say is written out */
+    end_logging ();
+    if (logfd != -1)
+        close (logfd);
     exit (status);
 };
 
@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "match.h"
+#include "debug.h"
+
+#define MATCH_MIN_BUCKETS   64
+
+/* Returns the message that owns LINK, which is its link for LIST */
+#define link_msg(LINK, LIST) \
+    ((struct match_msg*) ((char*) (LINK) - \
+                          offsetof (struct match_msg, links[LIST])))
+
+static uint64_t queue_key (enum match_list list, int src, int tag);
+static size_t hash_key (uint64_t key, size_t nbuckets);
+static struct match_queue* find_queue (struct match_engine* e, uint64_t key);
+static struct match_queue* get_queue (struct match_engine* e, uint64_t key);
+static void drop_queue (struct match_engine* e, struct match_queue* q);
+static bool grow (struct match_engine* e);
+static void list_init (struct match_link* head);
+static void list_push_back (struct match_link* head, struct match_link* l);
+static void list_remove (struct match_link* l);
+static bool list_empty (const struct match_link* head);
+
+int
+match_init (struct match_engine* e, size_t cap)
+{
+    ASSERT (e != NULL);
+
+    memset (e, 0, sizeof *e);
+    e->buckets = calloc (MATCH_MIN_BUCKETS, sizeof *e->buckets);
+    if (e->buckets == NULL)
+        return -1;
+    e->nbuckets = MATCH_MIN_BUCKETS;
+    e->cap = cap;
+    list_init (&e->all);
+    return 0;
+};
+
+void
+match_destroy (struct match_engine* e)
+{
+    ASSERT (e != NULL);
+
+    while (!list_empty (&e->all))
+        match_free (e, match_take (e, MATCH_ANY, MATCH_ANY));
+    free (e->buckets);
+    e->buckets = NULL;
+};
+
+int
+match_put (struct match_engine* e, int src, int tag, const void* data,
+        size_t sz)
+{
+    ASSERT (e != NULL);
+    ASSERT (src >= 0 && tag >= 0);
+
+    size_t cost = sizeof (struct match_msg) + sz;
+    if (e->bytes + cost > e->cap)
+        return -1;
+
+    struct match_msg* msg = malloc (cost);
+    if (msg == NULL)
+        return -1;
+    msg->src = src;
+    msg->tag = tag;
+    msg->sz = sz;
+    memcpy (msg->data, data, sz);
+
+    /* Look up all three queues before linking into any, so running out of
+     * memory leaves nothing half done */
+    int i;
+    for (i = MATCH_PAIR; i <= MATCH_TAG; i++)
+    {
+        msg->queues[i] = get_queue (e, queue_key (i, src, tag));
+        if (msg->queues[i] == NULL)
+        {
+            while (--i >= MATCH_PAIR)
+                if (list_empty (&msg->queues[i]->head))
+                    drop_queue (e, msg->queues[i]);
+            free (msg);
+            return -1;
+        }
+    }
+
+    for (i = MATCH_PAIR; i <= MATCH_TAG; i++)
+        list_push_back (&msg->queues[i]->head, &msg->links[i]);
+    list_push_back (&e->all, &msg->links[MATCH_ALL]);
+
+    e->count++;
+    e->bytes += cost;
+    return 0;
+};
+
+struct match_msg*
+match_take (struct match_engine* e, int src, int tag)
+{
+    ASSERT (e != NULL);
+
+    /* Pick the one queue whose head is the oldest match */
+    struct match_link* head;
+    enum match_list list;
+    if (src == MATCH_ANY && tag == MATCH_ANY)
+    {
+        list = MATCH_ALL;
+        head = &e->all;
+    }
+    else
+    {
+        if (src == MATCH_ANY)
+            list = MATCH_TAG;
+        else if (tag == MATCH_ANY)
+            list = MATCH_SRC;
+        else
+            list = MATCH_PAIR;
+
+        struct match_queue* q = find_queue (e, queue_key (list, src, tag));
+        if (q == NULL)
+            return NULL;
+        head = &q->head;
+    }
+
+    if (list_empty (head))
+        return NULL;
+    struct match_msg* msg = link_msg (head->next, list);
+
+    /* Off every queue it is on; queues left empty go away so senders and
+     * tags that are done with don't pile up */
+    int i;
+    for (i = MATCH_PAIR; i <= MATCH_TAG; i++)
+    {
+        list_remove (&msg->links[i]);
+        if (list_empty (&msg->queues[i]->head))
+            drop_queue (e, msg->queues[i]);
+    }
+    list_remove (&msg->links[MATCH_ALL]);
+
+    e->count--;
+    return msg;
+};
+
+void
+match_free (struct match_engine* e, struct match_msg* msg)
+{
+    ASSERT (e != NULL);
+
+    if (msg == NULL)
+        return;
+    e->bytes -= sizeof *msg + msg->sz;
+    free (msg);
+};
+
+struct mailbox*
+mailbox_create (size_t cap)
+{
+    struct mailbox* mb = malloc (sizeof *mb);
+    if (mb == NULL)
+        return NULL;
+    if (match_init (&mb->engine, cap))
+    {
+        free (mb);
+        return NULL;
+    }
+
+    /* Receive deadlines are on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&mb->arrived, &attr);
+    pthread_condattr_destroy (&attr);
+    pthread_mutex_init (&mb->lock, NULL);
+    mb->closed = false;
+
+    return mb;
+};
+
+void
+mailbox_destroy (struct mailbox* mb)
+{
+    if (mb == NULL)
+        return;
+    match_destroy (&mb->engine);
+    pthread_cond_destroy (&mb->arrived);
+    pthread_mutex_destroy (&mb->lock);
+    free (mb);
+};
+
+void
+mailbox_close (struct mailbox* mb)
+{
+    ASSERT (mb != NULL);
+
+    pthread_mutex_lock (&mb->lock);
+    mb->closed = true;
+    pthread_cond_broadcast (&mb->arrived);
+    pthread_mutex_unlock (&mb->lock);
+};
+
+int
+mailbox_put (struct mailbox* mb, int src, int tag, const void* data,
+        size_t sz)
+{
+    ASSERT (mb != NULL);
+
+    pthread_mutex_lock (&mb->lock);
+    int result = mb->closed ? -1
+        : match_put (&mb->engine, src, tag, data, sz);
+    if (result == 0)
+        pthread_cond_broadcast (&mb->arrived);
+    pthread_mutex_unlock (&mb->lock);
+
+    return result;
+};
+
+struct match_msg*
+mailbox_get (struct mailbox* mb, int src, int tag, int timeout_ms)
+{
+    ASSERT (mb != NULL);
+
+    struct timespec deadline;
+    if (timeout_ms > 0)
+    {
+        clock_gettime (CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock (&mb->lock);
+    struct match_msg* msg = NULL;
+    int error = 0;
+    while (!mb->closed
+            && (msg = match_take (&mb->engine, src, tag)) == NULL)
+    {
+        if (timeout_ms == 0)
+        {
+            error = EAGAIN;
+            break;
+        }
+        if (timeout_ms < 0)
+            pthread_cond_wait (&mb->arrived, &mb->lock);
+        else if (ETIMEDOUT == pthread_cond_timedwait (&mb->arrived,
+                    &mb->lock, &deadline))
+        {
+            /* One last look, in case it came in with the timeout */
+            msg = match_take (&mb->engine, src, tag);
+            error = ETIMEDOUT;
+            break;
+        }
+    }
+    if (msg == NULL)
+        errno = mb->closed ? ESRCH : error;
+    pthread_mutex_unlock (&mb->lock);
+
+    return msg;
+};
+
+void
+mailbox_free (struct mailbox* mb, struct match_msg* msg)
+{
+    ASSERT (mb != NULL);
+
+    pthread_mutex_lock (&mb->lock);
+    match_free (&mb->engine, msg);
+    pthread_mutex_unlock (&mb->lock);
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+/* Senders and tags are never negative, so both fit in 31 bits and the list
+ * goes in the top two */
+static uint64_t
+queue_key (enum match_list list, int src, int tag)
+{
+    uint64_t key = (uint64_t) list << 62;
+    if (list == MATCH_PAIR || list == MATCH_SRC)
+        key |= (uint64_t) (uint32) src << 31;
+    if (list == MATCH_PAIR || list == MATCH_TAG)
+        key |= (uint32) tag;
+    return key;
+};
+
+static size_t
+hash_key (uint64_t key, size_t nbuckets)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key & (nbuckets - 1);
+};
+
+static struct match_queue*
+find_queue (struct match_engine* e, uint64_t key)
+{
+    struct match_queue* q;
+    for (q = e->buckets[hash_key (key, e->nbuckets)]; q != NULL; q = q->next)
+        if (q->key == key)
+            return q;
+    return NULL;
+};
+
+/* Finds the queue for KEY, making it if it isn't there */
+static struct match_queue*
+get_queue (struct match_engine* e, uint64_t key)
+{
+    struct match_queue* q = find_queue (e, key);
+    if (q != NULL)
+        return q;
+
+    /* Keep chains short; failing to grow just makes them longer */
+    if (e->nqueues >= e->nbuckets)
+        grow (e);
+
+    q = malloc (sizeof *q);
+    if (q == NULL)
+        return NULL;
+    q->key = key;
+    list_init (&q->head);
+
+    struct match_queue** bucket = &e->buckets[hash_key (key, e->nbuckets)];
+    q->next = *bucket;
+    *bucket = q;
+    e->nqueues++;
+    return q;
+};
+
+static void
+drop_queue (struct match_engine* e, struct match_queue* q)
+{
+    struct match_queue** p;
+    for (p = &e->buckets[hash_key (q->key, e->nbuckets)]; *p != NULL;
+            p = &(*p)->next)
+    {
+        if (*p == q)
+        {
+            *p = q->next;
+            e->nqueues--;
+            free (q);
+            return;
+        }
+    }
+    ASSERT (false);
+};
+
+static bool
+grow (struct match_engine* e)
+{
+    size_t n = e->nbuckets * 2;
+    struct match_queue** buckets = calloc (n, sizeof *buckets);
+    if (buckets == NULL)
+        return false;
+
+    size_t i;
+    for (i = 0; i < e->nbuckets; i++)
+    {
+        struct match_queue* q = e->buckets[i];
+        while (q != NULL)
+        {
+            struct match_queue* next = q->next;
+            size_t b = hash_key (q->key, n);
+            q->next = buckets[b];
+            buckets[b] = q;
+            q = next;
+        }
+    }
+
+    free (e->buckets);
+    e->buckets = buckets;
+    e->nbuckets = n;
+    return true;
+};
+
+static void
+list_init (struct match_link* head)
+{
+    head->prev = head;
+    head->next = head;
+};
+
+static void
+list_push_back (struct match_link* head, struct match_link* l)
+{
+    l->prev = head->prev;
+    l->next = head;
+    head->prev->next = l;
+    head->prev = l;
+};
+
+static void
+list_remove (struct match_link* l)
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+};
+
+static bool
+list_empty (const struct match_link* head)
+{
+    return head->next == head;
+};
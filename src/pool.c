@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "debug.h"
+
+void
+pool_init (struct node_pool* pool, size_t size)
+{
+    ASSERT (pool != NULL);
+    ASSERT (size > 0);
+    ASSERT (size <= POOL_CHUNK_BYTES - sizeof (struct pool_chunk));
+
+    memset (pool, 0, sizeof *pool);
+    pool->size = (size + sizeof (void*) - 1) & ~(sizeof (void*) - 1);
+};
+
+void
+pool_destroy (struct node_pool* pool)
+{
+    ASSERT (pool != NULL);
+
+    while (pool->chunks != NULL)
+    {
+        struct pool_chunk* c = pool->chunks;
+        pool->chunks = c->next;
+        free (c);
+    }
+    pool->free = NULL;
+    pool->next = pool->end = NULL;
+    pool->in_use = 0;
+};
+
+void*
+pool_alloc (struct node_pool* pool)
+{
+    ASSERT (pool != NULL);
+
+    void* obj = pool->free;
+    if (obj != NULL)
+        pool->free = *(void**) obj;
+    else
+    {
+        /* Carve from the newest chunk, starting a new one when it is used
+         * up */
+        if (pool->next == NULL || pool->next + pool->size > pool->end)
+        {
+            struct pool_chunk* c = malloc (POOL_CHUNK_BYTES);
+            if (c == NULL)
+                return NULL;
+            c->next = pool->chunks;
+            pool->chunks = c;
+            pool->next = (char*) c + ((sizeof *c + 15) & ~(size_t) 15);
+            pool->end = (char*) c + POOL_CHUNK_BYTES;
+        }
+        obj = pool->next;
+        pool->next += pool->size;
+    }
+
+    pool->in_use++;
+    return obj;
+};
+
+void
+pool_free (struct node_pool* pool, void* obj)
+{
+    ASSERT (pool != NULL);
+
+    if (obj == NULL)
+        return;
+    *(void**) obj = pool->free;
+    pool->free = obj;
+    pool->in_use--;
+};
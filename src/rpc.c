@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rpc.h"
+#include "debug.h"
+
+#define RPC_BUCKETS     1024
+
+/* How often the sweeper looks when no call is waiting.  Calls due sooner
+ * than that wake it, so with none in flight each call would otherwise
+ * cost a wakeup. */
+#define RPC_SWEEP_IDLE  1000
+
+/* Calls in flight, hashed by call id */
+static struct rpc_call* calls[RPC_BUCKETS];
+
+/* Their deadlines, and when the sweeper next wakes to look at them */
+static struct timer_wheel deadlines;
+static uint64_t sweep_at = UINT64_MAX;
+
+/* Calls the sweeper found expired, to fail once it drops the lock */
+static struct rpc_call* expired = NULL;
+
+static pthread_mutex_t rpc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweep_cond;
+static pthread_t sweeper;
+static bool running = false;
+
+static rpc_deliver_func* deliver = NULL;
+static uint32 next_callid = 1;
+static struct rpc_stats stats;
+
+static void* sweep_thread (void* aux);
+static struct rpc_call* unlink_call (uint32 callid);
+static void deliver_result (struct rpc_call* call, int status,
+        const void* data, size_t sz);
+static void expire_call (struct timer_wheel* w, struct timer* t, void* aux);
+
+int
+init_rpc (rpc_deliver_func* func)
+{
+    ASSERT (func != NULL);
+
+    deliver = func;
+    memset (calls, 0, sizeof calls);
+    memset (&stats, 0, sizeof stats);
+    timer_wheel_init (&deadlines, timer_now ());
+
+    /* Deadlines are on the monotonic clock so changing the time of day
+     * can't expire or extend calls */
+    pthread_condattr_t attr;
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&sweep_cond, &attr);
+    pthread_condattr_destroy (&attr);
+
+    running = true;
+    if (pthread_create (&sweeper, NULL, &sweep_thread, NULL))
+    {
+        running = false;
+        return -1;
+    }
+    return 0;
+};
+
+uint32
+rpc_begin (int caller, uint32 corr_id, int callee, int timeout_ms)
+{
+    struct rpc_call* call = malloc (sizeof *call);
+    if (call == NULL)
+        return 0;
+
+    if (timeout_ms <= 0)
+        timeout_ms = RPC_DEFAULT_TIMEOUT;
+
+    call->caller = caller;
+    call->corr_id = corr_id;
+    call->callee = callee;
+    timer_init (&call->deadline, &expire_call, call);
+    /* A tick late rather than part of one early */
+    uint64_t deadline = timer_now () + timeout_ms + 1;
+
+    pthread_mutex_lock (&rpc_lock);
+    call->callid = next_callid++;
+    if (next_callid == 0)
+        next_callid = 1;
+
+    /* Wake the sweeper if it would sleep past this deadline */
+    timer_arm (&deadlines, &call->deadline, deadline);
+    if (deadline < sweep_at)
+        pthread_cond_signal (&sweep_cond);
+
+    struct rpc_call** bucket = &calls[call->callid % RPC_BUCKETS];
+    call->next = *bucket;
+    *bucket = call;
+    stats.calls++;
+    uint32 callid = call->callid;
+    pthread_mutex_unlock (&rpc_lock);
+
+    return callid;
+};
+
+int
+rpc_finish (uint32 callid, int callee, const void* data, size_t sz)
+{
+    pthread_mutex_lock (&rpc_lock);
+    struct rpc_call* call = unlink_call (callid);
+    if (call != NULL && call->callee != callee)
+    {
+        /* Not yours to answer; put it back */
+        struct rpc_call** bucket = &calls[callid % RPC_BUCKETS];
+        call->next = *bucket;
+        *bucket = call;
+        timer_arm (&deadlines, &call->deadline, call->deadline.expires);
+        call = NULL;
+    }
+    else if (call == NULL)
+        stats.late++;
+    else
+        stats.replies++;
+    pthread_mutex_unlock (&rpc_lock);
+
+    if (call == NULL)
+        return -1;
+
+    deliver_result (call, 0, data, sz);
+    free (call);
+    return 0;
+};
+
+void
+rpc_abort (uint32 callid, int status)
+{
+    pthread_mutex_lock (&rpc_lock);
+    struct rpc_call* call = unlink_call (callid);
+    pthread_mutex_unlock (&rpc_lock);
+
+    if (call != NULL)
+    {
+        deliver_result (call, status, NULL, 0);
+        free (call);
+    }
+};
+
+void
+rpc_get_stats (struct rpc_stats* s)
+{
+    ASSERT (s != NULL);
+
+    pthread_mutex_lock (&rpc_lock);
+    *s = stats;
+    pthread_mutex_unlock (&rpc_lock);
+};
+
+void
+end_rpc ()
+{
+    pthread_mutex_lock (&rpc_lock);
+    if (!running)
+    {
+        pthread_mutex_unlock (&rpc_lock);
+        return;
+    }
+    running = false;
+    pthread_cond_signal (&sweep_cond);
+    pthread_mutex_unlock (&rpc_lock);
+
+    pthread_join (sweeper, NULL);
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+/* Fails calls as their deadlines pass.  Results are delivered without the
+ * lock held, since writing to a child's pipe may block. */
+static void*
+sweep_thread (void* aux)
+{
+    pthread_mutex_lock (&rpc_lock);
+    while (running)
+    {
+        uint64_t now = timer_now ();
+        int wait = timer_next (&deadlines, now);
+        if (wait == -1)
+            wait = RPC_SWEEP_IDLE;
+        if (wait > 0)
+        {
+            struct timespec until;
+            sweep_at = now + wait;
+            until.tv_sec = sweep_at / 1000;
+            until.tv_nsec = (sweep_at % 1000) * 1000000L;
+            pthread_cond_timedwait (&sweep_cond, &rpc_lock, &until);
+            continue;
+        }
+
+        /* Collect everything that expired in one pass */
+        timer_advance (&deadlines, now);
+        struct rpc_call* list = expired;
+        expired = NULL;
+        pthread_mutex_unlock (&rpc_lock);
+
+        while (list != NULL)
+        {
+            struct rpc_call* call = list;
+            list = call->next;
+            deliver_result (call, ETIMEDOUT, NULL, 0);
+            free (call);
+        }
+
+        pthread_mutex_lock (&rpc_lock);
+    }
+    pthread_mutex_unlock (&rpc_lock);
+
+    return NULL;
+};
+
+/* The deadline of call AUX passed.  Called with RPC_LOCK held. */
+static void
+expire_call (struct timer_wheel* w, struct timer* t, void* aux)
+{
+    struct rpc_call* call = unlink_call (((struct rpc_call*) aux)->callid);
+
+    ASSERT (call == aux);
+    call->next = expired;
+    expired = call;
+    stats.timeouts++;
+};
+
+/* RPC_LOCK must be held */
+static struct rpc_call*
+unlink_call (uint32 callid)
+{
+    struct rpc_call** p;
+    for (p = &calls[callid % RPC_BUCKETS]; *p != NULL; p = &(*p)->next)
+    {
+        if ((*p)->callid == callid)
+        {
+            struct rpc_call* call = *p;
+            *p = call->next;
+            timer_cancel (&deadlines, &call->deadline);
+            return call;
+        }
+    }
+    return NULL;
+};
+
+static void
+deliver_result (struct rpc_call* call, int status, const void* data,
+        size_t sz)
+{
+    struct message m;
+    struct rpc_header h;
+
+    if (sz > RPC_MAX_PAYLOAD)
+    {
+        status = EMSGSIZE;
+        sz = 0;
+    }
+
+    memset (&m, 0, sizeof m);
+    m.command = RPC_RESULT;
+    m.id = call->corr_id;
+    memset (&h, 0, sizeof h);
+    h.corr_id = call->corr_id;
+    h.peer = call->callee;
+    h.status = status;
+    h.sz = sz;
+    memcpy (m.information, &h, sizeof h);
+    if (sz > 0)
+        memcpy (m.information + sizeof h, data, sz);
+    m.sz = sizeof h + sz;
+
+    /* If the caller is gone there is nobody left to tell */
+    deliver (call->caller, &m);
+};
@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
+
 #include "mysignal.h"
 #include "debug.h"
 #include "logging.h"
-#include "main.h"
-#include "mysignal.h"
+#include "child.h"
+#include "event.h"
+#include "idle.h"
+#include "supervisor.h"
+#include "sync.h"
+#include "type.h"
 
 #include <signal.h>
 #include <stdio.h>
@@ -12,54 +18,168 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+
+/* Signals we take through the descriptor */
+static const int handled[] = { SIGCHLD, SIGINT, SIGTERM, SIGHUP };
 
+/* The mask from before we blocked ours, which children get back */
+static sigset_t original;
+
+/* Reads this many signals at a time */
+#define SIGNAL_BATCH    16
+
+/* SIGINTs and SIGTERMs received */
+static unsigned stops = 0;
 
 /* Our signal handler functions */
-static void sigchld_handler (int);
-static void sigint_handler (int);
+static int reap_children ();
+static void sigint_handler (int sig);
+static void sighup_handler ();
 
-/* Declared in main.c and indicates whether the main loop should 
- * continue to run or not.  Set to FALSE to gracefully exit the 
+/* Declared in main.c and indicates whether the main loop should
+ * continue to run or not.  Set to FALSE to gracefully exit the
  * application. */
-extern int run;
+extern bool run;
 
 int
-init_signal_handler (int sig)
+init_signal_handler ()
 {
-    /* Here we map signals we want to catch to respective functions that can
-     * handle them */
-    signal (SIGCHLD, sigchld_handler);
-    signal (SIGINT, sigint_handler);
+    sigset_t mask;
+    size_t i;
+
+    /* Blocked signals stay pending instead of interrupting whatever the
+     * process was doing, until the main loop reads them from the
+     * descriptor.  Every thread must block them too, or the kernel would
+     * deliver them to one that doesn't, so this has to run before the
+     * first thread is created. */
+    sigemptyset (&mask);
+    for (i = 0; i < sizeof handled / sizeof handled[0]; i++)
+        sigaddset (&mask, handled[i]);
+    if (-1 == sigprocmask (SIG_BLOCK, &mask, &original))
+        return -1;
 
-    return 0;
+    return signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 };
 
+void
+restore_signal_mask ()
+{
+    sigprocmask (SIG_SETMASK, &original, NULL);
+};
+
+int
+handle_signals (int sfd)
+{
+    struct signalfd_siginfo info[SIGNAL_BATCH];
+    bool chld = false;
+    int reaped = 0;
+
+    while (true)
+    {
+        ssize_t n = read (sfd, info, sizeof info);
+        if (-1 == n && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
 
-/* Called when a child process exits.  We need to remove the child from our
- * index and invoke any listeners that listen on this event.  To do this, we
- * will queue up an event to tell the master server to do this so that we can
- * return from the signal handler ASAP */
-static void 
-sigchld_handler (int sig)
+        size_t i;
+        for (i = 0; i < n / sizeof info[0]; i++)
+        {
+            switch (info[i].ssi_signo)
+            {
+            case SIGCHLD:
+                chld = true;
+                break;
+            case SIGINT:
+            case SIGTERM:
+                sigint_handler (info[i].ssi_signo);
+                break;
+            case SIGHUP:
+                sighup_handler ();
+                break;
+            }
+        }
+    }
+
+    /* SIGCHLDs that arrive together are merged into one, so one pass
+     * reaps every child that has exited, however many signals we read */
+    if (chld)
+        reaped = reap_children ();
+    return reaped;
+};
+
+unsigned
+stop_signals ()
 {
-    ASSERT (sig == SIGCHLD);
+    return stops;
+};
+
+/* === HELPER FUNCTIONS === */
 
-    /* Get the pid and status of the child that exited */
+/* Reaps every child that has exited.  Each one releases any shared locks it
+ * still held, so its siblings don't block forever on them, and leaves the
+ * child index so siblings can't send to it any more.  Siblings that asked
+ * are told it exited.  Returns how many children were reaped. */
+static int
+reap_children ()
+{
+    int reaped = 0;
     int status;
-    pid_t child = wait (&status);
+    pid_t pid;
 
-    /* Now check the status code and act accordingly */
+    while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+    {
+        sync_release_pid (pid);
+        struct server_child* child = remove_child_by_pid (pid);
+        bool known = child != NULL;
+        reaped++;
 
-    printf ("Child exited: %d \n", child);
+        if (child != NULL)
+        {
+            /* Ours until we drop the index's reference to it */
+            int code = WIFSIGNALED (status) ? -WTERMSIG (status)
+                : WEXITSTATUS (status);
+            event_post (child->ourid, EVENT_EXIT, child->state, code);
+            event_forget (child->ourid);
+            idle_forget (child);
+            put_child (child);
+        }
+
+        /* Workers that exit are replaced by the main loop, and the log
+         * writer frees the slot of a compressor */
+        supervisor_exited (pid, status, supervisor_clock ());
+        known = log_child_exited (pid) || known;
+
+        if (WIFSIGNALED (status))
+        {
+            log_debug (LOG_SIGNAL, "Child %d killed by signal %d%s",
+                    (int) pid, WTERMSIG (status), known ? "" : " (unknown)");
+        }
+        else
+        {
+            log_debug (LOG_SIGNAL, "Child %d exited with status %d%s",
+                    (int) pid, WEXITSTATUS (status),
+                    known ? "" : " (unknown)");
+        }
+    }
+    return reaped;
 };
 
 static void
 sigint_handler (int sig)
 {
-    server_log ("SIGINT received, exiting... \n");
+    log_info (LOG_SIGNAL, "%s received, exiting...",
+            sig == SIGINT ? "SIGINT" : "SIGTERM");
 
     /* Exit gracefully... */
     run = false;
+    stops++;
 };
 
-
+/* Whatever moved our log files aside wants us to start new ones */
+static void
+sighup_handler ()
+{
+    reopen_logging ();
+};
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+#include "debug.h"
+
+static int make_id (uint32 slot, uint32 gen);
+static struct slab_slot* get_slot (const struct slab_table* t, uint32 slot);
+static struct slab_slot* id_slot (const struct slab_table* t, int id);
+static void write_begin (struct slab_slot* s);
+static void write_end (struct slab_slot* s);
+static bool grow (struct slab_table* t);
+
+void
+slab_init (struct slab_table* t)
+{
+    ASSERT (t != NULL);
+
+    memset (t, 0, sizeof *t);
+};
+
+void
+slab_destroy (struct slab_table* t)
+{
+    ASSERT (t != NULL);
+
+    uint32 i;
+    for (i = 0; i < SLAB_MAX_SEGS; i++)
+        free (t->segs[i]);
+    memset (t, 0, sizeof *t);
+};
+
+int
+slab_insert (struct slab_table* t, void* data)
+{
+    ASSERT (t != NULL);
+    ASSERT (data != NULL);
+
+    if (t->free_head == 0 && !grow (t))
+        return -1;
+
+    uint32 slot = t->free_head - 1;
+    struct slab_slot* s = get_slot (t, slot);
+    t->free_head = s->next_free;
+    if (t->free_head == 0)
+        t->free_tail = 0;
+
+    write_begin (s);
+    __atomic_store_n (&s->data, data, __ATOMIC_RELAXED);
+    write_end (s);
+
+    s->next_free = 0;
+    t->count++;
+    return make_id (slot, s->gen);
+};
+
+void*
+slab_find (const struct slab_table* t, int id)
+{
+    ASSERT (t != NULL);
+
+    struct slab_slot* s = id_slot (t, id);
+    if (s == NULL)
+        return NULL;
+
+    /* Read the slot until no writer got in the way */
+    uint32 seq, gen;
+    void* data;
+    do
+    {
+        seq = __atomic_load_n (&s->seq, __ATOMIC_ACQUIRE);
+        gen = __atomic_load_n (&s->gen, __ATOMIC_RELAXED);
+        data = __atomic_load_n (&s->data, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+    while ((seq & 1) || seq != __atomic_load_n (&s->seq, __ATOMIC_RELAXED));
+
+    return gen == (uint32) id >> SLAB_INDEX_BITS ? data : NULL;
+};
+
+void*
+slab_remove (struct slab_table* t, int id)
+{
+    ASSERT (t != NULL);
+
+    struct slab_slot* s = id_slot (t, id);
+    if (s == NULL || s->gen != (uint32) id >> SLAB_INDEX_BITS ||
+            s->data == NULL)
+        return NULL;
+
+    void* data = s->data;
+    write_begin (s);
+    __atomic_store_n (&s->data, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n (&s->gen, s->gen < SLAB_GEN_MAX ? s->gen + 1 : 1,
+            __ATOMIC_RELAXED);
+    write_end (s);
+
+    /* To the back of the free list, so it is the last slot to be reused */
+    uint32 slot = (uint32) id & (SLAB_MAX_SLOTS - 1);
+    s->next_free = 0;
+    if (t->free_tail == 0)
+        t->free_head = slot + 1;
+    else
+        get_slot (t, t->free_tail - 1)->next_free = slot + 1;
+    t->free_tail = slot + 1;
+
+    t->count--;
+    return data;
+};
+
+void*
+slab_next (const struct slab_table* t, uint32* pos)
+{
+    ASSERT (t != NULL);
+    ASSERT (pos != NULL);
+
+    uint32 nslots = __atomic_load_n (&t->nslots, __ATOMIC_ACQUIRE);
+    while (*pos < nslots)
+    {
+        struct slab_slot* s = get_slot (t, (*pos)++);
+        void* data = __atomic_load_n (&s->data, __ATOMIC_ACQUIRE);
+        if (data != NULL)
+            return data;
+    }
+    return NULL;
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+static int
+make_id (uint32 slot, uint32 gen)
+{
+    return (int) (gen << SLAB_INDEX_BITS | slot);
+};
+
+static struct slab_slot*
+get_slot (const struct slab_table* t, uint32 slot)
+{
+    struct slab_slot* seg = __atomic_load_n (&t->segs[slot >> SLAB_SEG_BITS],
+            __ATOMIC_ACQUIRE);
+    return &seg[slot & (SLAB_SEG_SIZE - 1)];
+};
+
+/* Returns the slot ID refers to, if the table has one */
+static struct slab_slot*
+id_slot (const struct slab_table* t, int id)
+{
+    if (id <= 0)
+        return NULL;
+
+    uint32 slot = (uint32) id & (SLAB_MAX_SLOTS - 1);
+    if (slot >= __atomic_load_n (&t->nslots, __ATOMIC_ACQUIRE))
+        return NULL;
+    return get_slot (t, slot);
+};
+
+static void
+write_begin (struct slab_slot* s)
+{
+    __atomic_store_n (&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+};
+
+static void
+write_end (struct slab_slot* s)
+{
+    __atomic_store_n (&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+};
+
+/* Adds a segment and puts its slots on the free list */
+static bool
+grow (struct slab_table* t)
+{
+    uint32 n = t->nslots;
+    if (n >= SLAB_MAX_SLOTS)
+        return false;
+
+    struct slab_slot* seg = calloc (SLAB_SEG_SIZE, sizeof *seg);
+    if (seg == NULL)
+        return false;
+
+    uint32 i;
+    for (i = 0; i < SLAB_SEG_SIZE; i++)
+    {
+        seg[i].gen = 1;
+        seg[i].next_free = i + 1 < SLAB_SEG_SIZE ? n + i + 2 : 0;
+    }
+
+    /* Only called with the free list empty */
+    t->free_head = n + 1;
+    t->free_tail = n + SLAB_SEG_SIZE;
+
+    /* Publish the segment before readers may index into it */
+    __atomic_store_n (&t->segs[n >> SLAB_SEG_BITS], seg, __ATOMIC_RELEASE);
+    __atomic_store_n (&t->nslots, n + SLAB_SEG_SIZE, __ATOMIC_RELEASE);
+    return true;
+};
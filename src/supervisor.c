@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include "supervisor.h"
+#include "logging.h"
+#include "debug.h"
+
+static struct worker_group* groups = NULL;
+static supervisor_spawn_func* spawn = NULL;
+static bool stopping = false;
+
+static void start_worker (struct worker_group* g, int slot, uint64_t now);
+static void crashed (struct worker_group* g, int slot, uint64_t uptime,
+        uint64_t now);
+static void open_breaker (struct worker_group* g, uint64_t now);
+static uint64_t backoff (const struct worker_group* g);
+static bool tripped (const struct worker_group* g, uint64_t now);
+
+void
+init_supervisor (supervisor_spawn_func* func)
+{
+    ASSERT (func != NULL);
+
+    while (groups != NULL)
+    {
+        struct worker_group* g = groups;
+        groups = g->next;
+        free (g->slots);
+        free (g->script);
+        free (g);
+    }
+    spawn = func;
+    stopping = false;
+};
+
+struct worker_group*
+supervise (const char* script, int target, const struct worker_policy* policy,
+        void* aux)
+{
+    static const struct worker_policy defaults = WORKER_DEFAULT_POLICY;
+    struct worker_group* g = calloc (1, sizeof *g);
+
+    ASSERT (target > 0);
+
+    if (g == NULL)
+        return NULL;
+    g->slots = calloc (target, sizeof *g->slots);
+    g->script = strdup (script);
+    if (g->slots == NULL || g->script == NULL)
+    {
+        free (g->slots);
+        free (g->script);
+        free (g);
+        return NULL;
+    }
+
+    g->aux = aux;
+    g->target = target;
+    g->policy = policy != NULL ? *policy : defaults;
+    if (g->policy.breaker_crashes > WORKER_BREAKER_MAX)
+        g->policy.breaker_crashes = WORKER_BREAKER_MAX;
+    g->probe = -1;
+    g->stats.breaker = BREAKER_CLOSED;
+    g->next = groups;
+    groups = g;
+    return g;
+};
+
+bool
+supervisor_exited (pid_t pid, int status, uint64_t now)
+{
+    struct worker_group* g;
+    int i = 0;
+
+    if (pid <= 0)
+        return false;
+    for (g = groups; g != NULL; g = g->next)
+    {
+        for (i = 0; i < g->target && g->slots[i].pid != pid; i++)
+            ;
+        if (i < g->target)
+            break;
+    }
+    if (g == NULL)
+        return false;
+
+    struct worker_slot* slot = &g->slots[i];
+    uint64_t uptime = now - slot->started;
+    int code = WIFSIGNALED (status) ? -WTERMSIG (status)
+        : WEXITSTATUS (status);
+
+    slot->pid = 0;
+    g->stats.running--;
+    g->stats.exits++;
+    g->stats.last_exit = code;
+    g->stats.last_exit_time = now;
+
+    if (code != 0 || uptime < g->policy.min_uptime)
+        crashed (g, i, uptime, now);
+    else
+    {
+        /* It did its job; replace it right away */
+        g->consecutive = 0;
+        slot->due = now;
+        if (g->probe == i)
+        {
+            g->probe = -1;
+            g->stats.breaker = BREAKER_CLOSED;
+        }
+    }
+
+    log_info (LOG_CHILD, "Worker %d of %s exited with %d after %llu ms",
+            (int) pid, g->script, code, (unsigned long long) uptime);
+    return true;
+};
+
+int
+supervisor_run (uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    struct worker_group* g;
+    int i;
+
+    if (stopping)
+        return -1;
+
+    for (g = groups; g != NULL; g = g->next)
+    {
+        if (g->stats.breaker == BREAKER_OPEN && now >= g->reopen)
+        {
+            /* Let one worker through to see whether the script is fixed */
+            for (i = 0; i < g->target && g->slots[i].pid != 0; i++)
+                ;
+            if (i < g->target)
+            {
+                start_worker (g, i, now);
+                if (g->slots[i].pid != 0)
+                {
+                    g->probe = i;
+                    g->stats.breaker = BREAKER_HALF_OPEN;
+                }
+                else
+                    g->reopen = now + g->policy.breaker_cooldown;
+            }
+        }
+
+        if (g->stats.breaker == BREAKER_HALF_OPEN)
+        {
+            uint64_t healthy = g->slots[g->probe].started
+                + g->policy.min_uptime;
+            if (now < healthy)
+            {
+                next = healthy < next ? healthy : next;
+                continue;
+            }
+
+            /* The probe lived; fill the group up again */
+            log_info (LOG_CHILD, "Workers of %s are starting again",
+                    g->script);
+            g->probe = -1;
+            g->consecutive = 0;
+            g->stats.breaker = BREAKER_CLOSED;
+            for (i = 0; i < g->target; i++)
+                g->slots[i].due = now;
+        }
+
+        if (g->stats.breaker == BREAKER_OPEN)
+        {
+            next = g->reopen < next ? g->reopen : next;
+            continue;
+        }
+
+        for (i = 0; i < g->target; i++)
+        {
+            struct worker_slot* slot = &g->slots[i];
+            if (slot->pid == 0 && slot->due <= now)
+                start_worker (g, i, now);
+            if (slot->pid == 0 && slot->due < next)
+                next = slot->due;
+        }
+    }
+
+    if (next == UINT64_MAX)
+        return -1;
+    return next <= now ? 0 : next - now > INT_MAX ? INT_MAX : next - now;
+};
+
+void
+supervisor_stop ()
+{
+    stopping = true;
+};
+
+int
+supervisor_kill (int sig)
+{
+    struct worker_group* g;
+    int n = 0;
+    int i;
+
+    for (g = groups; g != NULL; g = g->next)
+    {
+        for (i = 0; i < g->target; i++)
+        {
+            if (g->slots[i].pid != 0 && 0 == kill (g->slots[i].pid, sig))
+                n++;
+        }
+    }
+    return n;
+};
+
+void
+supervisor_get_stats (const struct worker_group* g, struct worker_stats* out)
+{
+    memcpy (out, &g->stats, sizeof *out);
+};
+
+uint64_t
+supervisor_clock ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+};
+
+/* === HELPER FUNCTIONS === */
+
+static void
+start_worker (struct worker_group* g, int i, uint64_t now)
+{
+    struct worker_slot* slot = &g->slots[i];
+    pid_t pid = spawn (g);
+
+    if (pid > 0)
+    {
+        slot->pid = pid;
+        slot->started = now;
+        g->stats.spawns++;
+        g->stats.running++;
+        return;
+    }
+
+    /* Out of processes or memory, most likely; give it a moment, but a
+     * broken script is not to blame */
+    g->stats.spawn_failures++;
+    g->consecutive++;
+    uint64_t wait = backoff (g);
+    slot->due = now + (wait > g->policy.backoff_min
+            ? wait : g->policy.backoff_min);
+    log_error (LOG_CHILD, "Could not start a worker of %s", g->script);
+};
+
+/* Worker I of G crashed after UPTIME ms */
+static void
+crashed (struct worker_group* g, int i, uint64_t uptime, uint64_t now)
+{
+    g->stats.crashes++;
+    g->crash_times[g->crash_next++ % WORKER_BREAKER_MAX] = now;
+
+    /* A crash after a good run doesn't make a loop */
+    if (uptime >= g->policy.min_uptime)
+        g->consecutive = 1;
+    else
+        g->consecutive++;
+    g->slots[i].due = now + backoff (g);
+
+    if (g->probe == i)
+    {
+        g->probe = -1;
+        open_breaker (g, now);
+    }
+    else if (g->stats.breaker == BREAKER_CLOSED && tripped (g, now))
+        open_breaker (g, now);
+};
+
+static void
+open_breaker (struct worker_group* g, uint64_t now)
+{
+    g->stats.breaker = BREAKER_OPEN;
+    g->stats.trips++;
+    g->reopen = now + g->policy.breaker_cooldown;
+    log_error (LOG_CHILD, "Workers of %s keep crashing, last with %d; "
+            "not starting any for %u ms", g->script, g->stats.last_exit,
+            g->policy.breaker_cooldown);
+};
+
+/* How long to wait before replacing a worker, given the crashes in a row */
+static uint64_t
+backoff (const struct worker_group* g)
+{
+    if (g->consecutive <= 1)
+        return 0;
+
+    unsigned shift = g->consecutive - 2;
+    if (shift >= 32
+            || (uint64_t) g->policy.backoff_min << shift
+            > g->policy.backoff_max)
+        return g->policy.backoff_max;
+    return (uint64_t) g->policy.backoff_min << shift;
+};
+
+/* Whether the last BREAKER_CRASHES crashes all came within BREAKER_WINDOW */
+static bool
+tripped (const struct worker_group* g, uint64_t now)
+{
+    unsigned n = g->policy.breaker_crashes;
+
+    if (n == 0 || g->crash_next < n)
+        return false;
+    uint64_t oldest = g->crash_times[(g->crash_next - n) % WORKER_BREAKER_MAX];
+    return now - oldest < g->policy.breaker_window;
+};
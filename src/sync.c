@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "sync.h"
+#include "debug.h"
+
+/* The mapped region.  Both the parent and the children use this pointer */
+static struct sync_region* region = NULL;
+
+/* Our own process slot and pid.  Only meaningful in a child */
+static int myslot = -1;
+static pid_t mypid = 0;
+
+/* Serializes object creation between the parent's communication threads */
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOAD(p)         __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v)     __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+#define CAS(p, e, v)    __atomic_compare_exchange_n ((p), (e), (v), false, \
+                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+static int futex_wait (uint32* addr, uint32 val);
+static void futex_wake (uint32* addr);
+
+static struct sync_object* get_object (int obj, enum sync_type type);
+static bool readers_empty (struct sync_rwlock* l);
+static void rw_wake (struct sync_rwlock* l);
+static void rw_sleep (struct sync_rwlock* l, bool for_readers);
+static int rd_acquire (int obj, bool wait);
+static int wr_acquire (int obj, bool wait);
+
+/* === Server side === */
+
+int
+init_sync_region ()
+{
+    char name[32];
+    snprintf (name, sizeof name, "/server_sync.%d", (int) getpid ());
+
+    int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return -1;
+
+    /* Children get the region through the inherited descriptor, so the name
+     * is not needed anymore and nothing is left behind if we crash. */
+    shm_unlink (name);
+
+    if (-1 == ftruncate (fd, sizeof (struct sync_region)))
+    {
+        close (fd);
+        return -1;
+    }
+
+    region = mmap (NULL, sizeof (struct sync_region), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+    {
+        region = NULL;
+        close (fd);
+        return -1;
+    }
+
+    memset (region, 0, sizeof (struct sync_region));
+    int i;
+    for (i = 0; i < SYNC_MAX_PROCS; i++)
+        region->procs[i].waiting_on = -1;
+
+    /* shm_open sets close-on-exec, but the children need this across exec */
+    fcntl (fd, F_SETFD, fcntl (fd, F_GETFD) & ~FD_CLOEXEC);
+
+    return fd;
+};
+
+int
+sync_alloc_proc ()
+{
+    ASSERT (region != NULL);
+
+    int i;
+    for (i = 0; i < SYNC_MAX_PROCS; i++)
+    {
+        pid_t expected = 0;
+        if (CAS (&region->procs[i].pid, &expected, -1))
+        {
+            region->procs[i].waiting_on = -1;
+            return i;
+        }
+    }
+    return -1;
+};
+
+void
+sync_set_proc (int slot, pid_t pid)
+{
+    ASSERT (region != NULL);
+    ASSERT (slot >= 0 && slot < SYNC_MAX_PROCS);
+
+    STORE (&region->procs[slot].pid, pid);
+};
+
+int
+sync_create (enum sync_type type, const char* name, int arg)
+{
+    ASSERT (region != NULL);
+    ASSERT (name != NULL);
+
+    if (type == SYNC_FREE)
+        return -1;
+    if ((type == SYNC_BARRIER || type == SYNC_LATCH) && arg <= 0)
+        return -1;
+
+    int i, free_obj = -1, result = -1;
+
+    pthread_mutex_lock (&create_lock);
+    for (i = 0; i < SYNC_MAX_OBJECTS; i++)
+    {
+        struct sync_object* o = &region->objects[i];
+        if (o->type == SYNC_FREE)
+        {
+            if (free_obj == -1)
+                free_obj = i;
+            continue;
+        }
+        if (strncmp (o->name, name, SYNC_NAME_LEN) == 0)
+        {
+            if (o->type == type)
+            {
+                /* Re-initializing a broken barrier makes it usable again */
+                if (type == SYNC_BARRIER && LOAD (&o->u.barrier.broken))
+                {
+                    STORE (&o->u.barrier.arrived, 0);
+                    STORE (&o->u.barrier.broken, 0);
+                }
+                result = i;
+            }
+            pthread_mutex_unlock (&create_lock);
+            return result;
+        }
+    }
+
+    if (free_obj != -1)
+    {
+        struct sync_object* o = &region->objects[free_obj];
+        memset (&o->u, 0, sizeof o->u);
+        strncpy (o->name, name, SYNC_NAME_LEN - 1);
+        o->name[SYNC_NAME_LEN - 1] = '\0';
+        if (type == SYNC_BARRIER)
+            o->u.barrier.parties = arg;
+        else if (type == SYNC_LATCH)
+            o->u.latch.count = arg;
+
+        /* Publish the object last so nobody sees it half initialized */
+        STORE (&o->type, type);
+        result = free_obj;
+    }
+    pthread_mutex_unlock (&create_lock);
+
+    return result;
+};
+
+void
+sync_release_pid (pid_t pid)
+{
+    if (region == NULL || pid <= 0)
+        return;
+
+    int slot;
+    for (slot = 0; slot < SYNC_MAX_PROCS; slot++)
+        if (LOAD (&region->procs[slot].pid) == pid)
+            break;
+    if (slot == SYNC_MAX_PROCS)
+        return;
+
+    int word = slot / 64;
+    uint64_t bit = 1ULL << (slot % 64);
+    int waiting_on = LOAD (&region->procs[slot].waiting_on);
+
+    int i;
+    for (i = 0; i < SYNC_MAX_OBJECTS; i++)
+    {
+        struct sync_object* o = &region->objects[i];
+        switch (LOAD (&o->type))
+        {
+        case SYNC_RWLOCK:
+        {
+            struct sync_rwlock* l = &o->u.rwlock;
+            bool wake = false;
+            pid_t expected = pid;
+            if (CAS (&l->writer, &expected, 0))
+                wake = true;
+            if (__atomic_fetch_and (&l->readers[word], ~bit,
+                        __ATOMIC_SEQ_CST) & bit)
+                wake = true;
+            if (wake)
+                rw_wake (l);
+            break;
+        }
+        case SYNC_BARRIER:
+            if (waiting_on == i)
+            {
+                struct sync_barrier* b = &o->u.barrier;
+                STORE (&b->broken, 1);
+                __atomic_add_fetch (&b->generation, 1, __ATOMIC_SEQ_CST);
+                futex_wake (&b->generation);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    STORE (&region->procs[slot].waiting_on, -1);
+    STORE (&region->procs[slot].pid, 0);
+};
+
+void
+end_sync ()
+{
+    if (region != NULL)
+        munmap (region, sizeof (struct sync_region));
+    region = NULL;
+};
+
+/* === Client side === */
+
+int
+sync_attach (int fd, int slot)
+{
+    if (slot < 0 || slot >= SYNC_MAX_PROCS)
+        return -1;
+
+    region = mmap (NULL, sizeof (struct sync_region), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+    {
+        region = NULL;
+        return -1;
+    }
+
+    myslot = slot;
+    mypid = getpid ();
+    return 0;
+};
+
+int
+sync_rdlock (int obj)
+{
+    return rd_acquire (obj, true);
+};
+
+int
+sync_tryrdlock (int obj)
+{
+    return rd_acquire (obj, false);
+};
+
+int
+sync_rdunlock (int obj)
+{
+    struct sync_object* o = get_object (obj, SYNC_RWLOCK);
+    if (o == NULL)
+        return -1;
+
+    struct sync_rwlock* l = &o->u.rwlock;
+    uint64_t bit = 1ULL << (myslot % 64);
+    if (!(__atomic_fetch_and (&l->readers[myslot / 64], ~bit,
+                __ATOMIC_SEQ_CST) & bit))
+        return -1;
+
+    /* A writer may be waiting for the readers to drain */
+    if (LOAD (&l->writer) != 0)
+        rw_wake (l);
+    return 0;
+};
+
+int
+sync_wrlock (int obj)
+{
+    return wr_acquire (obj, true);
+};
+
+int
+sync_trywrlock (int obj)
+{
+    return wr_acquire (obj, false);
+};
+
+int
+sync_wrunlock (int obj)
+{
+    struct sync_object* o = get_object (obj, SYNC_RWLOCK);
+    if (o == NULL)
+        return -1;
+
+    struct sync_rwlock* l = &o->u.rwlock;
+    pid_t expected = mypid;
+    if (!CAS (&l->writer, &expected, 0))
+        return -1;
+    rw_wake (l);
+    return 0;
+};
+
+int
+sync_barrier_wait (int obj)
+{
+    struct sync_object* o = get_object (obj, SYNC_BARRIER);
+    if (o == NULL)
+        return -1;
+
+    struct sync_barrier* b = &o->u.barrier;
+    if (LOAD (&b->broken))
+        return -1;
+
+    uint32 gen = LOAD (&b->generation);
+    STORE (&region->procs[myslot].waiting_on, obj);
+
+    if (__atomic_add_fetch (&b->arrived, 1, __ATOMIC_SEQ_CST) == b->parties)
+    {
+        /* Last one in trips the barrier for everyone */
+        STORE (&b->arrived, 0);
+        __atomic_add_fetch (&b->generation, 1, __ATOMIC_SEQ_CST);
+        futex_wake (&b->generation);
+        STORE (&region->procs[myslot].waiting_on, -1);
+        return 1;
+    }
+
+    while (LOAD (&b->generation) == gen)
+        futex_wait (&b->generation, gen);
+
+    STORE (&region->procs[myslot].waiting_on, -1);
+    return LOAD (&b->broken) ? -1 : 0;
+};
+
+int
+sync_latch_count_down (int obj)
+{
+    struct sync_object* o = get_object (obj, SYNC_LATCH);
+    if (o == NULL)
+        return -1;
+
+    struct sync_latch* l = &o->u.latch;
+    uint32 c = LOAD (&l->count);
+    do
+    {
+        if (c == 0)
+            return 0;
+    } while (!CAS (&l->count, &c, c - 1));
+
+    if (c == 1 && LOAD (&l->waiters))
+        futex_wake (&l->count);
+    return 0;
+};
+
+int
+sync_latch_wait (int obj)
+{
+    struct sync_object* o = get_object (obj, SYNC_LATCH);
+    if (o == NULL)
+        return -1;
+
+    struct sync_latch* l = &o->u.latch;
+    uint32 c;
+    while ((c = LOAD (&l->count)) != 0)
+    {
+        __atomic_add_fetch (&l->waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait (&l->count, c);
+        __atomic_sub_fetch (&l->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+};
+
+
+
+/* === HELPER FUNCTIONS === */
+
+static int
+futex_wait (uint32* addr, uint32 val)
+{
+    /* The region is shared between processes, so no FUTEX_PRIVATE_FLAG */
+    return syscall (SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+};
+
+static void
+futex_wake (uint32* addr)
+{
+    syscall (SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+};
+
+static struct sync_object*
+get_object (int obj, enum sync_type type)
+{
+    if (region == NULL || myslot < 0)
+        return NULL;
+    if (obj < 0 || obj >= SYNC_MAX_OBJECTS)
+        return NULL;
+
+    struct sync_object* o = &region->objects[obj];
+    if (LOAD (&o->type) != type)
+        return NULL;
+    return o;
+};
+
+static bool
+readers_empty (struct sync_rwlock* l)
+{
+    int i;
+    for (i = 0; i < SYNC_READER_WORDS; i++)
+        if (LOAD (&l->readers[i]) != 0)
+            return false;
+    return true;
+};
+
+static void
+rw_wake (struct sync_rwlock* l)
+{
+    __atomic_add_fetch (&l->seq, 1, __ATOMIC_SEQ_CST);
+    if (LOAD (&l->waiters))
+        futex_wake (&l->seq);
+};
+
+/* Sleeps until something changes on L.  FOR_READERS means we are a writer
+ * waiting for the readers to drain, otherwise we wait for the writer to
+ * leave.  The condition is checked again after SEQ is sampled, so a wakeup
+ * between the caller's check and the futex call is never lost. */
+static void
+rw_sleep (struct sync_rwlock* l, bool for_readers)
+{
+    uint32 s = LOAD (&l->seq);
+    __atomic_add_fetch (&l->waiters, 1, __ATOMIC_SEQ_CST);
+    if (for_readers ? !readers_empty (l) : LOAD (&l->writer) != 0)
+        futex_wait (&l->seq, s);
+    __atomic_sub_fetch (&l->waiters, 1, __ATOMIC_SEQ_CST);
+};
+
+static int
+rd_acquire (int obj, bool wait)
+{
+    struct sync_object* o = get_object (obj, SYNC_RWLOCK);
+    if (o == NULL)
+        return -1;
+
+    struct sync_rwlock* l = &o->u.rwlock;
+    uint64_t* word = &l->readers[myslot / 64];
+    uint64_t bit = 1ULL << (myslot % 64);
+
+    if (LOAD (word) & bit)
+        return -1;      // not recursive
+
+    while (true)
+    {
+        if (LOAD (&l->writer) == 0)
+        {
+            __atomic_fetch_or (word, bit, __ATOMIC_SEQ_CST);
+            if (LOAD (&l->writer) == 0)
+                return 0;
+
+            /* A writer got in first.  Back off and let it know, since it
+             * may already be waiting on us. */
+            __atomic_fetch_and (word, ~bit, __ATOMIC_SEQ_CST);
+            rw_wake (l);
+        }
+        if (!wait)
+            return 1;
+        rw_sleep (l, false);
+    }
+};
+
+static int
+wr_acquire (int obj, bool wait)
+{
+    struct sync_object* o = get_object (obj, SYNC_RWLOCK);
+    if (o == NULL)
+        return -1;
+
+    struct sync_rwlock* l = &o->u.rwlock;
+
+    /* Upgrading our own read lock would deadlock */
+    if (LOAD (&l->readers[myslot / 64]) & (1ULL << (myslot % 64)))
+        return -1;
+
+    while (true)
+    {
+        pid_t expected = 0;
+        if (CAS (&l->writer, &expected, mypid))
+            break;
+        if (expected == mypid)
+            return -1;  // not recursive
+        if (!wait)
+            return 1;
+        rw_sleep (l, false);
+    }
+
+    /* We own the writer claim; wait for readers already inside to leave */
+    while (!readers_empty (l))
+    {
+        if (!wait)
+        {
+            STORE (&l->writer, 0);
+            rw_wake (l);
+            return 1;
+        }
+        rw_sleep (l, true);
+    }
+    return 0;
+};
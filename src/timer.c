@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "timer.h"
+#include "debug.h"
+
+/* The furthest ahead the wheel reaches, in ticks */
+#define TIMER_REACH     (((uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+static void insert (struct timer_wheel* w, struct timer* t);
+static void unlink_timer (struct timer_wheel* w, struct timer* t);
+static unsigned cascade (struct timer_wheel* w, int level, uint64_t tick);
+static uint64_t rotate (uint64_t bits, unsigned by);
+
+void
+timer_wheel_init (struct timer_wheel* w, uint64_t now)
+{
+    ASSERT (w != NULL);
+
+    memset (w, 0, sizeof *w);
+    w->now = now;
+};
+
+void
+timer_init (struct timer* t, timer_func* func, void* aux)
+{
+    ASSERT (t != NULL);
+
+    memset (t, 0, sizeof *t);
+    t->func = func;
+    t->aux = aux;
+};
+
+void
+timer_arm (struct timer_wheel* w, struct timer* t, uint64_t expires)
+{
+    if (timer_armed (t))
+        unlink_timer (w, t);
+    else
+        w->armed++;
+    t->expires = expires;
+    insert (w, t);
+};
+
+void
+timer_cancel (struct timer_wheel* w, struct timer* t)
+{
+    if (!timer_armed (t))
+        return;
+    unlink_timer (w, t);
+    w->armed--;
+};
+
+size_t
+timer_advance (struct timer_wheel* w, uint64_t now)
+{
+    size_t expired = 0;
+    int level;
+
+    while (w->now <= now)
+    {
+        uint64_t tick = w->now;
+        unsigned slot = tick & TIMER_MASK;
+
+        /* Level 0 came round, so the next span of level 1 comes down, and
+         * so on up for each level that came round with it */
+        if (slot == 0)
+        {
+            for (level = 1; level < TIMER_LEVELS; level++)
+            {
+                if (0 != cascade (w, level, tick))
+                    break;
+            }
+        }
+
+        /* With nothing on level 0, nothing expires until it comes round */
+        if (w->pending[0] == 0)
+        {
+            uint64_t next = (tick | TIMER_MASK) + 1;
+            w->now = next <= now ? next : now + 1;
+            continue;
+        }
+
+        /* Timers the callbacks arm for a time already past go on the next
+         * tick rather than onto the slot we are emptying */
+        w->now = tick + 1;
+        uint64_t bit = (uint64_t) 1 << slot;
+        if (!(w->pending[0] & bit))
+            continue;
+
+        struct timer* list = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        w->pending[0] &= ~bit;
+        list->pprev = &list;
+        while (list != NULL)
+        {
+            struct timer* t = list;
+            list = t->next;
+            if (list != NULL)
+                list->pprev = &list;
+            t->next = NULL;
+            t->pprev = NULL;
+            w->armed--;
+            expired++;
+            t->func (w, t, t->aux);
+        }
+    }
+    return expired;
+};
+
+int
+timer_next (const struct timer_wheel* w, uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    int level;
+
+    if (w->armed == 0)
+        return -1;
+
+    /* Each slot of level 0 is a single tick */
+    if (w->pending[0] != 0)
+    {
+        unsigned from = w->now & TIMER_MASK;
+        next = w->now + __builtin_ctzll (rotate (w->pending[0], from));
+    }
+
+    /* A slot further up comes down once the levels below come round to
+     * it, which is as early as anything in it can expire */
+    for (level = 1; level < TIMER_LEVELS; level++)
+    {
+        if (w->pending[level] == 0)
+            continue;
+
+        unsigned shift = TIMER_BITS * level;
+        uint64_t span = w->now >> shift;
+        bool due = (w->now & (((uint64_t) 1 << shift) - 1)) == 0;
+        unsigned from = (span + (due ? 0 : 1)) & TIMER_MASK;
+        uint64_t ahead = __builtin_ctzll (rotate (w->pending[level], from))
+            + (due ? 0 : 1);
+        uint64_t at = (span + ahead) << shift;
+        if (at < next)
+            next = at;
+    }
+
+    if (next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : next - now;
+};
+
+uint64_t
+timer_now ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+};
+
+/* === HELPER FUNCTIONS === */
+
+/* Puts T in the slot of the lowest level that reaches its expiry */
+static void
+insert (struct timer_wheel* w, struct timer* t)
+{
+    uint64_t expires = t->expires < w->now ? w->now : t->expires;
+    uint64_t delta = expires - w->now;
+    int level = 0;
+
+    if (delta > TIMER_REACH)
+    {
+        delta = TIMER_REACH;
+        expires = w->now + delta;
+    }
+    while (level < TIMER_LEVELS - 1
+            && delta >= (uint64_t) 1 << (TIMER_BITS * (level + 1)))
+        level++;
+
+    unsigned slot = (expires >> (TIMER_BITS * level)) & TIMER_MASK;
+    struct timer** head = &w->slots[level][slot];
+    t->next = *head;
+    if (*head != NULL)
+        (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    t->slot = level * TIMER_SLOTS + slot;
+    w->pending[level] |= (uint64_t) 1 << slot;
+};
+
+static void
+unlink_timer (struct timer_wheel* w, struct timer* t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+
+    unsigned level = t->slot / TIMER_SLOTS;
+    unsigned slot = t->slot % TIMER_SLOTS;
+    if (w->slots[level][slot] == NULL)
+        w->pending[level] &= ~((uint64_t) 1 << slot);
+};
+
+/* Spreads the slot of LEVEL that TICK falls in over the levels below.
+ * Returns its index, which is 0 when LEVEL came round as well. */
+static unsigned
+cascade (struct timer_wheel* w, int level, uint64_t tick)
+{
+    unsigned slot = (tick >> (TIMER_BITS * level)) & TIMER_MASK;
+    struct timer* list = w->slots[level][slot];
+
+    w->slots[level][slot] = NULL;
+    w->pending[level] &= ~((uint64_t) 1 << slot);
+    while (list != NULL)
+    {
+        struct timer* t = list;
+        list = t->next;
+        insert (w, t);
+    }
+    return slot;
+};
+
+/* BITS rotated right BY places, so bit BY comes first */
+static uint64_t
+rotate (uint64_t bits, unsigned by)
+{
+    return by == 0 ? bits : bits >> by | bits << (64 - by);
+};
@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "type.h"
+
+/* Longest a span gets as JSON */
+#define TRACE_SPAN_JSON     256
+
+/* Bytes of JSON formatted before each write */
+#define TRACE_WRITE_BYTES   (16 * 1024)
+
+#define LOAD(p)         __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v)     __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+
+struct trace_record
+{
+    uint64_t start;
+    uint64_t end;
+    const char* name;
+    const char* arg_name;
+    long arg;
+    uint32 conn;
+};
+
+/* A thread's spans.  Buffers are recycled, never freed, so END_TRACING
+ * can walk them without racing a thread that exits. */
+struct trace_buffer
+{
+    uint32 n;
+    bool live;              // owned by a running thread
+    struct trace_buffer* next;
+    struct trace_record spans[TRACE_BUFFER_SPANS];
+};
+
+static int fd = -1;
+static bool enabled = false;
+static pid_t pid;
+
+static uint32 sample_every = 0;
+static uint32 connections = 0;
+static uint32 next_id = 0;
+
+static struct trace_buffer* buffers = NULL;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static __thread struct trace_buffer* mybuf = NULL;
+
+static void setup_once ();
+static void after_fork_child ();
+static struct trace_buffer* claim_buffer ();
+static void release_buffer (void* buffer);
+static void write_buffer (struct trace_buffer* b);
+static size_t format_span (char* out, const struct trace_record* s);
+static void write_all (const char* buf, size_t len);
+
+int
+init_tracing (const char* path, unsigned every)
+{
+    pthread_once (&once, &setup_once);
+
+    if (fd != -1)
+        end_tracing ();
+
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1)
+        return -1;
+
+    pid = getpid ();
+    write_all ("[\n", 2);
+    set_trace_sampling (every);
+    STORE (&enabled, true);
+    return 0;
+};
+
+void
+set_trace_sampling (unsigned every)
+{
+    STORE (&sample_every, every);
+};
+
+uint32
+trace_connection ()
+{
+    uint32 every = LOAD (&sample_every);
+    uint32 n = __atomic_fetch_add (&connections, 1, __ATOMIC_RELAXED);
+
+    if (every == 0 || !LOAD (&enabled) || n % every != 0)
+        return 0;
+    return __atomic_add_fetch (&next_id, 1, __ATOMIC_RELAXED);
+};
+
+uint64_t
+trace_now ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+};
+
+void
+trace_span (uint32 conn, const char* name, uint64_t start, uint64_t end,
+        const char* arg_name, long arg)
+{
+    if (conn == 0 || !LOAD (&enabled))
+        return;
+
+    struct trace_buffer* b = mybuf != NULL ? mybuf : claim_buffer ();
+    if (b == NULL)
+        return;
+
+    struct trace_record* s = &b->spans[b->n];
+    s->start = start;
+    s->end = end;
+    s->name = name;
+    s->arg_name = arg_name;
+    s->arg = arg;
+    s->conn = conn;
+    __atomic_store_n (&b->n, b->n + 1, __ATOMIC_RELEASE);
+
+    if (b->n == TRACE_BUFFER_SPANS)
+    {
+        pthread_mutex_lock (&buffer_lock);
+        if (LOAD (&enabled))
+            write_buffer (b);
+        b->n = 0;
+        pthread_mutex_unlock (&buffer_lock);
+    }
+};
+
+void
+end_tracing ()
+{
+    char tail[128];
+    struct trace_buffer* b;
+
+    /* Threads write their full buffers under the lock too, so none is
+     * still writing once we close the file */
+    pthread_mutex_lock (&buffer_lock);
+    if (fd == -1)
+    {
+        pthread_mutex_unlock (&buffer_lock);
+        return;
+    }
+    STORE (&enabled, false);
+    for (b = buffers; b != NULL; b = b->next)
+        write_buffer (b);
+
+    /* Every span ends in a comma, so the array ends with something that is
+     * worth having anyway */
+    int n = snprintf (tail, sizeof tail, "{\"name\":\"process_name\","
+            "\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"server\"}}\n]\n",
+            (int) pid);
+    write_all (tail, n);
+    close (fd);
+    fd = -1;
+    pthread_mutex_unlock (&buffer_lock);
+};
+
+/* === HELPER FUNCTIONS === */
+
+static void
+setup_once ()
+{
+    pthread_key_create (&buffer_key, &release_buffer);
+    pthread_atfork (NULL, NULL, &after_fork_child);
+    atexit (&end_tracing);
+};
+
+/* The spans we inherited are the parent's to write, and so is the file */
+static void
+after_fork_child ()
+{
+    enabled = false;
+    if (fd != -1)
+        close (fd);
+    fd = -1;
+};
+
+static struct trace_buffer*
+claim_buffer ()
+{
+    struct trace_buffer* b;
+
+    pthread_mutex_lock (&buffer_lock);
+    for (b = buffers; b != NULL && b->live; b = b->next)
+        ;
+    if (b == NULL && (b = calloc (1, sizeof *b)) != NULL)
+    {
+        b->next = buffers;
+        buffers = b;
+    }
+    if (b != NULL)
+        b->live = true;
+    pthread_mutex_unlock (&buffer_lock);
+
+    if (b != NULL)
+    {
+        pthread_setspecific (buffer_key, b);
+        mybuf = b;
+    }
+    return b;
+};
+
+/* Thread exit */
+static void
+release_buffer (void* buffer)
+{
+    struct trace_buffer* b = buffer;
+
+    pthread_mutex_lock (&buffer_lock);
+    if (LOAD (&enabled))
+        write_buffer (b);
+    b->n = 0;
+    b->live = false;
+    pthread_mutex_unlock (&buffer_lock);
+};
+
+/* Writes B's spans to the file and empties it */
+static void
+write_buffer (struct trace_buffer* b)
+{
+    char out[TRACE_WRITE_BYTES];
+    uint32 n = __atomic_load_n (&b->n, __ATOMIC_ACQUIRE);
+    size_t used = 0;
+    uint32 i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (used + TRACE_SPAN_JSON > sizeof out)
+        {
+            write_all (out, used);
+            used = 0;
+        }
+        used += format_span (out + used, &b->spans[i]);
+    }
+    if (used > 0)
+        write_all (out, used);
+    __atomic_store_n (&b->n, 0, __ATOMIC_RELEASE);
+};
+
+/* A complete event, with times in microseconds */
+static size_t
+format_span (char* out, const struct trace_record* s)
+{
+    uint64_t dur = s->end > s->start ? s->end - s->start : 0;
+    int n;
+
+    n = snprintf (out, TRACE_SPAN_JSON, "{\"name\":\"%s\","
+            "\"cat\":\"connection\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+            "\"ts\":%llu.%03u,\"dur\":%llu.%03u", s->name, (int) pid, s->conn,
+            (unsigned long long) (s->start / 1000),
+            (unsigned) (s->start % 1000),
+            (unsigned long long) (dur / 1000), (unsigned) (dur % 1000));
+    if (s->arg_name != NULL)
+        n += snprintf (out + n, TRACE_SPAN_JSON - n, ",\"args\":{\"%s\":%ld}",
+                s->arg_name, s->arg);
+    n += snprintf (out + n, TRACE_SPAN_JSON - n, "},\n");
+    return n < TRACE_SPAN_JSON ? n : 0;
+};
+
+static void
+write_all (const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write (fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+};
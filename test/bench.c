@@ -0,0 +1,27 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+
+double
+bench_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+};
+
+void
+bench_shuffle (int* a, int n)
+{
+    int i;
+    for (i = n - 1; i > 0; i--)
+    {
+        int j = rand () % (i + 1);
+        int t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+};
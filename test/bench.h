@@ -0,0 +1,15 @@
+#ifndef TEST_BENCH_H
+#define TEST_BENCH_H
+
+/*
+ * Helpers shared by the benchmarks and stress tests in test/.
+ * */
+
+/* Seconds on the monotonic clock */
+double bench_now ();
+
+/* Shuffles the N ints at A with rand (), so seed it with srand for the
+ * same order every run */
+void bench_shuffle (int* a, int n);
+
+#endif //TEST_BENCH_H
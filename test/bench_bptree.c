@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include "bptree.h"
+#include "avl.h"
+#include "bst.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Checks the B+tree against a reference array with random inserts and
+ * deletes, running bpt_check as it goes, then times it next to the bst and
+ * the avl tree on ELEMENTS keys: inserts in random order, lookups, a full
+ * in-order scan and deletes in another random order.  The B+tree is also
+ * bulk loaded from the sorted keys. */
+
+#define KEYS        4096
+#define OPS         200000
+#define ELEMENTS    1000000
+
+static int* keys;
+static int* order;
+static int* order2;
+
+static int compare (const void* a, const void* b, const void* AUX);
+static void check_random (unsigned seed);
+static void check_against (struct bpt_tree* tree, const bool* present);
+static void run_bpt (bool load);
+static void run_avl ();
+static void run_bst ();
+static void report (const char* name, double t0, double t1, double t2,
+        double t3, double t4);
+static bool sum_visit (void* data, void* aux);
+
+int
+main (int argc, char** argv)
+{
+    int i;
+    unsigned seed = argc > 1 ? atoi (argv[1]) : (unsigned) time (NULL);
+
+    keys = malloc (ELEMENTS * sizeof (int));
+    order = malloc (ELEMENTS * sizeof (int));
+    order2 = malloc (ELEMENTS * sizeof (int));
+    for (i = 0; i < ELEMENTS; i++)
+        keys[i] = order[i] = order2[i] = i;
+
+    printf ("seed %u\n", seed);
+    check_random (seed);
+    printf ("%d random operations on %d keys: ok\n", OPS, KEYS);
+
+    srand (1);
+    bench_shuffle (order, ELEMENTS);
+    bench_shuffle (order2, ELEMENTS);
+
+    printf ("%d elements, ns per element\n", ELEMENTS);
+    printf ("%16s %10s %10s %10s %10s\n", "", "insert", "find", "scan",
+            "delete");
+    run_bpt (false);
+    run_bpt (true);
+    run_avl ();
+    run_bst ();
+
+    free (keys);
+    free (order);
+    free (order2);
+    return 0;
+};
+
+static void
+check_random (unsigned seed)
+{
+    struct bpt_tree tree;
+    bool present[KEYS];
+    int i;
+
+    srand (seed);
+    bpt_init (&tree, &compare);
+    memset (present, 0, sizeof present);
+    for (i = 0; i < OPS; i++)
+    {
+        /* Lean towards inserts for the first half and deletes after, so
+         * the tree grows several levels and shrinks back */
+        int* k = &keys[rand () % KEYS];
+        int r = rand () % 10;
+        bool insert = i < OPS / 2 ? r < 6 : r < 4;
+        if (insert)
+        {
+            ASSERT (bpt_insert (&tree, k) == !present[*k]);
+            present[*k] = true;
+        }
+        else
+        {
+            ASSERT (bpt_delete (&tree, k) == (present[*k] ? k : NULL));
+            present[*k] = false;
+        }
+        ASSERT (bpt_find (&tree, k) == (present[*k] ? k : NULL));
+        if (i % 500 == 0)
+            check_against (&tree, present);
+    }
+    check_against (&tree, present);
+
+    /* Empty it, then bulk load every key */
+    for (i = 0; i < KEYS; i++)
+        bpt_delete (&tree, &keys[i]);
+    ASSERT (tree.root == NULL && bpt_check (&tree, NULL));
+    void* sorted[KEYS];
+    for (i = 0; i < KEYS; i++)
+    {
+        sorted[i] = &keys[i];
+        present[i] = true;
+    }
+    sorted[0] = &keys[1];
+    ASSERT (!bpt_load (&tree, sorted, KEYS));
+    sorted[0] = &keys[0];
+    ASSERT (bpt_load (&tree, sorted, KEYS));
+    ASSERT (!bpt_load (&tree, sorted, KEYS));
+    check_against (&tree, present);
+    bpt_destroy (&tree);
+};
+
+/* The tree must hold exactly the keys marked in PRESENT, in order both
+ * ways, and a random range must match too */
+static void
+check_against (struct bpt_tree* tree, const bool* present)
+{
+    size_t count, expected = 0;
+    int k;
+
+    ASSERT (bpt_check (tree, &count));
+    for (k = 0; k < KEYS; k++)
+        expected += present[k];
+    ASSERT (count == expected);
+
+    struct bpt_iterator it;
+    bpt_iter_first (tree, &it);
+    int* e = bpt_get (&it);
+    for (k = 0; k < KEYS; k++)
+    {
+        if (!present[k])
+            continue;
+        ASSERT (e != NULL && *e == k);
+        e = bpt_next (&it);
+    }
+    ASSERT (e == NULL && bpt_get (&it) == NULL);
+
+    bpt_iter_last (tree, &it);
+    e = bpt_get (&it);
+    for (k = KEYS - 1; k >= 0; k--)
+    {
+        if (!present[k])
+            continue;
+        ASSERT (e != NULL && *e == k);
+        e = bpt_prev (&it);
+    }
+    ASSERT (e == NULL);
+
+    int* out[KEYS];
+    int lo = rand () % KEYS, hi = rand () % KEYS;
+    size_t max = rand () % KEYS;
+    size_t n = bpt_range (tree, &lo, &hi, (void**) out, max);
+    expected = 0;
+    for (k = lo; k <= hi; k++)
+    {
+        if (!present[k])
+            continue;
+        if (expected < max)
+            ASSERT (*out[expected] == k);
+        expected++;
+    }
+    ASSERT (n == expected);
+};
+
+static void
+run_bpt (bool load)
+{
+    struct bpt_tree tree;
+    double t0, t1, t2, t3, t4;
+    long sum = 0;
+    int i;
+
+    bpt_init (&tree, &compare);
+    t0 = bench_now ();
+    if (load)
+    {
+        void** sorted = malloc (ELEMENTS * sizeof (void*));
+        for (i = 0; i < ELEMENTS; i++)
+            sorted[i] = &keys[i];
+        ASSERT (bpt_load (&tree, sorted, ELEMENTS));
+        free (sorted);
+    }
+    else
+        for (i = 0; i < ELEMENTS; i++)
+            bpt_insert (&tree, &keys[order[i]]);
+    t1 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        ASSERT (bpt_find (&tree, &keys[order2[i]]) == &keys[order2[i]]);
+    t2 = bench_now ();
+    ASSERT (bpt_walk (&tree, &sum_visit, &sum) == ELEMENTS);
+    t3 = bench_now ();
+
+    /* Not timed */
+    ASSERT (bpt_check (&tree, NULL));
+    t4 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        bpt_delete (&tree, &keys[order2[i]]);
+    t4 = t3 + (bench_now () - t4);
+
+    ASSERT (tree.root == NULL);
+    ASSERT (sum == (long) ELEMENTS * (ELEMENTS - 1) / 2);
+    bpt_destroy (&tree);
+    report (load ? "bptree loaded" : "bptree", t0, t1, t2, t3, t4);
+};
+
+static void
+run_avl ()
+{
+    struct avl_tree tree;
+    struct avl_iterator it;
+    double t0, t1, t2, t3, t4;
+    long sum = 0;
+    int i;
+    int* e;
+
+    avl_init (&tree, &compare);
+    t0 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        avl_insert (&tree, &keys[order[i]]);
+    t1 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        ASSERT (avl_find (&tree, &keys[order2[i]]) == &keys[order2[i]]);
+    t2 = bench_now ();
+    avl_iter_first (&tree, &it);
+    for (e = avl_get (&it); e != NULL; e = avl_next (&it))
+        sum += *e;
+    t3 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        avl_delete (&tree, &keys[order2[i]]);
+    t4 = bench_now ();
+
+    ASSERT (tree.root == NULL);
+    ASSERT (sum == (long) ELEMENTS * (ELEMENTS - 1) / 2);
+    avl_destroy (&tree);
+    report ("avl", t0, t1, t2, t3, t4);
+};
+
+static void
+run_bst ()
+{
+    struct bst_tree tree;
+    struct bst_iterator it;
+    double t0, t1, t2, t3, t4;
+    long sum = 0;
+    int i;
+    int* e;
+
+    bst_init (&tree, &compare);
+    t0 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        bst_insert (&tree, &keys[order[i]]);
+    t1 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        ASSERT (bst_find (&tree, &keys[order2[i]]) == &keys[order2[i]]);
+    t2 = bench_now ();
+    bst_iter_first (&tree, &it);
+    for (e = bst_get (&it); e != NULL; e = bst_next (&it))
+        sum += *e;
+    t3 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        bst_delete (&tree, &keys[order2[i]]);
+    t4 = bench_now ();
+
+    ASSERT (tree.root == NULL);
+    ASSERT (sum == (long) ELEMENTS * (ELEMENTS - 1) / 2);
+    bst_destroy (&tree);
+    report ("bst", t0, t1, t2, t3, t4);
+};
+
+static void
+report (const char* name, double t0, double t1, double t2, double t3,
+        double t4)
+{
+    printf ("%16s %10.1f %10.1f %10.1f %10.1f\n", name,
+            (t1 - t0) * 1e9 / ELEMENTS, (t2 - t1) * 1e9 / ELEMENTS,
+            (t3 - t2) * 1e9 / ELEMENTS, (t4 - t3) * 1e9 / ELEMENTS);
+};
+
+static bool
+sum_visit (void* data, void* aux)
+{
+    *(long*) aux += *(int*) data;
+    return true;
+};
+
+static int
+compare (const void* a, const void* b, const void* AUX)
+{
+    return *(const int*) a - *(const int*) b;
+};
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+
+#include "slab.h"
+#include "hash.h"
+#include "child.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark for the child index under connect and exit churn.  CHILDREN
+ * children from HOSTS client hosts are live at all times; each round one
+ * exits, found by the pid wait() gave us, and a new one connects with a
+ * fresh pid.  We time the exit path with the pid index against scanning the
+ * slab table for the pid, and counting one host's connections with the
+ * address index against a scan.  The indexes are checked against the table
+ * as we go. */
+
+#define CHILDREN        10000
+#define HOSTS           500
+#define ROUNDS          200000
+#define SCAN_ROUNDS     2000
+
+static struct server_child children[CHILDREN];
+static struct slab_table table;
+static struct hash_table by_pid;
+static struct hash_table by_addr;
+static pid_t next_pid = 100;
+
+static void connect_child (struct server_child* c, bool indexed);
+static struct server_child* find_by_pid (pid_t pid, bool indexed);
+static int count_by_addr (const struct child_addr* addr, bool indexed);
+static void make_addr (struct child_addr* addr, int host);
+
+int
+main (int argc, char** argv)
+{
+    int i, mode;
+
+    printf ("%d live children from %d hosts\n", CHILDREN, HOSTS);
+    printf ("%8s %16s %16s\n", "", "exit+connect ns", "addr query ns");
+
+    srand (1);
+    for (mode = 1; mode >= 0; mode--)
+    {
+        bool indexed = mode;
+        int rounds = indexed ? ROUNDS : SCAN_ROUNDS;
+
+        slab_init (&table);
+        hash_init (&by_pid);
+        hash_init (&by_addr);
+        for (i = 0; i < CHILDREN; i++)
+            connect_child (&children[i], indexed);
+
+        /* An exit removes the child wait() names, and a connect replaces
+         * it */
+        double start = bench_now ();
+        for (i = 0; i < rounds; i++)
+        {
+            pid_t pid = children[rand () % CHILDREN].pid;
+            struct server_child* c = find_by_pid (pid, indexed);
+            ASSERT (c != NULL && c->pid == pid);
+            ASSERT (slab_remove (&table, c->ourid) == c);
+            if (indexed)
+            {
+                hash_remove (&by_pid, &c->pid_link);
+                hash_remove (&by_addr, &c->addr_link);
+            }
+            connect_child (c, indexed);
+        }
+        double churn = (bench_now () - start) * 1e9 / rounds;
+
+        struct child_addr addr;
+        int total = 0;
+        start = bench_now ();
+        for (i = 0; i < rounds; i++)
+        {
+            make_addr (&addr, rand () % HOSTS);
+            total += count_by_addr (&addr, indexed);
+        }
+        double query = (bench_now () - start) * 1e9 / rounds;
+        ASSERT (total > 0);
+
+        /* Every host's count must agree between the index and a scan */
+        if (indexed)
+        {
+            int h, sum = 0;
+            for (h = 0; h < HOSTS; h++)
+            {
+                make_addr (&addr, h);
+                int n = count_by_addr (&addr, true);
+                ASSERT (n == count_by_addr (&addr, false));
+                sum += n;
+            }
+            ASSERT (sum == CHILDREN);
+            ASSERT (by_pid.count == CHILDREN && by_addr.count == CHILDREN);
+        }
+
+        printf ("%8s %16.1f %16.1f\n", indexed ? "hash" : "scan", churn,
+                query);
+        hash_destroy (&by_pid);
+        hash_destroy (&by_addr);
+        slab_destroy (&table);
+    }
+    return 0;
+};
+
+/* Gives C a new pid and a random host and adds it to the index */
+static void
+connect_child (struct server_child* c, bool indexed)
+{
+    c->pid = next_pid++;
+    make_addr (&c->addr, rand () % HOSTS);
+    c->ourid = slab_insert (&table, c);
+    ASSERT (c->ourid > 0);
+    if (indexed)
+    {
+        hash_insert (&by_pid, &c->pid_link, hash_int ((uint64_t) c->pid));
+        hash_insert (&by_addr, &c->addr_link,
+                hash_bytes (c->addr.ip, sizeof c->addr.ip));
+    }
+};
+
+static struct server_child*
+find_by_pid (pid_t pid, bool indexed)
+{
+    struct server_child* c;
+
+    if (indexed)
+    {
+        struct hash_link* l;
+        for (l = hash_first (&by_pid, hash_int ((uint64_t) pid)); l != NULL;
+                l = hash_next (l))
+        {
+            c = hash_entry (l, struct server_child, pid_link);
+            if (c->pid == pid)
+                return c;
+        }
+        return NULL;
+    }
+
+    uint32 pos = 0;
+    while ((c = slab_next (&table, &pos)) != NULL)
+        if (c->pid == pid)
+            return c;
+    return NULL;
+};
+
+static int
+count_by_addr (const struct child_addr* addr, bool indexed)
+{
+    struct server_child* c;
+    int n = 0;
+
+    if (indexed)
+    {
+        struct hash_link* l;
+        for (l = hash_first (&by_addr, hash_bytes (addr->ip, sizeof addr->ip));
+                l != NULL; l = hash_next (l))
+        {
+            c = hash_entry (l, struct server_child, addr_link);
+            n += memcmp (&c->addr, addr, sizeof *addr) == 0;
+        }
+        return n;
+    }
+
+    uint32 pos = 0;
+    while ((c = slab_next (&table, &pos)) != NULL)
+        n += memcmp (&c->addr, addr, sizeof *addr) == 0;
+    return n;
+};
+
+/* Host H is 10.0.H/256.H%256, mapped into IPv6 */
+static void
+make_addr (struct child_addr* addr, int host)
+{
+    memset (addr, 0, sizeof *addr);
+    addr->ip[10] = addr->ip[11] = 0xff;
+    addr->ip[12] = 10;
+    addr->ip[14] = host / 256;
+    addr->ip[15] = host % 256;
+};
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+
+#include "drain.h"
+#include "mysignal.h"
+#include "child.h"
+#include "match.h"
+#include "supervisor.h"
+#include "jobqueue.h"
+#include "epoch.h"
+#include "idle.h"
+#include "timer.h"
+#include "debug.h"
+#include "type.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Shutdown benchmark.  Children are started as the server starts them,
+ * each in the child index with a broker thread and a message waiting in its
+ * mailbox, and drained as the server drains them when it stops.  Some
+ * finish in their own time, some wait for SIGTERM and some ignore it, and
+ * workers are thrown in.  We check that each kind is counted as it should,
+ * that the drain ends as soon as the last child is gone rather than at the
+ * deadline, that a second SIGTERM cuts the wait short, and that no child,
+ * broker or record is left behind, even when a broker is waiting forever
+ * for a message or a job for its child.  Nor may such a broker hold up
+ * freeing the records of the children that exit meanwhile.  Last, idle
+ * clients are terminated while ones waiting on their broker are left
+ * alone, and every idle timer goes with its child. */
+
+#define CHILDREN        200
+#define WORKERS         4
+
+/* Read by the signal code; the main loop runs while it is set */
+bool run = true;
+
+/* What a child does */
+enum kind
+{
+    QUICK,              // exits within SPREAD ms
+    STUCK,              // waits to be terminated
+    STUBBORN,           // ignores SIGTERM
+    WAITING,            // asks its broker for what never comes, and waits
+                        // to be terminated
+    WORKER              // has no client, and waits to be terminated
+};
+
+static unsigned spread;
+
+/* The job queue WAITING children pop from */
+static int jobq;
+
+static pid_t start (enum kind kind, int i);
+static pid_t spawn_worker (struct worker_group* g);
+static void drain (const char* name, int sfd, unsigned deadline,
+        unsigned grace, struct drain_stats* s);
+
+int
+main (int argc, char** argv)
+{
+    struct drain_stats s;
+    int i;
+
+    init_child_index ();
+    init_jobqueues ();
+    jobq = jobqueue_open ("empty");
+    int sfd = init_signal_handler ();
+    ASSERT (sfd != -1);
+
+    printf ("%-24s %8s %8s %8s %8s %8s %8s\n", "", "children", "done",
+            "termed", "killed", "unsent", "ms");
+
+    /* Everyone finishes well before the deadline */
+    spread = 200;
+    for (i = 0; i < CHILDREN; i++)
+        start (QUICK, i);
+    drain ("all finish", sfd, 5000, 1000, &s);
+    ASSERT (s.completed == CHILDREN && s.terminated == 0 && s.killed == 0);
+    ASSERT (s.undelivered == CHILDREN);
+    ASSERT (s.elapsed < 5000);
+
+    /* Some are cut off, and workers stop at once */
+    init_supervisor (&spawn_worker);
+    ASSERT (supervise ("worker", WORKERS, NULL, NULL) != NULL);
+    supervisor_run (supervisor_clock ());
+    spread = 100;
+    for (i = 0; i < CHILDREN; i++)
+        start (i % 4 == 0 ? STUCK : i % 4 == 1 ? STUBBORN : QUICK, i);
+    drain ("some cut off", sfd, 300, 200, &s);
+    ASSERT (s.children == CHILDREN + WORKERS && s.workers == WORKERS);
+    ASSERT (s.completed == CHILDREN / 2 + WORKERS);
+    ASSERT (s.terminated == CHILDREN / 4 && s.killed == CHILDREN / 4);
+    ASSERT (s.undelivered == CHILDREN + WORKERS && s.elapsed >= 500);
+
+    /* A second SIGTERM doesn't wait for the deadline */
+    for (i = 0; i < CHILDREN; i++)
+        start (STUCK, i);
+    kill (getpid (), SIGTERM);
+    drain ("second SIGTERM", sfd, 60000, 60000, &s);
+    ASSERT (s.completed == 0 && s.terminated == CHILDREN);
+    ASSERT (s.undelivered == CHILDREN && s.elapsed < 60000);
+
+    /* A broker waiting on its child's behalf doesn't keep the records of
+     * others from being freed, and is woken when its child goes */
+    start (WAITING, 0);
+    uint64_t undelivered = get_undelivered ();
+    start (QUICK, 0);
+    double until = bench_now () + 5;
+    while (get_undelivered () == undelivered && bench_now () < until)
+    {
+        struct timespec t = { 0, 1000000 };
+        nanosleep (&t, NULL);
+        handle_signals (sfd);
+        epoch_collect ();
+    }
+    ASSERT (get_undelivered () == undelivered + 1);
+    for (i = 1; i < CHILDREN; i++)
+        start (WAITING, i);
+    drain ("waiting brokers", sfd, 100, 1000, &s);
+    ASSERT (s.completed == 0 && s.terminated == CHILDREN);
+    ASSERT (s.undelivered == CHILDREN);
+
+    /* Only the idle half goes, and drained, nothing is left to watch */
+    init_idle (200);
+    for (i = 0; i < CHILDREN; i++)
+        start (i % 2 == 0 ? STUCK : WAITING, i);
+    until = bench_now () + 1;
+    while (bench_now () < until)
+    {
+        struct timespec t = { 0, 1000000 };
+        nanosleep (&t, NULL);
+        handle_signals (sfd);
+        idle_run (timer_now ());
+    }
+    ASSERT (get_child_ids (NULL, 0) == CHILDREN / 2);
+    drain ("idle timeout", sfd, 100, 1000, &s);
+    ASSERT (s.children == CHILDREN / 2 && s.terminated == CHILDREN / 2);
+    ASSERT (idle_run (timer_now ()) == -1);
+
+    close (sfd);
+    return 0;
+};
+
+/* Starts a child of KIND, as START_CHILD in main.c does, with a message
+ * waiting for it */
+static pid_t
+start (enum kind kind, int i)
+{
+    struct server_child* child = calloc (1, sizeof *child);
+    int fds[2];
+
+    ASSERT (child != NULL);
+    ASSERT (pipe (fds) == 0);
+    child->clientfd = kind == WORKER ? -1 : 0;
+    child->parentread = fds[0];
+    child->parentwrite = -1;
+    child->execfd = -1;
+    child->syncslot = -1;
+    child->refs = 2;
+    child->mailbox = mailbox_create (4096);
+    ASSERT (child->mailbox != NULL);
+    ASSERT (mailbox_put (child->mailbox, 1, 0, "bye", 4) == 0);
+
+    pthread_mutex_init (&child->init_lock, NULL);
+    pthread_mutex_lock (&child->init_lock);
+    ASSERT (start_broker (child) == 0);
+
+    pid_t pid = fork ();
+    ASSERT (pid != -1);
+    if (pid == 0)
+    {
+        struct timespec t = { 0, (long) (i % (spread + 1)) * 1000000 };
+
+        restore_signal_mask ();
+        close (fds[0]);
+        if (kind == QUICK)
+        {
+            nanosleep (&t, NULL);
+            _exit (0);
+        }
+        if (kind == STUBBORN)
+            signal (SIGTERM, SIG_IGN);
+        if (kind == WAITING)
+        {
+            /* A receive for a tag nobody sends, or a pop from a queue
+             * nobody pushes to, without a timeout */
+            struct message m;
+            memset (&m, 0, sizeof m);
+            if (i % 2 == 0)
+            {
+                struct sibling_header h = { 0, 5, -1, 0, 0, 0 };
+                m.command = RECV_B;
+                m.id = -1;
+                memcpy (m.information, &h, sizeof h);
+            }
+            else
+            {
+                struct jobq_pop_args args = { 1, -1 };
+                m.command = JOBQ_POP;
+                m.id = jobq;
+                memcpy (m.information, &args, sizeof args);
+            }
+            ASSERT (write (fds[1], &m, sizeof m) == sizeof m);
+        }
+        for (;;)
+            pause ();
+    }
+
+    /* The broker sees end of file once the child is gone */
+    close (fds[1]);
+    child->pid = pid;
+    ASSERT (add_child (child) > 0);
+    if (kind != WORKER)
+        idle_watch (child);
+    pthread_mutex_unlock (&child->init_lock);
+    return pid;
+};
+
+static pid_t
+spawn_worker (struct worker_group* g)
+{
+    return start (WORKER, 0);
+};
+
+static void
+drain (const char* name, int sfd, unsigned deadline, unsigned grace,
+        struct drain_stats* s)
+{
+    double t = bench_now ();
+    drain_children (sfd, deadline, grace, s);
+    t = bench_now () - t;
+
+    /* Nothing left behind */
+    ASSERT (s->lost == 0 && s->brokers == 0);
+    ASSERT (get_child_ids (NULL, 0) == 0);
+    ASSERT (waitpid (-1, NULL, WNOHANG) == -1 && errno == ECHILD);
+
+    printf ("%-24s %8d %8d %8d %8d %8llu %8.0f\n", name, s->children,
+            s->completed, s->terminated, s->killed,
+            (unsigned long long) s->undelivered, t * 1e3);
+    fflush (stdout);
+};
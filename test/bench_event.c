@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+
+#include "event.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark for sibling events.  SUBSCRIBERS children subscribe to every
+ * sibling and TARGETS siblings change state POSTS times between them
+ * without anyone polling, as when scripts are busy.  We time a post, count
+ * the notices that would have gone down the pipes, and poll every box to
+ * check that each holds one entry per sibling with the latest state and
+ * every change counted.  Without merging every change would have been a
+ * message to every subscriber. */
+
+#define TARGETS         16
+#define POSTS           100000
+
+/* Notices sent to each subscriber, by ourid */
+static int notices[10001];
+
+static int count_notice (int ourid, struct message* m);
+static void run (int subscribers);
+static void check_merging ();
+
+int
+main (int argc, char** argv)
+{
+    int subscribers;
+
+    init_events (&count_notice);
+    check_merging ();
+
+    printf ("%d siblings changing state %d times\n", TARGETS, POSTS);
+    printf ("%12s %10s %10s %14s\n", "subscribers", "ns/post", "notices",
+            "unmerged msgs");
+    for (subscribers = 1; subscribers <= 1000; subscribers *= 10)
+        run (subscribers);
+    return 0;
+};
+
+static int
+count_notice (int ourid, struct message* m)
+{
+    ASSERT (m->command == EVENT_NOTIFY);
+    notices[ourid]++;
+    return 0;
+};
+
+/* Subscribers are 1 to SUBSCRIBERS and the siblings that change come after
+ * them */
+static void
+run (int subscribers)
+{
+    char info[484];
+    size_t sz;
+    int i, s;
+
+    memset (notices, 0, sizeof notices);
+    for (s = 1; s <= subscribers; s++)
+        ASSERT (event_subscribe (s, SIBLING_ANY_SOURCE, EVENT_STATE) == 0);
+
+    double start = bench_now ();
+    for (i = 0; i < POSTS; i++)
+        event_post (subscribers + 1 + i % TARGETS, EVENT_STATE, i, 0);
+    double elapsed = bench_now () - start;
+
+    for (s = 1; s <= subscribers; s++)
+    {
+        struct event_header h;
+        struct event_entry e[EVENT_MAX_BATCH];
+        int total = 0;
+
+        ASSERT (notices[s] == 1);
+        ASSERT (event_poll (s, info, &sz) == TARGETS);
+        memcpy (&h, info, sizeof h);
+        memcpy (e, info + sizeof h, h.n * sizeof e[0]);
+        ASSERT (h.lost == 0 && sz == sizeof h + TARGETS * sizeof e[0]);
+        for (i = 0; i < TARGETS; i++)
+        {
+            /* The last change each sibling made */
+            ASSERT (e[i].ourid == subscribers + 1 + e[i].state % TARGETS);
+            ASSERT (e[i].state >= POSTS - TARGETS);
+            total += e[i].count;
+        }
+        ASSERT (total == POSTS);
+        event_forget (s);
+    }
+
+    printf ("%12d %10.1f %10d %14lld\n", subscribers, elapsed * 1e9 / POSTS,
+            subscribers, (long long) subscribers * POSTS);
+    fflush (stdout);
+};
+
+static void
+check_merging ()
+{
+    char info[484];
+    struct event_header h;
+    struct event_entry e;
+    size_t sz;
+
+    /* Subscribed to one sibling and to all: one entry per event, and after
+     * a poll the next event sends a new notice */
+    ASSERT (event_subscribe (1, 2, EVENT_STATE | EVENT_EXIT) == 0);
+    ASSERT (event_subscribe (1, SIBLING_ANY_SOURCE, EVENT_STATE) == 0);
+    event_post (2, EVENT_STATE, 4, 0);
+    event_post (3, EVENT_EXIT, 4, 0);
+    event_post (2, EVENT_EXIT, 8, -9);
+    ASSERT (notices[1] == 1);
+    ASSERT (event_poll (1, info, &sz) == 1);
+    memcpy (&h, info, sizeof h);
+    memcpy (&e, info + sizeof h, sizeof e);
+    ASSERT (e.ourid == 2 && e.count == 2 && e.state == 8 && e.status == -9);
+    ASSERT (e.events == (EVENT_STATE | EVENT_EXIT));
+    ASSERT (event_poll (1, info, &sz) == 0);
+
+    /* Once 2 is forgotten only the subscription to all is left, which
+     * doesn't take exits */
+    event_forget (2);
+    event_post (2, EVENT_EXIT, 1, 0);
+    ASSERT (event_poll (1, info, &sz) == 0);
+    event_post (3, EVENT_STATE, 1, 0);
+    ASSERT (notices[1] == 2 && event_poll (1, info, &sz) == 1);
+    event_forget (1);
+};
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include "avl.h"
+#include "bptree.h"
+#include "debug.h"
+
+#define BPT_GEN_NAME    idmap
+#define BPT_GEN_KEY     int
+#define BPT_GEN_VALUE   void*
+#include "bptree_gen.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark for a B+tree generated by bptree_gen.h for int keys, against
+ * the generic avl and B+trees, which compare through a function pointer
+ * and reach each key through the element pointer.  All three hold the same
+ * records keyed by an int id, the way the server keys children by ourid,
+ * and we time random lookups at a size that fits in cache and one that
+ * does not.  First the generated tree is checked against a reference array
+ * under random inserts and deletes. */
+
+#define KEYS        4096
+#define OPS         200000
+#define LOOKUPS     2000000
+
+struct record
+{
+    int ourid;
+    int payload;
+};
+
+static int compare (const void* a, const void* b, const void* AUX);
+static void check_random (unsigned seed);
+static void run (int n);
+
+int
+main (int argc, char** argv)
+{
+    unsigned seed = argc > 1 ? atoi (argv[1]) : (unsigned) time (NULL);
+
+    printf ("seed %u\n", seed);
+    check_random (seed);
+    printf ("%d random operations on %d keys: ok\n", OPS, KEYS);
+
+    printf ("%10s %12s %12s %12s\n", "elements", "avl ns", "bptree ns",
+            "generated ns");
+    run (10000);
+    run (1000000);
+    return 0;
+};
+
+static void
+check_random (unsigned seed)
+{
+    static struct record records[KEYS];
+    struct idmap_tree tree;
+    bool present[KEYS];
+    int i;
+
+    srand (seed);
+    idmap_init (&tree);
+    memset (present, 0, sizeof present);
+    for (i = 0; i < KEYS; i++)
+        records[i].ourid = i;
+    for (i = 0; i < OPS; i++)
+    {
+        int k = rand () % KEYS;
+        int r = rand () % 10;
+        void* v = NULL;
+        if (i < OPS / 2 ? r < 6 : r < 4)
+        {
+            ASSERT (idmap_insert (&tree, k, &records[k]) == !present[k]);
+            present[k] = true;
+        }
+        else
+        {
+            ASSERT (idmap_delete (&tree, k, &v) == present[k]);
+            ASSERT (!present[k] || v == &records[k]);
+            present[k] = false;
+        }
+        void** found = idmap_find (&tree, k);
+        ASSERT (present[k] ? found && *found == &records[k] : !found);
+
+        if (i % 500 == 0)
+        {
+            size_t count, expected = 0;
+            struct idmap_iterator it;
+            int lo = rand () % KEYS;
+            ASSERT (idmap_check (&tree, &count));
+            for (k = 0; k < KEYS; k++)
+                expected += present[k];
+            ASSERT (count == expected);
+
+            bool more = idmap_iter_seek (&tree, &it, lo);
+            for (k = lo; k < KEYS; k++)
+            {
+                if (!present[k])
+                    continue;
+                ASSERT (more && idmap_iter_key (&it) == k);
+                ASSERT (*idmap_iter_value (&it) == &records[k]);
+                more = idmap_iter_next (&it);
+            }
+            ASSERT (!more);
+        }
+    }
+    idmap_destroy (&tree);
+};
+
+static void
+run (int n)
+{
+    struct record* records = malloc (n * sizeof *records);
+    int* order = malloc (n * sizeof (int));
+    int* probe = malloc (LOOKUPS * sizeof (int));
+    struct avl_tree avl;
+    struct bpt_tree bpt;
+    struct idmap_tree gen;
+    long hits = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        records[i].ourid = i;
+        records[i].payload = i * 3;
+        order[i] = i;
+    }
+    srand (1);
+    bench_shuffle (order, n);
+    for (i = 0; i < LOOKUPS; i++)
+        probe[i] = rand () % n;
+
+    avl_init (&avl, &compare);
+    bpt_init (&bpt, &compare);
+    idmap_init (&gen);
+    for (i = 0; i < n; i++)
+    {
+        struct record* r = &records[order[i]];
+        avl_insert (&avl, r);
+        bpt_insert (&bpt, r);
+        idmap_insert (&gen, r->ourid, r);
+    }
+
+    /* Lookups go by a key on the stack, as a command handler's would */
+    double t0 = bench_now ();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        struct record key = { .ourid = probe[i] };
+        struct record* r = avl_find (&avl, &key);
+        hits += r->payload;
+    }
+    double t1 = bench_now ();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        struct record key = { .ourid = probe[i] };
+        struct record* r = bpt_find (&bpt, &key);
+        hits += r->payload;
+    }
+    double t2 = bench_now ();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        struct record* r = *idmap_find (&gen, probe[i]);
+        hits += r->payload;
+    }
+    double t3 = bench_now ();
+
+    long expected = 0;
+    for (i = 0; i < LOOKUPS; i++)
+        expected += probe[i] * 3;
+    ASSERT (hits == 3 * expected);
+
+    printf ("%10d %12.1f %12.1f %12.1f\n", n, (t1 - t0) * 1e9 / LOOKUPS,
+            (t2 - t1) * 1e9 / LOOKUPS, (t3 - t2) * 1e9 / LOOKUPS);
+
+    avl_destroy (&avl);
+    bpt_destroy (&bpt);
+    idmap_destroy (&gen);
+    free (records);
+    free (order);
+    free (probe);
+};
+
+static int
+compare (const void* a, const void* b, const void* AUX)
+{
+    return ((const struct record*) a)->ourid
+        - ((const struct record*) b)->ourid;
+};
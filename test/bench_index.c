@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include "slab.h"
+#include "bst.h"
+#include "child.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark for the child index.  We fill the slab table and the old BST
+ * index with CHILDREN live children, ids handed out in increasing order the
+ * way the server used to, and time inserts and lookups on both.  The BST
+ * degenerates into a list under increasing ids, so it only gets BST_LOOKUPS
+ * lookups to keep the run short.  Then we churn the slab table and check
+ * that ids of removed children stay dead after their slots are reused. */
+
+#define CHILDREN        100000
+#define LOOKUPS         1000000
+#define BST_LOOKUPS     2000
+
+static struct server_child children[CHILDREN];
+
+static int compare (const void* a, const void* b, const void* AUX);
+
+int
+main (int argc, char** argv)
+{
+    int n = argc > 1 ? atoi (argv[1]) : CHILDREN;
+    int i;
+    volatile void* sink = NULL;
+
+    if (n <= 0 || n > CHILDREN)
+        n = CHILDREN;
+    printf ("%d live children\n", n);
+    printf ("%8s %14s %14s\n", "index", "insert ns/op", "lookup ns/op");
+
+    /* Slab table */
+    struct slab_table t;
+    slab_init (&t);
+    double start = bench_now ();
+    for (i = 0; i < n; i++)
+        children[i].ourid = slab_insert (&t, &children[i]);
+    double insert = bench_now () - start;
+
+    srand (1);
+    start = bench_now ();
+    for (i = 0; i < LOOKUPS; i++)
+        sink = slab_find (&t, children[rand () % n].ourid);
+    double lookup = bench_now () - start;
+    printf ("%8s %14.1f %14.1f\n", "slab", insert * 1e9 / n,
+            lookup * 1e9 / LOOKUPS);
+
+    /* The BST it replaces */
+    struct bst_tree tree;
+    bst_init (&tree, &compare);
+    for (i = 0; i < n; i++)
+        children[i].ourid = i + 1;
+    start = bench_now ();
+    for (i = 0; i < n; i++)
+        bst_insert (&tree, &children[i]);
+    insert = bench_now () - start;
+
+    start = bench_now ();
+    for (i = 0; i < BST_LOOKUPS; i++)
+    {
+        struct server_child key;
+        key.ourid = rand () % n + 1;
+        sink = bst_find (&tree, &key);
+    }
+    lookup = bench_now () - start;
+    printf ("%8s %14.1f %14.1f\n", "bst", insert * 1e9 / n,
+            lookup * 1e9 / BST_LOOKUPS);
+    (void) sink;
+
+    /* Churn: remove and re-add everyone a few times.  Every old id must
+     * miss, and every new one hit. */
+    slab_destroy (&t);
+    slab_init (&t);
+    for (i = 0; i < n; i++)
+        children[i].ourid = slab_insert (&t, &children[i]);
+    int* old = malloc (n * sizeof (int));
+    int round;
+    start = bench_now ();
+    for (round = 0; round < 4; round++)
+    {
+        for (i = 0; i < n; i++)
+        {
+            old[i] = children[i].ourid;
+            ASSERT (slab_remove (&t, old[i]) == &children[i]);
+            children[i].ourid = slab_insert (&t, &children[i]);
+            ASSERT (children[i].ourid > 0);
+        }
+        for (i = 0; i < n; i++)
+        {
+            ASSERT (slab_find (&t, old[i]) == NULL);
+            ASSERT (slab_find (&t, children[i].ourid) == &children[i]);
+        }
+    }
+    double churn = bench_now () - start;
+    ASSERT (t.count == (uint32) n);
+    printf ("churn: %.1f ns per remove+insert, stale ids rejected\n",
+            churn * 1e9 / (4.0 * n));
+
+    free (old);
+    slab_destroy (&t);
+    return 0;
+};
+
+static int
+compare (const void* a, const void* b, const void* AUX)
+{
+    return ((const struct server_child*) a)->ourid -
+        ((const struct server_child*) b)->ourid;
+};
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+
+#include "logging.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glob.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <wchar.h>
+#include <sys/wait.h>
+
+/* Benchmark for the logging pipeline.  THREADS threads each log LINES
+ * lines of the kind the accept loop writes.  We time what a call costs the
+ * caller, and lines per second until everything is on disk, for the queued
+ * logger with both overflow policies, for binary records, and for the old
+ * scheme, which took a semaphore, seeked to the end and formatted the whole
+ * line with stdio on every call.  Binary logs are read back through
+ * logdecode and checked line by line, as are formats that binary records
+ * can't carry and must fall back to text.  Rate limiting is off for those
+ * runs; a storm from a single call site then checks that it holds the site
+ * to its rate and accounts for every line it suppressed, and a run with
+ * rotation and compression on, and the file moved aside halfway, checks
+ * that no line is lost on the way.  The logs go to files under /tmp that
+ * are removed at the end. */
+
+#define LINES           200000
+
+struct result
+{
+    double caller_ns;       // average time inside a logging call
+    double lines_per_sec;   // until the last line was written out
+    unsigned long dropped;
+};
+
+static char logpath[64];
+static char errpath[64];
+
+/* The old logger, kept here for comparison */
+static FILE* legacy_file;
+static sem_t legacy_sem;
+
+static void legacy_log (const char* format, ...);
+static void* log_thread (void* aux);
+static void run (int nthreads, int mode, struct result* r);
+static double call_cost (bool bin);
+static double filtered_cost ();
+static double storm ();
+static double rotation (int* files);
+static void fallbacks ();
+static void default_policy ();
+static int reap (int options);
+static unsigned long count_lines (const char* path, const char* filter);
+
+enum mode { QUEUED_DROP, QUEUED_BLOCK, BINARY, LEGACY };
+
+static int run_mode;
+static double thread_ns[64];
+
+int
+main (int argc, char** argv)
+{
+    int nthreads;
+
+    snprintf (logpath, sizeof logpath, "/tmp/bench_log.%d", (int) getpid ());
+    snprintf (errpath, sizeof errpath, "/tmp/bench_err.%d", (int) getpid ());
+
+    set_log_rate (0);
+
+    default_policy ();
+    printf ("no line dropped without a policy set\n");
+
+    printf ("%d lines per thread\n", LINES);
+    printf ("%8s %26s %26s %26s %26s\n", "", "queued, drop", "queued, block",
+            "binary, block", "semaphore + stdio");
+    printf ("%8s %12s %13s %12s %13s %12s %13s %12s %13s\n", "threads",
+            "caller ns", "lines/s", "caller ns", "lines/s",
+            "caller ns", "lines/s", "caller ns", "lines/s");
+
+    for (nthreads = 1; nthreads <= 8; nthreads *= 2)
+    {
+        struct result drop, block, bin, legacy;
+
+        run (nthreads, QUEUED_DROP, &drop);
+        run (nthreads, QUEUED_BLOCK, &block);
+        run (nthreads, BINARY, &bin);
+        run (nthreads, LEGACY, &legacy);
+
+        printf ("%8d %12.1f %13.0f %12.1f %13.0f %12.1f %13.0f %12.1f %13.0f\n",
+                nthreads, drop.caller_ns, drop.lines_per_sec,
+                block.caller_ns, block.lines_per_sec, bin.caller_ns,
+                bin.lines_per_sec, legacy.caller_ns, legacy.lines_per_sec);
+        printf ("%8s dropped %lu of %d lines with the drop policy\n", "",
+                drop.dropped, nthreads * LINES);
+        fflush (stdout);
+    }
+
+    fallbacks ();
+    printf ("formats binary records can't carry decode as text\n");
+
+    printf ("\nper call while the ring has room: text %.1f ns, binary %.1f ns\n",
+            call_cost (false), call_cost (true));
+    printf ("skipped by level %.1f ns, suppressed by rate %.1f ns\n",
+            filtered_cost (), storm ());
+
+    int files;
+    double rate = rotation (&files);
+    printf ("rotating every %d bytes: %.0f lines/s over %d files\n",
+            1 << 20, rate, files);
+
+    unlink (logpath);
+    unlink (errpath);
+    return 0;
+};
+
+/* What a call costs when it does not have to wait or wake the writer:
+ * bursts of a quarter of a ring, with the writer draining between them
+ * untimed */
+static double
+call_cost (bool bin)
+{
+    const char* host = "192.168.1.20";
+    double total = 0;
+    int i, j;
+
+    set_log_binary (bin);
+    ASSERT (init_logging (logpath, errpath) == 0);
+    set_log_overflow (LOG_OVERFLOW_BLOCK);
+    for (i = 0; i < LINES / (LOG_RING_SLOTS / 4); i++)
+    {
+        flush_logging ();
+        double start = bench_now ();
+        for (j = 0; j < LOG_RING_SLOTS / 4; j++)
+            server_log ("got connection %d from %s port %d", j, host, 20171);
+        total += bench_now () - start;
+    }
+    end_logging ();
+    return total * 1e9 / (i * (LOG_RING_SLOTS / 4));
+};
+
+/* Until something sets a policy, a burst much longer than the ring, to
+ * either stream, waits for the writer rather than losing lines */
+static void
+default_policy ()
+{
+    struct log_stats before, after;
+    int i;
+
+    unlink (logpath);
+    unlink (errpath);
+    ASSERT (init_logging (logpath, errpath) == 0);
+    flush_logging ();
+    get_log_stats (&before);
+    for (i = 0; i < LINES / 10; i++)
+    {
+        server_log ("got connection %d from %s port %d", i, "192.168.1.20",
+                20171);
+        server_err ("lost connection %d", i);
+    }
+    flush_logging ();
+    get_log_stats (&after);
+    end_logging ();
+
+    ASSERT (after.dropped == before.dropped);
+    ASSERT (after.lines - before.lines == 2 * (LINES / 10));
+    ASSERT (count_lines (logpath, NULL) == LINES / 10);
+};
+
+/* Formats with conversions binary records can't carry, or too many
+ * arguments, must go out as text and decode whole.  Short and char
+ * conversions are carried, but must decode narrowed as text prints them. */
+static void
+fallbacks ()
+{
+    static const char* expected[] = {
+        "long double 1.500000 then 42",
+        "wide abc then 42",
+        "counted then 42",
+        "1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17",
+        "short ffff then 42",
+        "char 44 then 42"
+    };
+    bool found[6] = { false, false, false, false, false, false };
+    char line[512], cmd[128];
+    int counted, i;
+
+    unlink (logpath);
+    set_log_binary (true);
+    ASSERT (init_logging (logpath, errpath) == 0);
+    server_log ("long double %Lf then %d", (long double) 1.5, 42);
+    server_log ("wide %ls then %d", L"abc", 42);
+    server_log ("counted%n then %d", &counted, 42);
+    server_log ("%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", 1, 2,
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+    server_log ("short %hx then %d", -1, 42);
+    server_log ("char %hhd then %d", 300, 42);
+    end_logging ();
+    set_log_binary (false);
+
+    snprintf (cmd, sizeof cmd, "./logdecode %s", logpath);
+    FILE* f = popen (cmd, "r");
+    ASSERT (f != NULL);
+    while (fgets (line, sizeof line, f) != NULL)
+    {
+        const char* msg = strstr (line, "] server: ");
+        line[strcspn (line, "\n")] = '\0';
+        for (i = 0; msg != NULL && i < 6; i++)
+            if (strcmp (msg + strlen ("] server: "), expected[i]) == 0)
+                found[i] = true;
+    }
+    ASSERT (pclose (f) == 0);
+    for (i = 0; i < 6; i++)
+        ASSERT (found[i]);
+};
+
+/* Reaps children as the server's SIGCHLD handling does, and hands them to
+ * the log writer.  The only children we have are its compressors.  Returns
+ * how many were reaped. */
+static int
+reap (int options)
+{
+    pid_t pid;
+    int n = 0;
+
+    while ((pid = waitpid (-1, NULL, options)) > 0)
+    {
+        ASSERT (log_child_exited (pid));
+        n++;
+    }
+    return n;
+};
+
+/* What a call costs when its level is filtered out at run time */
+static double
+filtered_cost ()
+{
+    const char* host = "192.168.1.20";
+    int i;
+
+    set_log_level (LOG_ACCEPT, LOG_LEVEL_INFO);
+    double start = bench_now ();
+    for (i = 0; i < LINES; i++)
+        log_debug (LOG_ACCEPT, "got connection %d from %s port %d", i, host,
+                20171);
+    return (bench_now () - start) * 1e9 / LINES;
+};
+
+/* LINES lines as fast as one call site can make them, at the default
+ * rate.  Returns what a call costs on average, most of them suppressed. */
+static double
+storm ()
+{
+    const char* host = "192.168.1.20";
+    struct log_stats before, after;
+    unsigned long summarized = 0;
+    char line[512];
+    int i;
+
+    unlink (logpath);
+    set_log_binary (false);
+    ASSERT (init_logging (logpath, errpath) == 0);
+    set_log_rate (LOG_DEFAULT_RATE);
+    get_log_stats (&before);
+
+    double start = bench_now ();
+    for (i = 0; i < LINES; i++)
+        log_info (LOG_ACCEPT, "got connection %d from %s port %d", i, host,
+                20171);
+    double elapsed = bench_now () - start;
+
+    /* Writes the summary for the last second */
+    end_logging ();
+    get_log_stats (&after);
+    set_log_rate (0);
+
+    FILE* f = fopen (logpath, "r");
+    ASSERT (f != NULL);
+    while (fgets (line, sizeof line, f) != NULL)
+    {
+        const char* msg = strstr (line, "] server: ");
+        unsigned n;
+        if (msg != NULL && sscanf (msg, "] server: %u more lines", &n) == 1)
+            summarized += n;
+    }
+    fclose (f);
+
+    unsigned long written = count_lines (logpath, NULL);
+    unsigned long suppressed = after.suppressed - before.suppressed;
+    ASSERT (written <= LOG_DEFAULT_RATE * ((unsigned long) elapsed + 2));
+    ASSERT (written + suppressed == LINES);
+    ASSERT (summarized == suppressed);
+    return elapsed * 1e9 / LINES;
+};
+
+/* LINES lines with the file rotated every megabyte and compressed, and
+ * moved aside halfway as logrotate would before sending SIGHUP.  Returns
+ * lines per second, and in FILES how many files they ended up in. */
+static double
+rotation (int* files)
+{
+    const char* host = "192.168.1.20";
+    char moved[80], pattern[80];
+    unsigned long n = 0;
+    glob_t g;
+    int i;
+
+    unlink (logpath);
+    set_log_binary (false);
+    ASSERT (init_logging (logpath, errpath) == 0);
+    set_log_overflow (LOG_OVERFLOW_BLOCK);
+    set_log_rotation (1 << 20, 0, true);
+
+    snprintf (moved, sizeof moved, "%s.moved", logpath);
+    double start = bench_now ();
+    int compressed = 0;
+    for (i = 0; i < LINES; i++)
+    {
+        if (i == LINES / 2)
+        {
+            ASSERT (rename (logpath, moved) == 0);
+            reopen_logging ();
+        }
+        if (i % 1000 == 0)
+            compressed += reap (WNOHANG);
+        log_info (LOG_ACCEPT, "got connection %d from %s port %d", i, host,
+                20171);
+    }
+    flush_logging ();
+    double elapsed = bench_now () - start;
+    end_logging ();
+    set_log_rotation (0, 0, false);
+
+    /* The writer leaves its compressors to finish on their own */
+    compressed += reap (0);
+    ASSERT (compressed > 0);
+
+    snprintf (pattern, sizeof pattern, "%s*", logpath);
+    ASSERT (glob (pattern, 0, NULL, &g) == 0);
+    for (i = 0; i < (int) g.gl_pathc; i++)
+    {
+        const char* path = g.gl_pathv[i];
+        bool gz = strcmp (path + strlen (path) - 3, ".gz") == 0;
+        n += count_lines (path, gz ? "gzip -dc" : NULL);
+        unlink (path);
+    }
+    *files = g.gl_pathc;
+    globfree (&g);
+
+    ASSERT (n == LINES);
+    return LINES / elapsed;
+};
+
+static void
+run (int nthreads, int mode, struct result* r)
+{
+    pthread_t threads[64];
+    struct log_stats before, after;
+    int i;
+
+    unlink (logpath);
+    unlink (errpath);
+    if (mode == LEGACY)
+    {
+        legacy_file = fopen (logpath, "a");
+        ASSERT (legacy_file != NULL);
+        sem_init (&legacy_sem, 0, 1);
+    }
+    else
+    {
+        set_log_binary (mode == BINARY);
+        ASSERT (init_logging (logpath, errpath) == 0);
+        set_log_overflow (mode == QUEUED_DROP ? LOG_OVERFLOW_DROP
+                : LOG_OVERFLOW_BLOCK);
+        flush_logging ();
+    }
+    get_log_stats (&before);
+
+    run_mode = mode;
+    double start = bench_now ();
+    for (i = 0; i < nthreads; i++)
+        pthread_create (&threads[i], NULL, &log_thread, &thread_ns[i]);
+    for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+
+    unsigned long written;
+    r->dropped = 0;
+    if (mode == LEGACY)
+    {
+        fclose (legacy_file);
+        sem_destroy (&legacy_sem);
+        written = nthreads * LINES;
+    }
+    else
+    {
+        flush_logging ();
+        get_log_stats (&after);
+        written = after.lines - before.lines;
+        r->dropped = after.dropped - before.dropped;
+    }
+    double elapsed = bench_now () - start;
+
+    if (mode != LEGACY)
+        end_logging ();
+
+    /* Whatever was not dropped must be in the file */
+    ASSERT (count_lines (logpath, mode == BINARY ? "./logdecode" : NULL)
+            == written);
+    ASSERT (written + r->dropped == (unsigned long) nthreads * LINES);
+
+    r->caller_ns = 0;
+    for (i = 0; i < nthreads; i++)
+        r->caller_ns += thread_ns[i] / nthreads;
+    r->lines_per_sec = written / elapsed;
+};
+
+static void*
+log_thread (void* aux)
+{
+    const char* host = "192.168.1.20";
+    int i;
+
+    double start = bench_now ();
+    for (i = 0; i < LINES; i++)
+    {
+        if (run_mode == LEGACY)
+            legacy_log ("got connection %d from %s port %d", i, host, 20171);
+        else
+            server_log ("got connection %d from %s port %d", i, host, 20171);
+    }
+    *(double*) aux = (bench_now () - start) * 1e9 / LINES;
+    return NULL;
+};
+
+static void
+legacy_log (const char* format, ...)
+{
+    va_list args;
+    time_t t = time (NULL);
+    struct tm* l;
+
+    sem_wait (&legacy_sem);
+    fseek (legacy_file, 0, SEEK_END);
+
+    l = localtime (&t);
+    fprintf (legacy_file, "[%d %d %d, %d %02d:%02d:%02d] ", l->tm_wday,
+            l->tm_mon, l->tm_mday, (1900 + l->tm_year), l->tm_hour,
+            l->tm_min, l->tm_sec);
+    fprintf (legacy_file, "server: ");
+
+    va_start (args, format);
+    vfprintf (legacy_file, format, args);
+    va_end (args);
+
+    fprintf (legacy_file, "\n");
+    sem_post (&legacy_sem);
+};
+
+/* Counts the lines we logged in PATH, checking that each one reads back
+ * as it was logged.  If FILTER is not NULL, PATH is read through that
+ * command. */
+static unsigned long
+count_lines (const char* path, const char* filter)
+{
+    char line[512], host[64], cmd[128];
+    unsigned long n = 0;
+    FILE* f;
+
+    if (filter != NULL)
+    {
+        snprintf (cmd, sizeof cmd, "%s %s", filter, path);
+        f = popen (cmd, "r");
+    }
+    else
+    {
+        f = fopen (path, "r");
+    }
+    ASSERT (f != NULL);
+
+    while (fgets (line, sizeof line, f) != NULL)
+    {
+        const char* msg = strstr (line, "] server: got connection");
+        int i, port;
+        if (msg == NULL)
+            continue;
+        ASSERT (line[0] == '[');
+        ASSERT (sscanf (msg, "] server: got connection %d from %63s port %d",
+                    &i, host, &port) == 3);
+        ASSERT (i >= 0 && i < LINES && port == 20171);
+        ASSERT (strcmp (host, "192.168.1.20") == 0);
+        n++;
+    }
+    if (filter != NULL)
+    {
+        ASSERT (pclose (f) == 0);
+    }
+    else
+    {
+        fclose (f);
+    }
+    return n;
+};
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+
+#include "logging.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Contention benchmark for logging from children.  CHILDREN processes are
+ * forked and released at once, and each logs LINES lines.  We measure the
+ * CPU time a call costs the child, which leaves out the time it waits to be
+ * scheduled among so many, and how many lines per second reach the file, for
+ * the shared ring drained by the parent's writer (with both overflow
+ * policies), for children writing each line to the file themselves, and
+ * for the old scheme of a named semaphore, a seek and stdio.  The optional
+ * argument is the number of children.  Scripts attach to the ring after
+ * exec, so we also check that a child exec'd with the descriptor can log
+ * through it. */
+
+#define LINES           1000
+
+enum mode { DIRECT, LEGACY, SHARED_BLOCK, SHARED_DROP };
+
+static const char* names[] = {
+    "write per line", "semaphore + stdio", "shared ring, block",
+    "shared ring, drop" };
+
+static char logpath[64];
+static char errpath[64];
+static char semname[64];
+
+/* Per child CPU time per call in ns, in shared memory */
+static double* child_ns;
+
+/* The old scheme's semaphore, created by the parent for every child */
+static sem_t* sem;
+
+static void run (int nchildren, int mode);
+static void check_exec (const char* self, int fd);
+static void child (int mode, int go, double* ns);
+static void legacy_log (FILE* f, const char* format, ...);
+static unsigned long count_lines (const char* path, const char* match);
+static double now (clockid_t clock);
+
+int
+main (int argc, char** argv)
+{
+    /* Exec'd by CHECK_EXEC: log a line through the ring and go */
+    if (argc == 3 && !strcmp (argv[1], "attach"))
+    {
+        ASSERT (attach_log_ring (atoi (argv[2])) == 0);
+        set_log_child (getpid ());
+        server_log ("EXEC_CHILD logged after exec");
+        return 0;
+    }
+
+    int nchildren = argc > 1 ? atoi (argv[1]) : 1000;
+
+    snprintf (logpath, sizeof logpath, "/tmp/bench_log.%d", (int) getpid ());
+    snprintf (errpath, sizeof errpath, "/tmp/bench_err.%d", (int) getpid ());
+    snprintf (semname, sizeof semname, "/bench_logsem.%d", (int) getpid ());
+
+    child_ns = mmap (NULL, nchildren * sizeof (double),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT (child_ns != MAP_FAILED);
+
+    printf ("%d children, %d lines each\n", nchildren, LINES);
+    printf ("%20s %12s %12s %12s %10s\n", "", "cpu ns/call", "p99",
+            "lines/s", "dropped");
+
+    ASSERT (init_logging (logpath, errpath) == 0);
+    set_log_rate (0);
+
+    /* Without a shared ring, children write directly */
+    run (nchildren, DIRECT);
+    run (nchildren, LEGACY);
+
+    int fd = init_log_ring ();
+    ASSERT (fd != -1);
+    check_exec (argv[0], fd);
+    set_log_overflow (LOG_OVERFLOW_BLOCK);
+    run (nchildren, SHARED_BLOCK);
+    set_log_overflow (LOG_OVERFLOW_DROP);
+    run (nchildren, SHARED_DROP);
+
+    end_logging ();
+    unlink (logpath);
+    unlink (errpath);
+    return 0;
+};
+
+static void
+run (int nchildren, int mode)
+{
+    struct log_stats before, after;
+    int go[2];
+    int i;
+
+    flush_logging ();
+    truncate (logpath, 0);
+    get_log_stats (&before);
+    ASSERT (pipe (go) == 0);
+    if (mode == LEGACY)
+    {
+        sem = sem_open (semname, O_CREAT, S_IRUSR | S_IWUSR, 1);
+        ASSERT (sem != SEM_FAILED);
+    }
+
+    for (i = 0; i < nchildren; i++)
+    {
+        pid_t pid = fork ();
+        ASSERT (pid != -1);
+        if (pid == 0)
+        {
+            close (go[1]);
+            child (mode, go[0], &child_ns[i]);
+            _exit (0);
+        }
+    }
+
+    /* Closing the pipe releases every child at once */
+    close (go[0]);
+    double start = now (CLOCK_MONOTONIC);
+    close (go[1]);
+    for (i = 0; i < nchildren; i++)
+        wait (NULL);
+    flush_logging ();
+    double elapsed = now (CLOCK_MONOTONIC) - start;
+    get_log_stats (&after);
+    if (mode == LEGACY)
+    {
+        sem_close (sem);
+        sem_unlink (semname);
+    }
+
+    unsigned long expected = (unsigned long) nchildren * LINES;
+    unsigned long dropped = after.dropped - before.dropped;
+    ASSERT (count_lines (logpath, "SEND_B") + dropped == expected);
+
+    double sum = 0, sorted[nchildren];
+    for (i = 0; i < nchildren; i++)
+    {
+        int j = i;
+        sum += child_ns[i];
+        while (j > 0 && sorted[j - 1] > child_ns[i])
+        {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = child_ns[i];
+    }
+    printf ("%20s %12.1f %12.1f %12.0f %10lu\n", names[mode],
+            sum / nchildren, sorted[nchildren * 99 / 100],
+            (expected - dropped) / elapsed, dropped);
+    fflush (stdout);
+};
+
+static void
+check_exec (const char* self, int fd)
+{
+    char arg[16];
+    int status;
+
+    flush_logging ();
+    truncate (logpath, 0);
+    snprintf (arg, sizeof arg, "%d", fd);
+
+    pid_t pid = fork ();
+    ASSERT (pid != -1);
+    if (pid == 0)
+    {
+        execl (self, self, "attach", arg, (char*) NULL);
+        _exit (127);
+    }
+    ASSERT (waitpid (pid, &status, 0) == pid);
+    ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+    flush_logging ();
+    ASSERT (count_lines (logpath, "EXEC_CHILD") == 1);
+    printf ("a child exec'd with the ring logged through it\n");
+};
+
+static void
+child (int mode, int go, double* ns)
+{
+    FILE* f = NULL;
+    char c;
+    int i;
+
+    set_log_child (getpid ());
+    if (mode == LEGACY)
+    {
+        f = fopen (logpath, "a");
+        ASSERT (f != NULL);
+    }
+
+    read (go, &c, 1);
+    double start = now (CLOCK_PROCESS_CPUTIME_ID);
+    for (i = 0; i < LINES; i++)
+    {
+        if (mode == LEGACY)
+            legacy_log (f, "SEND_B to child %d, %d bytes", i % 50, i);
+        else
+            server_log ("SEND_B to child %d, %d bytes", i % 50, i);
+    }
+    *ns = (now (CLOCK_PROCESS_CPUTIME_ID) - start) * 1e9 / LINES;
+
+    if (mode == LEGACY)
+        fclose (f);
+};
+
+static void
+legacy_log (FILE* f, const char* format, ...)
+{
+    va_list args;
+    time_t t = time (NULL);
+    struct tm* l;
+
+    sem_wait (sem);
+    fseek (f, 0, SEEK_END);
+
+    l = localtime (&t);
+    fprintf (f, "[%d %d %d, %d %02d:%02d:%02d] ", l->tm_wday,
+            l->tm_mon, l->tm_mday, (1900 + l->tm_year), l->tm_hour,
+            l->tm_min, l->tm_sec);
+    fprintf (f, "%u: ", getpid ());
+
+    va_start (args, format);
+    vfprintf (f, format, args);
+    va_end (args);
+
+    fprintf (f, "\n");
+    sem_post (sem);
+};
+
+/* Lines of PATH that contain MATCH */
+static unsigned long
+count_lines (const char* path, const char* match)
+{
+    FILE* f = fopen (path, "r");
+    unsigned long n = 0;
+    char line[512];
+
+    ASSERT (f != NULL);
+    while (fgets (line, sizeof line, f) != NULL)
+        n += strstr (line, match) != NULL;
+    fclose (f);
+    return n;
+};
+
+static double
+now (clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime (clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+};
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include "slab.h"
+#include "epoch.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Multi-threaded benchmark for child lookups.  Reader threads play broker
+ * threads looking up the sibling a message is for and touching its record,
+ * while one writer thread keeps removing children and adding new ones the
+ * way connects and exits do.  We compare lookups under the index mutex with
+ * lock-free lookups inside an epoch read section.  The writer poisons every
+ * record it frees, so a reader ever seeing a freed record fails the run. */
+
+#define CHILDREN        10000
+#define SECONDS         1
+#define MAX_THREADS     16
+#define LIVE            0x11fe
+#define DEAD            0xdead
+
+struct record
+{
+    int ourid;
+    int magic;
+};
+
+static struct slab_table table;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int ids[CHILDREN];
+static volatile bool running;
+static bool lockfree;
+
+static void* reader_thread (void* aux);
+static void* writer_thread (void* aux);
+static void destroy_record (void* r);
+
+int
+main (int argc, char** argv)
+{
+    int max = argc > 1 ? atoi (argv[1]) : (int) sysconf (_SC_NPROCESSORS_ONLN);
+    int i, n, mode;
+
+    if (max < 1)
+        max = 1;
+    if (max > MAX_THREADS)
+        max = MAX_THREADS;
+
+    slab_init (&table);
+    for (i = 0; i < CHILDREN; i++)
+    {
+        struct record* r = malloc (sizeof *r);
+        r->magic = LIVE;
+        r->ourid = ids[i] = slab_insert (&table, r);
+    }
+
+    printf ("%d children, one writer churning, %d cpus\n", CHILDREN,
+            (int) sysconf (_SC_NPROCESSORS_ONLN));
+    printf ("%8s %16s %16s\n", "readers", "mutex Mops/s", "lockfree Mops/s");
+
+    for (n = 1; n <= max; n *= 2)
+    {
+        double rate[2];
+        for (mode = 0; mode <= 1; mode++)
+        {
+            pthread_t readers[MAX_THREADS], writer;
+            long counts[MAX_THREADS];
+
+            lockfree = mode;
+            running = true;
+            pthread_create (&writer, NULL, &writer_thread, NULL);
+            for (i = 0; i < n; i++)
+            {
+                counts[i] = i;
+                pthread_create (&readers[i], NULL, &reader_thread, &counts[i]);
+            }
+            double start = bench_now ();
+            sleep (SECONDS);
+            running = false;
+
+            long total = 0;
+            for (i = 0; i < n; i++)
+            {
+                pthread_join (readers[i], NULL);
+                total += counts[i];
+            }
+            pthread_join (writer, NULL);
+            rate[mode] = total / (bench_now () - start) / 1e6;
+        }
+        printf ("%8d %16.2f %16.2f\n", n, rate[0], rate[1]);
+        if (n < max && n * 2 > max)
+            n = max / 2;
+    }
+
+    epoch_collect ();
+    printf ("no freed record was ever seen\n");
+    return 0;
+};
+
+/* Counts its lookups into *AUX, which starts as a seed */
+static void*
+reader_thread (void* aux)
+{
+    long* count = aux;
+    unsigned seed = (unsigned) *count + 1;
+    long n = 0;
+
+    while (running)
+    {
+        int id = __atomic_load_n (&ids[rand_r (&seed) % CHILDREN],
+                __ATOMIC_RELAXED);
+
+        if (lockfree)
+            epoch_enter ();
+        else
+            pthread_mutex_lock (&lock);
+
+        struct record* r = slab_find (&table, id);
+        if (r != NULL)
+        {
+            ASSERT (r->magic == LIVE);
+            ASSERT (r->ourid == id);
+        }
+
+        if (lockfree)
+            epoch_exit ();
+        else
+            pthread_mutex_unlock (&lock);
+        n++;
+    }
+
+    epoch_thread_exit ();
+    *count = n;
+    return NULL;
+};
+
+static void*
+writer_thread (void* aux)
+{
+    unsigned seed = 12345;
+
+    while (running)
+    {
+        int i = rand_r (&seed) % CHILDREN;
+        struct record* fresh = malloc (sizeof *fresh);
+        fresh->magic = LIVE;
+
+        pthread_mutex_lock (&lock);
+        struct record* old = slab_remove (&table, ids[i]);
+        fresh->ourid = slab_insert (&table, fresh);
+        __atomic_store_n (&ids[i], fresh->ourid, __ATOMIC_RELAXED);
+        if (!lockfree)
+            destroy_record (old);
+        pthread_mutex_unlock (&lock);
+
+        if (lockfree)
+            epoch_retire (old, &destroy_record);
+
+        /* Connects and exits are rare next to lookups */
+        usleep (100);
+    }
+    return NULL;
+};
+
+static void
+destroy_record (void* r)
+{
+    ((struct record*) r)->magic = DEAD;
+    free (r);
+};
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include "match.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark for tagged message matching.  We queue QUEUED messages from
+ * SENDERS siblings over TAGS tags, then drain them with each kind of
+ * receive, and compare against the obvious implementation: one list in
+ * arrival order that every receive scans from the front.  Both are fed the
+ * same receives and must hand back the same messages, which checks that
+ * wildcards keep arrival order. */
+
+#define QUEUED      10000
+#define SENDERS     100
+#define TAGS        100
+
+/* The obvious implementation */
+struct scan_msg
+{
+    int src;
+    int tag;
+    int seq;
+    struct scan_msg* next;
+};
+
+struct scan_queue
+{
+    struct scan_msg* head;
+    struct scan_msg* tail;
+};
+
+struct recv
+{
+    int src;
+    int tag;
+};
+
+static int srcs[QUEUED];
+static int tags[QUEUED];
+static struct recv recvs[QUEUED];
+
+static void scan_put (struct scan_queue* q, int src, int tag, int seq);
+static int scan_take (struct scan_queue* q, int src, int tag);
+static void make_recvs (const char* kind);
+static double run_match (int* got);
+static double run_scan (int* got);
+
+int
+main (int argc, char** argv)
+{
+    const char* kinds[] = { "src+tag", "src", "tag", "any", "mixed" };
+    int i, k;
+
+    srand (1);
+    for (i = 0; i < QUEUED; i++)
+    {
+        srcs[i] = rand () % SENDERS;
+        tags[i] = rand () % TAGS;
+    }
+
+    printf ("%d queued messages, %d senders, %d tags\n", QUEUED, SENDERS,
+            TAGS);
+    printf ("%10s %14s %14s %10s\n", "receive", "match ns/op", "scan ns/op",
+            "speedup");
+
+    int* got_match = malloc (QUEUED * sizeof (int));
+    int* got_scan = malloc (QUEUED * sizeof (int));
+    for (k = 0; k < (int) (sizeof kinds / sizeof kinds[0]); k++)
+    {
+        make_recvs (kinds[k]);
+        double m = run_match (got_match);
+        double s = run_scan (got_scan);
+        ASSERT (memcmp (got_match, got_scan, QUEUED * sizeof (int)) == 0);
+        printf ("%10s %14.1f %14.1f %9.1fx\n", kinds[k], m * 1e9 / QUEUED,
+                s * 1e9 / QUEUED, s / m);
+    }
+    free (got_match);
+    free (got_scan);
+
+    /* The cap refuses what doesn't fit and lets it in again once there is
+     * room */
+    struct match_engine e;
+    char payload[100];
+    size_t cost = sizeof (struct match_msg) + sizeof payload;
+    memset (payload, 0, sizeof payload);
+    ASSERT (match_init (&e, 10 * cost) == 0);
+    for (i = 0; i < 10; i++)
+        ASSERT (match_put (&e, 1, i, payload, sizeof payload) == 0);
+    ASSERT (match_put (&e, 1, 10, payload, sizeof payload) == -1);
+    match_free (&e, match_take (&e, 1, 3));
+    ASSERT (match_put (&e, 1, 10, payload, sizeof payload) == 0);
+    ASSERT (e.count == 10 && e.bytes == 10 * cost);
+    match_destroy (&e);
+    printf ("cap of %lu bytes enforced\n", (unsigned long) (10 * cost));
+
+    return 0;
+};
+
+/* Receives for every queued message, so each one finds a match */
+static void
+make_recvs (const char* kind)
+{
+    int i;
+    for (i = 0; i < QUEUED; i++)
+    {
+        /* Name a message at random; a wildcard still takes the oldest */
+        int pick = rand () % QUEUED;
+        recvs[i].src = srcs[pick];
+        recvs[i].tag = tags[pick];
+
+        int w = kind[0] == 'm' ? rand () % 4 : -1;
+        if (!strcmp (kind, "tag") || w == 1 || !strcmp (kind, "any") || w == 3)
+            recvs[i].src = MATCH_ANY;
+        if (!strcmp (kind, "src") || w == 2 || !strcmp (kind, "any") || w == 3)
+            recvs[i].tag = MATCH_ANY;
+    }
+};
+
+static double
+run_match (int* got)
+{
+    struct match_engine e;
+    int i;
+    ASSERT (match_init (&e, (size_t) -1) == 0);
+    for (i = 0; i < QUEUED; i++)
+        ASSERT (match_put (&e, srcs[i], tags[i], &i, sizeof i) == 0);
+
+    double start = bench_now ();
+    for (i = 0; i < QUEUED; i++)
+    {
+        struct match_msg* msg = match_take (&e, recvs[i].src, recvs[i].tag);
+        if (msg == NULL)
+        {
+            got[i] = -1;
+            continue;
+        }
+        memcpy (&got[i], msg->data, sizeof got[i]);
+        match_free (&e, msg);
+    }
+    double elapsed = bench_now () - start;
+
+    match_destroy (&e);
+    return elapsed;
+};
+
+static double
+run_scan (int* got)
+{
+    struct scan_queue q = { NULL, NULL };
+    int i;
+    for (i = 0; i < QUEUED; i++)
+        scan_put (&q, srcs[i], tags[i], i);
+
+    double start = bench_now ();
+    for (i = 0; i < QUEUED; i++)
+        got[i] = scan_take (&q, recvs[i].src, recvs[i].tag);
+    double elapsed = bench_now () - start;
+
+    while (q.head != NULL)
+        scan_take (&q, MATCH_ANY, MATCH_ANY);
+    return elapsed;
+};
+
+static void
+scan_put (struct scan_queue* q, int src, int tag, int seq)
+{
+    struct scan_msg* m = malloc (sizeof *m);
+    ASSERT (m != NULL);
+    m->src = src;
+    m->tag = tag;
+    m->seq = seq;
+    m->next = NULL;
+    if (q->tail == NULL)
+        q->head = m;
+    else
+        q->tail->next = m;
+    q->tail = m;
+};
+
+static int
+scan_take (struct scan_queue* q, int src, int tag)
+{
+    struct scan_msg* prev = NULL;
+    struct scan_msg* m;
+    for (m = q->head; m != NULL; prev = m, m = m->next)
+    {
+        if ((src != MATCH_ANY && m->src != src) ||
+                (tag != MATCH_ANY && m->tag != tag))
+            continue;
+
+        if (prev == NULL)   q->head = m->next;
+        else                prev->next = m->next;
+        if (q->tail == m)
+            q->tail = prev;
+
+        int seq = m->seq;
+        free (m);
+        return seq;
+    }
+    return -1;
+};
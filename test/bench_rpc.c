@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+
+#include "rpc.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Latency benchmark for the parent's RPC routing.  Caller threads play the
+ * children making calls and callee threads play the children answering
+ * them; each has a pipe standing in for its pipe to the parent.  Every caller
+ * keeps WINDOW calls outstanding, spread over all callees so the replies come
+ * back out of order, and we report latency percentiles for each window. */
+
+#define CALLERS         4
+#define CALLEES         4
+#define CALLS           20000       // per caller
+#define CALLEE_BASE     100         // ourid of the first callee
+
+static int pipes[CALLEE_BASE + CALLEES][2];
+static int window;
+static double* latencies[CALLERS];
+
+static int deliver (int ourid, struct message* m);
+static void* caller_thread (void* aux);
+static void* callee_thread (void* aux);
+static void check_timeout ();
+static int compare_double (const void* a, const void* b);
+
+int
+main (int argc, char** argv)
+{
+    int i;
+    for (i = 0; i < CALLEE_BASE + CALLEES; i++)
+        if (i < CALLERS + 1 || i >= CALLEE_BASE)
+            ASSERT (pipe (pipes[i]) == 0);
+
+    ASSERT (init_rpc (&deliver) == 0);
+
+    pthread_t callees[CALLEES];
+    for (i = 0; i < CALLEES; i++)
+        pthread_create (&callees[i], NULL, &callee_thread,
+                (void*) (long) (CALLEE_BASE + i));
+
+    printf ("%d callers x %d calls, %d callees\n", CALLERS, CALLS, CALLEES);
+    printf ("%8s %10s %10s %10s %10s %10s %12s\n", "window", "p50 us",
+            "p90 us", "p99 us", "p99.9 us", "max us", "calls/s");
+
+    for (window = 1; window <= 64; window *= 4)
+    {
+        pthread_t callers[CALLERS];
+        double start = bench_now ();
+        for (i = 0; i < CALLERS; i++)
+        {
+            latencies[i] = malloc (CALLS * sizeof (double));
+            pthread_create (&callers[i], NULL, &caller_thread,
+                    (void*) (long) (i + 1));
+        }
+        for (i = 0; i < CALLERS; i++)
+            pthread_join (callers[i], NULL);
+        double elapsed = bench_now () - start;
+
+        double* all = malloc (CALLERS * CALLS * sizeof (double));
+        for (i = 0; i < CALLERS; i++)
+        {
+            memcpy (all + i * CALLS, latencies[i], CALLS * sizeof (double));
+            free (latencies[i]);
+        }
+        size_t n = CALLERS * CALLS;
+        qsort (all, n, sizeof (double), &compare_double);
+        printf ("%8d %10.1f %10.1f %10.1f %10.1f %10.1f %12.0f\n", window,
+                all[n / 2] * 1e6, all[n * 90 / 100] * 1e6,
+                all[n * 99 / 100] * 1e6, all[n * 999 / 1000] * 1e6,
+                all[n - 1] * 1e6, n / elapsed);
+        free (all);
+    }
+
+    struct rpc_stats stats;
+    rpc_get_stats (&stats);
+    printf ("calls %lu, replies %lu, timeouts %lu, late %lu\n",
+            (unsigned long) stats.calls, (unsigned long) stats.replies,
+            (unsigned long) stats.timeouts, (unsigned long) stats.late);
+
+    check_timeout ();
+    return 0;
+};
+
+static int
+deliver (int ourid, struct message* m)
+{
+    return sizeof *m == write (pipes[ourid][1], m, sizeof *m) ? 0 : -1;
+};
+
+static void*
+caller_thread (void* aux)
+{
+    int me = (int) (long) aux;
+    double* sent = calloc (CALLS + 1, sizeof (double));
+    int issued = 0, done = 0;
+
+    while (done < CALLS)
+    {
+        /* Keep the window full */
+        while (issued < CALLS && issued - done < window)
+        {
+            uint32 corr_id = ++issued;
+            int callee = CALLEE_BASE + corr_id % CALLEES;
+            sent[corr_id] = bench_now ();
+            uint32 callid = rpc_begin (me, corr_id, callee, 5000);
+            ASSERT (callid != 0);
+
+            struct message m;
+            struct rpc_header h;
+            memset (&m, 0, sizeof m);
+            memset (&h, 0, sizeof h);
+            m.command = RPC_REQUEST;
+            m.id = callid;
+            h.corr_id = callid;
+            h.peer = me;
+            memcpy (m.information, &h, sizeof h);
+            deliver (callee, &m);
+        }
+
+        struct message m;
+        ASSERT (read (pipes[me][0], &m, sizeof m) == sizeof m);
+        ASSERT (m.command == RPC_RESULT);
+        latencies[me - 1][done++] = bench_now () - sent[m.id];
+    }
+
+    free (sent);
+    return NULL;
+};
+
+static void*
+callee_thread (void* aux)
+{
+    int me = (int) (long) aux;
+    struct message m;
+
+    while (read (pipes[me][0], &m, sizeof m) == sizeof m)
+    {
+        int64_t answer = m.id;
+        rpc_finish (m.id, me, &answer, sizeof answer);
+    }
+    return NULL;
+};
+
+/* A call nobody answers fails once its deadline passes, and not before */
+static void
+check_timeout ()
+{
+    struct rpc_stats stats;
+    struct rpc_header h;
+    struct message m;
+
+    double start = bench_now ();
+    ASSERT (rpc_begin (0, 7, CALLEE_BASE - 1, 50) != 0);
+    ASSERT (read (pipes[0][0], &m, sizeof m) == sizeof m);
+    double elapsed = bench_now () - start;
+
+    memcpy (&h, m.information, sizeof h);
+    ASSERT (m.command == RPC_RESULT && h.corr_id == 7);
+    ASSERT (h.status == ETIMEDOUT);
+    ASSERT (elapsed >= 0.050 && elapsed < 1);
+    rpc_get_stats (&stats);
+    ASSERT (stats.timeouts == 1);
+    printf ("unanswered call failed after %.1f ms\n", elapsed * 1e3);
+};
+
+static int
+compare_double (const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return x < y ? -1 : x > y;
+};
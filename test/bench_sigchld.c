@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include "mysignal.h"
+#include "child.h"
+#include "debug.h"
+#include "type.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* SIGCHLD storm benchmark.  CHILDREN processes are forked, each with a
+ * record in the child index as the server gives them, and released so
+ * they all exit at once.  First a handler that waits once per SIGCHLD, as
+ * the server used to, to count the zombies it leaves behind, since signals
+ * that arrive together are merged.  Then the signal descriptor and
+ * HANDLE_SIGNALS, as the main loop uses them, timing how long it takes to
+ * reap the lot and checking that no zombie is left and no record is left in
+ * the index.  The optional argument is the number of children. */
+
+#define CHILDREN        4000
+#define ROUNDS          3
+
+/* Read by the signal code; the main loop runs while it is set */
+bool run = true;
+
+static volatile sig_atomic_t waited = 0;
+
+static void storm (int sfd, int n);
+static void legacy (int n);
+static void legacy_handler (int sig);
+static pid_t* fork_children (int n, int* gate);
+static int count_zombies ();
+
+int
+main (int argc, char** argv)
+{
+    int n = argc > 1 ? atoi (argv[1]) : CHILDREN;
+    int i;
+
+    init_child_index ();
+    printf ("%d children exiting at once\n", n);
+    legacy (n);
+
+    int sfd = init_signal_handler ();
+    ASSERT (sfd != -1);
+    for (i = 0; i < ROUNDS; i++)
+        storm (sfd, n);
+    close (sfd);
+    return 0;
+};
+
+/* One wait per signal, from the signal handler */
+static void
+legacy (int n)
+{
+    int gate;
+
+    signal (SIGCHLD, &legacy_handler);
+    fork_children (n, &gate);
+    close (gate);
+
+    /* Give every exit time to be signalled */
+    struct timespec pause = { 0, 200000000 };
+    int last = -1;
+    while (waited != last)
+    {
+        last = waited;
+        nanosleep (&pause, NULL);
+    }
+    int zombies = count_zombies ();
+    printf ("wait per SIGCHLD:      %5d reaped, %5d zombies left\n",
+            (int) waited, zombies);
+
+    signal (SIGCHLD, SIG_DFL);
+    while (waitpid (-1, NULL, 0) > 0)
+        ;
+};
+
+static void
+legacy_handler (int sig)
+{
+    if (wait (NULL) > 0)
+        waited++;
+};
+
+/* Reaped through the signal descriptor */
+static void
+storm (int sfd, int n)
+{
+    struct server_child** records = calloc (n, sizeof *records);
+    struct pollfd pfd = { sfd, POLLIN, 0 };
+    int gate, reaped = 0, wakeups = 0;
+    int i;
+
+    ASSERT (records != NULL);
+    pid_t* pids = fork_children (n, &gate);
+    for (i = 0; i < n; i++)
+    {
+        records[i] = calloc (1, sizeof **records);
+        ASSERT (records[i] != NULL);
+        records[i]->pid = pids[i];
+        records[i]->refs = 2;
+        ASSERT (add_child (records[i]) > 0);
+    }
+    ASSERT (get_child_ids (NULL, 0) == n);
+
+    double start = bench_now ();
+    close (gate);
+    while (reaped < n)
+    {
+        ASSERT (poll (&pfd, 1, 10000) == 1);
+        reaped += handle_signals (sfd);
+        wakeups++;
+    }
+    double elapsed = bench_now () - start;
+
+    /* Nothing left to reap, no zombie and no record.  The reaper dropped
+     * the index's reference to each, leaving the one of its broker thread,
+     * which is us here. */
+    ASSERT (reaped == n);
+    ASSERT (waitpid (-1, NULL, WNOHANG) == -1 && errno == ECHILD);
+    ASSERT (count_zombies () == 0);
+    ASSERT (get_child_ids (NULL, 0) == 0);
+    for (i = 0; i < n; i++)
+    {
+        ASSERT (get_child_by_pid (pids[i]) == NULL);
+        ASSERT (records[i]->refs == 1);
+        free (records[i]);
+    }
+
+    printf ("signalfd + waitpid:    %5d reaped, %5d zombies left, "
+            "%d wakeups, %.1f ms, %.1f us per child\n", reaped,
+            count_zombies (), wakeups, elapsed * 1e3, elapsed * 1e6 / n);
+    fflush (stdout);
+    free (records);
+    free (pids);
+};
+
+/* Forks N children that exit as soon as *GATE, the write end of a pipe
+ * they all read, is closed */
+static pid_t*
+fork_children (int n, int* gate)
+{
+    pid_t* pids = malloc (n * sizeof *pids);
+    int fds[2];
+    int i;
+
+    ASSERT (pids != NULL);
+    ASSERT (pipe (fds) == 0);
+    for (i = 0; i < n; i++)
+    {
+        pids[i] = fork ();
+        ASSERT (pids[i] != -1);
+        if (pids[i] == 0)
+        {
+            char c;
+            close (fds[1]);
+            while (read (fds[0], &c, 1) == -1 && errno == EINTR)
+                ;
+            _exit (i % 256);
+        }
+    }
+    close (fds[0]);
+    *gate = fds[1];
+    return pids;
+};
+
+/* Our children that have exited and not been reaped */
+static int
+count_zombies ()
+{
+    DIR* proc = opendir ("/proc");
+    struct dirent* d;
+    int zombies = 0;
+
+    ASSERT (proc != NULL);
+    while ((d = readdir (proc)) != NULL)
+    {
+        char path[300], buf[512];
+        if (d->d_name[0] < '0' || d->d_name[0] > '9')
+            continue;
+        snprintf (path, sizeof path, "/proc/%s/stat", d->d_name);
+        FILE* f = fopen (path, "r");
+        if (f == NULL)
+            continue;
+        if (fgets (buf, sizeof buf, f) != NULL)
+        {
+            /* pid (comm) state ppid ..., where comm may hold anything */
+            char state;
+            int ppid;
+            char* p = strrchr (buf, ')');
+            if (p != NULL && sscanf (p + 1, " %c %d", &state, &ppid) == 2
+                    && state == 'Z' && ppid == getpid ())
+                zombies++;
+        }
+        fclose (f);
+    }
+    closedir (proc);
+    return zombies;
+};
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include "supervisor.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* Benchmark for the worker supervisor.  First WORKERS healthy workers are
+ * stopped one at a time, half of them cleanly and half killed, timing how
+ * long it takes from the signal until the group is full again.  Then a
+ * script that dies as soon as it starts is left to the supervisor for
+ * LOOP_MS, under a policy without backoff or breaker, the default one and a
+ * short one, counting the forks and the CPU they cost.  Last a crashing
+ * script is fixed while the breaker is open, to check that the probe closes
+ * it and the group fills up again. */
+
+#define WORKERS         4
+#define RESPAWNS        200
+#define LOOP_MS         2000
+
+/* What the workers started from now on do */
+static enum { HEALTHY, CRASHING } mode;
+
+static pid_t spawn_worker (struct worker_group* g);
+static void quit (int sig);
+static void respawn_latency ();
+static void crash_loop (const char* name, const struct worker_policy* policy,
+        struct worker_stats* stats);
+static void recovery ();
+static void drive (uint64_t ms);
+static void stop_workers (struct worker_group* g);
+static double cpu_ms ();
+
+int
+main (int argc, char** argv)
+{
+    struct worker_policy none = { 1000, 0, 0, 0, 0, 0 };
+    struct worker_policy defaults = WORKER_DEFAULT_POLICY;
+    struct worker_policy fast = { 100, 10, 200, 5, 1000, 300 };
+    struct worker_stats s;
+
+    /* Workers inherit this, so they exit cleanly when told to */
+    signal (SIGTERM, &quit);
+
+    respawn_latency ();
+
+    printf ("a script that crashes at once, for %d ms\n", LOOP_MS);
+    printf ("%-10s %8s %8s %8s %8s\n", "policy", "forks", "forks/s",
+            "trips", "cpu ms");
+    crash_loop ("none", &none, &s);
+    ASSERT (s.trips == 0 && s.breaker == BREAKER_CLOSED);
+    crash_loop ("default", &defaults, &s);
+    ASSERT (s.trips == 1 && s.breaker == BREAKER_OPEN);
+    ASSERT (s.spawns < 4 * defaults.breaker_crashes);
+    crash_loop ("short", &fast, &s);
+    ASSERT (s.trips >= 2);
+
+    recovery ();
+    return 0;
+};
+
+static pid_t
+spawn_worker (struct worker_group* g)
+{
+    pid_t pid = fork ();
+
+    if (pid == 0)
+    {
+        if (mode == CRASHING)
+            _exit (1);
+        for (;;)
+            pause ();
+    }
+    return pid;
+};
+
+static void
+quit (int sig)
+{
+    _exit (0);
+};
+
+/* From stopping a worker until its replacement is running */
+static void
+respawn_latency ()
+{
+    struct worker_policy policy = WORKER_DEFAULT_POLICY;
+    struct worker_stats s;
+    double total = 0;
+    int status;
+    int i;
+
+    /* Every stop is after a good run, and the kills are not a crash loop */
+    policy.min_uptime = 0;
+    policy.breaker_crashes = 0;
+    init_supervisor (&spawn_worker);
+    mode = HEALTHY;
+    struct worker_group* g = supervise ("healthy", WORKERS, &policy, NULL);
+    ASSERT (g != NULL);
+    ASSERT (supervisor_run (supervisor_clock ()) == -1);
+
+    for (i = 0; i < RESPAWNS; i++)
+    {
+        pid_t pid = g->slots[i % WORKERS].pid;
+        double start = bench_now ();
+
+        ASSERT (kill (pid, i % 2 ? SIGKILL : SIGTERM) == 0);
+        ASSERT (waitpid (pid, &status, 0) == pid);
+        ASSERT (supervisor_exited (pid, status, supervisor_clock ()));
+
+        /* A crash after a good run is replaced at once, like an exit */
+        ASSERT (supervisor_run (supervisor_clock ()) == -1);
+        total += bench_now () - start;
+        supervisor_get_stats (g, &s);
+        ASSERT (s.running == WORKERS);
+    }
+
+    supervisor_get_stats (g, &s);
+    ASSERT (s.spawns == WORKERS + RESPAWNS && s.exits == RESPAWNS);
+    ASSERT (s.crashes == RESPAWNS / 2 && s.last_exit == -SIGKILL);
+    printf ("respawn latency: %.1f us, over %d exits and kills\n",
+            total * 1e6 / RESPAWNS, RESPAWNS);
+    stop_workers (g);
+};
+
+static void
+crash_loop (const char* name, const struct worker_policy* policy,
+        struct worker_stats* s)
+{
+    init_supervisor (&spawn_worker);
+    mode = CRASHING;
+    struct worker_group* g = supervise ("crashing", WORKERS, policy, NULL);
+    ASSERT (g != NULL);
+
+    double cpu = cpu_ms ();
+    drive (LOOP_MS);
+    stop_workers (g);
+    cpu = cpu_ms () - cpu;
+
+    supervisor_get_stats (g, s);
+    ASSERT (s->exits == s->spawns && s->crashes == s->exits);
+    ASSERT (s->last_exit == 1 && s->running == 0);
+    printf ("%-10s %8llu %8.0f %8llu %8.1f\n", name,
+            (unsigned long long) s->spawns, s->spawns * 1000.0 / LOOP_MS,
+            (unsigned long long) s->trips, cpu);
+    fflush (stdout);
+};
+
+/* The script is fixed while the breaker is open */
+static void
+recovery ()
+{
+    struct worker_policy policy = { 50, 10, 100, 3, 1000, 100 };
+    struct worker_stats s;
+    int i;
+
+    init_supervisor (&spawn_worker);
+    mode = CRASHING;
+    struct worker_group* g = supervise ("fixed", WORKERS, &policy, NULL);
+    ASSERT (g != NULL);
+    for (i = 0; i < 100 && g->stats.breaker != BREAKER_OPEN; i++)
+        drive (10);
+    ASSERT (g->stats.breaker == BREAKER_OPEN);
+
+    mode = HEALTHY;
+    drive (policy.breaker_cooldown + policy.min_uptime + 100);
+    supervisor_get_stats (g, &s);
+    ASSERT (s.breaker == BREAKER_CLOSED && s.trips == 1);
+    ASSERT (s.running == WORKERS);
+    printf ("fixed while the breaker was open: %d of %d workers back\n",
+            s.running, WORKERS);
+    stop_workers (g);
+};
+
+/* The main loop of the server for MS, reaping as the signal handler does */
+static void
+drive (uint64_t ms)
+{
+    uint64_t end = supervisor_clock () + ms;
+    uint64_t t;
+
+    while ((t = supervisor_clock ()) < end)
+    {
+        int timeout = supervisor_run (t);
+        int status;
+        pid_t pid;
+        bool reaped = false;
+
+        while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+        {
+            ASSERT (supervisor_exited (pid, status, supervisor_clock ()));
+            reaped = true;
+        }
+        if (!reaped && timeout != 0)
+        {
+            struct timespec tick = { 0, 1000000 };
+            nanosleep (&tick, NULL);
+        }
+    }
+};
+
+static void
+stop_workers (struct worker_group* g)
+{
+    int status;
+    int i;
+
+    supervisor_stop ();
+    for (i = 0; i < g->target; i++)
+    {
+        pid_t pid = g->slots[i].pid;
+        if (pid == 0)
+            continue;
+        kill (pid, SIGTERM);
+        ASSERT (waitpid (pid, &status, 0) == pid);
+        supervisor_exited (pid, status, supervisor_clock ());
+    }
+    while (waitpid (-1, &status, 0) > 0)
+        ;
+};
+
+/* CPU used by us and our reaped children */
+static double
+cpu_ms ()
+{
+    struct rusage self, children;
+
+    getrusage (RUSAGE_SELF, &self);
+    getrusage (RUSAGE_CHILDREN, &children);
+    return (self.ru_utime.tv_sec + self.ru_stime.tv_sec
+            + children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1e3
+        + (self.ru_utime.tv_usec + self.ru_stime.tv_usec
+            + children.ru_utime.tv_usec + children.ru_stime.tv_usec) / 1e3;
+};
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include "sync.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Contention benchmark for the shared reader-writer lock.  NPROCS processes
+ * hammer one lock with a read-mostly mix (one write every WRITE_EVERY
+ * operations) and we compare against the same loop guarded by a plain
+ * process-shared pthread mutex.  The optional argument is the number of reads
+ * done inside each critical section, to model longer read sections. */
+
+#define ITERATIONS      1000000
+#define WRITE_EVERY     100
+
+struct shared
+{
+    pthread_mutex_t mutex;
+    volatile int go;
+    volatile long value;
+};
+
+static struct shared* shared;
+static int syncfd;
+static int lock;
+static int work = 1;
+
+static void run_rwlock (int slot);
+static void run_mutex ();
+static double run (int nprocs, bool use_rwlock);
+
+int
+main (int argc, char** argv)
+{
+    if (argc > 1)
+        work = atoi (argv[1]);
+
+    syncfd = init_sync_region ();
+    ASSERT (syncfd != -1);
+    lock = sync_create (SYNC_RWLOCK, "bench", 0);
+    ASSERT (lock != -1);
+
+    shared = mmap (NULL, sizeof *shared, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT (shared != MAP_FAILED);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init (&shared->mutex, &attr);
+
+    printf ("%d ops per process, 1 write per %d ops, %d reads per section\n",
+            ITERATIONS, WRITE_EVERY, work);
+    printf ("%6s %14s %14s\n", "procs", "rwlock ns/op", "mutex ns/op");
+
+    int nprocs;
+    for (nprocs = 1; nprocs <= 16; nprocs *= 2)
+    {
+        double rw = run (nprocs, true);
+        double mx = run (nprocs, false);
+        printf ("%6d %14.1f %14.1f\n", nprocs, rw, mx);
+        fflush (stdout);
+    }
+
+    return 0;
+};
+
+/* Returns the average wall-clock cost of one operation, in ns */
+static double
+run (int nprocs, bool use_rwlock)
+{
+    int i;
+    pid_t pids[nprocs];
+    int slots[nprocs];
+
+    shared->go = 0;
+    fflush (stdout);
+    for (i = 0; i < nprocs; i++)
+    {
+        slots[i] = sync_alloc_proc ();
+        ASSERT (slots[i] != -1);
+
+        pids[i] = fork ();
+        ASSERT (pids[i] != -1);
+        if (pids[i] == 0)
+        {
+            if (use_rwlock)
+                run_rwlock (slots[i]);
+            else
+                run_mutex ();
+            exit (EXIT_SUCCESS);
+        }
+        sync_set_proc (slots[i], pids[i]);
+    }
+
+    double start = bench_now ();
+    __atomic_store_n (&shared->go, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < nprocs; i++)
+    {
+        waitpid (pids[i], NULL, 0);
+        sync_release_pid (pids[i]);
+    }
+    double elapsed = bench_now () - start;
+
+    return elapsed * 1e9 / ((double) ITERATIONS * nprocs);
+};
+
+static void
+run_rwlock (int slot)
+{
+    ASSERT (sync_attach (syncfd, slot) == 0);
+    while (!__atomic_load_n (&shared->go, __ATOMIC_SEQ_CST))
+        ;
+
+    long sum = 0;
+    int i, j;
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        if (i % WRITE_EVERY == 0)
+        {
+            sync_wrlock (lock);
+            shared->value++;
+            sync_wrunlock (lock);
+        }
+        else
+        {
+            sync_rdlock (lock);
+            for (j = 0; j < work; j++)
+                sum += shared->value;
+            sync_rdunlock (lock);
+        }
+    }
+};
+
+static void
+run_mutex ()
+{
+    while (!__atomic_load_n (&shared->go, __ATOMIC_SEQ_CST))
+        ;
+
+    long sum = 0;
+    int i, j;
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        pthread_mutex_lock (&shared->mutex);
+        if (i % WRITE_EVERY == 0)
+            shared->value++;
+        else
+            for (j = 0; j < work; j++)
+                sum += shared->value;
+        pthread_mutex_unlock (&shared->mutex);
+    }
+};
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include "timer.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark of the timer wheel against a binary heap of deadlines, with
+ * each entry's place kept so it can be cancelled without waiting for it to
+ * come up.  N timeouts are armed up to SPAN ms ahead, as for idle
+ * connections and calls, each is then pushed back once as activity would,
+ * half are cancelled as most timeouts are, and the rest are run out.  Time
+ * only moves on to the next expiry the wheel reports, as a poll timeout
+ * would, and every timer must expire on its own tick.  Both must expire the
+ * same timers at the same ticks. */
+
+#define SPAN            30000
+#define START           1000000     // any time will do; not zero
+
+struct heap_timer
+{
+    uint64_t expires;
+    size_t pos;                 // in the heap, or -1
+};
+
+static struct heap_timer* htimers;
+static uint32* heap;
+static size_t heap_len;
+
+static struct timer* timers;
+static uint64_t expired_sum;
+static size_t expired_n;
+
+static void run (size_t n);
+static void on_expire (struct timer_wheel* w, struct timer* t, void* aux);
+static void heap_arm (uint32 id, uint64_t expires);
+static void heap_cancel (uint32 id);
+static void heap_up (size_t i);
+static void heap_down (size_t i);
+static void heap_set (size_t i, uint32 id);
+static uint64_t rnd ();
+
+int
+main (int argc, char** argv)
+{
+    size_t n;
+
+    printf ("%9s %6s %10s %10s %10s %10s %10s\n", "timers", "", "arm ns",
+            "rearm ns", "cancel ns", "expire ns", "wakeups");
+    for (n = 10000; n <= 1000000; n *= 10)
+        run (n);
+    return 0;
+};
+
+static void
+run (size_t n)
+{
+    static struct timer_wheel w;
+    uint64_t* first = malloc (n * sizeof *first);
+    uint64_t* second = malloc (n * sizeof *second);
+    size_t i;
+
+    timers = malloc (n * sizeof *timers);
+    htimers = malloc (n * sizeof *htimers);
+    heap = malloc (n * sizeof *heap);
+    ASSERT (first && second && timers && htimers && heap);
+    for (i = 0; i < n; i++)
+    {
+        first[i] = START + 1 + rnd () % SPAN;
+        second[i] = first[i] + rnd () % SPAN;
+    }
+
+    /* The wheel */
+    timer_wheel_init (&w, START);
+    double t0 = bench_now ();
+    for (i = 0; i < n; i++)
+    {
+        timer_init (&timers[i], &on_expire, NULL);
+        timer_arm (&w, &timers[i], first[i]);
+    }
+    double t1 = bench_now ();
+    for (i = 0; i < n; i++)
+        timer_arm (&w, &timers[i], second[i]);
+    double t2 = bench_now ();
+    for (i = 0; i < n; i += 2)
+        timer_cancel (&w, &timers[i]);
+    double t3 = bench_now ();
+    ASSERT (w.armed == n / 2);
+
+    expired_sum = 0;
+    expired_n = 0;
+    uint64_t clock = START;
+    size_t wakeups = 0;
+    int wait;
+    while ((wait = timer_next (&w, clock)) != -1)
+    {
+        clock += wait;
+        timer_advance (&w, clock);
+        wakeups++;
+    }
+    double t4 = bench_now ();
+    ASSERT (expired_n == n / 2 && w.armed == 0);
+    uint64_t wheel_sum = expired_sum;
+
+    printf ("%9zu %6s %10.1f %10.1f %10.1f %10.1f %10zu\n", n, "wheel",
+            (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n,
+            (t3 - t2) * 1e9 / (n / 2), (t4 - t3) * 1e9 / (n / 2), wakeups);
+
+    /* The heap, taking the same steps */
+    heap_len = 0;
+    t0 = bench_now ();
+    for (i = 0; i < n; i++)
+        heap_arm (i, first[i]);
+    t1 = bench_now ();
+    for (i = 0; i < n; i++)
+    {
+        heap_cancel (i);
+        heap_arm (i, second[i]);
+    }
+    t2 = bench_now ();
+    for (i = 0; i < n; i += 2)
+        heap_cancel (i);
+    t3 = bench_now ();
+
+    expired_sum = 0;
+    expired_n = 0;
+    wakeups = 0;
+    while (heap_len > 0)
+    {
+        uint64_t at = htimers[heap[0]].expires;
+        while (heap_len > 0 && htimers[heap[0]].expires <= at)
+        {
+            uint32 id = heap[0];
+            heap_cancel (id);
+            expired_sum += id * at;
+            expired_n++;
+        }
+        wakeups++;
+    }
+    t4 = bench_now ();
+    ASSERT (expired_n == n / 2 && expired_sum == wheel_sum);
+
+    printf ("%9zu %6s %10.1f %10.1f %10.1f %10.1f %10zu\n", n, "heap",
+            (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n,
+            (t3 - t2) * 1e9 / (n / 2), (t4 - t3) * 1e9 / (n / 2), wakeups);
+    fflush (stdout);
+
+    free (first);
+    free (second);
+    free (timers);
+    free (htimers);
+    free (heap);
+};
+
+/* Expired on its own tick, which the wheel has just moved past */
+static void
+on_expire (struct timer_wheel* w, struct timer* t, void* aux)
+{
+    ASSERT (!timer_armed (t));
+    ASSERT (t->expires == w->now - 1);
+    expired_sum += (uint64_t) (t - timers) * t->expires;
+    expired_n++;
+};
+
+static void
+heap_arm (uint32 id, uint64_t expires)
+{
+    htimers[id].expires = expires;
+    heap_set (heap_len++, id);
+    heap_up (heap_len - 1);
+};
+
+static void
+heap_cancel (uint32 id)
+{
+    size_t i = htimers[id].pos;
+    if (i == (size_t) -1)
+        return;
+
+    htimers[id].pos = -1;
+    if (i == --heap_len)
+        return;
+    heap_set (i, heap[heap_len]);
+    heap_up (i);
+    heap_down (htimers[heap[i]].pos);
+};
+
+static void
+heap_up (size_t i)
+{
+    uint32 id = heap[i];
+    uint64_t e = htimers[id].expires;
+
+    while (i > 0 && htimers[heap[(i - 1) / 2]].expires > e)
+    {
+        heap_set (i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set (i, id);
+};
+
+static void
+heap_down (size_t i)
+{
+    uint32 id = heap[i];
+    uint64_t e = htimers[id].expires;
+
+    while (true)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= heap_len)
+            break;
+        if (c + 1 < heap_len
+                && htimers[heap[c + 1]].expires < htimers[heap[c]].expires)
+            c++;
+        if (htimers[heap[c]].expires >= e)
+            break;
+        heap_set (i, heap[c]);
+        i = c;
+    }
+    heap_set (i, id);
+};
+
+static void
+heap_set (size_t i, uint32 id)
+{
+    heap[i] = id;
+    htimers[id].pos = i;
+};
+
+/* xorshift; the same numbers every run */
+static uint64_t
+rnd ()
+{
+    static uint64_t x = 88172645463325252ULL;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+};
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Benchmark for connection tracing.  THREADS threads each record SPANS
+ * spans, as broker threads do for the commands of their connection.  We
+ * time what a span costs the caller, counting the writes of full buffers
+ * it makes along the way, what a call for a connection that is not sampled
+ * costs, and read the trace back to check that it is one JSON array with
+ * every span in it.  The trace goes to a file under /tmp that is removed at
+ * the end. */
+
+#define SPANS           100000
+
+static char path[64];
+static double thread_ns[64];
+
+static void run (int nthreads);
+static void* trace_thread (void* aux);
+static void check_trace (int nthreads);
+
+int
+main (int argc, char** argv)
+{
+    int nthreads, i;
+
+    snprintf (path, sizeof path, "/tmp/bench_trace.%d", (int) getpid ());
+
+    /* Sampling */
+    ASSERT (init_tracing (path, 4) == 0);
+    int sampled = 0;
+    for (i = 0; i < 1000; i++)
+        sampled += trace_connection () != 0;
+    ASSERT (sampled == 250);
+    set_trace_sampling (0);
+    ASSERT (trace_connection () == 0);
+    end_tracing ();
+
+    double start = bench_now ();
+    uint64_t sum = 0;
+    for (i = 0; i < SPANS; i++)
+        sum += trace_now ();
+    printf ("trace_now %.1f ns\n", (bench_now () - start) * 1e9 / SPANS);
+
+    start = bench_now ();
+    for (i = 0; i < SPANS; i++)
+        trace_span (0, "SEND_B", sum, sum + i, "result", 0);
+    printf ("span of a connection not sampled %.1f ns\n",
+            (bench_now () - start) * 1e9 / SPANS);
+
+    printf ("%d spans per thread\n", SPANS);
+    printf ("%8s %12s %14s\n", "threads", "ns/span", "spans/s");
+    for (nthreads = 1; nthreads <= 8; nthreads *= 2)
+        run (nthreads);
+
+    unlink (path);
+    return 0;
+};
+
+static void
+run (int nthreads)
+{
+    pthread_t threads[64];
+    long ids[64];
+    int i;
+
+    ASSERT (init_tracing (path, 1) == 0);
+    double start = bench_now ();
+    for (i = 0; i < nthreads; i++)
+    {
+        ids[i] = i;
+        pthread_create (&threads[i], NULL, &trace_thread, &ids[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+    end_tracing ();
+    double elapsed = bench_now () - start;
+
+    check_trace (nthreads);
+
+    double ns = 0;
+    for (i = 0; i < nthreads; i++)
+        ns += thread_ns[i] / nthreads;
+    printf ("%8d %12.1f %14.0f\n", nthreads, ns, nthreads * SPANS / elapsed);
+    fflush (stdout);
+};
+
+/* Spans of connection ID + 1, each 1 us after the last and I % 1000 ns
+ * long, so the reader can check them */
+static void*
+trace_thread (void* aux)
+{
+    long id = *(long*) aux;
+    uint64_t base = 1000000000;
+    int i;
+
+    double start = bench_now ();
+    for (i = 0; i < SPANS; i++)
+    {
+        uint64_t t = base + (uint64_t) i * 1000;
+        trace_span (id + 1, "SEND_B", t, t + i % 1000, "result", i);
+    }
+    thread_ns[id] = (bench_now () - start) * 1e9 / SPANS;
+    return NULL;
+};
+
+static void
+check_trace (int nthreads)
+{
+    FILE* f = fopen (path, "r");
+    unsigned long spans[64] = { 0 };
+    char line[512], last[512] = "";
+    int i;
+
+    ASSERT (f != NULL);
+    ASSERT (fgets (line, sizeof line, f) != NULL && strcmp (line, "[\n") == 0);
+    while (fgets (line, sizeof line, f) != NULL)
+    {
+        unsigned tid, tsfrac, durfrac;
+        unsigned long long ts, dur;
+        long result;
+
+        strcpy (last, line);
+        if (strncmp (line, "{\"name\":\"SEND_B\"", 16) != 0)
+            continue;
+        ASSERT (sscanf (line, "{\"name\":\"SEND_B\",\"cat\":\"connection\","
+                    "\"ph\":\"X\",\"pid\":%*d,\"tid\":%u,\"ts\":%llu.%u,"
+                    "\"dur\":%llu.%u,\"args\":{\"result\":%ld}},", &tid, &ts,
+                    &tsfrac, &dur, &durfrac, &result) == 6);
+        ASSERT (tid >= 1 && tid <= (unsigned) nthreads);
+        ASSERT (ts == 1000000 + (unsigned long long) result && tsfrac == 0);
+        ASSERT (dur == 0 && durfrac == result % 1000);
+        spans[tid - 1]++;
+    }
+    fclose (f);
+
+    ASSERT (strcmp (last, "]\n") == 0);
+    for (i = 0; i < nthreads; i++)
+        ASSERT (spans[i] == SPANS);
+};
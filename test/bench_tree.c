@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include "avl.h"
+#include "bst.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark for the two ways of keeping elements in bst and avl trees: the
+ * external form, where the tree allocates a node from its pool that points
+ * at the element, and the intrusive form, where the node is embedded in the
+ * element.  Keys are inserted in random order, looked up, and deleted in
+ * another random order.  In between, a full in-order pass is timed three
+ * ways: a malloc'd iterator, a stack iterator and a walk with a callback, and
+ * a range scan copies a tenth of the keys out. */
+
+#define ELEMENTS    200000
+
+struct element
+{
+    int key;
+    struct avl_node anode;
+    struct bst_node bnode;
+};
+
+static struct element* elements;
+static int* order;
+static int* order2;
+
+static int compare (const void* a, const void* b, const void* AUX);
+static void run_avl (bool intrusive);
+static void run_bst (bool intrusive);
+static void report (const char* name, double t0, double t1, double t2,
+        double t3);
+static void traverse_avl (struct avl_tree* tree);
+static bool count_visit (void* data, void* aux);
+
+int
+main (int argc, char** argv)
+{
+    int i;
+
+    elements = malloc (ELEMENTS * sizeof *elements);
+    order = malloc (ELEMENTS * sizeof (int));
+    order2 = malloc (ELEMENTS * sizeof (int));
+    for (i = 0; i < ELEMENTS; i++)
+    {
+        elements[i].key = i;
+        order[i] = order2[i] = i;
+    }
+    srand (1);
+    bench_shuffle (order, ELEMENTS);
+    bench_shuffle (order2, ELEMENTS);
+
+    printf ("%d elements, random order\n", ELEMENTS);
+    printf ("%16s %10s %10s %10s\n", "", "insert ns", "find ns", "delete ns");
+    run_avl (false);
+    run_avl (true);
+    run_bst (false);
+    run_bst (true);
+
+    struct avl_tree tree;
+    avl_init (&tree, &compare);
+    for (i = 0; i < ELEMENTS; i++)
+        avl_insert (&tree, &elements[order[i]]);
+    printf ("\n%16s %10s\n", "", "ns/elem");
+    traverse_avl (&tree);
+    avl_destroy (&tree);
+
+    free (elements);
+    free (order);
+    free (order2);
+    return 0;
+};
+
+static void
+run_avl (bool intrusive)
+{
+    struct avl_tree tree;
+    double t0, t1, t2, t3;
+    int i;
+
+    if (intrusive)  avl_init_intrusive (&tree, &compare);
+    else            avl_init (&tree, &compare);
+
+    t0 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+    {
+        struct element* e = &elements[order[i]];
+        if (intrusive)  avl_insert_node (&tree, &e->anode, e);
+        else            avl_insert (&tree, e);
+    }
+    t1 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        ASSERT (avl_find (&tree, &elements[order2[i]]) == &elements[order2[i]]);
+    t2 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+    {
+        struct element* e = &elements[order2[i]];
+        if (intrusive)  avl_remove_node (&tree, &e->anode);
+        else            avl_delete (&tree, e);
+    }
+    t3 = bench_now ();
+
+    ASSERT (tree.root == NULL);
+    avl_destroy (&tree);
+    report (intrusive ? "avl intrusive" : "avl pooled", t0, t1, t2, t3);
+};
+
+static void
+run_bst (bool intrusive)
+{
+    struct bst_tree tree;
+    double t0, t1, t2, t3;
+    int i;
+
+    if (intrusive)  bst_init_intrusive (&tree, &compare);
+    else            bst_init (&tree, &compare);
+
+    t0 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+    {
+        struct element* e = &elements[order[i]];
+        if (intrusive)  bst_insert_node (&tree, &e->bnode, e);
+        else            bst_insert (&tree, e);
+    }
+    t1 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+        ASSERT (bst_find (&tree, &elements[order2[i]]) == &elements[order2[i]]);
+    t2 = bench_now ();
+    for (i = 0; i < ELEMENTS; i++)
+    {
+        struct element* e = &elements[order2[i]];
+        if (intrusive)  bst_remove_node (&tree, &e->bnode);
+        else            bst_delete (&tree, e);
+    }
+    t3 = bench_now ();
+
+    ASSERT (tree.root == NULL);
+    bst_destroy (&tree);
+    report (intrusive ? "bst intrusive" : "bst pooled", t0, t1, t2, t3);
+};
+
+static void
+traverse_avl (struct avl_tree* tree)
+{
+    void** out = malloc (ELEMENTS / 10 * sizeof (void*));
+    double t0, t1, t2, t3, t4;
+    size_t n;
+
+    t0 = bench_now ();
+    struct avl_iterator* heap = avl_get_iterator (tree);
+    for (n = 0; avl_get (heap) != NULL; avl_next (heap))
+        n++;
+    free (heap);
+    ASSERT (n == ELEMENTS);
+    t1 = bench_now ();
+
+    struct avl_iterator it;
+    avl_iter_first (tree, &it);
+    for (n = 0; avl_get (&it) != NULL; avl_next (&it))
+        n++;
+    ASSERT (n == ELEMENTS);
+    t2 = bench_now ();
+
+    n = 0;
+    ASSERT (avl_walk (tree, &count_visit, &n) == ELEMENTS && n == ELEMENTS);
+    t3 = bench_now ();
+
+    struct element lo = { .key = ELEMENTS / 2 };
+    struct element hi = { .key = ELEMENTS / 2 + ELEMENTS / 10 - 1 };
+    n = avl_range (tree, &lo, &hi, out, ELEMENTS / 10);
+    ASSERT (n == ELEMENTS / 10 && out[0] == &elements[ELEMENTS / 2]);
+    t4 = bench_now ();
+
+    printf ("%16s %10.2f\n", "heap iterator", (t1 - t0) * 1e9 / ELEMENTS);
+    printf ("%16s %10.2f\n", "stack iterator", (t2 - t1) * 1e9 / ELEMENTS);
+    printf ("%16s %10.2f\n", "walk", (t3 - t2) * 1e9 / ELEMENTS);
+    printf ("%16s %10.2f\n", "range", (t4 - t3) * 1e9 / (ELEMENTS / 10));
+    free (out);
+};
+
+static bool
+count_visit (void* data, void* aux)
+{
+    (*(size_t*) aux)++;
+    return true;
+};
+
+static void
+report (const char* name, double t0, double t1, double t2, double t3)
+{
+    printf ("%16s %10.1f %10.1f %10.1f\n", name, (t1 - t0) * 1e9 / ELEMENTS,
+            (t2 - t1) * 1e9 / ELEMENTS, (t3 - t2) * 1e9 / ELEMENTS);
+};
+
+static int
+compare (const void* a, const void* b, const void* AUX)
+{
+    return ((const struct element*) a)->key - ((const struct element*) b)->key;
+};
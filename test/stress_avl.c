@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include "avl.h"
+#include "bst.h"
+#include "debug.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Randomized stress test for the AVL tree.  A long run of random inserts,
+ * deletes and finds is checked against a plain array saying which keys are
+ * in the tree, with avl_check run after every operation, and the iterators,
+ * walks and range scans are checked against the array too.  Then we time the AVL next to the BST.
+ * The BST only gets random keys, since increasing keys turn it into a
+ * list. */
+
+#define KEYS        2048
+#define OPS         200000
+#define BENCH_N     200000
+
+static int keys[BENCH_N];
+
+static int compare (const void* a, const void* b, const void* AUX);
+static void check_against (struct avl_tree* tree, const bool* present);
+static void check_range (struct avl_tree* tree, const bool* present);
+static bool check_visit (void* data, void* aux);
+
+int
+main (int argc, char** argv)
+{
+    struct avl_tree tree;
+    bool present[KEYS];
+    int i;
+
+    unsigned seed = argc > 1 ? atoi (argv[1]) : (unsigned) time (NULL);
+    srand (seed);
+    printf ("seed %u\n", seed);
+
+    for (i = 0; i < BENCH_N; i++)
+        keys[i] = i;
+
+    /* Random operations against the reference */
+    avl_init (&tree, &compare);
+    memset (present, 0, sizeof present);
+    for (i = 0; i < OPS; i++)
+    {
+        int* k = &keys[rand () % KEYS];
+        switch (rand () % 3)
+        {
+        case 0:
+            ASSERT (avl_insert (&tree, k) == !present[*k]);
+            present[*k] = true;
+            break;
+        case 1:
+            ASSERT (avl_delete (&tree, k) == (present[*k] ? k : NULL));
+            present[*k] = false;
+            break;
+        default:
+            ASSERT (avl_find (&tree, k) == (present[*k] ? k : NULL));
+            break;
+        }
+        ASSERT (avl_check (&tree, NULL));
+        if (i % 1000 == 0)
+            check_against (&tree, present);
+    }
+    check_against (&tree, present);
+
+    /* Removing through an iterator, every other element */
+    struct avl_iterator it;
+    int n = 0;
+    avl_iter_first (&tree, &it);
+    while (avl_get (&it) != NULL)
+    {
+        if (n++ % 2 == 0)
+        {
+            present[*(int*) avl_get (&it)] = false;
+            avl_itr_remove (&it);
+        }
+        else
+            avl_next (&it);
+        ASSERT (avl_check (&tree, NULL));
+    }
+    check_against (&tree, present);
+
+    /* Empty it in random order */
+    int order[KEYS];
+    memcpy (order, keys, sizeof order);
+    bench_shuffle (order, KEYS);
+    for (i = 0; i < KEYS; i++)
+    {
+        avl_delete (&tree, &keys[order[i]]);
+        ASSERT (avl_check (&tree, NULL));
+    }
+    ASSERT (tree.root == NULL);
+    ASSERT (!avl_iter_first (&tree, &it) && avl_get (&it) == NULL);
+    ASSERT (!avl_iter_last (&tree, &it) && avl_get (&it) == NULL);
+    ASSERT (avl_walk (&tree, &check_visit, &n) == 0);
+    ASSERT (avl_range (&tree, NULL, NULL, NULL, 0) == 0);
+    printf ("%d random operations on %d keys: ok\n", OPS, KEYS);
+
+    /* Throughput */
+    int* order_n = malloc (BENCH_N * sizeof (int));
+    memcpy (order_n, keys, BENCH_N * sizeof (int));
+    bench_shuffle (order_n, BENCH_N);
+
+    printf ("%d elements\n", BENCH_N);
+    printf ("%16s %10s %10s %10s\n", "", "insert ns", "find ns", "delete ns");
+
+    double t0, t1, t2, t3;
+    struct avl_tree avl;
+    avl_init (&avl, &compare);
+    t0 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        avl_insert (&avl, &keys[order_n[i]]);
+    t1 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        ASSERT (avl_find (&avl, &keys[i]) == &keys[i]);
+    t2 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        avl_delete (&avl, &keys[order_n[i]]);
+    t3 = bench_now ();
+    printf ("%16s %10.1f %10.1f %10.1f\n", "avl random",
+            (t1 - t0) * 1e9 / BENCH_N, (t2 - t1) * 1e9 / BENCH_N,
+            (t3 - t2) * 1e9 / BENCH_N);
+
+    t0 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        avl_insert (&avl, &keys[i]);
+    t1 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        ASSERT (avl_find (&avl, &keys[i]) == &keys[i]);
+    t2 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        avl_delete (&avl, &keys[i]);
+    t3 = bench_now ();
+    printf ("%16s %10.1f %10.1f %10.1f\n", "avl increasing",
+            (t1 - t0) * 1e9 / BENCH_N, (t2 - t1) * 1e9 / BENCH_N,
+            (t3 - t2) * 1e9 / BENCH_N);
+
+    struct bst_tree bst;
+    bst_init (&bst, &compare);
+    t0 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        bst_insert (&bst, &keys[order_n[i]]);
+    t1 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        ASSERT (bst_find (&bst, &keys[i]) == &keys[i]);
+    t2 = bench_now ();
+    for (i = 0; i < BENCH_N; i++)
+        ASSERT (bst_delete (&bst, &keys[order_n[i]]) == &keys[order_n[i]]);
+    t3 = bench_now ();
+    ASSERT (bst.root == NULL);
+    printf ("%16s %10.1f %10.1f %10.1f\n", "bst random",
+            (t1 - t0) * 1e9 / BENCH_N, (t2 - t1) * 1e9 / BENCH_N,
+            (t3 - t2) * 1e9 / BENCH_N);
+
+    avl_destroy (&avl);
+    bst_destroy (&bst);
+    free (order_n);
+    return 0;
+};
+
+static int
+compare (const void* a, const void* b, const void* AUX)
+{
+    return *(const int*) a - *(const int*) b;
+};
+
+/* The tree must hold exactly the keys marked in PRESENT, in order both
+ * ways */
+static void
+check_against (struct avl_tree* tree, const bool* present)
+{
+    size_t count, expected = 0;
+    int k, last = -1;
+
+    ASSERT (avl_check (tree, &count));
+    for (k = 0; k < KEYS; k++)
+        expected += present[k];
+    ASSERT (count == expected);
+
+    struct avl_iterator it;
+    avl_iter_first (tree, &it);
+    int* e = avl_get (&it);
+    for (k = 0; k < KEYS; k++)
+    {
+        if (!present[k])
+            continue;
+        ASSERT (e != NULL && *e == k && k > last);
+        last = k;
+        e = avl_next (&it);
+    }
+    ASSERT (e == NULL);
+
+    avl_iter_last (tree, &it);
+    e = avl_get (&it);
+    for (k = KEYS - 1; k >= 0; k--)
+    {
+        if (!present[k])
+            continue;
+        ASSERT (e != NULL && *e == k);
+        e = avl_prev (&it);
+    }
+    ASSERT (e == NULL);
+
+    last = -1;
+    ASSERT (avl_walk (tree, &check_visit, &last) == count);
+    check_range (tree, present);
+};
+
+/* A range between two random bounds, either of which may be missing, must
+ * hold the keys marked between them */
+static void
+check_range (struct avl_tree* tree, const bool* present)
+{
+    int* out[KEYS];
+    int lo = rand () % KEYS, hi = rand () % KEYS;
+    bool open_lo = rand () % 8 == 0, open_hi = rand () % 8 == 0;
+    size_t max = rand () % KEYS;
+    int k;
+
+    size_t n = avl_range (tree, open_lo ? NULL : &lo, open_hi ? NULL : &hi,
+            (void**) out, max);
+    size_t expected = 0;
+    for (k = open_lo ? 0 : lo; k <= (open_hi ? KEYS - 1 : hi); k++)
+    {
+        if (!present[k])
+            continue;
+        if (expected < max)
+            ASSERT (*out[expected] == k);
+        expected++;
+    }
+    ASSERT (n == expected);
+};
+
+/* Elements must come in increasing order; AUX holds the last one seen */
+static bool
+check_visit (void* data, void* aux)
+{
+    int* last = aux;
+    ASSERT (*(int*) data > *last);
+    *last = *(int*) data;
+    return true;
+};
@@ -1,85 +1,626 @@
+#define _GNU_SOURCE
+
 #include "bst.h"
+#include "avl.h"
+#include "bptree.h"
+#include "slab.h"
+#include "hash.h"
 #include "debug.h"
+#include "bench.h"
+
+#define BPT_GEN_NAME    intmap
+#define BPT_GEN_KEY     int
+#define BPT_GEN_VALUE   void*
+#include "bptree_gen.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
 
-static int compare (const void* a, const void* b, const void* AUX);
-static void dump (const void* a);
+/* Benchmark harness for the containers in src/.  Every container is filled
+ * with N records keyed by an int, for N from 1K up to a maximum given on
+ * the command line (1M by default, at most 10M), and is put through four
+ * phases: inserting every key, finding N keys, a mix of 80% finds, 10%
+ * deletes and 10% inserts, and deleting every key.  Keys come in one of
+ * three orders: sequential, uniformly random, or for finds and the mix
+ * Zipfian, where a few keys get most of the traffic.  For each phase we
+ * report ns/op and allocations/op.  Memory is reported twice: the heap
+ * bytes each element cost once all were inserted, counted exactly by our
+ * malloc below, and the process's resident size at that point.  Results go
+ * to stdout as CSV; progress goes to stderr. */
+
+#define MIN_ELEMENTS    1000
+#define MAX_ELEMENTS    10000000
+#define DEFAULT_MAX     1000000
+
+/* The bst degenerates into a list under sequential keys */
+#define BST_SEQ_MAX     10000
+
+/* Skew of the Zipfian distribution, as in YCSB */
+#define ZIPF_THETA      0.99
+
+struct record
+{
+    int key;
+    struct hash_link link;
+};
 
-/* Emulate main.c's variable RUN here.  We can now run tests on this 
+/* One container under test.  Keys are 0 to N - 1. */
+struct container
+{
+    const char* name;
+    void* (*create) (int n);
+    bool (*insert) (void* c, struct record* r);
+    struct record* (*find) (void* c, int key);
+    bool (*remove) (void* c, int key);
+    void (*destroy) (void* c);
+};
+
+enum distribution
+{
+    DIST_SEQ,
+    DIST_RANDOM,
+    DIST_ZIPF,
+    NUM_DISTS
+};
+
+static const char* dist_names[NUM_DISTS] = { "sequential", "random", "zipf" };
+
+/* Emulate main.c's variable RUN here.  We can now run tests on this
  * variable */
 int run = 1;
 
-int 
+/* Allocations made since the start, and heap bytes in use, counted by our
+ * malloc below */
+static long allocations;
+static long heap_bytes;
+
+static struct record* records;
+static int* order;
+static int* probes;
+static bool* present;
+
+static void run_one (const struct container* c, enum distribution d, int n);
+static void make_keys (enum distribution d, int n, int* out, bool zipf);
+static void zipf_keys (int n, int* out, int count);
+static long resident_bytes ();
+
+static void* bst_create (int n);
+static bool bst_put (void* c, struct record* r);
+static struct record* bst_get_key (void* c, int key);
+static bool bst_del (void* c, int key);
+static void bst_free (void* c);
+static void* avl_create (int n);
+static bool avl_put (void* c, struct record* r);
+static struct record* avl_get_key (void* c, int key);
+static bool avl_del (void* c, int key);
+static void avl_free (void* c);
+static void* bpt_create (int n);
+static bool bpt_put (void* c, struct record* r);
+static struct record* bpt_get_key (void* c, int key);
+static bool bpt_del (void* c, int key);
+static void bpt_free (void* c);
+static void* intmap_create (int n);
+static bool intmap_put (void* c, struct record* r);
+static struct record* intmap_get_key (void* c, int key);
+static bool intmap_del (void* c, int key);
+static void intmap_free (void* c);
+static void* slab_create (int n);
+static bool slab_put (void* c, struct record* r);
+static struct record* slab_get_key (void* c, int key);
+static bool slab_del (void* c, int key);
+static void slab_free (void* c);
+static void* hash_create (int n);
+static bool hash_put (void* c, struct record* r);
+static struct record* hash_get_key (void* c, int key);
+static bool hash_del (void* c, int key);
+static void hash_free (void* c);
+static int compare (const void* a, const void* b, const void* AUX);
+
+static const struct container containers[] =
+{
+    { "bst", bst_create, bst_put, bst_get_key, bst_del, bst_free },
+    { "avl", avl_create, avl_put, avl_get_key, avl_del, avl_free },
+    { "bptree", bpt_create, bpt_put, bpt_get_key, bpt_del, bpt_free },
+    { "bptree_gen", intmap_create, intmap_put, intmap_get_key, intmap_del,
+        intmap_free },
+    { "slab", slab_create, slab_put, slab_get_key, slab_del, slab_free },
+    { "hash", hash_create, hash_put, hash_get_key, hash_del, hash_free },
+};
+
+#define NUM_CONTAINERS  (sizeof containers / sizeof containers[0])
+
+int
 main (int argc, char** argv)
 {
-    struct bst_tree a;
-    bst_init (&a, &compare);
+    int max = argc > 1 ? atoi (argv[1]) : DEFAULT_MAX;
+    int n, i;
+    unsigned c;
+    enum distribution d;
+
+    if (max < MIN_ELEMENTS)
+        max = MIN_ELEMENTS;
+    if (max > MAX_ELEMENTS)
+        max = MAX_ELEMENTS;
+
+    records = malloc (max * sizeof *records);
+    order = malloc (max * sizeof (int));
+    probes = malloc (max * sizeof (int));
+    present = malloc (max * sizeof (bool));
+    ASSERT (records && order && probes && present);
+    for (i = 0; i < max; i++)
+        records[i].key = i;
 
-    int t1 = 1;
-    int t2 = 2;
-    int t3 = 3;
-    int t4 = 4;
-    int t5 = 5;
-    int t6 = 6;
-    int t7 = 7;
-    int t8 = 8;
-    int t9 = 9;
-    int t0 = 0;
+    printf ("container,distribution,elements,phase,ns_per_op,allocs_per_op,"
+            "heap_bytes_per_element,rss_kb\n");
+    for (n = MIN_ELEMENTS; n <= max; n *= 10)
+        for (c = 0; c < NUM_CONTAINERS; c++)
+            for (d = 0; d < NUM_DISTS; d++)
+            {
+                if (!strcmp (containers[c].name, "bst") && d == DIST_SEQ
+                        && n > BST_SEQ_MAX)
+                {
+                    fprintf (stderr, "skipping bst, sequential, %d\n", n);
+                    continue;
+                }
+                /* Nor does the slab table hold more than it has slots */
+                if (!strcmp (containers[c].name, "slab")
+                        && n > SLAB_MAX_SLOTS)
+                {
+                    fprintf (stderr, "skipping slab, %s, %d: over %d slots\n",
+                            dist_names[d], n, SLAB_MAX_SLOTS);
+                    continue;
+                }
+                run_one (&containers[c], d, n);
+            }
 
-    bst_insert (&a, &t1);
+    free (records);
+    free (order);
+    free (probes);
+    free (present);
+    return 0;
+};
 
-    bst_dump (&a, &dump);
+static void
+run_one (const struct container* c, enum distribution d, int n)
+{
+    const char* phases[4] = { "insert", "find", "mix", "delete" };
+    double elapsed[4];
+    long allocs[4];
+    int ops[4] = { n, n, n, n };
+    int i;
 
-    bst_insert (&a, &t2);
+    fprintf (stderr, "%s, %s, %d\n", c->name, dist_names[d], n);
+    srand (n);
 
-    bst_dump (&a, &dump);
+    long heap = heap_bytes;
+    void* box = c->create (n);
+    memset (present, 0, n * sizeof (bool));
 
-    bst_insert (&a, &t3);
+    /* Insert */
+    make_keys (d, n, order, false);
+    long a = allocations;
+    double t = bench_now ();
+    for (i = 0; i < n; i++)
+        ASSERT (c->insert (box, &records[order[i]]));
+    elapsed[0] = bench_now () - t;
+    allocs[0] = allocations - a;
+    heap = heap_bytes - heap;
+    long rss = resident_bytes ();
+    for (i = 0; i < n; i++)
+        present[i] = true;
 
-    bst_dump (&a, &dump);
+    /* Find */
+    make_keys (d, n, probes, true);
+    a = allocations;
+    t = bench_now ();
+    for (i = 0; i < n; i++)
+        ASSERT (c->find (box, probes[i]) == &records[probes[i]]);
+    elapsed[1] = bench_now () - t;
+    allocs[1] = allocations - a;
 
-    bst_insert (&a, &t4);
+    /* Mix.  Keys for deletes and inserts come from the same distribution
+     * as finds, and we only try what can succeed, so every container does
+     * the same work. */
+    make_keys (d, n, probes, true);
+    a = allocations;
+    t = bench_now ();
+    for (i = 0; i < n; i++)
+    {
+        int k = probes[i];
+        int r = i % 10;
+        if (r == 0 && present[k])
+        {
+            ASSERT (c->remove (box, k));
+            present[k] = false;
+        }
+        else if (r == 5 && !present[k])
+        {
+            ASSERT (c->insert (box, &records[k]));
+            present[k] = true;
+        }
+        else
+            ASSERT ((c->find (box, k) != NULL) == present[k]);
+    }
+    elapsed[2] = bench_now () - t;
+    allocs[2] = allocations - a;
 
-    bst_dump (&a, &dump);
+    /* Delete what is left */
+    make_keys (d, n, order, false);
+    a = allocations;
+    t = bench_now ();
+    for (i = 0; i < n; i++)
+        if (present[order[i]])
+            ASSERT (c->remove (box, order[i]));
+    elapsed[3] = bench_now () - t;
+    allocs[3] = allocations - a;
 
-    bst_insert (&a, &t5);
+    c->destroy (box);
 
-    bst_dump (&a, &dump);
+    for (i = 0; i < 4; i++)
+        printf ("%s,%s,%d,%s,%.1f,%.4f,%.1f,%ld\n", c->name, dist_names[d],
+                n, phases[i], elapsed[i] * 1e9 / ops[i],
+                (double) allocs[i] / ops[i], (double) heap / n, rss / 1024);
+    fflush (stdout);
+};
 
-    bst_insert (&a, &t6);
+/* Fills OUT with N keys in the order of distribution D.  Inserts and
+ * deletes need each key once, so for them Zipfian falls back to random. */
+static void
+make_keys (enum distribution d, int n, int* out, bool zipf)
+{
+    int i;
 
-    bst_dump (&a, &dump);
+    if (d == DIST_ZIPF && zipf)
+    {
+        zipf_keys (n, out, n);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        out[i] = i;
+    if (d != DIST_SEQ)
+        bench_shuffle (out, n);
+};
 
-    bst_insert (&a, &t7);
+/* Draws COUNT keys from 0 to N - 1 with Gray et al.'s Zipfian generator,
+ * as YCSB does, then scatters the popular ranks over the key space */
+static void
+zipf_keys (int n, int* out, int count)
+{
+    static int cached_n;
+    static double zetan;
+    double zeta2 = 1 + pow (0.5, ZIPF_THETA);
+    int i;
 
-    bst_dump (&a, &dump);
+    if (cached_n != n)
+    {
+        zetan = 0;
+        for (i = 1; i <= n; i++)
+            zetan += 1 / pow (i, ZIPF_THETA);
+        cached_n = n;
+    }
 
-    bst_insert (&a, &t8);
+    double alpha = 1 / (1 - ZIPF_THETA);
+    double eta = (1 - pow (2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / zetan);
+    for (i = 0; i < count; i++)
+    {
+        double u = (double) rand () / RAND_MAX;
+        double uz = u * zetan;
+        long rank;
+        if (uz < 1)
+            rank = 0;
+        else if (uz < zeta2)
+            rank = 1;
+        else
+            rank = (long) (n * pow (eta * u - eta + 1, alpha));
+        if (rank >= n)
+            rank = n - 1;
 
-    bst_dump (&a, &dump);
+        /* A multiplicative hash, so the hot keys aren't all together */
+        out[i] = (int) ((rank * 2654435761UL) % (unsigned long) n);
+    }
+};
 
-    bst_insert (&a, &t9);
+static long
+resident_bytes ()
+{
+    long size, resident = 0;
+    FILE* f = fopen ("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf (f, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose (f);
+    return resident * sysconf (_SC_PAGESIZE);
+};
 
-    bst_dump (&a, &dump);
+/* Count every allocation by standing in for glibc's malloc */
+extern void* __libc_malloc (size_t size);
+extern void* __libc_calloc (size_t n, size_t size);
+extern void* __libc_realloc (void* ptr, size_t size);
+extern void __libc_free (void* ptr);
 
-    bst_insert (&a, &t0);
+void*
+malloc (size_t size)
+{
+    void* p = __libc_malloc (size);
+    allocations++;
+    heap_bytes += malloc_usable_size (p);
+    return p;
+};
 
-    bst_dump (&a, &dump);
+void*
+calloc (size_t n, size_t size)
+{
+    void* p = __libc_calloc (n, size);
+    allocations++;
+    heap_bytes += malloc_usable_size (p);
+    return p;
+};
 
+void*
+realloc (void* ptr, size_t size)
+{
+    long old = malloc_usable_size (ptr);
+    void* p = __libc_realloc (ptr, size);
+    allocations++;
+    if (p != NULL || size == 0)
+        heap_bytes += (long) malloc_usable_size (p) - old;
+    return p;
+};
 
+void
+free (void* ptr)
+{
+    heap_bytes -= malloc_usable_size (ptr);
+    __libc_free (ptr);
 };
 
-static int 
+
+
+/* ===  CONTAINERS === */
+
+static int
 compare (const void* a, const void* b, const void* AUX)
 {
-    return *((int*) a) - *((int*) b);
+    return ((const struct record*) a)->key - ((const struct record*) b)->key;
+};
+
+static void*
+bst_create (int n)
+{
+    struct bst_tree* t = malloc (sizeof *t);
+    bst_init (t, &compare);
+    return t;
+};
+
+static bool
+bst_put (void* c, struct record* r)
+{
+    return bst_insert (c, r);
+};
+
+static struct record*
+bst_get_key (void* c, int key)
+{
+    struct record k = { .key = key };
+    return bst_find (c, &k);
+};
+
+static bool
+bst_del (void* c, int key)
+{
+    struct record k = { .key = key };
+    return bst_delete (c, &k) != NULL;
 };
 
 static void
-dump (const void* a)
+bst_free (void* c)
+{
+    bst_destroy (c);
+    free (c);
+};
+
+static void*
+avl_create (int n)
 {
-    printf ("%d", *((int*) a));
+    struct avl_tree* t = malloc (sizeof *t);
+    avl_init (t, &compare);
+    return t;
 };
 
+static bool
+avl_put (void* c, struct record* r)
+{
+    return avl_insert (c, r);
+};
+
+static struct record*
+avl_get_key (void* c, int key)
+{
+    struct record k = { .key = key };
+    return avl_find (c, &k);
+};
+
+static bool
+avl_del (void* c, int key)
+{
+    struct record k = { .key = key };
+    return avl_delete (c, &k) != NULL;
+};
+
+static void
+avl_free (void* c)
+{
+    avl_destroy (c);
+    free (c);
+};
+
+static void*
+bpt_create (int n)
+{
+    struct bpt_tree* t = malloc (sizeof *t);
+    bpt_init (t, &compare);
+    return t;
+};
+
+static bool
+bpt_put (void* c, struct record* r)
+{
+    return bpt_insert (c, r);
+};
+
+static struct record*
+bpt_get_key (void* c, int key)
+{
+    struct record k = { .key = key };
+    return bpt_find (c, &k);
+};
+
+static bool
+bpt_del (void* c, int key)
+{
+    struct record k = { .key = key };
+    return bpt_delete (c, &k) != NULL;
+};
+
+static void
+bpt_free (void* c)
+{
+    bpt_destroy (c);
+    free (c);
+};
+
+static void*
+intmap_create (int n)
+{
+    struct intmap_tree* t = malloc (sizeof *t);
+    intmap_init (t);
+    return t;
+};
+
+static bool
+intmap_put (void* c, struct record* r)
+{
+    return intmap_insert (c, r->key, r);
+};
+
+static struct record*
+intmap_get_key (void* c, int key)
+{
+    void** v = intmap_find (c, key);
+    return v ? *v : NULL;
+};
+
+static bool
+intmap_del (void* c, int key)
+{
+    return intmap_delete (c, key, NULL);
+};
+
+static void
+intmap_free (void* c)
+{
+    intmap_destroy (c);
+    free (c);
+};
+
+/* The slab table picks its own ids, so we remember which id each key got */
+struct slab_box
+{
+    struct slab_table table;
+    int* ids;
+};
+
+static void*
+slab_create (int n)
+{
+    struct slab_box* b = malloc (sizeof *b);
+    slab_init (&b->table);
+    b->ids = calloc (n, sizeof (int));
+    return b;
+};
+
+static bool
+slab_put (void* c, struct record* r)
+{
+    struct slab_box* b = c;
+    b->ids[r->key] = slab_insert (&b->table, r);
+    return b->ids[r->key] != -1;
+};
+
+static struct record*
+slab_get_key (void* c, int key)
+{
+    struct slab_box* b = c;
+    return b->ids[key] > 0 ? slab_find (&b->table, b->ids[key]) : NULL;
+};
+
+static bool
+slab_del (void* c, int key)
+{
+    struct slab_box* b = c;
+    if (b->ids[key] <= 0)
+        return false;
+    bool found = slab_remove (&b->table, b->ids[key]) != NULL;
+    b->ids[key] = 0;
+    return found;
+};
+
+static void
+slab_free (void* c)
+{
+    struct slab_box* b = c;
+    slab_destroy (&b->table);
+    free (b->ids);
+    free (b);
+};
+
+static void*
+hash_create (int n)
+{
+    struct hash_table* h = malloc (sizeof *h);
+    hash_init (h);
+    return h;
+};
+
+static bool
+hash_put (void* c, struct record* r)
+{
+    hash_insert (c, &r->link, hash_int (r->key));
+    return true;
+};
+
+static struct record*
+hash_get_key (void* c, int key)
+{
+    struct hash_link* l;
+    for (l = hash_first (c, hash_int (key)); l != NULL; l = hash_next (l))
+    {
+        struct record* r = hash_entry (l, struct record, link);
+        if (r->key == key)
+            return r;
+    }
+    return NULL;
+};
+
+static bool
+hash_del (void* c, int key)
+{
+    struct record* r = hash_get_key (c, key);
+    if (r == NULL)
+        return false;
+    hash_remove (c, &r->link);
+    return true;
+};
+
+static void
+hash_free (void* c)
+{
+    hash_destroy (c);
+    free (c);
+};